@@ -0,0 +1,151 @@
+#include <engine/assertion.hpp>
+#include <engine/concurrency/context.hpp>
+
+namespace OJob {
+
+#ifdef JOB_ASMCONTEXT
+
+#if defined(__x86_64__)
+
+    // System V: rbx, rbp and r12-r15 are callee-saved, along with the SSE control/status register and the x87 control word. Everything else is already spilled by the compiler around the call.
+    // Frame (from the saved stack pointer up): mxcsr (4), x87 cw (4), r15, r14, r13, r12, rbx, rbp, return address.
+    asm(
+        ".text\n"
+        ".globl ojob_switchcontext\n"
+        ".type ojob_switchcontext, @function\n"
+        "ojob_switchcontext:\n"
+        "    pushq %rbp\n"
+        "    pushq %rbx\n"
+        "    pushq %r12\n"
+        "    pushq %r13\n"
+        "    pushq %r14\n"
+        "    pushq %r15\n"
+        "    subq $8, %rsp\n"
+        "    stmxcsr (%rsp)\n"
+        "    fnstcw 4(%rsp)\n"
+        "    movq %rsp, (%rdi)\n" // from->sp
+        "    movq (%rsi), %rsp\n" // to->sp
+        "    ldmxcsr (%rsp)\n"
+        "    fldcw 4(%rsp)\n"
+        "    addq $8, %rsp\n"
+        "    popq %r15\n"
+        "    popq %r14\n"
+        "    popq %r13\n"
+        "    popq %r12\n"
+        "    popq %rbx\n"
+        "    popq %rbp\n"
+        "    ret\n"
+        ".size ojob_switchcontext, .-ojob_switchcontext\n"
+
+        // First switch into a new context returns here with the entry point in r12 and its parameter in r13.
+        ".globl ojob_contextstart\n"
+        ".type ojob_contextstart, @function\n"
+        "ojob_contextstart:\n"
+        "    movq %r13, %rdi\n"
+        "    callq *%r12\n"
+        "    ud2\n" // entry points never return
+        ".size ojob_contextstart, .-ojob_contextstart\n"
+    );
+
+    extern "C" void ojob_contextstart(void);
+
+    void initcontext(struct OJob::context *ctx, void *stack, size_t size, void (*entry)(void *param), void *param) {
+        ASSERT(stack != NULL && size >= 4096, "Invalid stack for context.\n");
+
+        uint64_t *top = (uint64_t *)(((uintptr_t)stack + size) & ~(uintptr_t)15);
+        // The return address sits one slot below a 16 byte boundary so that the stack is aligned as it would be just before a call when ojob_contextstart begins.
+        uint64_t *sp = top - 10;
+        sp[0] = 0x037f00001f80; // default mxcsr (all exceptions masked) and x87 control word (extended precision, all exceptions masked)
+        sp[1] = 0; // r15
+        sp[2] = 0; // r14
+        sp[3] = (uint64_t)param; // r13
+        sp[4] = (uint64_t)entry; // r12
+        sp[5] = 0; // rbx
+        sp[6] = 0; // rbp
+        sp[7] = (uint64_t)ojob_contextstart; // return address
+        sp[8] = 0;
+        sp[9] = 0;
+        ctx->sp = sp;
+    }
+
+#elif defined(__aarch64__)
+
+    // AAPCS64: x19-x28, the frame pointer (x29), link register (x30) and the low halves of v8-v15 are callee-saved.
+    // Frame (from the saved stack pointer up): x19-x28, x29, x30, d8-d15.
+    asm(
+        ".text\n"
+        ".globl ojob_switchcontext\n"
+        ".type ojob_switchcontext, %function\n"
+        "ojob_switchcontext:\n"
+        "    sub sp, sp, #160\n"
+        "    stp x19, x20, [sp, #0]\n"
+        "    stp x21, x22, [sp, #16]\n"
+        "    stp x23, x24, [sp, #32]\n"
+        "    stp x25, x26, [sp, #48]\n"
+        "    stp x27, x28, [sp, #64]\n"
+        "    stp x29, x30, [sp, #80]\n"
+        "    stp d8, d9, [sp, #96]\n"
+        "    stp d10, d11, [sp, #112]\n"
+        "    stp d12, d13, [sp, #128]\n"
+        "    stp d14, d15, [sp, #144]\n"
+        "    mov x9, sp\n"
+        "    str x9, [x0]\n" // from->sp
+        "    ldr x9, [x1]\n" // to->sp
+        "    mov sp, x9\n"
+        "    ldp x19, x20, [sp, #0]\n"
+        "    ldp x21, x22, [sp, #16]\n"
+        "    ldp x23, x24, [sp, #32]\n"
+        "    ldp x25, x26, [sp, #48]\n"
+        "    ldp x27, x28, [sp, #64]\n"
+        "    ldp x29, x30, [sp, #80]\n"
+        "    ldp d8, d9, [sp, #96]\n"
+        "    ldp d10, d11, [sp, #112]\n"
+        "    ldp d12, d13, [sp, #128]\n"
+        "    ldp d14, d15, [sp, #144]\n"
+        "    add sp, sp, #160\n"
+        "    ret\n"
+        ".size ojob_switchcontext, .-ojob_switchcontext\n"
+
+        // First switch into a new context returns here with the entry point in x19 and its parameter in x20.
+        ".globl ojob_contextstart\n"
+        ".type ojob_contextstart, %function\n"
+        "ojob_contextstart:\n"
+        "    mov x0, x20\n"
+        "    blr x19\n"
+        "    brk #0\n" // entry points never return
+        ".size ojob_contextstart, .-ojob_contextstart\n"
+    );
+
+    extern "C" void ojob_contextstart(void);
+
+    void initcontext(struct OJob::context *ctx, void *stack, size_t size, void (*entry)(void *param), void *param) {
+        ASSERT(stack != NULL && size >= 4096, "Invalid stack for context.\n");
+
+        uint64_t *top = (uint64_t *)(((uintptr_t)stack + size) & ~(uintptr_t)15);
+        uint64_t *sp = top - 20; // 160 byte frame, keeps sp 16 byte aligned
+        for (size_t i = 0; i < 20; i++) {
+            sp[i] = 0;
+        }
+        sp[0] = (uint64_t)entry; // x19
+        sp[1] = (uint64_t)param; // x20
+        sp[11] = (uint64_t)ojob_contextstart; // x30
+        ctx->sp = sp;
+    }
+
+#endif
+
+#else
+
+    void initcontext(struct OJob::context *ctx, void *stack, size_t size, void (*entry)(void *param), void *param) {
+        ASSERT(stack != NULL && size >= 4096, "Invalid stack for context.\n");
+
+        getcontext(&ctx->uc);
+        ctx->uc.uc_stack.ss_sp = stack;
+        ctx->uc.uc_stack.ss_size = size;
+        ctx->uc.uc_link = NULL; // No return is ever expected.
+        makecontext(&ctx->uc, (void (*)())entry, 1, param);
+    }
+
+#endif
+
+}
@@ -0,0 +1,228 @@
+#include <engine/concurrency/graph.hpp>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+namespace OJob {
+
+#define GRAPH_KICKBATCH 64 // ready nodes gathered on the stack before being kicked together
+
+    static uint64_t now(void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+
+    size_t TaskGraph::addnode(const char *name, void (*entry)(uintptr_t param), uintptr_t param, enum OJob::Job::priority priority, enum OJob::Job::stack stack) {
+        ASSERT(!this->running.load(), "Task graph modified while it is running.\n");
+        ASSERT(entry != NULL, "Task graph node with no entry.\n");
+
+        struct node node;
+        node.name = name != NULL ? name : "Unnamed Task";
+        node.entry = entry;
+        node.param = param;
+        node.priority = priority;
+        node.stack = stack;
+        this->nodes.push_back(node);
+        this->dirty = true;
+        return this->nodes.size() - 1;
+    }
+
+    void TaskGraph::depend(size_t node, size_t on) {
+        ASSERT(!this->running.load(), "Task graph modified while it is running.\n");
+        ASSERT(node < this->nodes.size() && on < this->nodes.size(), "Invalid task graph dependency %lu -> %lu.\n", on, node);
+        ASSERT(node != on, "Task graph node %lu depends on itself.\n", node);
+
+        this->nodes[on].successors.push_back(node);
+        this->nodes[node].indegree++;
+        this->dirty = true;
+    }
+
+    void TaskGraph::clear(void) {
+        ASSERT(!this->running.load(), "Task graph modified while it is running.\n");
+        this->nodes.clear();
+        this->roots.clear();
+        this->runners.clear();
+        this->dirty = true;
+    }
+
+    // Find the roots and make sure the graph can actually finish (a cycle would leave its nodes waiting forever).
+    void TaskGraph::validate(void) {
+        this->roots.clear();
+        this->runners.resize(this->nodes.size());
+
+        std::vector<size_t> indegree = std::vector<size_t>(this->nodes.size());
+        std::vector<size_t> ready;
+        for (size_t i = 0; i < this->nodes.size(); i++) {
+            this->runners[i] = (struct runner) { .graph = this, .node = i };
+            indegree[i] = this->nodes[i].indegree;
+            if (indegree[i] == 0) {
+                this->roots.push_back(i);
+                ready.push_back(i);
+            }
+        }
+
+        size_t visited = 0;
+        while (ready.size() > 0) {
+            size_t node = ready.back();
+            ready.pop_back();
+            visited++;
+            for (size_t i = 0; i < this->nodes[node].successors.size(); i++) {
+                size_t succ = this->nodes[node].successors[i];
+                if (--indegree[succ] == 0) {
+                    ready.push_back(succ);
+                }
+            }
+        }
+        ASSERT(visited == this->nodes.size(), "Task graph contains a dependency cycle (%lu of %lu nodes reachable).\n", visited, this->nodes.size());
+
+        this->dirty = false;
+    }
+
+    void TaskGraph::kick(size_t *ready, size_t count) {
+        OJob::Job *jobs[GRAPH_KICKBATCH];
+        ASSERT(count <= GRAPH_KICKBATCH, "Too many task graph nodes kicked at once.\n");
+
+        for (size_t i = 0; i < count; i++) {
+            struct node *node = &this->nodes[ready[i]];
+            jobs[i] = new OJob::Job(TaskGraph::run, (uintptr_t)&this->runners[ready[i]]);
+            jobs[i]->priority = node->priority;
+            jobs[i]->stack = node->stack;
+            jobs[i]->counter = &this->counter;
+        }
+        OJob::kickjobs(count, jobs);
+    }
+
+    void TaskGraph::run(OJob::Job *job) {
+        struct runner *runner = (struct runner *)job->param;
+        TaskGraph *graph = runner->graph;
+        struct node *node = &graph->nodes[runner->node];
+
+        ZoneScopedN("Task Graph Node");
+        ZoneName(node->name, strlen(node->name));
+
+        node->worker = OJob::currentworker != NULL ? OJob::currentworker->id : -1;
+        node->start = OJob::now() - graph->epoch;
+        node->entry(node->param);
+        node->end = OJob::now() - graph->epoch;
+
+        // Release our successors, kicking any that we were the last dependency of. This happens before our own job completes, so the graph's counter can't reach zero while there's still work to come.
+        size_t ready[GRAPH_KICKBATCH];
+        size_t count = 0;
+        for (size_t i = 0; i < node->successors.size(); i++) {
+            size_t succ = node->successors[i];
+            if (graph->nodes[succ].pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                graph->nodes[succ].releasedby.store(runner->node, std::memory_order_relaxed);
+                ready[count++] = succ;
+                if (count == GRAPH_KICKBATCH) {
+                    graph->kick(ready, count);
+                    count = 0;
+                }
+            }
+        }
+        if (count > 0) {
+            graph->kick(ready, count);
+        }
+    }
+
+    void TaskGraph::submit(void) {
+        ZoneScoped;
+        ASSERT(!this->running.exchange(true), "Task graph submitted while it is still running.\n");
+
+        if (this->dirty) {
+            this->validate();
+        }
+
+        for (size_t i = 0; i < this->nodes.size(); i++) {
+            struct node *node = &this->nodes[i];
+            node->pending.store(node->indegree, std::memory_order_relaxed);
+            node->releasedby.store(SIZE_MAX, std::memory_order_relaxed);
+            node->start = 0;
+            node->end = 0;
+            node->worker = -1;
+        }
+        this->epoch = OJob::now();
+
+        for (size_t i = 0; i < this->roots.size(); i += GRAPH_KICKBATCH) {
+            size_t count = this->roots.size() - i < GRAPH_KICKBATCH ? this->roots.size() - i : GRAPH_KICKBATCH;
+            this->kick(&this->roots[i], count);
+        }
+    }
+
+    void TaskGraph::wait(void) {
+        ZoneScoped;
+        if (!this->running.load()) {
+            return;
+        }
+
+        this->counter.wait();
+        this->running.store(false);
+    }
+
+    size_t TaskGraph::criticalpath(size_t *path, size_t max) {
+        ASSERT(!this->running.load(), "Task graph critical path requested while it is still running.\n");
+        if (this->nodes.size() == 0 || max == 0) {
+            return 0;
+        }
+
+        size_t last = 0;
+        for (size_t i = 1; i < this->nodes.size(); i++) {
+            if (this->nodes[i].end > this->nodes[last].end) {
+                last = i;
+            }
+        }
+
+        size_t count = 0;
+        for (size_t node = last; node != SIZE_MAX && count < max; node = this->nodes[node].releasedby.load(std::memory_order_relaxed)) {
+            path[count++] = node;
+        }
+        return count;
+    }
+
+    void TaskGraph::tracecriticalpath(void) {
+        size_t path[64];
+        size_t count = this->criticalpath(path, 64);
+        if (count == 0) {
+            return;
+        }
+
+        char buf[1024];
+        uint64_t length = this->nodes[path[0]].end - this->nodes[path[count - 1]].start;
+        int len = snprintf(buf, sizeof(buf), "Critical path (%.3fms):", length / 1000000.0);
+        for (size_t i = count; i > 0 && len < (int)sizeof(buf); i--) {
+            struct node *node = &this->nodes[path[i - 1]];
+            len += snprintf(buf + len, sizeof(buf) - len, " %s (%.3fms)%s", node->name, (node->end - node->start) / 1000000.0, i > 1 ? " ->" : "");
+        }
+        TracyMessage(buf, len < (int)sizeof(buf) ? len : sizeof(buf) - 1);
+        TracyPlot("Task Graph Critical Path (ms)", length / 1000000.0);
+    }
+
+    bool TaskGraph::writetrace(const char *path) {
+        ASSERT(!this->running.load(), "Task graph trace requested while it is still running.\n");
+
+        FILE *f = fopen(path, "w");
+        if (f == NULL) {
+            return false;
+        }
+
+        std::vector<bool> critical = std::vector<bool>(this->nodes.size());
+        std::vector<size_t> crit = std::vector<size_t>(this->nodes.size());
+        size_t count = this->criticalpath(crit.data(), crit.size());
+        for (size_t i = 0; i < count; i++) {
+            critical[crit[i]] = true;
+        }
+
+        fprintf(f, "{\"traceEvents\":[\n");
+        for (size_t i = 0; i < this->nodes.size(); i++) {
+            struct node *node = &this->nodes[i];
+            // Complete ("X") events, timestamps in microseconds. One track per worker.
+            fprintf(f, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":0,\"tid\":%d,\"args\":{\"node\":%lu,\"critical\":%s}}%s\n",
+                node->name, critical[i] ? "critical" : "task", node->start / 1000.0, (node->end - node->start) / 1000.0, node->worker, i, critical[i] ? "true" : "false", i + 1 < this->nodes.size() ? "," : ""
+            );
+        }
+        fprintf(f, "]}\n");
+        fclose(f);
+        return true;
+    }
+
+}
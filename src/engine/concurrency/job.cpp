@@ -2,6 +2,13 @@
 #include <engine/concurrency/job.hpp>
 #include <errno.h>
 #include <engine/utils/memory.hpp>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/param.h>
 #include <unistd.h>
 
 // XXX: This is not OS agnostic!!!!!
@@ -15,7 +22,10 @@ namespace OJob {
     // 15872 possible normal priority jobs, 512 high priority jobs (we expect there to be less of them).
     // consider increasing these queue sizes
     OUtils::MPMCQueue queues[OJob::Job::PRIORITY_COUNT] = { OUtils::MPMCQueue(16384), OUtils::MPMCQueue(512) };
-    OUtils::MPMCQueue freefibres = OUtils::MPMCQueue(FIBRE_COUNT);
+    // Fibres ready to run a job, per stack class.
+    OUtils::MPMCQueue freefibres[OJob::Job::STACK_COUNT] = { OUtils::MPMCQueue(FIBRE_SMALLMAX), OUtils::MPMCQueue(FIBRE_LARGEMAX) };
+    // Fibres whose stacks were handed back to the OS, kept around (rather than deleted) so their names stay valid for Tracy and so we can reuse them when the pool grows again.
+    OUtils::MPMCQueue retiredfibres[OJob::Job::STACK_COUNT] = { OUtils::MPMCQueue(FIBRE_SMALLMAX), OUtils::MPMCQueue(FIBRE_LARGEMAX) };
 
     pthread_spinlock_t spin;
     struct OJob::worker workers[JOB_MAXWORKERS];
@@ -33,17 +43,39 @@ namespace OJob {
         allocator.free((OJob::Job *)ptr);
     }
 
-    static OJob::Job *findjob(void) {
+    // Try to steal a job of a specific priority from any worker other than ourselves.
+    static OJob::Job *stealjob(enum OJob::Job::priority priority) {
+        size_t self = OJob::currentworker != NULL ? OJob::currentworker->id : 0;
+        for (size_t i = 1; i <= OJob::numworkers; i++) {
+            struct OJob::worker *victim = &OJob::workers[(self + i) % OJob::numworkers];
+            if (victim == OJob::currentworker) {
+                continue;
+            }
 
-        OJob::Job *job = (OJob::Job *)OJob::queues[OJob::Job::PRIORITY_HIGH].pop();
-        if (job == NULL) {
-            job = (OJob::Job *)OJob::queues[OJob::Job::PRIORITY_NORMAL].pop();
-            if (job == NULL) {
-                return NULL;
+            OJob::Job *job = (OJob::Job *)victim->deques[priority].steal();
+            if (job != NULL) {
+                return job;
             }
         }
+        return NULL;
+    }
 
-        return job;
+    static OJob::Job *findjob(void) {
+        // High priority work anywhere beats normal priority work everywhere: check our own deque, then the global queue, then everyone else's deques.
+        for (ssize_t priority = OJob::Job::PRIORITY_COUNT - 1; priority >= 0; priority--) {
+            OJob::Job *job = NULL;
+            if (OJob::currentworker != NULL && (job = (OJob::Job *)OJob::currentworker->deques[priority].pop()) != NULL) {
+                return job;
+            }
+            if ((job = (OJob::Job *)OJob::queues[priority].pop()) != NULL) {
+                return job;
+            }
+            if ((job = OJob::stealjob((enum OJob::Job::priority)priority)) != NULL) {
+                return job;
+            }
+        }
+
+        return NULL;
     }
 
     static OJob::Job *getnextjob(void) {
@@ -55,23 +87,151 @@ namespace OJob {
         return job;
     }
 
-    // pthread mutexes and conditions to help reduce CPU usage on the worker threads
-    pthread_cond_t availablecond = PTHREAD_COND_INITIALIZER;
-    pthread_mutex_t availablemutex = PTHREAD_MUTEX_INITIALIZER;
-    pthread_cond_t fibrecond = PTHREAD_COND_INITIALIZER;
-    pthread_mutex_t fibremutex = PTHREAD_MUTEX_INITIALIZER;
+    void EventCount::wait(uint32_t key) {
+#ifdef __linux__
+        // Kernel compares the futex word against our key before sleeping, so a notify between prepare() and here is never lost.
+        syscall(SYS_futex, (uint32_t *)&this->epoch, FUTEX_WAIT_PRIVATE, key, NULL, NULL, 0);
+#else
+        while (this->epoch.load(std::memory_order_acquire) == key) {
+            sched_yield();
+        }
+#endif
+        this->waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    void EventCount::notify(size_t count) {
+        // Pairs with prepare(): either we see the waiter, or the waiter sees whatever we published before calling notify().
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        uint32_t waiting = this->waiters.load(std::memory_order_relaxed);
+        if (waiting == 0) {
+            return; // Common case under load, nobody to wake.
+        }
+
+        this->epoch.fetch_add(1, std::memory_order_seq_cst);
+#ifdef __linux__
+        long woken = syscall(SYS_futex, (uint32_t *)&this->epoch, FUTEX_WAKE_PRIVATE, (int)MIN(count, (size_t)waiting), NULL, NULL, 0);
+        if (woken > 0) {
+            this->unparks.fetch_add(woken, std::memory_order_relaxed);
+        }
+#endif
+    }
+
+    void EventCount::notifyall(void) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (this->waiters.load(std::memory_order_relaxed) == 0) {
+            return;
+        }
 
-    static OJob::Fibre *getfibre(void) {
+        this->epoch.fetch_add(1, std::memory_order_seq_cst);
+#ifdef __linux__
+        long woken = syscall(SYS_futex, (uint32_t *)&this->epoch, FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0);
+        if (woken > 0) {
+            this->unparks.fetch_add(woken, std::memory_order_relaxed);
+        }
+#endif
+    }
+
+    // Idle workers park on `available`, jobs waiting on a free fibre park on `fibreavailable` (one per stack class so a freed small stack never wakes someone after a large one).
+    OJob::EventCount available;
+    OJob::EventCount fibreavailable[OJob::Job::STACK_COUNT];
+    std::atomic<size_t> fibreparks = 0;
+
+    // Wake a single parked worker (if there are any) after making a job available.
+    static void wakeworker(void) {
+        OJob::available.notify();
+    }
+
+    static const size_t fibrestacksize[OJob::Job::STACK_COUNT] = { FIBRE_SMALLSTACK, FIBRE_LARGESTACK };
+    static const size_t fibremin[OJob::Job::STACK_COUNT] = { FIBRE_SMALLMIN, FIBRE_LARGEMIN };
+    static const size_t fibremax[OJob::Job::STACK_COUNT] = { FIBRE_SMALLMAX, FIBRE_LARGEMAX };
+    std::atomic<size_t> fibrecount[OJob::Job::STACK_COUNT]; // fibres currently holding a stack (free or in use)
+    std::atomic<size_t> fibreid = 0;
+    size_t pagesize = 4096;
+
+    [[noreturn]] static void fibre(OJob::Fibre *fibre);
+
+    // Give a fibre a fresh stack and point its context at the fibre loop.
+    static void mapfibre(OJob::Fibre *fibre, enum OJob::Job::stack stackclass) {
+        fibre->stackclass = stackclass;
+        fibre->stacksize = fibrestacksize[stackclass] + OJob::pagesize;
+
+        // Reserve the whole stack now but let the kernel back it with pages lazily as the fibre actually touches them (MAP_NORESERVE so untouched stack isn't charged against overcommit).
+        fibre->stack = mmap(NULL, fibre->stacksize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+        ASSERT(fibre->stack != MAP_FAILED, "Failed to map stack for fibre context (%s).\n", strerror(errno));
+        // Stacks grow down, so the guard page sits at the bottom of the mapping and turns an overflow into an immediate fault rather than silent corruption of whatever lies below.
+        ASSERT(mprotect(fibre->stack, OJob::pagesize, PROT_NONE) == 0, "Failed to protect fibre stack guard page (%s).\n", strerror(errno));
+
+        OJob::initcontext(&fibre->ctx, (uint8_t *)fibre->stack + OJob::pagesize, fibrestacksize[stackclass], (void (*)(void *))OJob::fibre, fibre);
+    }
+
+    static void unmapfibre(OJob::Fibre *fibre) {
+        munmap(fibre->stack, fibre->stacksize);
+        fibre->stack = NULL;
+        fibre->stacksize = 0;
+    }
+
+    // Create a new fibre for a stack class, returns NULL if the class is already at its limit.
+    static OJob::Fibre *growfibres(enum OJob::Job::stack stackclass) {
+        size_t count = OJob::fibrecount[stackclass].load(std::memory_order_relaxed);
+        do {
+            if (count >= fibremax[stackclass]) {
+                return NULL;
+            }
+        } while (!OJob::fibrecount[stackclass].compare_exchange_weak(count, count + 1, std::memory_order_relaxed));
+
+        OJob::Fibre *fibre = (OJob::Fibre *)OJob::retiredfibres[stackclass].pop();
+        if (fibre == NULL) {
+            fibre = new OJob::Fibre(); // Only ever happens as the pool reaches a new high, fibres are never deleted until shutdown.
+            fibre->id = OJob::fibreid.fetch_add(1);
+            fibre->name = (char *)malloc(FIBRE_NAMELEN);
+            ASSERT(fibre->name != NULL, "Failed to allocate memory for fibre debug name.\n");
+            snprintf(fibre->name, FIBRE_NAMELEN, "Fibre %lu", fibre->id);
+        }
+        OJob::mapfibre(fibre, stackclass);
+        return fibre;
+    }
+
+    // Hand a fibre that has finished its job back to the pool, or its stack back to the OS if we've got plenty spare.
+    static void releasefibre(OJob::Fibre *fibre) {
+        enum OJob::Job::stack stackclass = fibre->stackclass;
+
+        // Keep up to the minimum again in reserve so bursty workloads don't keep mapping and unmapping stacks.
+        if (OJob::freefibres[stackclass].size() >= fibremin[stackclass]) {
+            size_t count = OJob::fibrecount[stackclass].load(std::memory_order_relaxed);
+            while (count > fibremin[stackclass]) {
+                if (OJob::fibrecount[stackclass].compare_exchange_weak(count, count - 1, std::memory_order_relaxed)) {
+                    OJob::unmapfibre(fibre);
+                    OJob::retiredfibres[stackclass].push(fibre);
+                    OJob::fibreavailable[stackclass].notify(); // anyone stuck at the limit can grow the pool again
+                    return;
+                }
+            }
+        }
+
+        OJob::freefibres[stackclass].push(fibre); // only push after the coroutine exits, this way the fibre doesn't get acquired before the coroutine is properly yielded
+        OJob::fibreavailable[stackclass].notify(); // one fibre freed, one waiter woken
+    }
+
+    static OJob::Fibre *getfibre(enum OJob::Job::stack stackclass) {
         // XXX Takes a bit too long sometimes.
         ZoneScopedN("Get Free Fibre");
 
         OJob::Fibre *fibre = NULL;
-        pthread_mutex_lock(&OJob::fibremutex);
-        while ((fibre = (OJob::Fibre *)OJob::freefibres.pop()) == NULL) {
+        while ((fibre = (OJob::Fibre *)OJob::freefibres[stackclass].pop()) == NULL) {
+            if ((fibre = OJob::growfibres(stackclass)) != NULL) {
+                break;
+            }
+
+            // Pool is at its limit, wait for a job to finish with its fibre.
+            uint32_t key = OJob::fibreavailable[stackclass].prepare();
+            if ((fibre = (OJob::Fibre *)OJob::freefibres[stackclass].pop()) != NULL) {
+                OJob::fibreavailable[stackclass].cancel();
+                break;
+            }
             TracyMessageL("Hanging while waiting for free fibres");
-            pthread_cond_wait(&OJob::fibrecond, &OJob::fibremutex);
+            OJob::fibreparks.fetch_add(1, std::memory_order_relaxed);
+            OJob::fibreavailable[stackclass].wait(key);
         }
-        pthread_mutex_unlock(&OJob::fibremutex);
 
         return fibre;
     }
@@ -85,8 +245,19 @@ namespace OJob {
         COMPILER_BARRIER();
         ASSERT(OJob::currentfibre != NULL, "Yield called outside of job system or with invalid fibre.\n");
         ASSERT(OJob::currentworker != NULL, "Yield called outside of job system or with invalid worker.\n");
-        ASSERT(OJob::currentworker->ctx.uc_mcontext.fpregs->rip != 0, "Invalid RIP.\n");
-        swapcontext(&OJob::currentfibre->ctx, &OJob::currentworker->ctx); // Swap to worker context.
+        ASSERT(OJob::validcontext(&OJob::currentworker->ctx), "Invalid worker context.\n");
+        OJob::switchcontext(&OJob::currentfibre->ctx, &OJob::currentworker->ctx); // Swap to worker context.
+    }
+
+    void schedule(OJob::Job *job) {
+        ASSERT(job->priority < Job::PRIORITY_COUNT, "Invalid job priority %u.\n", job->priority);
+
+        // Jobs kicked from a worker (or a fibre running on one) stay local, anything else (or anything that doesn't fit) goes through the global queues.
+        if (OJob::currentworker == NULL || !OJob::currentworker->deques[job->priority].push(job)) {
+            OJob::queues[job->priority].push(job);
+        }
+
+        OJob::wakeworker();
     }
 
     void kickjob(OJob::Job *job) {
@@ -98,17 +269,61 @@ namespace OJob {
             pthread_spin_trylock(&job->counter->lock);
         }
 
-        pthread_mutex_lock(&OJob::availablemutex);
-        OJob::queues[job->priority].push(job);
-        pthread_cond_broadcast(&OJob::availablecond);
-        pthread_mutex_unlock(&OJob::availablemutex);
+        OJob::schedule(job);
+    }
+
+#define JOB_BATCHSIZE 256 // jobs per priority gathered on the stack before being submitted in one go
+
+    // Submit a batch of same priority jobs to the local deque (overflowing to the global queue).
+    static void schedulebatch(enum OJob::Job::priority priority, OJob::Job **jobs, size_t count) {
+        size_t pushed = 0;
+        if (OJob::currentworker != NULL) {
+            pushed = OJob::currentworker->deques[priority].pushbatch((void **)jobs, count);
+        }
+        if (pushed < count && !OJob::queues[priority].pushbatch((void **)(jobs + pushed), count - pushed)) {
+            for (size_t i = pushed; i < count; i++) { // Not enough contiguous room, fall back on single pushes.
+                OJob::queues[priority].push(jobs[i]);
+            }
+        }
     }
 
     void kickjobs(int count, OJob::Job *jobs[]) {
         ASSERT(count > 0, "Kicking zero jobs!\n");
+
+        // Reference counters once per run of jobs sharing the same counter (in the common case, once for the whole batch).
+        for (int i = 0; i < count;) {
+            ASSERT(jobs[i]->priority < Job::PRIORITY_COUNT, "Invalid job priority %u.\n", jobs[i]->priority);
+            OJob::Counter *counter = jobs[i]->counter;
+            int run = 1;
+            while (i + run < count && jobs[i + run]->counter == counter) {
+                ASSERT(jobs[i + run]->priority < Job::PRIORITY_COUNT, "Invalid job priority %u.\n", jobs[i + run]->priority);
+                run++;
+            }
+            if (counter != NULL) {
+                counter->ref.fetch_add(run);
+                pthread_spin_trylock(&counter->lock);
+            }
+            i += run;
+        }
+
+        // Gather by priority and submit in chunks.
+        OJob::Job *batch[Job::PRIORITY_COUNT][JOB_BATCHSIZE];
+        size_t batched[Job::PRIORITY_COUNT] = { 0 };
         for (int i = 0; i < count; i++) {
-            OJob::kickjob(jobs[i]);
+            enum OJob::Job::priority priority = jobs[i]->priority;
+            batch[priority][batched[priority]++] = jobs[i];
+            if (batched[priority] == JOB_BATCHSIZE) {
+                OJob::schedulebatch(priority, batch[priority], batched[priority]);
+                batched[priority] = 0;
+            }
         }
+        for (size_t i = 0; i < Job::PRIORITY_COUNT; i++) {
+            if (batched[i] > 0) {
+                OJob::schedulebatch((enum OJob::Job::priority)i, batch[i], batched[i]);
+            }
+        }
+
+        OJob::available.notify(count); // Wake min(count, idle) workers.
     }
 
     void Counter::unreference(void) {
@@ -119,15 +334,21 @@ namespace OJob {
 
         COMPILER_BARRIER();
         if (this->ref.load() <= 0) {
-            for (size_t i = 0; i < this->waitlist.size(); i++) {
-                OJob::Fibre **it = &this->waitlist[i];
-                ASSERT((*it) != NULL, "Invalid fibre on queue.\n");
-                ASSERT((*it)->job != NULL, "Fibre with invalid job on queue.\n");
-                ASSERT((*it)->job->priority < Job::PRIORITY_COUNT, "Fibre with invalid job priority.\n");
-                OJob::queues[(*it)->job->priority].push((*it)->job);
-            }
+            // Take the waitlist for ourselves: once a waiter is rescheduled it may return and destroy this counter (they're often on the stack), so we must be completely done with it before any of them can run.
+            std::vector<OJob::Fibre *> waiting;
+            waiting.swap(this->waitlist);
 
             pthread_spin_unlock(&this->lock); // only unlock the lock when we're done so in the tiny amount of time between unlocking starting the waitlist iteration we don't overwrite the counter memory (if of course it is deleted)
+            pthread_spin_unlock(&this->waitlistlock); // Last access to the counter.
+
+            for (size_t i = 0; i < waiting.size(); i++) {
+                OJob::Fibre *it = waiting[i];
+                ASSERT(it != NULL, "Invalid fibre on queue.\n");
+                ASSERT(it->job != NULL, "Fibre with invalid job on queue.\n");
+                ASSERT(it->job->priority < Job::PRIORITY_COUNT, "Fibre with invalid job priority.\n");
+                OJob::schedule(it->job);
+            }
+            return;
         }
         pthread_spin_unlock(&this->waitlistlock);
     }
@@ -150,8 +371,13 @@ namespace OJob {
             pthread_spin_unlock(&this->waitlistlock);
 
             COMPILER_BARRIER();
-            pthread_spin_lock(&this->lock);
+            while (pthread_spin_trylock(&this->lock) != 0) { // there's a worker per core, so spinning here takes a core from whatever we're waiting on
+                sched_yield();
+            }
             pthread_spin_unlock(&this->lock);
+            // Wait for the unreference that released us to let go of the counter before we let our caller destroy it.
+            pthread_spin_lock(&this->waitlistlock);
+            pthread_spin_unlock(&this->waitlistlock);
         }
     }
 
@@ -212,6 +438,51 @@ namespace OJob {
         initcounter->wait();
     }
 
+    struct parallelwork {
+        void (*fn)(size_t start, size_t end, uintptr_t param);
+        uintptr_t param;
+        size_t start;
+        size_t end;
+    };
+
+    static void parallelworker(OJob::Job *job) {
+        struct parallelwork *work = (struct parallelwork *)job->param;
+        work->fn(work->start, work->end, work->param);
+    }
+
+    void parallelfor(size_t start, size_t end, size_t grain, void (*fn)(size_t start, size_t end, uintptr_t param), uintptr_t param, enum OJob::Job::priority priority) {
+        ASSERT(fn != NULL, "Parallel for with no function.\n");
+        ASSERT(grain > 0, "Parallel for with a grain of zero.\n");
+        if (start >= end) {
+            return;
+        }
+
+        size_t numjobs = (end - start + grain - 1) / grain;
+        if (numjobs == 1) { // Not worth a trip through the scheduler.
+            fn(start, end, param);
+            return;
+        }
+
+        struct parallelwork *work = (struct parallelwork *)malloc(sizeof(struct parallelwork) * numjobs);
+        ASSERT(work != NULL, "Failed to allocate memory for parallel for work.\n");
+        OJob::Job **jobs = (OJob::Job **)malloc(sizeof(OJob::Job *) * numjobs);
+        ASSERT(jobs != NULL, "Failed to allocate memory for parallel for job list.\n");
+
+        OJob::Counter counter = OJob::Counter(); // Stack memory is fine here, we don't return until the counter is done with.
+        for (size_t i = 0; i < numjobs; i++) {
+            work[i] = (struct parallelwork) { .fn = fn, .param = param, .start = start + i * grain, .end = MIN(start + (i + 1) * grain, end) };
+            jobs[i] = new OJob::Job(parallelworker, (uintptr_t)&work[i]);
+            jobs[i]->priority = priority;
+            jobs[i]->stack = OJob::Job::STACK_SMALL; // Loop bodies are expected to be leaf work.
+            jobs[i]->counter = &counter;
+        }
+
+        OJob::kickjobs(numjobs, jobs);
+        free(jobs); // Jobs free themselves on completion, we only needed the list for submission.
+        counter.wait();
+        free(work);
+    }
+
     [[noreturn]] static void fibre(OJob::Fibre *fibre) {
         for (;;) {
             OJob::Job *job = fibre->job;
@@ -243,16 +514,26 @@ namespace OJob {
         struct OJob::worker *worker = &OJob::workers[*id];
         OJob::currentworker = worker;
         for (;;) {
-            getcontext(&worker->ctx);
             // acquire lock for job schedule
             OJob::Job *decl = NULL;
-            // we HAVE to use a pthread mutex here because polling otherwise causes major CPU busy usage
+            // Spin briefly (work tends to arrive in bursts), then park until a kick wakes us. Polling forever would otherwise cause major CPU busy usage.
             // NEVER use a pthread mutex when using the job system as it'll only yield to another worker thread, not another job.
-            pthread_mutex_lock(&OJob::availablemutex);
-            while ((decl = OJob::findjob()) == NULL) {
-                pthread_cond_wait(&OJob::availablecond, &OJob::availablemutex);
+            for (size_t spin = 0; spin < JOB_SPINCOUNT && (decl = OJob::findjob()) == NULL; spin++) {
+                CPU_RELAX();
+            }
+            while (decl == NULL) {
+                uint32_t key = OJob::available.prepare();
+                if ((decl = OJob::findjob()) != NULL) { // Recheck now that kickers can see us, otherwise we could sleep through a job pushed just before prepare().
+                    OJob::available.cancel();
+                    break;
+                }
+                worker->parks.fetch_add(1, std::memory_order_relaxed);
+                OJob::available.wait(key);
+                pthread_testcancel(); // Raw futex waits aren't a cancellation point, destroy() wakes us so we can exit here.
+                if ((decl = OJob::findjob()) == NULL) {
+                    worker->spurious.fetch_add(1, std::memory_order_relaxed); // Someone else got there first.
+                }
             }
-            pthread_mutex_unlock(&OJob::availablemutex);
             ASSERT(decl != NULL, "Job queues are empty yet availability check signalled they weren't\n");
             ASSERT(!decl->allgood.load(), "Rescheduling an already completed job %lu.\n", decl->id);
 
@@ -260,7 +541,7 @@ namespace OJob {
             if (decl->fibre != NULL) {
                 fibre = decl->fibre; // Resume with existing encapsulating fibre.
             } else {
-                fibre = OJob::getfibre();
+                fibre = OJob::getfibre(decl->stack);
             }
             ASSERT(fibre != NULL, "Attempted to use a NULL fibre.\n");
             ASSERT(decl->fibre != NULL ? true : fibre->job == NULL, "Fibre is being rescheduled (check code for potentially recursive job kick).\n");
@@ -274,26 +555,28 @@ namespace OJob {
             OJob::currentfibre = fibre;
             TracyFiberEnter(fibre->name);
 
-            // XXX: non-x86 hostile.
-            ASSERT(fibre->ctx.uc_mcontext.fpregs->rip != 0, "Invalid RIP.\n");
-            swapcontext(&worker->ctx, &fibre->ctx);
+            ASSERT(OJob::validcontext(&fibre->ctx), "Invalid fibre context.\n");
+            OJob::switchcontext(&worker->ctx, &fibre->ctx);
             TracyFiberLeave;
 
             worker->prev = fibre; // Establish what was our previous fibre.
             OJob::currentfibre = NULL; // thread-local. no contention.
 
             // all job and fibre cleanup code past this point (helps prevent resume-before-yield errors)
+            // Read the status exactly once: as soon as a waiting fibre is published below it can be resumed (and finished) on another worker, which rewrites yieldstatus under us.
+            const enum OJob::Job::status status = fibre->yieldstatus;
 
-            if (fibre->yieldstatus != OJob::Job::STATUS_DONE) { // don't modify anything in here if the job is marked as done (we'll get a sigsegv as we already clean up all this stuff)
+            if (status != OJob::Job::STATUS_DONE) { // don't modify anything in here if the job is marked as done (we'll get a sigsegv as we already clean up all this stuff)
                 decl->running.store(false); // Mark as no longer running (suspended)
             }
 
-            if (fibre->yieldstatus == OJob::Job::STATUS_YIELD) {
+            if (status == OJob::Job::STATUS_YIELD) {
                 // this was pretty evil of me. this is being pushed back and yet isn't finished?
-                OJob::queues[decl->priority].push(decl); // Push the job to the back of the queue, the idea being that it'll only be picked back up later.
+                OJob::queues[decl->priority].push(decl); // Push the job to the back of the global queue (not our own deque, where we'd just pop it straight back off), the idea being that it'll only be picked back up later.
+                OJob::wakeworker();
             }
 
-            if (fibre->yieldstatus == OJob::Job::STATUS_WAIT) {
+            if (status == OJob::Job::STATUS_WAIT) {
                 if (fibre->waitfor != NULL) { // waiting on counter
                     OJob::Counter *waiting = fibre->waitfor;
                     fibre->waitfor = NULL; // Declare fibre is no longer waiting on anything.
@@ -311,18 +594,15 @@ namespace OJob {
                 }
             }
 
-            if (fibre->yieldstatus == OJob::Job::STATUS_DONE) {
+            if (status == OJob::Job::STATUS_DONE) {
                 if (fibre->tounref != NULL) {
                     fibre->tounref.load()->unreference(); // unreference when done.
                     fibre->tounref.store(NULL);
                 }
                 fibre->job = NULL;
-                pthread_mutex_lock(&OJob::fibremutex);
                 // Push fibre back to job list.
                 COMPILER_BARRIER();
-                OJob::freefibres.push(fibre); // only push after the coroutine exits, this way the fibre doesn't get acquired before the coroutine is properly yielded
-                pthread_cond_broadcast(&OJob::fibrecond);
-                pthread_mutex_unlock(&OJob::fibremutex);
+                OJob::releasefibre(fibre);
             }
         }
         __builtin_unreachable();
@@ -334,45 +614,81 @@ namespace OJob {
             pthread_cancel(OJob::workers[i].thread);
             // TODO: Core affinity
         }
+        OJob::available.notifyall(); // Kick parked workers so they notice the cancellation.
 #endif
-        pthread_mutex_destroy(&availablemutex);
-        pthread_mutex_destroy(&fibremutex);
 
         OJob::Fibre *fibre = NULL;
-        while ((fibre = (OJob::Fibre *)OJob::freefibres.pop()) != NULL) {
-            // coroutine_destroy(fibre->co);
-            free(fibre->stack);
-            free(fibre->name);
-            delete fibre;
+        for (size_t i = 0; i < Job::STACK_COUNT; i++) {
+            while ((fibre = (OJob::Fibre *)OJob::freefibres[i].pop()) != NULL) {
+                // coroutine_destroy(fibre->co);
+                OJob::unmapfibre(fibre);
+                free(fibre->name);
+                delete fibre;
+            }
+            while ((fibre = (OJob::Fibre *)OJob::retiredfibres[i].pop()) != NULL) {
+                free(fibre->name);
+                delete fibre;
+            }
         }
     }
 
+    void getstats(struct stats *stats) {
+        ASSERT(stats != NULL, "Invalid stats output.\n");
+        memset(stats, 0, sizeof(struct stats));
+
+        for (size_t i = 0; i < Job::PRIORITY_COUNT; i++) {
+            stats->queuedepth[i] = OJob::queues[i].size();
+        }
+        for (size_t i = 0; i < numworkers; i++) {
+            struct OJob::worker *worker = &OJob::workers[i];
+            stats->parks += worker->parks.load(std::memory_order_relaxed);
+            stats->spurious += worker->spurious.load(std::memory_order_relaxed);
+            for (size_t j = 0; j < Job::PRIORITY_COUNT; j++) {
+                stats->queuedepth[j] += worker->deques[j].size();
+            }
+        }
+        stats->unparks = OJob::available.unparks.load(std::memory_order_relaxed);
+        stats->fibreparks = OJob::fibreparks.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < Job::STACK_COUNT; i++) {
+            stats->fibres[i] = OJob::fibrecount[i].load(std::memory_order_relaxed);
+        }
+        stats->idle = OJob::available.getwaiters();
+    }
+
+    void plotstats(void) {
+        struct stats stats;
+        OJob::getstats(&stats);
+        TracyPlot("Job Parks", (int64_t)stats.parks);
+        TracyPlot("Job Unparks", (int64_t)stats.unparks);
+        TracyPlot("Job Spurious Wakeups", (int64_t)stats.spurious);
+        TracyPlot("Job Fibre Parks", (int64_t)stats.fibreparks);
+        TracyPlot("Job Queue Depth (High)", (int64_t)stats.queuedepth[Job::PRIORITY_HIGH]);
+        TracyPlot("Job Queue Depth (Normal)", (int64_t)stats.queuedepth[Job::PRIORITY_NORMAL]);
+        TracyPlot("Job Idle Workers", (int64_t)stats.idle);
+        TracyPlot("Job Fibres (Small Stack)", (int64_t)stats.fibres[Job::STACK_SMALL]);
+        TracyPlot("Job Fibres (Large Stack)", (int64_t)stats.fibres[Job::STACK_LARGE]);
+    }
+
     std::atomic<size_t> id;
 
     // TODO: Jobify the engine!!!!!
     // as much as possible should be shoved into jobs so we can be concurrent
     // work asynchronously whenever possible
-    void init(void) {
+    void init(size_t workers) {
         OJob::id.store(0);
 
         pthread_spin_init(&OJob::spin, true);
 
-        for (size_t i = 0; i < FIBRE_COUNT; i++) {
-            OJob::Fibre *fibre = new OJob::Fibre(); // we can afford to use the heap here as we only ever allocate this once
-            fibre->id = i;
-            fibre->name = (char *)malloc(16);
-            ASSERT(fibre->name != NULL, "Failed to allocate memory for fibre debug name.\n");
-            snprintf(fibre->name, 32, "Fibre %lu", fibre->id);
-
-            getcontext(&fibre->ctx);
-
-            fibre->stack = (uint8_t *)malloc(64 * 1024 * 1024); // 64KB
-            ASSERT(fibre->stack != NULL, "Failed to allocate stack for fibre context.\n");
-            fibre->ctx.uc_stack.ss_sp = fibre->stack;
-            fibre->ctx.uc_stack.ss_size = 64 * 1024 * 1024;
-            fibre->ctx.uc_link = NULL; // No return is ever expected.
-            makecontext(&fibre->ctx, (void (*)())OJob::fibre, 1, fibre);
-            OJob::freefibres.push(fibre);
+#ifdef __unix__
+        OJob::pagesize = sysconf(_SC_PAGESIZE);
+#endif
+        // Pre-populate the pools with their minimum number of fibres, anything past that is created as needed.
+        for (size_t i = 0; i < Job::STACK_COUNT; i++) {
+            for (size_t j = 0; j < fibremin[i]; j++) {
+                OJob::Fibre *fibre = OJob::growfibres((enum OJob::Job::stack)i);
+                ASSERT(fibre != NULL, "Fibre pool minimum exceeds its maximum.\n");
+                OJob::freefibres[i].push(fibre);
+            }
         }
 
         for (size_t i = 0; i < JOB_MAXWORKERS; i++) {
@@ -382,6 +698,16 @@ namespace OJob {
 #ifdef __linux__
         numworkers = sysconf(_SC_NPROCESSORS_ONLN);
 #endif
+        if (workers != 0) { // explicitly asked for (benchmarks, tools)
+            numworkers = workers;
+        }
+        ASSERT(numworkers <= JOB_MAXWORKERS, "Too many workers (%lu), maximum is %u.\n", numworkers, JOB_MAXWORKERS);
+
+        for (size_t i = 0; i < numworkers; i++) { // only allocate deques for workers we're actually going to run
+            for (size_t j = 0; j < Job::PRIORITY_COUNT; j++) {
+                OJob::workers[i].deques[j].init(JOB_DEQUESIZE);
+            }
+        }
 
         printf("Job system initialised with %lu worker thread(s)\n", numworkers);
 
@@ -5,8 +5,36 @@
 #include <engine/resources/model.hpp>
 #include <engine/resources/texture.hpp>
 #include <stdlib.h>
+#include <string.h>
 
 namespace ORenderer {
+    // Material textures are shared between every mesh (of any model) that uses the same image.
+    static void *loadtexture(const char *path, uintptr_t param, size_t *cpusize, size_t *gpusize) {
+        OResource::Resource *source = (OResource::Resource *)param;
+        struct Material::texturepair *pair = new struct Material::texturepair;
+        pair->texture = OResource::Texture::load(source->path); // XXX: Use information from texture to set up view data.
+        ASSERT(ORenderer::context->createtextureview(
+            &pair->view, ORenderer::FORMAT_RGBA8SRGB,
+            pair->texture, ORenderer::IMAGETYPE_2D,
+            ORenderer::ASPECT_COLOUR, 0, 1, 0, 1
+        ) == ORenderer::RESULT_SUCCESS, "Failed to create material texture view.\n");
+        pair->gpuid = ORenderer::setmanager.registertexture(pair->view);
+        *cpusize = sizeof(struct Material::texturepair);
+        *gpusize = 0; // XXX: Size of the uploaded image isn't known by the time we get it back.
+        return pair;
+    }
+
+    static void unloadtexture(void *ptr, uintptr_t param) {
+        struct Material::texturepair *pair = (struct Material::texturepair *)ptr;
+        ORenderer::setmanager.removetexture(pair->gpuid);
+        ORenderer::context->destroytextureview(&pair->view);
+        ORenderer::context->destroytexture(&pair->texture);
+        delete pair;
+    }
+
+    static OResource::AssetCache materialtextures = OResource::AssetCache("texture", OResource::ResourceManager::CATEGORY_TEXTURE, loadtexture, unloadtexture);
+    OResource::AssetCache models = OResource::AssetCache("model", OResource::ResourceManager::CATEGORY_MODEL, Model::residentload, Model::residentunload);
+
     Mesh::Mesh(OResource::Model::mesh *mesh, OResource::Model::material *material) {
         for (size_t i = 0; i < mesh->header.vertexcount; i++) {
             struct Mesh::vertex vertex;
@@ -47,30 +75,12 @@ namespace ORenderer {
         this->material.metallicfactor = material->metallicfactor;
         this->material.roughnessfactor = material->roughnessfactor;
 
-        // Might me a good idea to try refer to a previously created texture rather than load it brand new every time (if the material stays the same)
-        this->material.base.texture = OResource::Texture::load(material->base); // XXX: Use information from texture to set up view data.
-        this->material.normal.texture = OResource::Texture::load(material->normal);
-        this->material.mr.texture = OResource::Texture::load(material->mr);
-
-        ASSERT(ORenderer::context->createtextureview(
-            &this->material.base.view, ORenderer::FORMAT_RGBA8SRGB,
-            this->material.base.texture, ORenderer::IMAGETYPE_2D,
-            ORenderer::ASPECT_COLOUR, 0, 1, 0, 1
-        ) == ORenderer::RESULT_SUCCESS, "Failed to create material texture view.\n");
-        ASSERT(ORenderer::context->createtextureview(
-            &this->material.normal.view, ORenderer::FORMAT_RGBA8SRGB,
-            this->material.normal.texture, ORenderer::IMAGETYPE_2D,
-            ORenderer::ASPECT_COLOUR, 0, 1, 0, 1
-        ) == ORenderer::RESULT_SUCCESS, "Failed to create material texture view.\n");
-        ASSERT(ORenderer::context->createtextureview(
-            &this->material.mr.view, ORenderer::FORMAT_RGBA8SRGB,
-            this->material.mr.texture, ORenderer::IMAGETYPE_2D,
-            ORenderer::ASPECT_COLOUR, 0, 1, 0, 1
-        ) == ORenderer::RESULT_SUCCESS, "Failed to create material texture view.\n");
-
-        this->material.base.gpuid = ORenderer::setmanager.registertexture(this->material.base.view);
-        this->material.normal.gpuid = ORenderer::setmanager.registertexture(this->material.normal.view);
-        this->material.mr.gpuid = ORenderer::setmanager.registertexture(this->material.mr.view);
+        this->textures[0] = materialtextures.get(material->base);
+        this->textures[1] = materialtextures.get(material->normal);
+        this->textures[2] = materialtextures.get(material->mr);
+        this->material.base = *this->textures[0]->as<struct Material::texturepair>();
+        this->material.normal = *this->textures[1]->as<struct Material::texturepair>();
+        this->material.mr = *this->textures[2]->as<struct Material::texturepair>();
         this->bounds = OMath::AABB(mesh->header.bmin, mesh->header.bmax);
     }
 
@@ -81,4 +91,51 @@ namespace ORenderer {
             this->meshes.push_back(Mesh(&model.meshes[i], &model.materials[model.meshes[i].header.material]));
         }
     }
+
+    void Mesh::destroy(void) {
+        for (size_t i = 0; i < 3; i++) {
+            OResource::manager.unreference(this->textures[i]);
+        }
+        ORenderer::context->destroybuffer(&this->vertexbuffer);
+        ORenderer::context->destroybuffer(&this->indexbuffer);
+    }
+
+    void Model::destroy(void) {
+        for (size_t i = 0; i < this->meshes.size(); i++) {
+            this->meshes[i].destroy();
+        }
+        this->meshes.clear();
+    }
+
+    size_t Model::cpusize(void) {
+        size_t size = sizeof(Model) + this->meshes.capacity() * sizeof(Mesh);
+        for (size_t i = 0; i < this->meshes.size(); i++) {
+            size += this->meshes[i].vertices.capacity() * sizeof(struct Mesh::vertex);
+            size += this->meshes[i].indices.capacity() * sizeof(uint16_t);
+        }
+        return size;
+    }
+
+    size_t Model::gpusize(void) {
+        size_t size = 0;
+        for (size_t i = 0; i < this->meshes.size(); i++) {
+            size += this->meshes[i].vertices.size() * sizeof(struct Mesh::vertex);
+            size += this->meshes[i].indices.size() * sizeof(uint16_t);
+        }
+        return size;
+    }
+
+    void *Model::residentload(const char *path, uintptr_t param, size_t *cpusize, size_t *gpusize) {
+        OResource::Resource *source = (OResource::Resource *)param;
+        Model *model = new Model(source->path);
+        *cpusize = model->cpusize();
+        *gpusize = model->gpusize();
+        return model;
+    }
+
+    void Model::residentunload(void *ptr, uintptr_t param) {
+        Model *model = (Model *)ptr;
+        model->destroy();
+        delete model;
+    }
 }
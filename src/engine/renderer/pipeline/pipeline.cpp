@@ -402,9 +402,9 @@ skip:
     // printf("post render begin start work.\n");
 
     // XXX: This would be done asynchronously! Cull while we do other important work on this thread instead of waiting on this!
+    scene.transforms.update();
     OScene::CullResult *res = scene.partitionmanager.cull(*camera);
     TracyMessageL("Done Culling");
-    OScene::CullResult *reshead = res;
     size_t totalobjects = scene.objects.size();
     size_t visibleobjects = 0;
     ORenderer::ScratchBuffer *scratchbuffer = ORenderer::context->requestscratchbuffer();
@@ -423,6 +423,9 @@ skip:
                     ZoneScopedN("Individual");
                     visibleobjects++;
                     OUtils::Handle<OScene::ModelInstance> model = obj->getcomponent(OUtils::STRINGID("ModelInstance"))->gethandle<OScene::ModelInstance>();
+                    if (!model->modelready.load(std::memory_order_acquire)) {
+                        continue; // still loading
+                    }
 
                     model->model->claim(); // XXX: Claim access.
                     const float time = glfwGetTime();
@@ -457,8 +460,7 @@ skip:
             res = res->header.next;
         }
 
-        // Release our result pages back to the allocator.
-        scene.partitionmanager.freeresults(reshead);
+        // Result pages live in the frame allocator, they go when it's reset at the end of the frame.
     }
     // printf("rendered.\n");
 
@@ -562,9 +564,6 @@ skip:
     //         }
     //         res = res->header.next;
     //     }
-    //
-    //     // Release out result pages back to the allocator.
-        // scene.partitionmanager.freeresults(res);
     // }
 
     // canvas.updatebuffer();
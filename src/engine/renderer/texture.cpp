@@ -474,6 +474,7 @@ namespace ORenderer {
             // context->destroybuffer(&staging);
 
             OUtils::print("scheduling resolution increase.\n");
+            OResource::Texture::prefetchlevel(this->headers, info.resolution); // get the level's pages on their way while the job waits to be picked up
             struct updatework *work = (struct updatework *)malloc(sizeof(struct updatework));
             ASSERT(work != NULL, "Failed to allocate memory for update work.\n");
             memset(work, 0, sizeof(struct updatework));
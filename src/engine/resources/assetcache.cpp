@@ -0,0 +1,177 @@
+#include <engine/resources/assetcache.hpp>
+#include <stdio.h>
+#include <string.h>
+
+namespace OResource {
+
+    AssetCache::AssetCache(const char *kind, enum ResourceManager::category category, ResourceManager::loadfunc load, ResourceManager::unloadfunc unload) {
+        ASSERT(kind != NULL, "Asset cache needs a kind.\n");
+        ASSERT(load != NULL, "Asset cache needs a loader.\n");
+        this->kind = kind;
+        this->category = category;
+        this->load = load;
+        this->unload = unload;
+    }
+
+    AssetCache::~AssetCache(void) {
+        for (auto it = this->entries.begin(); it != this->entries.end(); it++) {
+            delete it->second;
+        }
+    }
+
+    OUtils::Handle<Resource> AssetCache::source(const char *path) {
+        ASSERT(path != NULL, "Invalid path given to asset cache.\n");
+        OUtils::Handle<Resource> source = manager.get(path);
+        if (source.isvalid()) {
+            return source;
+        }
+
+        // Not in any RPak, so it's a file on disk. Registered under our lock so two requests for it can't register it twice.
+        this->mutex.lock();
+        source = manager.get(path);
+        if (!source.isvalid()) {
+            char *copy = strdup(path);
+            ASSERT(copy != NULL, "Failed to allocate memory for asset path.\n");
+            source = manager.create(copy);
+        }
+        this->mutex.unlock();
+        return source;
+    }
+
+    // Called with the mutex held.
+    struct AssetCache::entry *AssetCache::getentry(Resource *source) {
+        auto it = this->entries.find(source);
+        if (it != this->entries.end()) {
+            return it->second;
+        }
+        struct entry *entry = new struct entry;
+        entry->cache = this;
+        entry->source = source;
+        this->entries[source] = entry;
+        return entry;
+    }
+
+    // Hash the source and load (or just reference) the payload for its contents. `first` is whether this path has never been resolved before.
+    OUtils::Handle<Resource> AssetCache::resolve(Resource *source, bool first) {
+        ZoneScoped;
+        uint64_t hash = manager.contenthash(source->gethandle());
+        char key[ASSETCACHE_KEYLEN];
+        snprintf(key, sizeof(key), "%s:%016lx*", this->kind, hash);
+
+        if (first && manager.get(key).isvalid()) {
+            this->mutex.lock();
+            this->counters.shared++;
+            this->mutex.unlock();
+        }
+        return manager.acquire(key, this->category, this->load, this->unload, (uintptr_t)source);
+    }
+
+    OUtils::Handle<Resource> AssetCache::get(const char *path) {
+        Resource *source = this->source(path).resolve();
+
+        this->mutex.lock();
+        this->counters.requests++;
+        struct entry *entry = this->getentry(source);
+        if (entry->asset.isvalid() && manager.reference(entry->asset)) {
+            this->counters.hits++;
+            OUtils::Handle<Resource> asset = entry->asset;
+            this->mutex.unlock();
+            return asset;
+        }
+        this->counters.loads++;
+        bool first = !entry->asset.isvalid();
+        this->mutex.unlock();
+
+        // Loading on our own thread, anyone else loading the same contents meets us in the resource manager (which only lets one of us load it).
+        OUtils::Handle<Resource> asset = this->resolve(source, first);
+        this->mutex.lock();
+        entry->asset = asset;
+        this->mutex.unlock();
+        return asset;
+    }
+
+    void AssetCache::request(const char *path, readyfunc ready, uintptr_t param) {
+        ASSERT(ready != NULL, "Asset request with no ready callback.\n");
+        Resource *source = this->source(path).resolve();
+
+        this->mutex.lock();
+        this->counters.requests++;
+        struct entry *entry = this->getentry(source);
+        if (entry->asset.isvalid() && manager.reference(entry->asset)) {
+            this->counters.hits++;
+            ready(entry->asset, param);
+            this->mutex.unlock();
+            return;
+        }
+
+        entry->waiters.push_back((struct waiter) { .ready = ready, .param = param });
+        if (entry->loading) {
+            this->counters.joined++;
+            this->mutex.unlock();
+            return;
+        }
+        entry->loading = true;
+        entry->first = !entry->asset.isvalid();
+        this->counters.loads++;
+        this->counters.inflight++;
+        this->mutex.unlock();
+
+        OJob::Job *job = new OJob::Job(AssetCache::loadworker, (uintptr_t)entry);
+        job->priority = OJob::Job::PRIORITY_NORMAL;
+        OJob::kickjob(job);
+    }
+
+    void AssetCache::loadworker(OJob::Job *job) {
+        struct entry *entry = (struct entry *)job->param;
+        AssetCache *cache = entry->cache;
+
+        OUtils::Handle<Resource> asset = cache->resolve(entry->source, entry->first); // one reference, handed to the first waiter
+
+        cache->mutex.lock();
+        entry->asset = asset;
+        entry->loading = false;
+        cache->counters.inflight--;
+        for (size_t i = 0; i < entry->waiters.size(); i++) {
+            if (i > 0) {
+                bool referenced = manager.reference(asset);
+                ASSERT(referenced, "Asset '%s' went away while we held a reference to it.\n", entry->source->path);
+            }
+            entry->waiters[i].ready(asset, entry->waiters[i].param);
+        }
+        if (entry->waiters.size() == 0) { // everybody cancelled
+            manager.unreference(asset);
+        }
+        entry->waiters.clear();
+        cache->mutex.unlock();
+    }
+
+    bool AssetCache::cancel(const char *path, uintptr_t param) {
+        OUtils::Handle<Resource> source = manager.get(path);
+        if (!source.isvalid()) {
+            return false;
+        }
+
+        bool found = false;
+        this->mutex.lock();
+        auto it = this->entries.find(source.resolve());
+        if (it != this->entries.end()) {
+            std::vector<struct waiter> *waiters = &it->second->waiters;
+            for (size_t i = 0; i < waiters->size(); i++) {
+                if ((*waiters)[i].param == param) {
+                    waiters->erase(waiters->begin() + i);
+                    found = true;
+                    break;
+                }
+            }
+        }
+        this->mutex.unlock();
+        return found;
+    }
+
+    void AssetCache::getstats(struct stats *stats) {
+        this->mutex.lock();
+        *stats = this->counters;
+        this->mutex.unlock();
+    }
+
+}
@@ -0,0 +1,716 @@
+#include <common/TracySystem.hpp>
+#include <algorithm>
+#include <engine/resources/asyncio.hpp>
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#if defined(__linux__) && !defined(OMICRON_NOIOURING)
+#define ASYNCIO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+namespace OResource {
+
+    // A single read handed to the kernel (or a reader thread), covering one or more requests that sit next to each other in the same file.
+    struct dispatch {
+        int fd;
+        size_t offset;
+        size_t size;
+        size_t count;
+        struct AsyncIO::request *members[ASYNCIO_COALESCE]; // in file order
+        struct iovec iov[ASYNCIO_COALESCE];
+    };
+
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; // everything below
+    static pthread_cond_t available = PTHREAD_COND_INITIALIZER; // reader threads sleep on this
+    static std::vector<struct AsyncIO::request *> pending; // waiting to be scheduled
+    static uint64_t sequence = 0;
+    static struct dispatch dispatches[ASYNCIO_INFLIGHT];
+    static size_t freedispatches[ASYNCIO_INFLIGHT];
+    static size_t numfree = 0;
+    static size_t ready[ASYNCIO_INFLIGHT]; // dispatches waiting on a reader thread (FIFO)
+    static size_t readyhead = 0;
+    static size_t readycount = 0;
+    static bool running = false;
+    static bool quitting = false;
+    static bool useuring = false;
+    static pthread_t threads[ASYNCIO_READERS];
+    static size_t numthreads = 0;
+
+    static size_t budget = 0;
+    static size_t spent = 0;
+    static size_t completed = 0;
+    static size_t cancelled = 0;
+    static size_t coalesced = 0;
+    static uint64_t latencies[ASYNCIO_LATENCYSAMPLES];
+    static size_t numlatencies = 0;
+    static size_t nextlatency = 0;
+
+    uint64_t AsyncIO::now(void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+
+    // Let whoever is waiting on the read go. The request may be gone the moment the counter is released (they often live on the waiter's stack).
+    static void finish(struct AsyncIO::request *req) {
+        req->counter->unreference();
+    }
+
+    static void readnow(struct AsyncIO::request *req) {
+        while (req->done < req->size) {
+            ssize_t ret = pread(req->fd, req->buffer + req->done, req->size - req->done, req->offset + req->done);
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                req->error = errno;
+                return;
+            } else if (ret == 0) { // file is shorter than it was when the read was issued
+                req->error = EIO;
+                return;
+            }
+            req->done += ret;
+        }
+    }
+
+    // Anything past its deadline is treated as critical.
+    static enum AsyncIO::priority effectivepriority(struct AsyncIO::request *req, uint64_t time) {
+        return req->deadline != 0 && req->deadline <= time ? AsyncIO::PRIORITY_CRITICAL : req->priority;
+    }
+
+    // Merge a request into a dispatch if it sits directly before or after it in the same file.
+    static bool coalesce(struct dispatch *dispatch, struct AsyncIO::request *req) {
+        size_t start = req->offset + req->done;
+        size_t remaining = req->size - req->done;
+        if (dispatch->fd != req->fd || dispatch->count == ASYNCIO_COALESCE || dispatch->size + remaining > ASYNCIO_COALESCESIZE) {
+            return false;
+        }
+
+        if (start == dispatch->offset + dispatch->size) {
+            dispatch->members[dispatch->count] = req;
+            dispatch->iov[dispatch->count] = (struct iovec) { .iov_base = req->buffer + req->done, .iov_len = remaining };
+        } else if (start + remaining == dispatch->offset) {
+            memmove(&dispatch->members[1], &dispatch->members[0], sizeof(struct AsyncIO::request *) * dispatch->count);
+            memmove(&dispatch->iov[1], &dispatch->iov[0], sizeof(struct iovec) * dispatch->count);
+            dispatch->members[0] = req;
+            dispatch->iov[0] = (struct iovec) { .iov_base = req->buffer + req->done, .iov_len = remaining };
+            dispatch->offset = start;
+        } else {
+            return false;
+        }
+        dispatch->count++;
+        dispatch->size += remaining;
+        return true;
+    }
+
+    static void issue(size_t *indices, size_t count);
+
+    // Hand as many pending requests as there's room (and budget) for to the kernel or the readers, best first. Called with the lock held.
+    static void schedule(void) {
+        if (pending.size() == 0 || numfree == 0) {
+            return;
+        }
+
+        uint64_t time = AsyncIO::now();
+        std::sort(pending.begin(), pending.end(), [time](struct AsyncIO::request *a, struct AsyncIO::request *b) {
+            enum AsyncIO::priority pa = OResource::effectivepriority(a, time);
+            enum AsyncIO::priority pb = OResource::effectivepriority(b, time);
+            if (pa != pb) {
+                return pa < pb;
+            }
+            uint64_t da = a->deadline != 0 ? a->deadline : UINT64_MAX;
+            uint64_t db = b->deadline != 0 ? b->deadline : UINT64_MAX;
+            if (da != db) {
+                return da < db;
+            }
+            return a->sequence < b->sequence;
+        });
+
+        size_t opened[ASYNCIO_INFLIGHT];
+        size_t numopened = 0;
+        size_t taken = 0;
+        for (; taken < pending.size(); taken++) {
+            struct AsyncIO::request *req = pending[taken];
+            size_t remaining = req->size - req->done;
+            // Once the frame's budget is spent only critical reads get through (critical ones sort first, so nothing after this could either). The first read of a frame always goes, however big it is.
+            if (budget != 0 && spent != 0 && spent + remaining > budget && OResource::effectivepriority(req, time) != AsyncIO::PRIORITY_CRITICAL) {
+                break;
+            }
+
+            bool merged = false;
+            for (size_t i = 0; i < numopened && !merged; i++) {
+                merged = OResource::coalesce(&dispatches[opened[i]], req);
+            }
+            if (merged) {
+                coalesced++;
+            } else {
+                if (numfree == 0) {
+                    break;
+                }
+                size_t index = freedispatches[--numfree];
+                struct dispatch *dispatch = &dispatches[index];
+                dispatch->fd = req->fd;
+                dispatch->offset = req->offset + req->done;
+                dispatch->size = remaining;
+                dispatch->count = 1;
+                dispatch->members[0] = req;
+                dispatch->iov[0] = (struct iovec) { .iov_base = req->buffer + req->done, .iov_len = remaining };
+                opened[numopened++] = index;
+            }
+            spent += remaining;
+        }
+        pending.erase(pending.begin(), pending.begin() + taken);
+
+        if (numopened > 0) {
+            OResource::issue(opened, numopened);
+        }
+    }
+
+    // A dispatch has come back with `res` bytes (or -errno). Finished requests are gathered in `done` so they can be released once the lock is dropped, anything cut short goes back to the scheduler. Called with the lock held.
+    static void complete(size_t index, ssize_t res, struct AsyncIO::request **done, size_t *numdone) {
+        struct dispatch *dispatch = &dispatches[index];
+        uint64_t time = AsyncIO::now();
+        size_t left = res > 0 ? res : 0;
+        for (size_t i = 0; i < dispatch->count; i++) {
+            struct AsyncIO::request *req = dispatch->members[i];
+            if (res == -EINTR || res == -EAGAIN) {
+                pending.push_back(req);
+                continue;
+            } else if (res < 0) {
+                req->error = -res;
+            } else if (res == 0) { // file is shorter than it was when the read was issued
+                req->error = EIO;
+            } else {
+                size_t got = MIN(req->size - req->done, left);
+                req->done += got;
+                left -= got;
+                if (req->done < req->size) { // short read, go again for the rest
+                    pending.push_back(req);
+                    continue;
+                }
+            }
+
+            latencies[nextlatency] = time - req->submitted;
+            nextlatency = (nextlatency + 1) % ASYNCIO_LATENCYSAMPLES;
+            numlatencies = MIN(numlatencies + 1, ASYNCIO_LATENCYSAMPLES);
+            completed++;
+            done[(*numdone)++] = req;
+        }
+        freedispatches[numfree++] = index;
+    }
+
+    static void *readerthread(void *) {
+        tracy::SetThreadName("AsyncIO Reader");
+
+        struct AsyncIO::request *done[ASYNCIO_COALESCE];
+        pthread_mutex_lock(&lock);
+        for (;;) {
+            while (readycount == 0 && !quitting) {
+                pthread_cond_wait(&available, &lock);
+            }
+            if (readycount == 0) { // quitting with nothing left to do
+                break;
+            }
+            size_t index = ready[readyhead];
+            readyhead = (readyhead + 1) % ASYNCIO_INFLIGHT;
+            readycount--;
+            pthread_mutex_unlock(&lock);
+
+            struct dispatch *dispatch = &dispatches[index];
+            ssize_t res;
+            do {
+                res = preadv(dispatch->fd, dispatch->iov, dispatch->count, dispatch->offset);
+            } while (res < 0 && errno == EINTR);
+
+            size_t numdone = 0;
+            pthread_mutex_lock(&lock);
+            OResource::complete(index, res < 0 ? -errno : res, done, &numdone);
+            OResource::schedule();
+            pthread_mutex_unlock(&lock);
+
+            for (size_t i = 0; i < numdone; i++) {
+                OResource::finish(done[i]);
+            }
+
+            pthread_mutex_lock(&lock);
+        }
+        pthread_mutex_unlock(&lock);
+        return NULL;
+    }
+
+#ifdef ASYNCIO_URING
+
+    static struct {
+        int fd = -1;
+
+        uint32_t *sqtail;
+        uint32_t *sqmask;
+        uint32_t *sqarray;
+        struct io_uring_sqe *sqes;
+
+        uint32_t *cqhead;
+        uint32_t *cqtail;
+        uint32_t *cqmask;
+        struct io_uring_cqe *cqes;
+
+        void *sqring;
+        size_t sqringsize;
+        void *cqring;
+        size_t cqringsize;
+        size_t sqessize;
+    } ring;
+
+    static int uringenter(uint32_t submit, uint32_t wait, uint32_t flags) {
+        return syscall(SYS_io_uring_enter, ring.fd, submit, wait, flags, NULL, 0);
+    }
+
+    // Queue submission entries and hand them to the kernel. There's always room: there are never more than ASYNCIO_INFLIGHT dispatches (plus the shutdown NOP) against a ring of ASYNCIO_QUEUEDEPTH. Called with the lock held.
+    static void uringsubmit(struct io_uring_sqe *entries, size_t count) {
+        uint32_t tail = *ring.sqtail;
+        for (size_t i = 0; i < count; i++) {
+            uint32_t index = tail & *ring.sqmask;
+            ring.sqes[index] = entries[i];
+            ring.sqarray[index] = index;
+            tail++;
+        }
+        __atomic_store_n(ring.sqtail, tail, __ATOMIC_RELEASE);
+
+        size_t queued = count;
+        while (queued > 0) {
+            int ret = OResource::uringenter(queued, 0, 0);
+            if (ret < 0) {
+                ASSERT(errno == EINTR || errno == EAGAIN, "Failed to submit reads to io_uring (%s).\n", strerror(errno));
+                continue;
+            }
+            queued -= ret;
+        }
+    }
+
+    static void *reaperthread(void *) {
+        tracy::SetThreadName("AsyncIO Reaper");
+
+        struct AsyncIO::request *done[ASYNCIO_INFLIGHT * ASYNCIO_COALESCE];
+        bool quit = false;
+        while (!quit) {
+            if (OResource::uringenter(0, 1, IORING_ENTER_GETEVENTS) < 0) {
+                ASSERT(errno == EINTR || errno == EAGAIN, "Failed to wait on io_uring completions (%s).\n", strerror(errno));
+            }
+
+            size_t numdone = 0;
+            pthread_mutex_lock(&lock);
+            uint32_t head = *ring.cqhead;
+            uint32_t tail = __atomic_load_n(ring.cqtail, __ATOMIC_ACQUIRE);
+            for (; head != tail; head++) {
+                struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cqmask];
+                if (cqe->user_data == 0) { // shutdown
+                    quit = true;
+                    continue;
+                }
+                OResource::complete(cqe->user_data - 1, cqe->res, done, &numdone);
+            }
+            __atomic_store_n(ring.cqhead, head, __ATOMIC_RELEASE);
+            OResource::schedule(); // room for anything that was waiting
+            pthread_mutex_unlock(&lock);
+
+            for (size_t i = 0; i < numdone; i++) {
+                OResource::finish(done[i]);
+            }
+        }
+        return NULL;
+    }
+
+    static bool uringinit(void) {
+        struct io_uring_params params = { };
+        ring.fd = syscall(SYS_io_uring_setup, ASYNCIO_QUEUEDEPTH, &params);
+        if (ring.fd < 0) { // not supported or not permitted, the readers will do
+            ring.fd = -1;
+            return false;
+        }
+        ASSERT(params.sq_entries > ASYNCIO_INFLIGHT, "io_uring too small for the scheduler.\n");
+
+        ring.sqringsize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+        ring.cqringsize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            ring.sqringsize = ring.sqringsize > ring.cqringsize ? ring.sqringsize : ring.cqringsize;
+            ring.cqringsize = ring.sqringsize;
+        }
+        ring.sqring = mmap(NULL, ring.sqringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+        ASSERT(ring.sqring != MAP_FAILED, "Failed to map io_uring submission queue (%s).\n", strerror(errno));
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            ring.cqring = ring.sqring;
+        } else {
+            ring.cqring = mmap(NULL, ring.cqringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+            ASSERT(ring.cqring != MAP_FAILED, "Failed to map io_uring completion queue (%s).\n", strerror(errno));
+        }
+        ring.sqessize = params.sq_entries * sizeof(struct io_uring_sqe);
+        ring.sqes = (struct io_uring_sqe *)mmap(NULL, ring.sqessize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+        ASSERT(ring.sqes != MAP_FAILED, "Failed to map io_uring submission entries (%s).\n", strerror(errno));
+
+        ring.sqtail = (uint32_t *)((uint8_t *)ring.sqring + params.sq_off.tail);
+        ring.sqmask = (uint32_t *)((uint8_t *)ring.sqring + params.sq_off.ring_mask);
+        ring.sqarray = (uint32_t *)((uint8_t *)ring.sqring + params.sq_off.array);
+        ring.cqhead = (uint32_t *)((uint8_t *)ring.cqring + params.cq_off.head);
+        ring.cqtail = (uint32_t *)((uint8_t *)ring.cqring + params.cq_off.tail);
+        ring.cqmask = (uint32_t *)((uint8_t *)ring.cqring + params.cq_off.ring_mask);
+        ring.cqes = (struct io_uring_cqe *)((uint8_t *)ring.cqring + params.cq_off.cqes);
+        return true;
+    }
+
+    static void uringdestroy(void) {
+        // A NOP with no dispatch behind it tells the reaper to stop.
+        struct io_uring_sqe sqe = { };
+        sqe.opcode = IORING_OP_NOP;
+        sqe.user_data = 0;
+        pthread_mutex_lock(&lock);
+        OResource::uringsubmit(&sqe, 1);
+        pthread_mutex_unlock(&lock);
+
+        pthread_join(threads[0], NULL);
+
+        munmap(ring.sqes, ring.sqessize);
+        if (ring.cqring != ring.sqring) {
+            munmap(ring.cqring, ring.cqringsize);
+        }
+        munmap(ring.sqring, ring.sqringsize);
+        close(ring.fd);
+        ring.fd = -1;
+    }
+
+#endif
+
+    static void issue(size_t *indices, size_t count) {
+#ifdef ASYNCIO_URING
+        if (useuring) {
+            struct io_uring_sqe entries[ASYNCIO_INFLIGHT];
+            for (size_t i = 0; i < count; i++) {
+                struct dispatch *dispatch = &dispatches[indices[i]];
+                entries[i] = (struct io_uring_sqe) { };
+                entries[i].opcode = IORING_OP_READV; // plain IORING_OP_READ needs 5.6, readv works on anything with io_uring (and lets us merge reads)
+                entries[i].fd = dispatch->fd;
+                entries[i].off = dispatch->offset;
+                entries[i].addr = (uintptr_t)dispatch->iov;
+                entries[i].len = dispatch->count;
+                entries[i].user_data = indices[i] + 1; // 0 is reserved for shutdown
+            }
+            OResource::uringsubmit(entries, count);
+            return;
+        }
+#endif
+        for (size_t i = 0; i < count; i++) {
+            ready[(readyhead + readycount) % ASYNCIO_INFLIGHT] = indices[i];
+            readycount++;
+        }
+        if (count > 1) {
+            pthread_cond_broadcast(&available);
+        } else {
+            pthread_cond_signal(&available);
+        }
+    }
+
+    void AsyncIO::init(void) {
+        ASSERT(!running, "AsyncIO initialised twice.\n");
+        quitting = false;
+        numfree = 0;
+        for (size_t i = ASYNCIO_INFLIGHT; i > 0; i--) {
+            freedispatches[numfree++] = i - 1;
+        }
+        readyhead = 0;
+        readycount = 0;
+#ifdef ASYNCIO_URING
+        useuring = OResource::uringinit();
+        if (useuring) {
+            pthread_create(&threads[0], NULL, OResource::reaperthread, NULL);
+            numthreads = 1;
+        }
+#endif
+        if (!useuring) {
+            for (size_t i = 0; i < ASYNCIO_READERS; i++) {
+                pthread_create(&threads[i], NULL, OResource::readerthread, NULL);
+            }
+            numthreads = ASYNCIO_READERS;
+        }
+        running = true;
+        printf("AsyncIO initialised with %s\n", useuring ? "io_uring" : "reader threads");
+    }
+
+    void AsyncIO::destroy(void) {
+        if (!running) {
+            return;
+        }
+        pthread_mutex_lock(&lock);
+        ASSERT(pending.size() == 0 && numfree == ASYNCIO_INFLIGHT, "AsyncIO destroyed with reads still pending.\n");
+        pthread_mutex_unlock(&lock);
+        running = false;
+#ifdef ASYNCIO_URING
+        if (useuring) {
+            OResource::uringdestroy();
+            useuring = false;
+            numthreads = 0;
+            return;
+        }
+#endif
+        pthread_mutex_lock(&lock);
+        quitting = true;
+        pthread_cond_broadcast(&available);
+        pthread_mutex_unlock(&lock);
+        for (size_t i = 0; i < numthreads; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        numthreads = 0;
+    }
+
+    bool AsyncIO::uring(void) {
+        return useuring;
+    }
+
+    void AsyncIO::submit(struct request **requests, size_t count) {
+        if (!running) { // no service, just do it ourselves
+            for (size_t i = 0; i < count; i++) {
+                OResource::readnow(requests[i]);
+                OResource::finish(requests[i]);
+            }
+            return;
+        }
+
+        uint64_t time = AsyncIO::now();
+        pthread_mutex_lock(&lock);
+        for (size_t i = 0; i < count; i++) {
+            ASSERT(requests[i]->priority < PRIORITY_COUNT, "Invalid read priority %u.\n", requests[i]->priority);
+            requests[i]->submitted = time;
+            requests[i]->sequence = sequence++;
+            pending.push_back(requests[i]);
+        }
+        OResource::schedule();
+        pthread_mutex_unlock(&lock);
+    }
+
+    size_t AsyncIO::cancel(size_t tag) {
+        std::vector<struct request *> removed;
+        pthread_mutex_lock(&lock);
+        size_t kept = 0;
+        for (size_t i = 0; i < pending.size(); i++) {
+            if (pending[i]->tag == tag) {
+                pending[i]->error = ECANCELED;
+                removed.push_back(pending[i]);
+            } else {
+                pending[kept++] = pending[i];
+            }
+        }
+        pending.resize(kept);
+        cancelled += removed.size();
+        pthread_mutex_unlock(&lock);
+
+        for (size_t i = 0; i < removed.size(); i++) {
+            OResource::finish(removed[i]);
+        }
+        return removed.size();
+    }
+
+    size_t AsyncIO::cancel(OUtils::Handle<Resource> resource) {
+        ASSERT(resource.isvalid(), "Invalid resource handle passed to async read cancel.\n");
+        return AsyncIO::cancel(resource->id);
+    }
+
+    void AsyncIO::setbudget(size_t bytes) {
+        pthread_mutex_lock(&lock);
+        budget = bytes;
+        OResource::schedule();
+        pthread_mutex_unlock(&lock);
+    }
+
+    void AsyncIO::frame(void) {
+        pthread_mutex_lock(&lock);
+        spent = 0;
+        OResource::schedule(); // whatever the last frame's budget held back
+        pthread_mutex_unlock(&lock);
+    }
+
+    void AsyncIO::getstats(struct stats *stats) {
+        uint64_t samples[ASYNCIO_LATENCYSAMPLES];
+        pthread_mutex_lock(&lock);
+        stats->pending = pending.size();
+        stats->inflight = ASYNCIO_INFLIGHT - numfree;
+        stats->completed = completed;
+        stats->cancelled = cancelled;
+        stats->coalesced = coalesced;
+        stats->bytes = spent;
+        stats->budget = budget;
+        size_t count = numlatencies;
+        memcpy(samples, latencies, sizeof(uint64_t) * count);
+        pthread_mutex_unlock(&lock);
+
+        std::sort(samples, samples + count);
+        const size_t percentiles[3] = { 50, 95, 99 };
+        for (size_t i = 0; i < 3; i++) {
+            stats->latency[i] = count > 0 ? samples[(count - 1) * percentiles[i] / 100] : 0;
+        }
+    }
+
+    void AsyncIO::plotstats(void) {
+        struct stats stats;
+        AsyncIO::getstats(&stats);
+        TracyPlot("AsyncIO Pending", (int64_t)stats.pending);
+        TracyPlot("AsyncIO In Flight", (int64_t)stats.inflight);
+        TracyPlot("AsyncIO Bytes This Frame", (int64_t)stats.bytes);
+        TracyPlot("AsyncIO Latency p50 (ms)", stats.latency[0] / 1000000.0);
+        TracyPlot("AsyncIO Latency p99 (ms)", stats.latency[2] / 1000000.0);
+    }
+
+    void AsyncIO::readbatch(struct batchread *reads, size_t count) {
+        ZoneScopedN("AsyncIO Batch Read");
+
+        struct request stackrequests[ASYNCIO_BATCHSTACK];
+        struct request *stackqueue[ASYNCIO_BATCHSTACK];
+        size_t stackindices[ASYNCIO_BATCHSTACK];
+        struct request *requests = stackrequests;
+        struct request **queue = stackqueue;
+        size_t *indices = stackindices; // batch entry each request reads for
+        if (count > ASYNCIO_BATCHSTACK) {
+            requests = (struct request *)malloc(sizeof(struct request) * count);
+            queue = (struct request **)malloc(sizeof(struct request *) * count);
+            indices = (size_t *)malloc(sizeof(size_t) * count);
+            ASSERT(requests != NULL && queue != NULL && indices != NULL, "Failed to allocate memory for async batch read.\n");
+        }
+
+        OJob::Counter counter = OJob::Counter();
+        size_t queued = 0;
+        for (size_t i = 0; i < count; i++) {
+            struct batchread *read = &reads[i];
+            ASSERT(read->resource.isvalid(), "Invalid resource handle passed to async batch read.\n");
+            read->error = SUCCESS;
+
+            int fd = -1;
+            size_t base = 0;
+            size_t filesize = 0;
+            RESOURCE_GUARANTEE(read->resource, // Only for as long as it takes to find the file, the read itself happens without holding the resource.
+                if (read->resource->type == Resource::SOURCE_RPAK) {
+                    filesize = read->resource->rpakentry.uncompressedsize;
+                    if (!read->resource->rpakentry.compressed) {
+                        fd = read->resource->rpak->descriptor();
+                        base = read->resource->rpakentry.offset;
+                    }
+                } else if (read->resource->type == Resource::SOURCE_OSFS) {
+                    if (read->resource->fd == -1) {
+                        read->resource->fd = open(read->resource->path, O_RDONLY | O_CLOEXEC);
+                    }
+                    ASSERT(read->resource->fd != -1, "Failed to load file %s.\n", read->resource->path);
+                    struct ::stat st;
+                    ASSERT(!fstat(read->resource->fd, &st), "Failed to figure out the size of %s.\n", read->resource->path);
+                    filesize = st.st_size;
+                    fd = read->resource->fd;
+                } else {
+                    ASSERT(false, "Virtual resource %s can't be read from.\n", read->resource->path);
+                }
+            );
+
+            ASSERT(read->offset < filesize, "Specified offset is at the end of the file for %s.\n", read->resource->path);
+            if (read->size == SIZE_MAX) {
+                read->size = filesize - read->offset; // update the size to now include the actual buffer size
+            }
+            ASSERT(read->size <= filesize - read->offset, "Read past the end of the file for %s.\n", read->resource->path);
+            if (read->buffer == NULL) {
+                read->buffer = malloc(read->size);
+                ASSERT(read->buffer != NULL, "Failed to allocate buffer memory for async file load of %s.\n", read->resource->path);
+            }
+
+            if (fd == -1) { // compressed RPak file, inflating is CPU work anyway so it may as well happen here
+                if (read->resource->rpak->read(&read->resource->rpakentry, read->buffer, read->size, read->offset) != read->size) {
+                    read->error = FAILED;
+                }
+                continue;
+            }
+
+            requests[queued] = (struct request) {
+                .fd = fd, .offset = base + read->offset, .size = read->size, .buffer = (uint8_t *)read->buffer,
+                .done = 0, .error = 0, .counter = &counter, .priority = read->priority, .deadline = read->deadline, .tag = read->resource->id,
+                .submitted = 0, .sequence = 0
+            };
+            queue[queued] = &requests[queued];
+            indices[queued] = i;
+            queued++;
+        }
+
+        if (queued > 0) {
+            counter.ref.fetch_add(queued); // the same as kicking a batch of jobs would
+            pthread_spin_trylock(&counter.lock);
+            AsyncIO::submit(queue, queued);
+            counter.wait();
+
+            for (size_t i = 0; i < queued; i++) {
+                if (requests[i].error == ECANCELED) {
+                    reads[indices[i]].error = CANCELLED;
+                } else if (requests[i].error != 0) {
+                    reads[indices[i]].error = FAILED;
+                }
+            }
+        }
+
+        if (requests != stackrequests) {
+            free(requests);
+            free(queue);
+            free(indices);
+        }
+    }
+
+    void AsyncIO::loadwork(struct work *work) {
+        ZoneScopedN("AsyncIO File Load");
+
+        work->mapped = false;
+        if (work->hascallback && work->resource->type == Resource::SOURCE_RPAK) { // callbacks only borrow the buffer, so they can have the mapped data itself
+            RPak *rpak = work->resource->rpak;
+            ASSERT(work->offset < work->resource->rpakentry.uncompressedsize, "Specified offset is at the end of the file for %s.\n", work->resource->path);
+            struct RPak::span span = rpak->map(&work->resource->rpakentry, work->offset, work->size);
+            if (span.data != NULL) {
+                rpak->advise(&work->resource->rpakentry, RPak::ADVICE_SEQUENTIAL, work->offset, span.size);
+                work->buffer = (void *)span.data;
+                work->size = span.size;
+                work->mapped = true;
+            }
+        }
+
+        uint8_t error = SUCCESS;
+        if (!work->mapped) {
+            struct batchread read = { .resource = work->resource, .offset = work->offset, .size = work->size, .buffer = NULL, .error = SUCCESS, .priority = work->priority, .deadline = work->deadline };
+            AsyncIO::readbatch(&read, 1);
+            work->buffer = read.buffer;
+            work->size = read.size;
+            error = read.error;
+        }
+        if (work->error != NULL) {
+            *work->error = error;
+        } else {
+            ASSERT(error != FAILED, "Failed to read data from file %s.\n", work->resource->path);
+        }
+        if (error == CANCELLED) { // nothing worth handing over
+            free(work->buffer);
+            work->buffer = NULL;
+        }
+
+        if (work->hascallback) {
+            ASSERT(work->callback != NULL, "Callback async file load for %s was requested but no callback provided!\n", work->resource->path);
+            if (error != CANCELLED) {
+                RESOURCE_GUARANTEE(work->resource, // Guarantee exclusive access to this resource for the callback.
+                    work->callback(work); // Run callback
+                );
+            }
+            if (!work->mapped) {
+                free(work->buffer);
+            }
+            delete work;
+        } else if (work->out != NULL) { // load(), nobody else is holding on to the work
+            *work->out = work->buffer;
+            delete work;
+        }
+    }
+
+}
@@ -83,7 +83,7 @@ namespace OResource {
 
             ASSERT(reqsize >= sizeof(struct header), "OMod file is not large enough to accomodate for at least the header size.\n");
             reqsize -= sizeof(struct header);
-            ASSERT(rpak->read(res->path, &this->header, sizeof(struct header), 0) > 0, "Failed to read OMod file header from RPak.\n");
+            ASSERT(rpak->read(&res->rpakentry, &this->header, sizeof(struct header), 0) > 0, "Failed to read OMod file header from RPak.\n");
             ASSERT(!strncmp(this->header.magic, "OMOD", sizeof(this->header.magic)), "Invalid OMod file magic.\n");
 
             OUtils::print("Model file header:\n\tMagic: %s\n\tMesh count: %u\n\tMaterial count: %u\n", this->header.magic, this->header.nummesh, this->header.nummaterial);
@@ -91,7 +91,7 @@ namespace OResource {
             this->materials = (struct material *)malloc(sizeof(struct material) * this->header.nummaterial);
             ASSERT(this->materials != NULL, "Failed to allocate memory for model materials.\n");
             ASSERT(rpak->read(
-                res->path, this->materials, sizeof(struct material) * this->header.nummaterial,
+                &res->rpakentry, this->materials, sizeof(struct material) * this->header.nummaterial,
                 sizeof(struct header)) > 0, "Failed to read OMod file materials from RPak.\n"
             );
             reqsize -= sizeof(struct material) * this->header.nummaterial;
@@ -101,7 +101,7 @@ namespace OResource {
             struct meshhdr *meshheaders = (struct meshhdr *)malloc(sizeof(struct meshhdr) * this->header.nummesh);
             ASSERT(meshheaders != NULL, "Failed to allocate memory for mesh headers.\n");
             ASSERT(rpak->read(
-                res->path, meshheaders, sizeof(struct meshhdr) * this->header.nummesh,
+                &res->rpakentry, meshheaders, sizeof(struct meshhdr) * this->header.nummesh,
                 sizeof(struct header) + (sizeof(struct material) * this->header.nummaterial)) > 0, "Failed to read OMod file mesh headers from RPak.\n"
             );
             OUtils::print("Material ID %u, Vertices: %u, Indices: %u, Offset: 0x%lx\n", meshheaders[0].material, meshheaders[0].vertexcount, meshheaders[0].indexcount, meshheaders[0].offset);
@@ -124,12 +124,12 @@ namespace OResource {
                 ASSERT(this->meshes[i].indices != NULL, "Failed to allocate memory for mesh indices.\n");
 
                 ASSERT(rpak->read(
-                    res->path, this->meshes[i].vertices, sizeof(struct mesh::vertex) * this->meshes[i].header.vertexcount,
+                    &res->rpakentry, this->meshes[i].vertices, sizeof(struct mesh::vertex) * this->meshes[i].header.vertexcount,
                     this->meshes[i].header.offset) > 0,
                     "Failed to read OMod file mesh %lu vertices from RPak.\n", i
                 );
                 ASSERT(rpak->read(
-                    res->path, this->meshes[i].indices, sizeof(uint16_t) * this->meshes[i].header.indexcount,
+                    &res->rpakentry, this->meshes[i].indices, sizeof(uint16_t) * this->meshes[i].header.indexcount,
                     this->meshes[i].header.offset + (sizeof(struct mesh::vertex) * this->meshes[i].header.vertexcount)) > 0,
                     "Failed to read OMod file mesh %lu indices from RPak.\n", i
                 );
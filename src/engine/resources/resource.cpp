@@ -1,7 +1,13 @@
 #include <engine/concurrency/job.hpp>
+#include <fcntl.h>
+#include <new>
 #include <pthread.h>
 #include <engine/resources/resource.hpp>
 #include <engine/utils/hash.hpp>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
 
 // custom format for models (animations, etc.)
 // KTX for textures
@@ -9,19 +15,109 @@
 namespace OResource {
     ResourceManager manager;
 
+    struct ResourceManager::index *ResourceManager::createindex(size_t capacity) {
+        struct ResourceManager::index *index = (struct ResourceManager::index *)malloc(sizeof(struct ResourceManager::index));
+        ASSERT(index != NULL, "Failed to allocate memory for resource index.\n");
+        index->capacity = capacity;
+        index->slots = (std::atomic<Resource *> *)calloc(capacity, sizeof(std::atomic<Resource *>)); // all NULL
+        ASSERT(index->slots != NULL, "Failed to allocate memory for resource index slots.\n");
+        index->retired = NULL;
+        return index;
+    }
+
+    ResourceManager::ResourceManager(void) {
+        this->paths.store(ResourceManager::createindex(RESOURCE_MINCAPACITY), std::memory_order_release);
+        pthread_spin_init(&this->residencylock, PTHREAD_PROCESS_PRIVATE);
+    }
+
+    ResourceManager::~ResourceManager(void) {
+        struct index *index = this->paths.load(std::memory_order_acquire);
+        while (index != NULL) {
+            struct index *retired = index->retired;
+            free(index->slots);
+            free(index);
+            index = retired;
+        }
+        pthread_spin_destroy(&this->residencylock);
+    }
+
+    // Make sure the index can take `count` more resources, growing it if it can't. Called with the mutex held.
+    void ResourceManager::reserve(size_t count) {
+        struct index *index = this->paths.load(std::memory_order_relaxed);
+        if ((this->count + count) * 2 <= index->capacity) {
+            return;
+        }
+
+        size_t capacity = index->capacity;
+        while ((this->count + count) * 2 > capacity) {
+            capacity <<= 1;
+        }
+        struct index *grown = ResourceManager::createindex(capacity);
+        for (size_t i = 0; i < index->capacity; i++) {
+            Resource *resource = index->slots[i].load(std::memory_order_relaxed);
+            if (resource == NULL) {
+                continue;
+            }
+            size_t slot = resource->hash & (capacity - 1);
+            while (grown->slots[slot].load(std::memory_order_relaxed) != NULL) {
+                slot = (slot + 1) & (capacity - 1);
+            }
+            grown->slots[slot].store(resource, std::memory_order_relaxed);
+        }
+        grown->retired = index; // readers may still be in the old one, it goes when we do
+        this->paths.store(grown, std::memory_order_release);
+    }
+
+    // Called with the mutex held, and with room reserved.
+    void ResourceManager::insert(Resource *resource) {
+        struct index *index = this->paths.load(std::memory_order_relaxed);
+        size_t slot = resource->hash & (index->capacity - 1);
+        for (;;) {
+            Resource *existing = index->slots[slot].load(std::memory_order_relaxed);
+            if (existing == NULL) {
+                index->slots[slot].store(resource, std::memory_order_release);
+                this->count++;
+                return;
+            } else if (existing->hash == resource->hash && !strcmp(existing->path, resource->path)) { // same path registered again, newest wins
+                index->slots[slot].store(resource, std::memory_order_release);
+                return;
+            }
+            slot = (slot + 1) & (index->capacity - 1);
+        }
+    }
+
     void ResourceManager::loadrpak(RPak *rpak) {
         ASSERT(rpak != NULL, "Invalid RPak given to resource manager load.\n");
-        for (size_t i = 0; i < rpak->header.num; i++) {
-            Resource *res = new Resource(rpak, rpak->entries[i].path);
-            res->rpakentry = rpak->entries[i];
-            this->resources[OUtils::fnv1a(rpak->entries[i].path, strlen(rpak->entries[i].path), FNV1A_SEED)] = res;
+        size_t num = rpak->header.num;
+        if (num == 0) {
+            return;
+        }
+
+        // One block for every resource in the pack, handles and IDs reserved in one go.
+        Resource *resources = (Resource *)malloc(sizeof(Resource) * num);
+        ASSERT(resources != NULL, "Failed to allocate memory for RPak resources.\n");
+        size_t handle = this->table.bindrange(resources, sizeof(Resource), num);
+        ASSERT(handle != SIZE_MAX, "Failed to bind RPak resources.\n");
+        size_t id = this->idcounter.fetch_add(num);
+        for (size_t i = 0; i < num; i++) {
+            new (&resources[i]) Resource(rpak, &rpak->entries[i], handle + i, id + i);
         }
+
+        this->mutex.lock();
+        this->reserve(num);
+        for (size_t i = 0; i < num; i++) {
+            this->insert(&resources[i]);
+        }
+        this->mutex.unlock();
     }
 
     OUtils::Handle<Resource> ResourceManager::create(const char *path) {
         ASSERT(path != NULL, "Invalid path given to resource manager create.\n");
         Resource *ret = new Resource(path);
-        this->resources[OUtils::fnv1a(path, strlen(path), FNV1A_SEED)] = ret;
+        this->mutex.lock();
+        this->reserve(1);
+        this->insert(ret);
+        this->mutex.unlock();
         return ret->gethandle();
     }
 
@@ -29,17 +125,286 @@ namespace OResource {
         ASSERT(path != NULL, "Invalid path given to resource manager virtual create.\n");
         ASSERT(src != NULL, "Invalid source pointer given to resource manager virtual create.\n");
         Resource *ret = new Resource(path, src);
-        this->resources[OUtils::fnv1a(path, strlen(path), FNV1A_SEED)] = ret;
+        this->mutex.lock();
+        this->reserve(1);
+        this->insert(ret);
+        this->mutex.unlock();
         return ret->gethandle();
     }
 
     OUtils::Handle<Resource> ResourceManager::get(const char *path) {
         ASSERT(path != NULL, "Invalid path given to resource manager search.\n");
-        auto res = this->resources.find(OUtils::fnv1a(path, strlen(path), FNV1A_SEED));
-        if (res == this->resources.end()) { // No such resource, return invalid handle.
-            return RESOURCE_INVALIDHANDLE;
+        uint64_t hash = OUtils::fnv1a64(path, strlen(path));
+        struct index *index = this->paths.load(std::memory_order_acquire);
+        for (size_t slot = hash & (index->capacity - 1);; slot = (slot + 1) & (index->capacity - 1)) {
+            Resource *resource = index->slots[slot].load(std::memory_order_acquire);
+            if (resource == NULL) { // No such resource, return invalid handle.
+                return RESOURCE_INVALIDHANDLE;
+            } else if (resource->hash == hash && !strcmp(resource->path, path)) {
+                return resource->gethandle();
+            }
+        }
+    }
+
+    uint64_t ResourceManager::contenthash(OUtils::Handle<Resource> resource) {
+        Resource *res = resource.resolve();
+        uint64_t hash = res->content.load(std::memory_order_acquire);
+        if (hash != 0) {
+            return hash;
+        }
+
+        ZoneScoped;
+        // Concurrent first callers may all end up hashing, they come to the same answer so it doesn't matter who stores it.
+        if (res->type == Resource::SOURCE_RPAK) {
+            const struct RPak::tableentry *entry = &res->rpakentry; // resolved when the RPak was loaded
+            struct RPak::span span = res->rpak->map(entry);
+            if (span.data != NULL) {
+                hash = OUtils::hash64(span.data, span.size, span.size);
+            } else {
+                uint8_t *data = (uint8_t *)malloc(entry->uncompressedsize);
+                ASSERT(data != NULL || entry->uncompressedsize == 0, "Failed to allocate memory for hashing resource '%s'.\n", res->path);
+                size_t size = res->rpak->read(entry, data, entry->uncompressedsize, 0);
+                hash = OUtils::hash64(data, size, size);
+                free(data);
+            }
+        } else if (res->type == Resource::SOURCE_OSFS) {
+            int fd = open(res->path, O_RDONLY);
+            ASSERT(fd != -1, "Failed to open '%s' for hashing.\n", res->path);
+            struct stat st;
+            ASSERT(fstat(fd, &st) == 0, "Failed to stat '%s' for hashing.\n", res->path);
+            uint8_t *data = (uint8_t *)malloc(st.st_size);
+            ASSERT(data != NULL || st.st_size == 0, "Failed to allocate memory for hashing resource '%s'.\n", res->path);
+            size_t size = 0;
+            while (size < (size_t)st.st_size) {
+                ssize_t got = read(fd, data + size, st.st_size - size);
+                ASSERT(got > 0, "Failed to read '%s' for hashing.\n", res->path);
+                size += got;
+            }
+            close(fd);
+            hash = OUtils::hash64(data, size, size);
+            free(data);
         } else {
-            return res->second->gethandle();
+            ASSERT(false, "Virtual resource '%s' has no contents to hash.\n", res->path);
         }
+
+        hash = hash != 0 ? hash : 1; // 0 is "not worked out yet"
+        res->content.store(hash, std::memory_order_release);
+        return hash;
+    }
+
+    // LRU of unreferenced resident payloads, called with the residency lock held.
+    void ResourceManager::lruremove(Resource *resource) {
+        struct residency *category = &this->categories[resource->category];
+        if (resource->lruprev != NULL) {
+            resource->lruprev->lrunext = resource->lrunext;
+        } else {
+            category->head = resource->lrunext;
+        }
+        if (resource->lrunext != NULL) {
+            resource->lrunext->lruprev = resource->lruprev;
+        } else {
+            category->tail = resource->lruprev;
+        }
+        resource->lruprev = NULL;
+        resource->lrunext = NULL;
+        resource->inlru = false;
+        category->unreferenced--;
+    }
+
+    void ResourceManager::lrupush(Resource *resource) {
+        struct residency *category = &this->categories[resource->category];
+        resource->lastused = this->frame;
+        resource->lruprev = category->tail;
+        resource->lrunext = NULL;
+        if (category->tail != NULL) {
+            category->tail->lrunext = resource;
+        } else {
+            category->head = resource;
+        }
+        category->tail = resource;
+        resource->inlru = true;
+        category->unreferenced++;
+    }
+
+    bool ResourceManager::reference(OUtils::Handle<Resource> resource) {
+        ASSERT(resource.isvalid(), "Invalid resource handle given to resource manager reference.\n");
+        Resource *res = resource.resolve();
+        pthread_spin_lock(&this->residencylock);
+        if (!res->resident) {
+            pthread_spin_unlock(&this->residencylock);
+            return false;
+        }
+        if (res->refs.fetch_add(1, std::memory_order_relaxed) == 0 && res->inlru) {
+            this->lruremove(res);
+        }
+        pthread_spin_unlock(&this->residencylock);
+        return true;
+    }
+
+    void ResourceManager::unreference(OUtils::Handle<Resource> resource) {
+        ASSERT(resource.isvalid(), "Invalid resource handle given to resource manager unreference.\n");
+        Resource *res = resource.resolve();
+        pthread_spin_lock(&this->residencylock);
+        ASSERT(res->refs.load(std::memory_order_relaxed) > 0, "Resource '%s' unreferenced more times than it was referenced.\n", res->path);
+        if (res->refs.fetch_sub(1, std::memory_order_relaxed) == 1 && res->resident) {
+            this->lrupush(res);
+        }
+        pthread_spin_unlock(&this->residencylock);
+    }
+
+    void ResourceManager::makeresident(OUtils::Handle<Resource> resource, enum category category, size_t cpusize, size_t gpusize, unloadfunc unload, uintptr_t param) {
+        ASSERT(resource.isvalid(), "Invalid resource handle given to resource manager makeresident.\n");
+        ASSERT(category < CATEGORY_COUNT, "Invalid residency category %u.\n", category);
+        Resource *res = resource.resolve();
+        pthread_spin_lock(&this->residencylock);
+        ASSERT(!res->resident, "Resource '%s' made resident twice.\n", res->path);
+        if (res->tracked) { // back after an eviction
+            this->categories[category].reloads++;
+        }
+        res->tracked = true;
+        res->resident = true;
+        res->category = category;
+        res->cpusize = cpusize;
+        res->gpusize = gpusize;
+        res->unload = unload;
+        res->unloadparam = param;
+        this->categories[category].resident++;
+        this->categories[category].cpu += cpusize;
+        this->categories[category].gpu += gpusize;
+        if (res->refs.load(std::memory_order_relaxed) == 0) {
+            this->lrupush(res);
+        }
+        pthread_spin_unlock(&this->residencylock);
+    }
+
+    void ResourceManager::resize(OUtils::Handle<Resource> resource, size_t cpusize, size_t gpusize) {
+        ASSERT(resource.isvalid(), "Invalid resource handle given to resource manager resize.\n");
+        Resource *res = resource.resolve();
+        pthread_spin_lock(&this->residencylock);
+        if (res->resident) {
+            struct residency *category = &this->categories[res->category];
+            category->cpu = category->cpu - res->cpusize + cpusize;
+            category->gpu = category->gpu - res->gpusize + gpusize;
+            res->cpusize = cpusize;
+            res->gpusize = gpusize;
+        }
+        pthread_spin_unlock(&this->residencylock);
+    }
+
+    OUtils::Handle<Resource> ResourceManager::acquire(const char *path, enum category category, loadfunc load, unloadfunc unload, uintptr_t param) {
+        ASSERT(path != NULL, "Invalid path given to resource manager acquire.\n");
+        ASSERT(load != NULL, "No loader given to resource manager acquire.\n");
+
+        for (;;) {
+            OUtils::Handle<Resource> resource = this->get(path);
+            if (resource.isvalid()) {
+                if (this->reference(resource)) { // already resident (the common case)
+                    return resource;
+                }
+
+                // Never loaded (registered some other way) or evicted, load it back in place. Whoever claims it first does the loading, everyone else finds it resident on the next go around.
+                RESOURCE_GUARANTEE(resource,
+                    if (!resource->resident) {
+                        size_t cpusize = 0;
+                        size_t gpusize = 0;
+                        resource->ptr = load(path, param, &cpusize, &gpusize);
+                        ASSERT(resource->ptr != NULL, "Failed to load resource '%s'.\n", path);
+                        this->makeresident(resource, category, cpusize, gpusize, unload, param);
+                    }
+                );
+                continue;
+            }
+
+            // First time anyone has asked for this path. Register it unloaded and go around again, whoever claims it first loads it while everyone else asking for it waits on the claim (so it's only ever loaded once).
+            this->mutex.lock();
+            if (!this->get(path).isvalid()) {
+                char *copy = strdup(path);
+                ASSERT(copy != NULL, "Failed to allocate memory for resource path.\n");
+                Resource *res = new Resource(copy, NULL);
+                this->reserve(1);
+                this->insert(res);
+            }
+            this->mutex.unlock();
+        }
+    }
+
+    void ResourceManager::setbudget(enum category category, size_t cpu, size_t gpu) {
+        ASSERT(category < CATEGORY_COUNT, "Invalid residency category %u.\n", category);
+        pthread_spin_lock(&this->residencylock);
+        this->categories[category].cpubudget = cpu;
+        this->categories[category].gpubudget = gpu;
+        pthread_spin_unlock(&this->residencylock);
+    }
+
+    void ResourceManager::tick(void) {
+        ZoneScoped;
+        struct eviction {
+            Resource *res;
+            void *ptr;
+            unloadfunc unload;
+            uintptr_t param;
+        };
+        std::vector<struct eviction> evicted;
+
+        pthread_spin_lock(&this->residencylock);
+        this->frame++;
+        for (size_t i = 0; i < CATEGORY_COUNT; i++) {
+            struct residency *category = &this->categories[i];
+            // Oldest first, so the first one that's too recent to go means the rest are too.
+            while (category->head != NULL &&
+                ((category->cpubudget != 0 && category->cpu > category->cpubudget) || (category->gpubudget != 0 && category->gpu > category->gpubudget)) &&
+                this->frame - category->head->lastused >= RESOURCE_EVICTFRAMES
+            ) {
+                Resource *res = category->head;
+                this->lruremove(res);
+                res->resident = false; // nobody can reference it from here on, acquire() will load it again
+                category->resident--;
+                category->cpu -= res->cpusize;
+                category->gpu -= res->gpusize;
+                category->evictions++;
+                // Take the payload while we still hold the lock, an acquire() that gets in before we unload loads a fresh one into ptr rather than overwriting this one.
+                evicted.push_back((struct eviction) { .res = res, .ptr = res->ptr, .unload = res->unload, .param = res->unloadparam });
+                res->ptr = NULL;
+            }
+        }
+        pthread_spin_unlock(&this->residencylock);
+
+        // Unload outside the lock, claiming each resource so a concurrent acquire() waits for the unload to finish before loading it back in.
+        for (size_t i = 0; i < evicted.size(); i++) {
+            struct eviction *eviction = &evicted[i];
+            eviction->res->claim();
+            if (eviction->unload != NULL) {
+                eviction->unload(eviction->ptr, eviction->param);
+            }
+            eviction->res->release();
+        }
+    }
+
+    void ResourceManager::getstats(struct stats *stats) {
+        pthread_spin_lock(&this->residencylock);
+        for (size_t i = 0; i < CATEGORY_COUNT; i++) {
+            struct residency *category = &this->categories[i];
+            stats->resident[i] = category->resident;
+            stats->unreferenced[i] = category->unreferenced;
+            stats->cpu[i] = category->cpu;
+            stats->gpu[i] = category->gpu;
+            stats->cpubudget[i] = category->cpubudget;
+            stats->gpubudget[i] = category->gpubudget;
+            stats->evictions[i] = category->evictions;
+            stats->reloads[i] = category->reloads;
+        }
+        pthread_spin_unlock(&this->residencylock);
+    }
+
+    void ResourceManager::plotstats(void) {
+        struct stats stats;
+        this->getstats(&stats);
+        TracyPlot("Resident Models", (int64_t)stats.resident[CATEGORY_MODEL]);
+        TracyPlot("Resident Model CPU Memory (MB)", stats.cpu[CATEGORY_MODEL] / (1024.0 * 1024.0));
+        TracyPlot("Resident Model GPU Memory (MB)", stats.gpu[CATEGORY_MODEL] / (1024.0 * 1024.0));
+        TracyPlot("Resident Textures", (int64_t)stats.resident[CATEGORY_TEXTURE]);
+        TracyPlot("Resident Texture GPU Memory (MB)", stats.gpu[CATEGORY_TEXTURE] / (1024.0 * 1024.0));
+        TracyPlot("Unreferenced Resident Payloads", (int64_t)(stats.unreferenced[CATEGORY_MODEL] + stats.unreferenced[CATEGORY_TEXTURE] + stats.unreferenced[CATEGORY_OTHER]));
+        TracyPlot("Resource Evictions", (int64_t)(stats.evictions[CATEGORY_MODEL] + stats.evictions[CATEGORY_TEXTURE] + stats.evictions[CATEGORY_OTHER]));
     }
-}
\ No newline at end of file
+}
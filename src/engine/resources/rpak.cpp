@@ -1,5 +1,7 @@
 #include <dirent.h>
 #include <engine/resources/rpak.hpp>
+#include <engine/utils/hash.hpp>
+#include <sys/param.h>
 #include <zlib.h>
 
 namespace OResource {
@@ -10,170 +12,382 @@ namespace OResource {
         int fd = open(path, O_RDONLY);
         ASSERT(fd != -1, "Failed to open RPAK to mount.\n");
 
-        struct ::stat st;
-        ASSERT(!fstat(fd, &st), "Failed to determine file size of RPAK.\n");
-        size_t size = st.st_size;
-
         struct RPak::header header = { };
-        ASSERT(pread(fd, &header, sizeof(struct RPak::header), 0), "Failed to read RPAK header.\n");
+        ASSERT(pread(fd, &header, sizeof(struct RPak::header), 0) == sizeof(struct RPak::header), "Failed to read RPAK header.\n");
         ASSERT(!strncmp(header.magic, "RPAK", sizeof(header.magic)), "Attempting to mount RPAK file that does not display magic.\n");
+        ASSERT(header.version >= 1 && header.version <= RPAK_FORMATVERSION, "Unsupported RPAK format version %u.\n", header.version);
 
-        struct RPak::tableentry *entries = (struct RPak::tableentry *)malloc(sizeof(struct RPak::tableentry) * header.num);
-        ASSERT(entries != NULL, "Failed to allocate memory for RPAK table entries.\n");
-        ASSERT(pread(fd, entries, sizeof(struct RPak::tableentry) * header.num, sizeof(struct RPak::header)), "Failed to read RPAK table entries.\n");
-
-        this->entries = entries;
         this->header = header;
         this->fd = fd;
+
+        struct ::stat st;
+        ASSERT(!fstat(fd, &st), "Failed to stat RPAK.\n");
+        this->mappingsize = st.st_size;
+        this->mapping = (uint8_t *)mmap(NULL, this->mappingsize, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (this->mapping == MAP_FAILED) { // not fatal, we just can't hand out spans
+            this->mapping = NULL;
+        }
+        this->entries = (struct RPak::tableentry *)malloc(sizeof(struct RPak::tableentry) * header.num);
+        ASSERT(this->entries != NULL, "Failed to allocate memory for RPAK table entries.\n");
+
+        if (header.version == 1) {
+            // Old archives carry full inline paths, pack them into a string table of our own and index them.
+            struct RPak::diskentryv1 *old = (struct RPak::diskentryv1 *)malloc(sizeof(struct RPak::diskentryv1) * header.num);
+            ASSERT(old != NULL, "Failed to allocate memory for RPAK table entries.\n");
+            ASSERT(pread(fd, old, sizeof(struct RPak::diskentryv1) * header.num, sizeof(struct RPak::header)) == (ssize_t)(sizeof(struct RPak::diskentryv1) * header.num), "Failed to read RPAK table entries.\n");
+
+            size_t stringsize = 0;
+            for (size_t i = 0; i < header.num; i++) {
+                stringsize += strnlen(old[i].path, sizeof(old[i].path)) + 1;
+            }
+            this->strings = (uint8_t *)malloc(stringsize);
+            ASSERT(this->strings != NULL, "Failed to allocate memory for RPAK path strings.\n");
+
+            size_t stroff = 0;
+            for (size_t i = 0; i < header.num; i++) {
+                size_t len = strnlen(old[i].path, sizeof(old[i].path));
+                char *str = (char *)this->strings + stroff;
+                memcpy(str, old[i].path, len);
+                str[len] = '\0';
+                stroff += len + 1;
+
+                ASSERT(!old[i].compressed, "RPAK entry %lu is compressed in a format we can't read.\n", i); // never actually written by version 1 packagers
+                this->entries[i] = (struct RPak::tableentry) {
+                    .path = str, .hash = OUtils::fnv1a64(str, len), .compressed = old[i].compressed,
+                    .uncompressedsize = old[i].uncompressedsize, .compressedsize = old[i].compressedsize, .offset = old[i].offset
+                };
+            }
+            free(old);
+            this->buildindex();
+            return;
+        }
+
+        struct RPak::tocheader toc = { };
+        size_t off = sizeof(struct RPak::header);
+        ASSERT(pread(fd, &toc, sizeof(struct RPak::tocheader), off) == sizeof(struct RPak::tocheader), "Failed to read RPAK table of contents header.\n");
+        off += sizeof(struct RPak::tocheader);
+        ASSERT(toc.buckets > header.num && (toc.buckets & (toc.buckets - 1)) == 0, "Invalid RPAK hash index size %u for %u entries.\n", toc.buckets, header.num);
+
+        // Read the entries, index and string table in one go (they're contiguous).
+        size_t entriessize = sizeof(struct RPak::diskentry) * header.num;
+        size_t indexsize = sizeof(uint32_t) * toc.buckets;
+        uint8_t *toc_ = (uint8_t *)malloc(entriessize + indexsize + toc.stringsize);
+        ASSERT(toc_ != NULL, "Failed to allocate memory for RPAK table of contents.\n");
+        ASSERT(pread(fd, toc_, entriessize + indexsize + toc.stringsize, off) == (ssize_t)(entriessize + indexsize + toc.stringsize), "Failed to read RPAK table of contents.\n");
+
+        this->buckets = toc.buckets;
+        this->index = (uint32_t *)malloc(indexsize);
+        ASSERT(this->index != NULL, "Failed to allocate memory for RPAK hash index.\n");
+        memcpy(this->index, toc_ + entriessize, indexsize);
+        this->strings = (uint8_t *)malloc(toc.stringsize);
+        ASSERT(this->strings != NULL, "Failed to allocate memory for RPAK path strings.\n");
+        memcpy(this->strings, toc_ + entriessize + indexsize, toc.stringsize);
+
+        struct RPak::diskentry *disk = (struct RPak::diskentry *)toc_;
+        for (size_t i = 0; i < header.num; i++) {
+            ASSERT(disk[i].pathoffset + disk[i].pathlen < toc.stringsize, "RPAK entry %lu path lies outside of the string table.\n", i);
+            ASSERT(!disk[i].compressed || (header.version >= 3 && (disk[i].offset & (RPAK_DATAALIGN - 1)) == 0), "RPAK entry %lu is compressed in a format we can't read.\n", i);
+            this->entries[i] = (struct RPak::tableentry) {
+                .path = (const char *)this->strings + disk[i].pathoffset, .hash = disk[i].hash, .compressed = disk[i].compressed != 0,
+                .uncompressedsize = disk[i].uncompressedsize, .compressedsize = disk[i].compressedsize, .offset = disk[i].offset
+            };
+        }
+        free(toc_);
     }
 
-    struct RPak::stat RPak::stat(const char *path) {
-        ASSERT(path, "Attempting to read NULL file path.\n");
-        OJob::ScopedMutex mutex(&this->lock);
+    // Index entries by path hash (only needed for archives that don't ship one).
+    void RPak::buildindex(void) {
+        this->buckets = 2;
+        while (this->buckets < this->header.num * 2) { // keep the load factor at or below 50% so probe sequences stay short
+            this->buckets <<= 1;
+        }
+        this->index = (uint32_t *)calloc(this->buckets, sizeof(uint32_t));
+        ASSERT(this->index != NULL, "Failed to allocate memory for RPAK hash index.\n");
 
-        struct RPak::tableentry *entry = NULL;
         for (size_t i = 0; i < this->header.num; i++) {
-            if (!strncmp(this->entries[i].path, path, 512)) {
-                entry = &this->entries[i];
-                goto found;
+            uint32_t bucket = this->entries[i].hash & (this->buckets - 1);
+            while (this->index[bucket] != RPAK_INDEXEMPTY) {
+                bucket = (bucket + 1) & (this->buckets - 1);
             }
+            this->index[bucket] = i + 1;
         }
+    }
+
+    const struct RPak::tableentry *RPak::find(const char *path) {
+        ASSERT(path, "Attempting to find NULL file path.\n");
 
+        size_t len = strlen(path);
+        uint64_t hash = OUtils::fnv1a64(path, len);
+        for (uint32_t bucket = hash & (this->buckets - 1); this->index[bucket] != RPAK_INDEXEMPTY; bucket = (bucket + 1) & (this->buckets - 1)) {
+            struct RPak::tableentry *entry = &this->entries[this->index[bucket] - 1];
+            if (entry->hash == hash && !strcmp(entry->path, path)) { // only compare strings on a full hash match
+                return entry;
+            }
+        }
+        return NULL;
+    }
 
-        return (struct RPak::stat) { .realsize = SIZE_MAX, .decompressedsize = SIZE_MAX, .compressed = true };
-    found:
+    struct RPak::stat RPak::stat(const struct RPak::tableentry *entry) {
+        if (entry == NULL) {
+            return (struct RPak::stat) { .realsize = SIZE_MAX, .decompressedsize = SIZE_MAX, .compressed = true };
+        }
         return (struct RPak::stat) { .realsize = entry->compressed ? entry->compressedsize : entry->uncompressedsize, .decompressedsize = entry->uncompressedsize, .compressed = entry->compressed };
     }
 
+    struct RPak::stat RPak::stat(const char *path) {
+        ASSERT(path, "Attempting to read NULL file path.\n");
+        return this->stat(this->find(path));
+    }
+
     size_t RPak::read(const char *path, void *buf, const size_t size, const size_t off) {
-        ZoneScoped;
         ASSERT(path, "Attempting to read NULL file path.\n");
+        const struct RPak::tableentry *entry = this->find(path);
+        if (entry == NULL) {
+            return 0;
+        }
+        return this->read(entry, buf, size, off);
+    }
+
+    struct RPak::span RPak::map(const struct RPak::tableentry *entry, size_t off, size_t size) {
+        ASSERT(entry, "Attempting to map NULL entry.\n");
+        ASSERT(off <= entry->uncompressedsize, "Mapping beyond the end of RPAK file `%s`.\n", entry->path);
+        if (size == SIZE_MAX) {
+            size = entry->uncompressedsize - off;
+        }
+        ASSERT(size <= entry->uncompressedsize - off, "Mapping beyond the end of RPAK file `%s`.\n", entry->path);
+
+        if (this->mapping == NULL || entry->compressed) {
+            return (struct RPak::span) { .data = NULL, .size = 0 };
+        }
+        ASSERT(entry->offset + off + size <= this->mappingsize, "RPAK file `%s` lies outside of the archive.\n", entry->path);
+        return (struct RPak::span) { .data = this->mapping + entry->offset + off, .size = size };
+    }
+
+    void RPak::advise(const struct RPak::tableentry *entry, enum advice advice, size_t off, size_t size) {
+        ASSERT(entry, "Attempting to advise NULL entry.\n");
+        if (this->mapping == NULL || off >= entry->uncompressedsize || size == 0) {
+            return;
+        }
+        if (size == SIZE_MAX || size > entry->uncompressedsize - off) {
+            size = entry->uncompressedsize - off;
+        }
+
+        // Where the range lives in the archive, compressed files go through the block table (the same way readblocks() does) as off and size are in the uncompressed file.
+        size_t archiveoff = entry->offset + off;
+        if (entry->compressed) {
+            const size_t first = off / RPAK_BLOCKSIZE;
+            const size_t last = (off + size - 1) / RPAK_BLOCKSIZE;
+            const uint64_t *offsets = (const uint64_t *)(this->mapping + entry->offset); // file data is RPAK_DATAALIGN aligned, so the table can be used in place
+            const size_t datastart = entry->offset + (sizeof(uint64_t) * (RPak::blockcount(entry->uncompressedsize) + 1));
+            ASSERT(offsets[first] <= offsets[last + 1] && datastart + offsets[last + 1] <= this->mappingsize, "Corrupt block table for RPAK file `%s`.\n", entry->path);
+            archiveoff = datastart + offsets[first];
+            size = offsets[last + 1] - offsets[first];
+        }
+
+        // madvise() wants a page aligned start, round down and grow the range to match.
+        const uintptr_t pagemask = (uintptr_t)sysconf(_SC_PAGESIZE) - 1;
+        uintptr_t start = (uintptr_t)this->mapping + archiveoff;
+        uintptr_t aligned = start & ~pagemask;
+        const int advices[] = { MADV_NORMAL, MADV_SEQUENTIAL, MADV_WILLNEED, MADV_DONTNEED };
+        madvise((void *)aligned, size + (start - aligned), advices[advice]); // purely a hint, failure doesn't matter
+    }
+
+    size_t RPak::read(const struct RPak::tableentry *entry, void *buf, const size_t size, const size_t off) {
+        ZoneScoped;
+        ASSERT(entry, "Attempting to read NULL entry.\n");
         ASSERT(buf, "Attempting to read into NULL buffer.\n");
         ASSERT(size > 0, "Read zero bytes.\n");
-        // OJob::ScopedMutex mutex(&this->lock); XXX: With pread() we can do lockless reads.
+        ASSERT(off + size <= entry->uncompressedsize, "Reading beyond the end of RPAK file `%s`.\n", entry->path);
+        // Both the mapping and pread() allow for lockless reads.
 
-        struct RPak::tableentry *entry = NULL;
-        for (size_t i = 0; i < this->header.num; i++) {
-            if (!strncmp(this->entries[i].path, path, 512)) {
-                entry = &this->entries[i];
-                goto found;
+        if (entry->compressed) {
+            this->readblocks(entry, (uint8_t *)buf, size, off);
+        } else if (this->mapping != NULL) {
+            memcpy(buf, this->mapping + entry->offset + off, size); // skip the syscall, a fault on a cold page is no worse than pread() having to go to disk
+        } else {
+            ASSERT(pread(this->fd, buf, size, entry->offset + off) == (ssize_t)size, "Failed to read file from RPAK.\n");
+        }
+        return size;
+    }
+
+    struct blockread {
+        int fd;
+        const uint8_t *mapping;
+        const struct RPak::tableentry *entry;
+        const uint64_t *offsets; // block offsets from `first` on
+        size_t first; // first block of the read
+        uint8_t *buf;
+        size_t size;
+        size_t off;
+    };
+
+    void RPak::inflateblocks(size_t start, size_t end, uintptr_t param) {
+        ZoneScopedN("RPAK Block Inflate");
+        struct blockread *read = (struct blockread *)param;
+        const struct RPak::tableentry *entry = read->entry;
+        const size_t datastart = entry->offset + (sizeof(uint64_t) * (RPak::blockcount(entry->uncompressedsize) + 1));
+
+        uint8_t *scratch = NULL; // partially read blocks inflate here first
+        uint8_t *source = NULL; // compressed data when we have to pread() it
+        for (size_t i = start; i < end; i++) {
+            const size_t blockstart = i * RPAK_BLOCKSIZE;
+            const size_t rawsize = MIN(RPAK_BLOCKSIZE, entry->uncompressedsize - blockstart);
+            const size_t lo = MAX(blockstart, read->off);
+            const size_t hi = MIN(blockstart + rawsize, read->off + read->size);
+            const uint64_t coff = read->offsets[i - read->first];
+            const size_t csize = read->offsets[i - read->first + 1] - coff;
+            ASSERT(csize <= rawsize + RPAK_COMPRESSIONFAULTTOLERANCE, "Corrupt block table for RPAK file `%s`.\n", entry->path);
+
+            const uint8_t *from;
+            if (read->mapping != NULL) {
+                from = read->mapping + datastart + coff;
+            } else {
+                if (source == NULL) {
+                    source = (uint8_t *)malloc(RPAK_BLOCKSIZE + RPAK_COMPRESSIONFAULTTOLERANCE);
+                    ASSERT(source != NULL, "Failed to allocate memory for compressed RPAK block.\n");
+                }
+                ASSERT(pread(read->fd, source, csize, datastart + coff) == (ssize_t)csize, "Failed to read compressed block of RPAK file `%s`.\n", entry->path);
+                from = source;
+            }
+
+            const bool whole = lo == blockstart && hi == blockstart + rawsize;
+            uint8_t *to = read->buf + (lo - read->off);
+            if (!whole) {
+                if (scratch == NULL) {
+                    scratch = (uint8_t *)malloc(RPAK_BLOCKSIZE);
+                    ASSERT(scratch != NULL, "Failed to allocate memory for RPAK block decompression.\n");
+                }
+                to = scratch;
+            }
+
+            if (csize == rawsize) { // stored
+                if (whole) {
+                    memcpy(to, from, rawsize);
+                } else {
+                    to = (uint8_t *)from; // no need to bounce it through scratch
+                }
+            } else {
+                uLongf outsize = rawsize;
+                int res = uncompress(to, &outsize, from, csize);
+                ASSERT(res == Z_OK && outsize == rawsize, "Failed to decompress block %lu of RPAK file `%s`.\n", i, entry->path);
+            }
+
+            if (!whole) {
+                memcpy(read->buf + (lo - read->off), to + (lo - blockstart), hi - lo);
             }
         }
+        free(scratch);
+        free(source);
+    }
+
+    void RPak::readblocks(const struct RPak::tableentry *entry, uint8_t *buf, size_t size, size_t off) {
+        ZoneScopedN("RPAK Compressed Read");
+        const size_t first = off / RPAK_BLOCKSIZE;
+        const size_t last = (off + size - 1) / RPAK_BLOCKSIZE;
+        const size_t count = last - first + 1;
 
-        return 0;
-    found:
-        // ASSERT(!fseek(this->file, entry->offset + off, SEEK_SET), "Failed to seek file offset for path `%s` in RPAK.\n", path);
-        if (true) {
-            // reads entire file in one go, isn't this slow?
-            // ASSERT(fread(buf, size, 1, this->file), "Failed to read file from RPAK.\n");
-            ASSERT(pread(this->fd, buf, size, entry->offset + off), "Failed to read file from RPAK.\n");
-        } else { // compressed stuff
-            ZoneScopedN("Compression read");
-            // XXX: FAR too expensive!
-        //     uint8_t *tbuf = (uint8_t *)malloc(entry->uncompressedsize + RPAK_COMPRESSIONFAULTTOLERANCE);
-        //     ASSERT(tbuf != NULL, "Failed to allocate memory for resulting decompression of file `%s` in RPAK.\n", path);
-        //     uint8_t *from = (uint8_t *)malloc(entry->compressedsize);
-        //     ASSERT(from != NULL, "Failed to allocate memory for reading compressed file `%s` in RPAK.\n", path);
-        //     ASSERT(!fseek(this->file, entry->offset, SEEK_SET), "Failed to seek beginning of file for path `%s` in RPAK.\n", path);
-        //     ASSERT(fread(from, entry->compressedsize, 1, this->file), "Failed to read compressed file data for path `%s` in RPAK.\n", path);
-        //     size_t decompressed = entry->uncompressedsize + RPAK_COMPRESSIONFAULTTOLERANCE;
-        //     {
-        //     int res = uncompress(tbuf, &decompressed, from, entry->compressedsize);
-        //     free(from);
-        //     ASSERT(res == Z_OK, "Failed to decompress RPAK file data.\n");
-        //     memcpy(buf, tbuf + off, size);
-        //     free(tbuf);
+        // Only the part of the block table this read touches.
+        uint64_t *offsets = NULL;
+        if (this->mapping != NULL) {
+            offsets = (uint64_t *)(this->mapping + entry->offset) + first; // file data is RPAK_DATAALIGN aligned, so the table can be used in place
+        } else {
+            offsets = (uint64_t *)malloc(sizeof(uint64_t) * (count + 1));
+            ASSERT(offsets != NULL, "Failed to allocate memory for RPAK block table.\n");
+            ASSERT(pread(this->fd, offsets, sizeof(uint64_t) * (count + 1), entry->offset + (sizeof(uint64_t) * first)) == (ssize_t)(sizeof(uint64_t) * (count + 1)), "Failed to read block table of RPAK file `%s`.\n", entry->path);
         }
-        return size;
+
+        struct blockread read = (struct blockread) {
+            .fd = this->fd, .mapping = this->mapping, .entry = entry, .offsets = offsets, .first = first,
+            .buf = buf, .size = size, .off = off
+        };
+        if (count >= RPAK_PARALLELBLOCKS && OJob::currentworker != NULL && OJob::numworkers > 1) { // blocks are independent, so large reads from jobs can inflate on every worker
+            OJob::parallelfor(first, last + 1, RPAK_PARALLELBLOCKS, RPak::inflateblocks, (uintptr_t)&read);
+        } else {
+            RPak::inflateblocks(first, last + 1, (uintptr_t)&read);
+        }
+
+        if (this->mapping == NULL) {
+            free(offsets);
+        }
+    }
+
+    uint8_t *RPak::compress(const uint8_t *data, size_t size, size_t *outsize) {
+        ASSERT(data != NULL && outsize != NULL, "Invalid RPAK compression input.\n");
+        if (size < RPAK_COMPRESSBIAS) {
+            return NULL;
+        }
+
+        const size_t blocks = RPak::blockcount(size);
+        const size_t tablesize = sizeof(uint64_t) * (blocks + 1);
+        uint8_t *out = (uint8_t *)malloc(tablesize + compressBound(size) + (blocks * RPAK_COMPRESSIONFAULTTOLERANCE));
+        ASSERT(out != NULL, "Failed to allocate memory for RPAK compression.\n");
+
+        uint64_t *offsets = (uint64_t *)out;
+        uint64_t coff = 0;
+        for (size_t i = 0; i < blocks; i++) {
+            const size_t rawsize = MIN(RPAK_BLOCKSIZE, size - (i * RPAK_BLOCKSIZE));
+            uLongf csize = compressBound(rawsize);
+            offsets[i] = coff;
+            int res = compress2(out + tablesize + coff, &csize, data + (i * RPAK_BLOCKSIZE), rawsize, RPAK_COMPRESSIONLEVEL);
+            ASSERT(res == Z_OK, "Compression failed.\n");
+            if (csize >= rawsize) { // incompressible, store it (readers tell by the size)
+                memcpy(out + tablesize + coff, data + (i * RPAK_BLOCKSIZE), rawsize);
+                csize = rawsize;
+            }
+            coff += csize;
+        }
+        offsets[blocks] = coff;
+
+        if ((tablesize + coff) * 100 > size * (100 - RPAK_COMPRESSMINSAVING)) {
+            free(out);
+            return NULL;
+        }
+        *outsize = tablesize + coff;
+        return out;
     }
 
-    static size_t listdir(int counter, char *path, char *gdpath, struct RPak::tableentry **tables, size_t *tableidx, struct RPak::data **data, size_t *dataidx, size_t *datasize) {
+    // Gather every file under path (without reading any of them), growing the table geometrically.
+    static void listdir(char *path, char *gdpath, struct RPak::tableentry **tables, size_t *count, size_t *capacity) {
         struct dirent *dir;
         DIR *d = opendir(path);
         if (d == NULL) {
-            return 0;
+            return;
         }
-        size_t count = 0;
         while ((dir = readdir(d)) != NULL) {
             if (dir->d_type == DT_REG) {
-                count++;
                 char dpath[512];
                 char fpath[512];
-                // if (counter == 1) {
-                    // snprintf(dpath, 512, "%s", dir->d_name);
-                // } else {
-                    snprintf(dpath, 512, "%s/%s", gdpath, dir->d_name);
-                // }
+                snprintf(dpath, 512, "%s/%s", gdpath, dir->d_name);
                 snprintf(fpath, 512, "%s/%s", path, dir->d_name);
 
-                struct RPak::tableentry entry = { };
-                FILE *f = fopen(fpath, "r");
-                ASSERT(f, "Failed to open file for RPAK packaging.\n");
-                ASSERT(!fseek(f, 0, SEEK_END), "Failed to seek end of file to determine size for RPAK packaging.\n");
-                entry.uncompressedsize = ftell(f);
-                ASSERT(entry.uncompressedsize, "Failed to determine file size for RPAK packaging.\n");
-                ASSERT(!fseek(f, 0, SEEK_SET), "Failed to reset file pointer for RPAK packaging.\n");
-                entry.offset = 0;
-                strncpy(entry.path, dpath, 512);
-                // XXX: Too expensive
-                // entry.compressed = (entry.uncompressedsize > RPAK_COMPRESSBIAS);
-
-                uint8_t *fdata = (uint8_t *)malloc(entry.uncompressedsize);
-                ASSERT(fdata != NULL, "Failed to allocate memory for file data for RPAK packaging.\n");
-                ASSERT(fread(fdata, entry.uncompressedsize, 1, f), "Failed to read file for RPAK compression.\n");
-                fclose(f);
-
-                uint8_t *compressed = NULL;
-
-                if (entry.compressed) {
-                    compressed = (uint8_t *)malloc(entry.uncompressedsize + RPAK_COMPRESSIONFAULTTOLERANCE); // more space for the compression (annoying if it gets too big)
-                    ASSERT(compressed != NULL, "Failed to allocate memory for compressed file data for RPAK packaging.\n");
-                    size_t compressedsize = entry.uncompressedsize + RPAK_COMPRESSIONFAULTTOLERANCE;
-                    int res = compress(compressed, &compressedsize, fdata, entry.uncompressedsize);
-                    ASSERT(res == Z_OK, "Compression failed.\n");
-                    entry.compressedsize = compressedsize;
-                    free(fdata);
-                } else {
-                    entry.compressedsize = entry.uncompressedsize;
-                }
+                struct ::stat st;
+                ASSERT(!::stat(fpath, &st), "Failed to stat file for RPAK packaging.\n");
+                ASSERT(st.st_size > 0, "Failed to determine file size for RPAK packaging.\n");
 
-                size_t outsize = entry.compressed ? entry.compressedsize : entry.uncompressedsize;
-                (*tables)[*tableidx] = entry;
-                (*tableidx)++;
-                *tables = (struct RPak::tableentry *)realloc(*tables, sizeof(struct RPak::tableentry) * ((*tableidx) + 1));
-                ASSERT(*tables != NULL, "Failed to reallocate memory to expand tables for RPAK packaging.\n");
-                entry.offset = outsize;
-                struct RPak::data *d = *data;
-                d[*dataidx] = (struct RPak::data) { .data = (uint8_t *)malloc(outsize), .size = outsize };
-                memcpy(d[*dataidx].data, entry.compressed ? compressed : fdata, outsize);
-                (*dataidx)++;
-                *datasize += outsize;
-                *data = (struct RPak::data *)realloc(*data, sizeof(struct RPak::data) * ((*dataidx) + 1));
-                ASSERT(*data != NULL, "Failed to reallocate memory to expand data for RPAK packaging.\n");
-
-                if (entry.compressed) {
-                    free(compressed);
-                } else {
-                    free(fdata);
+                if (*count == *capacity) {
+                    *capacity = *capacity ? *capacity * 2 : 64;
+                    *tables = (struct RPak::tableentry *)realloc(*tables, sizeof(struct RPak::tableentry) * (*capacity));
+                    ASSERT(*tables != NULL, "Failed to reallocate memory to expand tables for RPAK packaging.\n");
                 }
-
+                struct RPak::tableentry *entry = &(*tables)[(*count)++];
+                *entry = (struct RPak::tableentry) { };
+                entry->path = strdup(dpath);
+                ASSERT(entry->path != NULL, "Failed to allocate memory for file path for RPAK packaging.\n");
+                entry->hash = OUtils::fnv1a64(dpath, strlen(dpath));
+                entry->uncompressedsize = st.st_size;
             } else if (dir->d_type == DT_DIR && strcmp(dir->d_name, ".") && strcmp(dir->d_name, "..")) {
                 char dpath[512];
-                // if (counter == 1) {
-                    // snprintf(dpath, 256, "%s", dir->d_name);
-                // } else {
-                    snprintf(dpath, 256, "%s/%s", gdpath, dir->d_name);
-                // }
+                snprintf(dpath, 256, "%s/%s", gdpath, dir->d_name);
                 char fpath[512];
                 snprintf(fpath, 256, "%s/%s", path, dir->d_name);
-                count += listdir(counter - 1, fpath, dpath, tables, tableidx, data, dataidx, datasize);
+                listdir(fpath, dpath, tables, count, capacity);
             }
         }
         closedir(d);
-
-        return count;
     }
 
+    // Everything ahead of the file data only depends on the file list, so each file is streamed straight to its final place in the archive (never holding more than one in memory) and the table of contents is written last.
+    // utils/rpak is the parallel and incremental version of this for packaging whole asset trees, both produce the same archive.
     void RPak::create(const char *path, const char *output) {
         ASSERT(strlen(path) < 512, "Path too long.\n");
         ASSERT(strlen(output) < 64, "Output path too long.\n");
@@ -184,45 +398,90 @@ namespace OResource {
         header.contentversion = 1;
         strncpy(header.name, output, 64);
 
-        size_t tableidx = 0;
-        size_t dataidx = 0;
-        size_t datasize = 0;
-        struct RPak::tableentry *tables = (struct RPak::tableentry *)malloc(sizeof(struct RPak::tableentry));
-        ASSERT(tables != NULL, "Failed to allocate memory for RPAK packaging tables.\n");
-        struct RPak::data *data = (struct RPak::data *)malloc(sizeof(struct RPak::data));
-        ASSERT(data != NULL, "Failed to allocate memory for RPAK packaging data.\n");
-        size_t count = listdir(1, (char *)path, (char *)path, &tables, &tableidx, &data, &dataidx, &datasize);
-
+        size_t count = 0;
+        size_t capacity = 0;
+        struct RPak::tableentry *tables = NULL;
+        listdir((char *)path, (char *)path, &tables, &count, &capacity);
         header.num = count;
 
-        size_t outputsize = sizeof(struct RPak::header) + (sizeof(struct RPak::tableentry) * count) + (datasize);
-        uint8_t *rpakdata = (uint8_t *)malloc(outputsize);
-        ASSERT(rpakdata != NULL, "Failed to allocate memory for final RPAK output.\n");
-        memcpy(rpakdata, &header, sizeof(struct RPak::header));
-        size_t off = sizeof(struct RPak::header);
-        size_t dataoff = sizeof(struct RPak::header);
-        for (size_t i = 0; i < tableidx; i++) {
-            struct RPak::tableentry entry = tables[i];
-            entry.offset += dataoff + (sizeof(struct RPak::tableentry) * (tableidx)); // update offset
-            dataoff += data[i].size;
-            memcpy(rpakdata + off, &entry, sizeof(struct RPak::tableentry));
-            off += (sizeof(struct RPak::tableentry));
+        struct RPak::tocheader toc = { };
+        toc.buckets = 2;
+        while (toc.buckets < count * 2) {
+            toc.buckets <<= 1;
         }
-        free(tables);
-
-        for (size_t i = 0; i < dataidx; i++) {
-            struct RPak::data *rdata = &data[i];
-            memcpy(rpakdata + off, rdata->data, rdata->size);
-            off += rdata->size;
-            free(rdata->data);
+        for (size_t i = 0; i < count; i++) {
+            toc.stringsize += strlen(tables[i].path) + 1;
         }
-        free(data);
+        ASSERT(toc.stringsize <= UINT32_MAX, "RPAK path string table too large.\n");
+
+        size_t tocsize = sizeof(struct RPak::tocheader) + (sizeof(struct RPak::diskentry) * count) + (sizeof(uint32_t) * toc.buckets) + toc.stringsize;
+        size_t dataoff = RPAK_ALIGNDATA(sizeof(struct RPak::header) + tocsize);
 
         FILE *out = fopen(output, "w");
         ASSERT(out, "Failed to open output RPAK.\n");
-        ASSERT(fwrite(rpakdata, outputsize, 1, out), "Failed to write RPAK.\n");
-        free(rpakdata);
-        fclose(out);
+        ASSERT(!fseek(out, dataoff, SEEK_SET), "Failed to seek to RPAK data.\n");
+        const uint8_t padding[RPAK_DATAALIGN] = { };
+        for (size_t i = 0; i < count; i++) {
+            struct RPak::tableentry *entry = &tables[i];
+            FILE *f = fopen(entry->path, "r"); // packaged paths are relative to the input directory, the same as the path we were given
+            ASSERT(f, "Failed to open file for RPAK packaging.\n");
+            uint8_t *fdata = (uint8_t *)malloc(entry->uncompressedsize);
+            ASSERT(fdata != NULL, "Failed to allocate memory for file data for RPAK packaging.\n");
+            ASSERT(fread(fdata, entry->uncompressedsize, 1, f), "Failed to read file for RPAK compression.\n");
+            fclose(f);
+
+            size_t outsize = entry->uncompressedsize;
+            uint8_t *compressed = RPak::compress(fdata, entry->uncompressedsize, &outsize);
+            entry->compressed = compressed != NULL;
+            entry->compressedsize = outsize;
+            entry->offset = dataoff;
+            ASSERT(fwrite(compressed != NULL ? compressed : fdata, outsize, 1, out), "Failed to write RPAK.\n");
+            if (RPAK_ALIGNDATA(outsize) != outsize) {
+                ASSERT(fwrite(padding, RPAK_ALIGNDATA(outsize) - outsize, 1, out), "Failed to write RPAK.\n");
+            }
+            dataoff += RPAK_ALIGNDATA(outsize);
+            free(compressed);
+            free(fdata);
+        }
+
+        uint8_t *tocdata = (uint8_t *)calloc(1, sizeof(struct RPak::header) + tocsize);
+        ASSERT(tocdata != NULL, "Failed to allocate memory for RPAK table of contents.\n");
+        uint32_t *index = (uint32_t *)calloc(toc.buckets, sizeof(uint32_t));
+        ASSERT(index != NULL, "Failed to allocate memory for RPAK hash index.\n");
+        memcpy(tocdata, &header, sizeof(struct RPak::header));
+        size_t off = sizeof(struct RPak::header);
+        memcpy(tocdata + off, &toc, sizeof(struct RPak::tocheader));
+        off += sizeof(struct RPak::tocheader);
+
+        uint8_t *strings = tocdata + off + (sizeof(struct RPak::diskentry) * count) + (sizeof(uint32_t) * toc.buckets);
+        size_t stroff = 0;
+        for (size_t i = 0; i < count; i++) {
+            size_t len = strlen(tables[i].path);
+            ASSERT(len <= UINT16_MAX, "RPAK path too long.\n");
+            struct RPak::diskentry entry = (struct RPak::diskentry) {
+                .hash = tables[i].hash, .pathoffset = (uint32_t)stroff, .pathlen = (uint16_t)len, .compressed = tables[i].compressed, .reserved = 0,
+                .uncompressedsize = tables[i].uncompressedsize, .compressedsize = tables[i].compressedsize, .offset = tables[i].offset
+            };
+            memcpy(tocdata + off, &entry, sizeof(struct RPak::diskentry));
+            off += sizeof(struct RPak::diskentry);
+            memcpy(strings + stroff, tables[i].path, len + 1);
+            stroff += len + 1;
+
+            uint32_t bucket = tables[i].hash & (toc.buckets - 1);
+            while (index[bucket] != RPAK_INDEXEMPTY) {
+                bucket = (bucket + 1) & (toc.buckets - 1);
+            }
+            index[bucket] = i + 1;
+            free((void *)tables[i].path);
+        }
+        free(tables);
+        memcpy(tocdata + off, index, sizeof(uint32_t) * toc.buckets); // output buffer isn't necessarily aligned for uint32_t here
+        free(index);
+
+        ASSERT(!fseek(out, 0, SEEK_SET), "Failed to seek to RPAK table of contents.\n");
+        ASSERT(fwrite(tocdata, sizeof(struct RPak::header) + tocsize, 1, out), "Failed to write RPAK table of contents.\n");
+        free(tocdata);
+        ASSERT(!fclose(out), "Failed to write RPAK.\n");
     }
 
 }
@@ -181,7 +181,7 @@ namespace OResource {
         } else if (resource->type == Resource::SOURCE_RPAK) {
             struct RPak::tableentry entry = resource->rpakentry;
             ASSERT(entry.uncompressedsize > sizeof(struct header), "File too small, or has empty data.\n");
-            ASSERT(resource->rpak->read(resource->path, &loaded.header, sizeof(struct header), 0) > 0, "Failed to read RPak file.\n");
+            ASSERT(resource->rpak->read(&resource->rpakentry, &loaded.header, sizeof(struct header), 0) > 0, "Failed to read RPak file.\n");
 
             ASSERT(!strncmp(loaded.header.magic, "OTEX", sizeof(loaded.header.magic)), "Invalid magic bytes.\n");
             ASSERT(loaded.header.levelcount > 0, "Need at least one mip level to be valid.\n");
@@ -190,13 +190,20 @@ namespace OResource {
             ASSERT(entry.uncompressedsize > sizeof(struct header) + (sizeof(struct levelhdr) * loaded.header.levelcount), "Too small for level headers.\n");
             loaded.levels = (struct levelhdr *)malloc(sizeof(struct levelhdr) * loaded.header.levelcount);
             ASSERT(loaded.levels != NULL, "Failed to allocate buffer to accomodate for levels.\n");
-            ASSERT(resource->rpak->read(resource->path, loaded.levels, sizeof(struct levelhdr) * loaded.header.levelcount, sizeof(struct header)) > 0, "Failed to read level headers.\n");
+            ASSERT(resource->rpak->read(&resource->rpakentry, loaded.levels, sizeof(struct levelhdr) * loaded.header.levelcount, sizeof(struct header)) > 0, "Failed to read level headers.\n");
         } else {
             ASSERT(false, "Invalid resource type.\n");
         }
         return loaded;
     }
 
+    void Texture::prefetchlevel(struct loaded &loaded, uint32_t level) {
+        ASSERT(level < loaded.header.levelcount, "Level exceeds available levels in resource.\n");
+        if (loaded.resource->type == Resource::SOURCE_RPAK) {
+            loaded.resource->rpak->advise(&loaded.resource->rpakentry, RPak::ADVICE_WILLNEED, loaded.levels[level].offset, loaded.levels[level].size);
+        }
+    }
+
     void Texture::loadlevel(struct loaded &loaded, uint32_t level, OUtils::Handle<Resource> resource, void *data, size_t size, size_t offset) {
         ZoneScoped;
         ASSERT(data != NULL, "Given NULL for provided buffer.\n");
@@ -206,7 +213,7 @@ namespace OResource {
         if (loaded.resource->type == Resource::SOURCE_RPAK) {
             struct RPak::tableentry entry = loaded.resource->rpakentry;
             ASSERT(resource->rpak->read(
-                resource->path, data, loaded.levels[level].size,
+                &resource->rpakentry, data, loaded.levels[level].size,
                 loaded.levels[level].offset + offset)
             > 0,"Failed to read RPak file.\n");
             // And with that, we're done with loading the data out of the file for a specific mip level. Pretty simple actually.
@@ -228,7 +235,8 @@ namespace OResource {
         resource->claim();
         struct header header = { };
         size_t size = 0;
-        uint8_t *data = NULL;
+        uint8_t *data = NULL; // owned copy of the data (when we couldn't map it)
+        const uint8_t *mapped = NULL;
         struct ORenderer::texture texture;
         if (resource->type == Resource::SOURCE_OSFS) {
             FILE *f = fopen(resource->path, "r");
@@ -256,7 +264,7 @@ namespace OResource {
         } else if (resource->type == Resource::SOURCE_RPAK) {
             struct RPak::tableentry entry = resource->rpakentry;
             ASSERT(entry.uncompressedsize > sizeof(struct header), "File too small, or has empty data.\n");
-            ASSERT(resource->rpak->read(resource->path, &header, sizeof(struct header), 0) > 0, "Failed to read RPak file.\n");
+            ASSERT(resource->rpak->read(&resource->rpakentry, &header, sizeof(struct header), 0) > 0, "Failed to read RPak file.\n");
 
             ASSERT(!strncmp(header.magic, "OTEX", sizeof(header.magic)), "Invalid magic bytes.\n");
             ASSERT(header.levelcount > 0, "Need at least one mip level to be valid.\n");
@@ -266,9 +274,15 @@ namespace OResource {
 
             size_t offset = sizeof(struct header) + (sizeof(struct levelhdr) * header.levelcount); // Ignore everything else and just grab the data.
             size = entry.uncompressedsize - offset;
-            data = (uint8_t *)malloc(size);
-            ASSERT(data != NULL, "Could not allocate buffer to accomodate for data size.\n");
-            ASSERT(resource->rpak->read(resource->path, data, size, offset) > 0, "Failed to read RPak file.\n");
+            resource->rpak->advise(&resource->rpakentry, RPak::ADVICE_SEQUENTIAL, offset);
+            struct RPak::span span = resource->rpak->map(&resource->rpakentry, offset, size);
+            if (span.data != NULL) {
+                mapped = span.data; // upload straight from the mapped archive, the staging buffer gets the only copy
+            } else {
+                data = (uint8_t *)malloc(size);
+                ASSERT(data != NULL, "Could not allocate buffer to accomodate for data size.\n");
+                ASSERT(resource->rpak->read(&resource->rpakentry, data, size, offset) > 0, "Failed to read RPak file.\n");
+            }
         } else {
             return texture;
         }
@@ -284,7 +298,7 @@ namespace OResource {
         desc.format = header.format;
         desc.memlayout = ORenderer::MEMLAYOUT_OPTIMAL;
         desc.usage = ORenderer::USAGE_SAMPLED | ORenderer::USAGE_DST;
-        texture = loadfromdata(&desc, data, size);
+        texture = loadfromdata(&desc, mapped != NULL ? mapped : data, size);
 
         char text[256];
         sprintf(text, "OTexture Texture %s", basename(resource->path));
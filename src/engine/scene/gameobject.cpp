@@ -23,15 +23,32 @@ namespace OScene {
         return this->staticmatrix;
     }
 
+    // Up to date world transform from the scene's TransformSystem, NULL if we have to work it out ourselves.
+    static inline const struct TransformSystem::world *getworld(GameObject *obj) {
+        return obj->scene != NULL ? obj->scene->transforms.get(obj) : NULL;
+    }
+
     glm::mat4 GameObject::getglobalmatrix(void) {
+        const struct TransformSystem::world *world = getworld(this);
+        if (world != NULL) {
+            return world->matrix;
+        }
         return this->parent.isvalid() ? this->parent->getglobalmatrix() * this->getmatrix() : this->getmatrix();
     }
 
     glm::mat4 GameObject::getglobalstaticmatrix(void) {
+        const struct TransformSystem::world *world = getworld(this);
+        if (world != NULL) {
+            return world->staticmatrix;
+        }
         return this->parent.isvalid() ? this->parent->getglobalstaticmatrix() * this->getstaticmatrix() : this->getstaticmatrix();
     }
 
     glm::vec3 GameObject::getglobalposition(void) {
+        const struct TransformSystem::world *world = getworld(this);
+        if (world != NULL) {
+            return world->position;
+        }
         return this->parent.isvalid() ? this->parent->getglobalposition() + this->position : this->position;
     }
 
@@ -40,6 +57,10 @@ namespace OScene {
     }
 
     glm::quat GameObject::getglobalorientation(void) {
+        const struct TransformSystem::world *world = getworld(this);
+        if (world != NULL) {
+            return world->orientation;
+        }
         return this->parent.isvalid() ? glm::normalize(this->parent->getglobalorientation() * this->orientation) : this->orientation;
     }
 
@@ -48,6 +69,10 @@ namespace OScene {
     }
 
     glm::vec3 GameObject::getglobalscale(void) {
+        const struct TransformSystem::world *world = getworld(this);
+        if (world != NULL) {
+            return world->scale;
+        }
         return this->parent.isvalid() ? this->parent->getglobalscale() * this->scale : this->scale;
     }
 
@@ -58,52 +83,97 @@ namespace OScene {
     void GameObject::setglobalposition(glm::vec3 pos) {
         ASSERT(this->scene != NULL, "Cannot set global position without a scene.\n");
         this->position = pos - (this->getglobalposition() - this->position); // Transform into a local position (Subtracting our parent's global position will turn the other global position into a local position, we use the parent's global position instead of our's because we want it to be *relative* to the parent, not *relative* to the current position)
-        this->scene->partitionmanager.updatepos(this->gethandle());
         this->dirty.store(this->dirty.load() | dirtyflags::DIRTY_ALL);
+        this->scene->transforms.markdirty(this); // world transform (and the partition) catch up on the next update
     }
 
     void GameObject::setposition(glm::vec3 pos) {
         ASSERT(this->scene != NULL, "Cannot set position without a scene.\n");
         this->position = pos;
-        this->scene->partitionmanager.updatepos(this->gethandle());
         this->dirty.store(this->dirty.load() | dirtyflags::DIRTY_ALL);
+        this->scene->transforms.markdirty(this);
     }
 
     void GameObject::setorientation(glm::quat q) {
         this->orientation = q;
         this->dirty.store(this->dirty.load() | dirtyflags::DIRTY_MATRIX);
+        if (this->scene != NULL) {
+            this->scene->transforms.markdirty(this);
+        }
     }
 
     void GameObject::setrotation(glm::vec3 euler) {
         this->orientation = glm::quat(euler);
         this->dirty.store(this->dirty.load() | dirtyflags::DIRTY_MATRIX);
+        if (this->scene != NULL) {
+            this->scene->transforms.markdirty(this);
+        }
     }
 
     void GameObject::setscale(glm::vec3 scale) {
         this->scale = scale;
         this->dirty.store(this->dirty.load() | dirtyflags::DIRTY_ALL);
+        if (this->scene != NULL) {
+            this->scene->transforms.markdirty(this);
+        }
     }
 
     void GameObject::translate(glm::vec3 v) {
         ASSERT(this->scene != NULL, "Cannot translate without a scene.\n");
         this->position += v;
-        this->scene->partitionmanager.updatepos(this->gethandle());
         this->dirty.store(this->dirty.load() | dirtyflags::DIRTY_ALL);
+        this->scene->transforms.markdirty(this);
     }
 
     void GameObject::orientate(glm::quat q) {
         this->orientation = glm::normalize(this->orientation * q);
         this->dirty.store(this->dirty.load() | dirtyflags::DIRTY_MATRIX);
+        if (this->scene != NULL) {
+            this->scene->transforms.markdirty(this);
+        }
     }
 
     void GameObject::lookat(glm::vec4 target) {
         this->orientation = glm::quatLookAt(-glm::normalize(target.w ? glm::vec3(target) - this->position : glm::vec3(target)), glm::vec3(0.0f, 1.0f, 0.0f));
         this->dirty.store(this->dirty.load() | dirtyflags::DIRTY_MATRIX);
+        if (this->scene != NULL) {
+            this->scene->transforms.markdirty(this);
+        }
     }
 
     void GameObject::scaleby(glm::vec3 s) {
         this->scale *= s;
         this->dirty.store(this->dirty.load() | dirtyflags::DIRTY_ALL);
+        if (this->scene != NULL) {
+            this->scene->transforms.markdirty(this);
+        }
+    }
+
+    void GameObject::setparent(OUtils::Handle<GameObject> parent) {
+        if (this->parent.isvalid()) {
+            std::vector<OUtils::Handle<GameObject>> *siblings = &this->parent->children;
+            OUtils::Handle<GameObject> self = this->gethandle();
+            for (size_t i = 0; i < siblings->size(); i++) {
+                if ((*siblings)[i] == self) {
+                    siblings->erase(siblings->begin() + i);
+                    break;
+                }
+            }
+        }
+        this->parent = parent;
+        if (parent.isvalid()) {
+            parent->children.push_back(this->gethandle());
+        }
+        this->dirty.store(this->dirty.load() | dirtyflags::DIRTY_ALL);
+        if (this->scene != NULL) {
+            this->scene->transforms.reparent(this); // re-sorted (and moved in the partition) on the next update
+        }
+    }
+
+    void GameObject::releasetransform(void) {
+        if (this->scene != NULL && this->transformidx != SIZE_MAX) {
+            this->scene->transforms.markdirty(this); // the update notices we're gone and drops the slot
+        }
     }
 
 
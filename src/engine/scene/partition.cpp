@@ -5,124 +5,214 @@
 namespace OScene {
     #define PARTITION_CELLSIZE 150.0f
 
-    void ParitionManager::addtocell(Cell *cell, OUtils::Handle<GameObject> obj) {
-        ZoneScoped;
-        Cell *head = cell->header.prev != NULL ? this->map[cell->header.cellpos] : cell; // Head of our cell list
-
-        if (cell->header.count < cell->COUNT - 1) { // This header has a free spot somewhere
-            size_t slot = this->getfreespot(cell);
-            ASSERT(slot != SIZE_MAX, "Cell reported having a free slot but none was found.\n");
-
-            cell->objects[slot] = obj;
-            obj->culldata = (struct GameObject::culldata) {
-                .cellpos = head->header.cellpos, // head of the cell list
-                .objid = slot, // slot in object list
-                .pageref = cell, // cell page in cell list
-                .pageid = cell->header.id // ID of page in cell list
-            };
-            cell->header.count++;
+    // Cell a world position falls in (rounding towards negative infinity, so an object always lies within its cell's bounds and a cell entirely inside the frustum only ever holds visible objects).
+    static glm::ivec3 cellpos(const glm::vec3 &pos) {
+        return glm::ivec3(glm::floor(pos * (1.0f / PARTITION_CELLSIZE)));
+    }
+
+    // Prepare a freshly allocated cell page, every slot empty.
+    static void initcell(Cell *cell) {
+        memset(cell, 0, sizeof(Cell));
+        for (size_t i = 0; i < cell->COUNT; i++) {
+            cell->objects[i] = SCENE_INVALIDHANDLE;
+            cell->spherer[i] = CULL_INVALIDRADIUS;
+        }
+    }
+
+    // Store an object's world space bounding sphere in its slot (the same sphere we used to build for Frustum::testsphere() every frame).
+    static void setsphere(Cell *cell, size_t slot, OUtils::Handle<GameObject> &obj) {
+        if (!(obj->flags & GameObject::typeflags::IS_CULLABLE)) { // No bounds to speak of, so it can't be culled.
+            cell->spherex[slot] = 0.0f;
+            cell->spherey[slot] = 0.0f;
+            cell->spherez[slot] = 0.0f;
+            cell->spherer[slot] = CULL_ALWAYSRADIUS;
             return;
         }
 
-        // O(N) time complexity, consider using a "free list" (this will leave less space for objects per page as we'll need to keep information about the next free cell data, but it will turn time complexity to O(1) to search for the next free spot)
-        cell = cell->header.next;
-        while (cell != NULL) {
-            if (cell->header.count < cell->COUNT - 1) { // Check for a free spot
-                size_t slot = this->getfreespot(cell);
-                ASSERT(slot != SIZE_MAX, "Cell reported having a free slot but none was found.\n");
-
-                cell->objects[slot] = obj;
-                obj->culldata = (struct GameObject::culldata) {
-                    .cellpos = head->header.cellpos, // head of the cell list
-                    .objid = slot, // slot in object list
-                    .pageref = cell, // cell page in cell list
-                    .pageid = cell->header.id // ID of page in cell list
-                };
-                cell->header.count++;
-                return;
-            }
+        OMath::AABB bounds = obj->bounds.transformed(obj->getglobalstaticmatrix());
+        cell->spherex[slot] = bounds.centre.x;
+        cell->spherey[slot] = bounds.centre.y;
+        cell->spherez[slot] = bounds.centre.z;
+        cell->spherer[slot] = bounds.radius();
+    }
 
-            cell = cell->header.next;
+    static void clearsphere(Cell *cell, size_t slot) {
+        cell->spherex[slot] = 0.0f;
+        cell->spherey[slot] = 0.0f;
+        cell->spherez[slot] = 0.0f;
+        cell->spherer[slot] = CULL_INVALIDRADIUS;
+    }
+
+    void ParitionManager::addtocluster(Cell *cell) {
+        const glm::ivec3 pos = ParitionManager::clusterpos(cell->header.cellpos);
+        Cluster *cluster = NULL;
+        auto it = this->clustermap.find(pos);
+        if (it != this->clustermap.end()) {
+            cluster = it->second;
+        } else {
+            cluster = new Cluster();
+            cluster->pos = pos;
+            cluster->idx = this->clusters.size();
+            this->clusters.push_back(cluster);
+            this->clustermap[pos] = cluster;
         }
 
-        Cell *newcell = (Cell *)this->allocator.alloc();
-        memset(newcell, 0, sizeof(Cell));
-        for (size_t i = 0; i < newcell->COUNT; i++) {
-            newcell->objects[i] = SCENE_INVALIDHANDLE;
+        cell->header.cluster = cluster;
+        cell->header.idx = cluster->cells.size();
+        cell->header.lastplane = 0;
+        cluster->cells.push_back(cell);
+    }
+
+    void ParitionManager::removefromcluster(Cell *cell, Cell *replacement) {
+        Cluster *cluster = cell->header.cluster;
+        ASSERT(cluster != NULL && cluster->cells[cell->header.idx] == cell, "Cell list head is not in its cluster.\n");
+
+        if (replacement != NULL) { // The next cell in the list takes over as head.
+            replacement->header.cluster = cluster;
+            replacement->header.idx = cell->header.idx;
+            replacement->header.lastplane = cell->header.lastplane;
+            cluster->cells[cell->header.idx] = replacement;
+            return;
+        }
+
+        // Swap the last cell into our place, order doesn't matter to culling.
+        Cell *last = cluster->cells.back();
+        cluster->cells[cell->header.idx] = last;
+        last->header.idx = cell->header.idx;
+        cluster->cells.pop_back();
+
+        if (cluster->cells.empty()) {
+            Cluster *lastcluster = this->clusters.back();
+            this->clusters[cluster->idx] = lastcluster;
+            lastcluster->idx = cluster->idx;
+            this->clusters.pop_back();
+            this->clustermap.erase(cluster->pos);
+            delete cluster;
+        }
+    }
+
+    // Pages of a cell list that still have room are kept on a list of their own (rooted in the head), so finding room never walks the cell list.
+    static void linkfree(Cell *head, Cell *cell) {
+        cell->header.prevfree = NULL;
+        cell->header.nextfree = head->header.freelist;
+        if (head->header.freelist != NULL) {
+            head->header.freelist->header.prevfree = cell;
         }
-        newcell->header.origin = head->header.origin;
-        newcell->header.cellpos = head->header.cellpos;
-        // Place this new cell just after the head cell (so future placements need not reposition everything)
-        if (head->header.next != NULL) {
-            newcell->header.next = head->header.next;
+        head->header.freelist = cell;
+    }
+
+    static void unlinkfree(Cell *head, Cell *cell) {
+        if (cell->header.prevfree != NULL) {
+            cell->header.prevfree->header.nextfree = cell->header.nextfree;
+        } else {
+            head->header.freelist = cell->header.nextfree;
+        }
+        if (cell->header.nextfree != NULL) {
+            cell->header.nextfree->header.prevfree = cell->header.prevfree;
         }
-        newcell->header.prev = head;
-        newcell->header.id = this->idcounter.fetch_add(1);
+        cell->header.nextfree = NULL;
+        cell->header.prevfree = NULL;
+    }
 
-        if (head->header.next != NULL) {
-            newcell->header.next->header.prev = newcell; // make sure we're just before the next cell
+    void ParitionManager::addtocell(Cell *head, OUtils::Handle<GameObject> obj) {
+        ZoneScoped;
+        Cell *cell = head->header.freelist;
+        if (cell == NULL) { // Every page is full, chain a new one in.
+            cell = (Cell *)this->allocator.alloc();
+            initcell(cell);
+            cell->header.origin = head->header.origin;
+            cell->header.cellpos = head->header.cellpos;
+            cell->header.id = this->idcounter.fetch_add(1);
+            // Place this new cell just after the head cell (so future placements need not reposition everything)
+            cell->header.next = head->header.next;
+            cell->header.prev = head;
+            if (head->header.next != NULL) {
+                head->header.next->header.prev = cell; // make sure we're just before the next cell
+            }
+            head->header.next = cell;
+            linkfree(head, cell);
         }
-        head->header.next = newcell;
 
-        newcell->header.count = 1;
-        newcell->objects[0] = obj;
+        // Objects are packed at the front of the page, so the next free slot is always the one after the last object.
+        const size_t slot = cell->header.count++;
+        cell->objects[slot] = obj;
+        setsphere(cell, slot, obj);
         obj->culldata = (struct GameObject::culldata) {
             .cellpos = head->header.cellpos, // head of the cell list
-            .objid = 0, // slot in object list
-            .pageref = newcell, // cell page in cell list
-            .pageid = newcell->header.id // ID of page in cell list
+            .objid = slot, // slot in object list
+            .pageref = cell, // cell page in cell list
+            .pageid = cell->header.id // ID of page in cell list
         };
+
+        if (cell->header.count == Cell::COUNT) {
+            unlinkfree(head, cell);
+        }
     }
 
     void ParitionManager::add(OUtils::Handle<GameObject> obj) {
         ZoneScoped;
         ASSERT(obj.isvalid(), "Attempted to register invalid object to partition system.\n");
         Cell *icell = NULL;
-        const glm::ivec3 cellpos = obj->getglobalposition() * (1 / PARTITION_CELLSIZE);
-        if (this->map.find(cellpos) != this->map.end()) { // XXX: Rework this so we only have one call to do
-            icell = this->map[cellpos]; // Retrieve head of cell page list
+        const glm::ivec3 cellpos = OScene::cellpos(obj->getglobalposition());
+        OJob::Spinlock *celllock = this->celllock(cellpos);
+        celllock->lock();
+        this->maplock.lock();
+        auto it = this->map.find(cellpos);
+        if (it != this->map.end()) {
+            icell = it->second; // Retrieve head of cell page list
         } else {
             Cell *cell = (Cell *)this->allocator.alloc();
-            memset(cell, 0, sizeof(Cell));
-            for (size_t i = 0; i < cell->COUNT; i++) {
-                cell->objects[i] = SCENE_INVALIDHANDLE;
-            }
+            initcell(cell);
             cell->header.origin = glm::vec3(cellpos.x, cellpos.y, cellpos.z) * PARTITION_CELLSIZE; // Convert to cell coordinates and back to lose precision
             cell->header.cellpos = cellpos;
             cell->header.next = NULL;
             cell->header.prev = NULL;
             cell->header.count = 0;
-            cell->header.idx = this->cells.size();
             cell->header.id = this->idcounter.fetch_add(1);
-            this->cells.push_back(cell);
+            linkfree(cell, cell);
             this->map[cell->header.cellpos] = cell;
-            icell = this->map[cell->header.cellpos];
+            this->addtocluster(cell);
+            icell = cell;
         }
+        this->maplock.unlock();
 
-        this->addtocell(icell, obj);
+        this->addtocell(icell, obj); // only the cell list itself is touched from here, which is ours while we hold its lock
+        celllock->unlock();
     }
+
     void ParitionManager::remove(OUtils::Handle<GameObject> obj) {
         ZoneScoped;
         ASSERT(obj.isvalid(), "Attempted to remove invalid object from partition.\n");
 
         struct GameObject::culldata &cdata = obj->culldata;
         ASSERT(cdata.pageid != 0, "Object is not registered in the partition system.\n");
-        ASSERT(cdata.objid < Cell::COUNT, "Object index in cell exceeds maximum number of objects [in a cell].\n");
 
-        ASSERT(this->map.find(cdata.cellpos) != this->map.end(), "Object culling data refers to a cell that is not mapped.\n");
+        OJob::Spinlock *celllock = this->celllock(cdata.cellpos);
+        celllock->lock();
+        this->maplock.lock();
+        auto it = this->map.find(cdata.cellpos);
+        ASSERT(it != this->map.end(), "Object culling data refers to a cell that is not mapped.\n");
+        Cell *head = it->second;
+        this->maplock.unlock();
 
         ASSERT(cdata.pageref != NULL, "Cell referenced is located at NULL, therefore the object is not registered in the partition system.\n");
         Cell *cell = (Cell *)cdata.pageref;
-        ASSERT(cell->header.id != 0, "Reference to stale cell (does not exist in the partition system).\n");
+        ASSERT(cell->header.id == cdata.pageid, "Reference to stale cell (does not exist in the partition system).\n");
+        const size_t slot = cdata.objid; // only stable while we hold the lock, removing a neighbour may move us
+        ASSERT(slot < cell->header.count && cell->objects[slot] == obj, "Object culling data does not match its cell.\n");
 
         if (cell->header.count == 1) { // Removing this object will make the cell contain nothing
+            unlinkfree(head, cell);
             if (!cell->header.prev) { // Cell is the head of a list
+                this->maplock.lock();
                 if (!cell->header.next) { // Only cell in list, invalidate the entire map reference
                     this->map.erase(cell->header.cellpos);
-                    this->cells.erase(this->cells.begin() + cell->header.idx);
                 } else {
                     this->map[cell->header.cellpos] = cell->header.next; // Make this next cell the new head of the list
+                    cell->header.next->header.freelist = cell->header.freelist; // which now holds the list of pages with room
                 }
+                this->removefromcluster(cell, cell->header.next);
+                this->maplock.unlock();
             }
 
             if (cell->header.prev) { // Normal cell in the list
@@ -135,9 +225,24 @@ namespace OScene {
             cell->header.id = 0; // Invalidate cell (it will now be picked up as a stale reference as a cell's id will NEVER be 0)
             this->allocator.free(cell); // Free from the allocator so that this may be used once again
         } else {
-            cell->objects[cdata.objid] = SCENE_INVALIDHANDLE; // Invalidate the reference
-            cell->header.count--; // Decrement the number of claimed spots
+            if (cell->header.count == Cell::COUNT) { // About to have room again
+                linkfree(head, cell);
+            }
+
+            // Keep the page packed: the last object moves into our slot (and is told where it went).
+            const size_t last = --cell->header.count;
+            if (slot != last) {
+                cell->objects[slot] = cell->objects[last];
+                cell->spherex[slot] = cell->spherex[last];
+                cell->spherey[slot] = cell->spherey[last];
+                cell->spherez[slot] = cell->spherez[last];
+                cell->spherer[slot] = cell->spherer[last];
+                cell->objects[slot]->culldata.objid = slot;
+            }
+            cell->objects[last] = SCENE_INVALIDHANDLE;
+            clearsphere(cell, last); // and make sure culling never picks the slot up
         }
+        celllock->unlock();
 
         // Invalidate culling data
         obj->culldata = (struct GameObject::culldata) {
@@ -157,99 +262,195 @@ namespace OScene {
             return;
         }
 
-        glm::ivec3 current = obj->getglobalposition() * (1 / PARTITION_CELLSIZE);
+        glm::ivec3 current = cellpos(obj->getglobalposition());
         if (current == obj->culldata.cellpos) {
-            return; // Literally no need to update the position of the object in our system as nothing has changed (and it would be a waste of cycles to go through the whole remove+add routine).
+            this->refresh(obj); // Same cell, so no need to go through the whole remove+add routine, only the bounding sphere has moved.
+            return;
         }
 
         this->remove(obj); // remove from old cell
         this->add(obj); // get us a new cell
     }
 
-    void ParitionManager::docull(Cell *cell, OMath::Frustum *frustum, CullResult **ret, CullResultList *list) {
-        ZoneScoped;
-        CullResult *res = *ret;
-        size_t cursor = res->header.count;
+    void ParitionManager::refresh(OUtils::Handle<GameObject> obj) {
+        ASSERT(obj.isvalid(), "Attempted to refresh invalid object in partition.\n");
+        struct GameObject::culldata &cdata = obj->culldata;
+        if (cdata.objid == SIZE_MAX) { // Not in the system, the sphere is worked out whenever it gets added.
+            return;
+        }
 
-        while (cell != NULL) { // Iterate over all cells in the chain.
-            for (size_t i = 0; i < cell->header.count; i++) {
-                if (!(cell->objects[i]->flags & GameObject::typeflags::IS_CULLABLE)) {
-                    continue;
-                }
+        OJob::Spinlock *celllock = this->celllock(cdata.cellpos);
+        celllock->lock();
+        setsphere((Cell *)cdata.pageref, cdata.objid, obj);
+        celllock->unlock();
+    }
 
-                OUtils::Handle<GameObject> obj = cell->objects[i]->gethandle<GameObject>();
-                OMath::AABB bounds = obj->bounds;
-                // bounds = bounds.transformed(glm::translate(obj->getglobalposition()) * glm::toMat4(glm::quat(1.0f, 0.0f, 0.0f, 0.0f)) * glm::scale(obj->getglobalscale()));
-                bounds = bounds.transformed(obj->getglobalstaticmatrix());
-                // bounds = bounds.transformed(obj->getglobalmatrix());
-                // bounds.translate(obj->getglobalposition());
-                OMath::Sphere sphere = OMath::Sphere(bounds.centre, bounds.radius());
-
-                // printf("checking bounds %f %f %f to %f %f %f\n", bounds.min.x, bounds.min.y, bounds.min.z, bounds.max.x, bounds.max.y, bounds.max.z);
-                // printf("checking sphere %f %f %f %f\n", sphere.pos.x, sphere.pos.y, sphere.pos.z, sphere.radius);
-                if (frustum->testsphere(sphere) == OMath::Frustum::OUTSIDE) {
-                // if (camera.getfrustum().testobb(OMath::OBB(bounds, obj->getglobalorientation())) == OMath::Frustum::OUTSIDE) {
-                // if (camera.getfrustum().testaabb(bounds) == OMath::Frustum::OUTSIDE) {
-                // if (!camera.getfrustum().sphereinfrustum(sphere)) {
-                    continue;
-                }
+    static void pushmove(struct ParitionManager::movequeue *queue, OUtils::Handle<GameObject> obj) {
+        if (queue->count == queue->capacity) {
+            queue->capacity = queue->capacity ? queue->capacity * 2 : 64;
+            queue->objects = (OUtils::Handle<GameObject> *)realloc(queue->objects, queue->capacity * sizeof(queue->objects[0]));
+            ASSERT(queue->objects != NULL, "Failed to grow partition move queue.\n");
+        }
+        queue->objects[queue->count++] = obj;
+    }
 
-                if (cursor == CullResult::COUNT) {
-                    res->header.count = cursor;
-                    res = list->acquire();
-                    cursor = 0;
-                }
+    void ParitionManager::queue(OUtils::Handle<GameObject> obj) {
+        if (obj->cullqueued.exchange(true, std::memory_order_acq_rel)) {
+            return; // Already waiting, sync() will see wherever it ends up.
+        }
 
-                res->objects[cursor++] = cell->objects[i];
-            }
-            res->header.count = cursor;
+        struct movequeue *queue = this->queues.get();
+        if (queue == NULL) {
+            OJob::ScopedSpinlock lock(&this->sharedlock);
+            pushmove(&this->sharedqueue, obj);
+            return;
+        }
+        pushmove(queue, obj);
+    }
 
-            cell = cell->header.next;
+    static void applymoves(struct ParitionManager::syncwork *work) {
+        for (size_t i = 0; i < work->count; i++) {
+            OUtils::Handle<GameObject> obj = work->objects[i];
+            if (!obj.isvalid()) { // Deleted since it moved.
+                continue;
+            }
+            obj->cullqueued.store(false, std::memory_order_release);
+            work->manager->updatepos(obj); // cell and map locks keep the batches off each other's toes
         }
-        *ret = res;
     }
 
-    static void cullworker(OJob::Job *job) {
+    static void syncworker(OJob::Job *job) {
         ZoneScoped;
-        struct ParitionManager::work *work = (struct ParitionManager::work *)job->param;
-        ParitionManager *manager = work->manager;
-        CullResultList list = CullResultList(&manager->allocator); // create a new result list
-        OMath::Frustum *frustum = work->frustum;
+        applymoves((struct ParitionManager::syncwork *)job->param);
+    }
 
-        size_t start = work->idx->fetch_add(work->cellsperjob); // get the current working index, while adding the number of cells to work through for the next worker.
-        size_t end = MIN(start + work->cellsperjob, manager->cells.size()); // either do all the cells that a worker is supposed to do, or work until the end of the list of cells.
+    void ParitionManager::sync(void) {
+        ZoneScoped;
+        this->pending.clear();
+        struct movequeue *queues = this->queues.all();
+        for (size_t i = 0; queues != NULL && i < OJob::numworkers; i++) {
+            this->pending.insert(this->pending.end(), queues[i].objects, queues[i].objects + queues[i].count);
+            queues[i].count = 0;
+        }
+        this->sharedlock.lock();
+        this->pending.insert(this->pending.end(), this->sharedqueue.objects, this->sharedqueue.objects + this->sharedqueue.count);
+        this->sharedqueue.count = 0;
+        this->sharedlock.unlock();
+        TracyPlot("Partition Sync Objects", (int64_t)this->pending.size());
 
-        CullResult *res = NULL;
-        size_t total = 0;
-        for (size_t index = start; index < end; index++) {
-            total++;
+        if (this->pending.size() == 0) {
+            return;
+        }
 
-            Cell *cell = manager->cells[index];
+        const size_t numjobs = (this->pending.size() + PARTITION_SYNCBATCH - 1) / PARTITION_SYNCBATCH;
+        struct syncwork *work = (struct syncwork *)malloc(sizeof(struct syncwork) * numjobs);
+        ASSERT(work != NULL, "Failed to allocate memory for partition sync work.\n");
+        for (size_t i = 0; i < numjobs; i++) {
+            work[i] = (struct syncwork) {
+                .manager = this,
+                .objects = this->pending.data() + i * PARTITION_SYNCBATCH,
+                .count = MIN(PARTITION_SYNCBATCH, this->pending.size() - i * PARTITION_SYNCBATCH)
+            };
+        }
 
-            if (res == NULL) {
-                res = list.acquire();
-            }
+        if (numjobs == 1) { // Not worth a job.
+            applymoves(&work[0]);
+            free(work);
+            return;
+        }
 
-            if (frustum->testaabb(OMath::AABB(cell->header.origin, cell->header.origin + PARTITION_CELLSIZE)) == OMath::Frustum::INSIDE) {
+        OJob::Counter counter;
+        OJob::Job **jobs = (OJob::Job **)malloc(sizeof(OJob::Job *) * numjobs);
+        ASSERT(jobs != NULL, "Failed to allocate memory for job list.\n");
+        for (size_t i = 0; i < numjobs; i++) {
+            jobs[i] = new OJob::Job(syncworker, (uintptr_t)&work[i]);
+            jobs[i]->stack = OJob::Job::STACK_SMALL;
+            jobs[i]->counter = &counter;
+        }
+        OJob::kickjobs(numjobs, jobs);
+        counter.wait();
+        free(jobs);
+        free(work);
+    }
+
+    void ParitionManager::docull(Cell *cell, OMath::cullplanes *planes, CullResult **ret, CullResultList *list) {
+        CullResult *res = *ret;
+        uint16_t visible[Cell::COUNT];
+
+        while (cell != NULL) { // Iterate over all cells in the chain.
+            if (planes == NULL) { // Entirely inside, every object is visible (and they're packed, so copy them straight in).
                 size_t remaining = cell->header.count;
                 size_t srcoff = 0;
-
-                // Directly copy everything inside the cell into the result implicitly (as we can assume total containment == all are visible).
                 while (remaining > 0) {
                     if (res->header.count == CullResult::COUNT) {
-                        res = list.acquire();
+                        res = list->acquire();
                     }
-                    size_t remspace = CullResult::COUNT - res->header.count;
-                    size_t step = glm::min(remaining, remspace);
+                    size_t step = MIN(remaining, CullResult::COUNT - res->header.count);
 
                     memcpy(res->objects + res->header.count, cell->objects + srcoff, step * sizeof(cell->objects[0]));
                     srcoff += step;
                     res->header.count += step;
                     remaining -= step;
                 }
-            } else if (frustum->testaabb(OMath::AABB(cell->header.origin - PARTITION_CELLSIZE, cell->header.origin + PARTITION_CELLSIZE)) == OMath::Frustum::INTERSECT) {
-                manager->docull(cell, frustum, &res, &list);
+                cell = cell->header.next;
+                continue;
+            }
+
+            // Only the occupied front of the page (rounded up to a whole block, the empty slots after the last object can never pass).
+            const size_t num = OMath::cullspheres(planes, cell->spherex, cell->spherey, cell->spherez, cell->spherer, (cell->header.count + CULL_PADDING - 1) & ~(size_t)(CULL_PADDING - 1), cell->lastplane, visible);
+            for (size_t i = 0; i < num; i++) {
+                if (res->header.count == CullResult::COUNT) {
+                    res = list->acquire();
+                }
+                res->objects[res->header.count++] = cell->objects[visible[i]];
+            }
+
+            cell = cell->header.next;
+        }
+        *ret = res;
+    }
+
+    void ParitionManager::cullcluster(Cluster *cluster, OMath::Frustum *frustum, OMath::cullplanes *planes, CullResult **ret, CullResultList *list) {
+        for (size_t i = 0; i < cluster->cells.size(); i++) {
+            Cell *cell = cluster->cells[i];
+            if (planes == NULL) {
+                this->docull(cell, NULL, ret, list);
+                continue;
+            }
+
+            // Objects may hang out of their cell by up to a cell, so only the padded bounds can reject the cell outright.
+            if (frustum->testaabb(OMath::AABB(cell->header.origin - PARTITION_CELLSIZE, cell->header.origin + PARTITION_CELLSIZE), &cell->header.lastplane) == OMath::Frustum::OUTSIDE) {
+                continue;
+            }
+            if (frustum->testaabb(OMath::AABB(cell->header.origin, cell->header.origin + PARTITION_CELLSIZE)) == OMath::Frustum::INSIDE) {
+                this->docull(cell, NULL, ret, list); // Total containment == all are visible.
+            } else {
+                this->docull(cell, planes, ret, list);
+            }
+        }
+    }
+
+    static void cullworker(OJob::Job *job) {
+        ZoneScoped;
+        struct ParitionManager::work *work = (struct ParitionManager::work *)job->param;
+        ParitionManager *manager = work->manager;
+        CullResultList list = CullResultList(&OUtils::frameallocator); // create a new result list
+        OMath::Frustum *frustum = work->frustum;
+
+        size_t start = work->idx->fetch_add(work->clustersperjob); // get the current working index, while adding the number of clusters to work through for the next worker.
+        size_t end = MIN(start + work->clustersperjob, manager->clusters.size()); // either do all the clusters that a worker is supposed to do, or work until the end of the list of clusters.
+
+        CullResult *res = list.acquire();
+        for (size_t index = start; index < end; index++) {
+            Cluster *cluster = manager->clusters[index];
+
+            // One test for the whole cluster before any of its cells.
+            const glm::vec3 min = glm::vec3(cluster->pos * PARTITION_CLUSTERCELLS) * PARTITION_CELLSIZE;
+            const glm::vec3 max = min + PARTITION_CLUSTERCELLS * PARTITION_CELLSIZE;
+            if (frustum->testaabb(OMath::AABB(min - PARTITION_CELLSIZE, max + PARTITION_CELLSIZE), &cluster->lastplane) == OMath::Frustum::OUTSIDE) {
+                continue;
             }
+            manager->cullcluster(cluster, frustum, frustum->testaabb(OMath::AABB(min, max)) == OMath::Frustum::INSIDE ? NULL : &work->planes, &res, &list);
         }
 
         job->returnvalue = list.detach(); // our job's return value will be a detached list of culling nodes, that can be merged in later with the main result list.
@@ -257,27 +458,29 @@ namespace OScene {
 
     CullResult *ParitionManager::cull(ORenderer::PerspectiveCamera &camera) {
         ZoneScoped;
+        this->sync(); // Everything has to be where it says it is first.
         if (!this->map.size()) {
             return NULL;
         }
 
-        CullResultList list = CullResultList(&this->allocator);
-        std::atomic<size_t> workeridx = 0; // Index into cell map list, atomic so only one worker is working on a cell at any one time.
+        CullResultList list = CullResultList(&OUtils::frameallocator);
+        std::atomic<size_t> workeridx = 0; // Index into cluster list, atomic so only one worker is working on a cluster at any one time.
 
-        size_t cellsperjob = MAX(1, this->cells.size() / (OJob::numworkers * 2)); // even spread, but ensure at least one cell per job if the number of worker threads exceeds the number of cells. additionally, pessimistically assume that the job system will be in heavy use.
-        size_t numjobs = (this->cells.size() + cellsperjob - 1) / cellsperjob; // balance the number of jobs based on the number of cells and the number of cells per job.
+        size_t clustersperjob = MAX(1, this->clusters.size() / (OJob::numworkers * 2)); // even spread, but ensure at least one cluster per job if the number of worker threads exceeds the number of clusters. additionally, pessimistically assume that the job system will be in heavy use.
+        size_t numjobs = (this->clusters.size() + clustersperjob - 1) / clustersperjob; // balance the number of jobs based on the number of clusters and the number of clusters per job.
 
-        printf("Dispatching culling work on %lu cells at a saturation of %lu jobs, with %lu cells per job.\n", this->cells.size(), numjobs, cellsperjob);
-        struct work work = { .idx = &workeridx, .frustum = &camera.getfrustum(), .manager = this, .cellsperjob = cellsperjob };
+        struct work work = { .idx = &workeridx, .frustum = &camera.getfrustum(), .manager = this, .clustersperjob = clustersperjob };
+        work.frustum->getcullplanes(&work.planes);
         OJob::Counter *counter = new OJob::Counter();
         OJob::Job **jobs = (OJob::Job **)malloc(sizeof(OJob::Job *) * numjobs);
         ASSERT(jobs != NULL, "Failed to allocate memory for job list.\n");
         for (size_t i = 0; i < numjobs; i++) { // Create a series of jobs to distribute the work over the worker threads.
             jobs[i] = new OJob::Job(cullworker, (uintptr_t)&work);
             jobs[i]->returns = true; // mark that this job returns a value.
+            jobs[i]->stack = OJob::Job::STACK_SMALL; // culling is shallow, no need for a big stack.
             jobs[i]->counter = counter;
-            OJob::kickjob(jobs[i]);
         }
+        OJob::kickjobs(numjobs, jobs); // Submit all the culling work in one go.
 
         counter->wait();
         delete counter;
@@ -1,20 +1,22 @@
 #include <engine/scene/scene.hpp>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace OScene {
-#define SCENE_OBJECTSPERLOADCHUNK 256
-    void Scene::load(const char *path) {
-        ASSERT(path != NULL, "NULL path.\n");
-        FILE *f = fopen(path, "r");
-        ASSERT(f != NULL, "Failed to open scene file `%s` for loading.\n", path);
-
+    // Version 1 scenes, one object record at a time.
+    void Scene::loadlegacy(FILE *f) {
+        ZoneScoped;
         struct scenehdr header = { };
         ASSERT(fread(&header, sizeof(struct scenehdr), 1, f), "Failed to read scene header.\n");
         ASSERT(!strncmp(header.magic, "OSCE", sizeof(header.magic)), "Failed to verify scene header magic.\n");
-        printf("Loading scene `%s`.\n", path);
         printf("Number of terrains: %lu\n", header.numterrain);
         printf("Number of objects: %lu\n", header.numobjects);
 
         std::unordered_map<size_t, GameObject *> idptrmap; // Resolution between serialised ID and pointer
+        size_t base = this->objects.size();
 
         for (size_t i = 0; i < header.numobjects; i++) {
             struct gameobjecthdr gobj = { };
@@ -32,7 +34,7 @@ namespace OScene {
             obj->sparent = gobj.parent;
             obj->bounds = OMath::AABB(gobj.min, gobj.max);
             if (gobj.numchildren) {
-                obj->schildren.reserve(gobj.numchildren);
+                obj->schildren.resize(gobj.numchildren);
                 ASSERT(fread(obj->schildren.data(), sizeof(size_t) * gobj.numchildren, 1, f), "Failed to read game object children.\n");
             }
             obj->flags = gobj.flags;
@@ -50,14 +52,7 @@ namespace OScene {
             this->objects.push_back(obj->gethandle());
         }
 
-        fclose(f);
-
-        // TODO: Concurrent (split into chunks and shove work onto each job)
-        size_t numobjects = this->objects.size();
-        // Split objects into chunks
-        size_t numjobs = numobjects > SCENE_OBJECTSPERLOADCHUNK ? numobjects / SCENE_OBJECTSPERLOADCHUNK : 1;
-
-        for (size_t i = 0; i < numobjects; i++) {
+        for (size_t i = base; i < this->objects.size(); i++) {
             OUtils::Handle<GameObject> obj = this->objects[i];
             if (obj->sparent) {
                 ASSERT(idptrmap.find(obj->sparent) != idptrmap.end(), "Unresolved parent ID (%lu) for object.\n", obj->sparent);
@@ -73,54 +68,280 @@ namespace OScene {
                 obj->schildren.clear();
             }
             this->partitionmanager.add(obj);
+            this->transforms.add(obj);
+        }
+    }
+
+    void Scene::runload(void (*worker)(OJob::Job *job), struct loadwork *work, size_t numjobs) {
+        OJob::Counter counter;
+        OJob::Job **jobs = (OJob::Job **)malloc(sizeof(OJob::Job *) * numjobs);
+        ASSERT(jobs != NULL, "Failed to allocate memory for scene loading jobs.\n");
+        for (size_t i = 0; i < numjobs; i++) {
+            jobs[i] = new OJob::Job(worker, (uintptr_t)&work[i]);
+            jobs[i]->counter = &counter;
+        }
+        OJob::kickjobs(numjobs, jobs);
+        counter.wait();
+        free(jobs);
+    }
+
+    // Pass one: create the objects and hand them their serialised data.
+    void Scene::instantiateworker(OJob::Job *job) {
+        ZoneScoped;
+        struct loadwork *work = (struct loadwork *)job->param;
+        const struct fileheader *header = work->header;
+        const uint8_t *file = work->file;
+        const uint64_t *ids = (const uint64_t *)(file + header->sections[SECTION_ID].offset);
+        const uint32_t *types = (const uint32_t *)(file + header->sections[SECTION_TYPE].offset);
+        const uint32_t *flags = (const uint32_t *)(file + header->sections[SECTION_FLAGS].offset);
+        const glm::vec3 *positions = (const glm::vec3 *)(file + header->sections[SECTION_POSITION].offset);
+        const glm::quat *orientations = (const glm::quat *)(file + header->sections[SECTION_ORIENTATION].offset);
+        const glm::vec3 *scales = (const glm::vec3 *)(file + header->sections[SECTION_SCALE].offset);
+        const glm::vec3 *mins = (const glm::vec3 *)(file + header->sections[SECTION_MIN].offset);
+        const glm::vec3 *maxs = (const glm::vec3 *)(file + header->sections[SECTION_MAX].offset);
+        const uint64_t *datastart = (const uint64_t *)(file + header->sections[SECTION_DATASTART].offset);
+        const uint8_t *data = file + header->sections[SECTION_DATA].offset;
+
+        for (size_t i = work->start; i < work->end; i++) {
+            auto type = OUtils::reflectiontable.find(types[i]);
+            ASSERT(type != OUtils::reflectiontable.end(), "Invalid object type (not registered in reflection table).\n");
+
+            GameObject *obj = (GameObject *)type->second->create(true);
+            obj->scene = work->scene;
+            obj->position = positions[i];
+            obj->orientation = orientations[i];
+            obj->scale = scales[i];
+            obj->parent = SCENE_INVALIDHANDLE;
+            obj->sparent = 0;
+            obj->bounds = OMath::AABB(mins[i], maxs[i]);
+            obj->flags = flags[i];
+            obj->type = types[i];
+            obj->id = ids[i];
+
+            ASSERT(datastart[i] <= datastart[i + 1] && datastart[i + 1] <= header->sections[SECTION_DATA].size, "Object %lu serialised data is out of range.\n", i);
+            if (datastart[i + 1] > datastart[i]) {
+                OResource::Serialiser serialiser = OResource::Serialiser((uint8_t *)data + datastart[i], datastart[i + 1] - datastart[i]); // read only, straight out of the mapping
+                obj->deserialise(&serialiser);
+            }
+            work->objects[i] = obj;
+            work->scene->objects[work->base + i] = obj->gethandle();
+        }
+    }
+
+    // Pass two: hook up parents and children (everything exists by now).
+    void Scene::linkworker(OJob::Job *job) {
+        ZoneScoped;
+        struct loadwork *work = (struct loadwork *)job->param;
+        const struct fileheader *header = work->header;
+        const uint64_t *parents = (const uint64_t *)(work->file + header->sections[SECTION_PARENT].offset);
+        const uint64_t *childstart = (const uint64_t *)(work->file + header->sections[SECTION_CHILDSTART].offset);
+        const uint64_t *children = (const uint64_t *)(work->file + header->sections[SECTION_CHILDREN].offset);
+        const size_t numchildren = header->sections[SECTION_CHILDREN].size / sizeof(uint64_t);
+
+        for (size_t i = work->start; i < work->end; i++) {
+            GameObject *obj = work->objects[i];
+            if (parents[i] != SCENE_NOPARENT) {
+                ASSERT(parents[i] < header->numobjects, "Unresolved parent index (%lu) for object.\n", parents[i]);
+                obj->parent = work->objects[parents[i]]->gethandle();
+            }
+
+            ASSERT(childstart[i] <= childstart[i + 1] && childstart[i + 1] <= numchildren, "Object %lu children are out of range.\n", i);
+            if (childstart[i + 1] > childstart[i]) {
+                obj->children.reserve(childstart[i + 1] - childstart[i]);
+                for (size_t j = childstart[i]; j < childstart[i + 1]; j++) {
+                    ASSERT(children[j] < header->numobjects, "Unresolved child index (%lu) for object.\n", children[j]);
+                    obj->children.push_back(work->objects[children[j]]->gethandle());
+                }
+            }
         }
     }
 
+    // Pass three: place everything in the world (global positions need the parents from pass two).
+    void Scene::partitionworker(OJob::Job *job) {
+        ZoneScoped;
+        struct loadwork *work = (struct loadwork *)job->param;
+        for (size_t i = work->start; i < work->end; i++) {
+            work->scene->partitionmanager.add(work->objects[i]->gethandle());
+            work->scene->transforms.add(work->objects[i]->gethandle());
+        }
+    }
+
+    // Anything whose world transform changed has to be moved in the partition too.
+    void Scene::transformmoved(GameObject *obj, uintptr_t param) {
+        ((Scene *)param)->partitionmanager.queue(obj->gethandle());
+    }
+
+    void Scene::load(const char *path) {
+        ZoneScoped;
+        ASSERT(path != NULL, "NULL path.\n");
+        int fd = open(path, O_RDONLY);
+        ASSERT(fd != -1, "Failed to open scene file `%s` for loading.\n", path);
+        struct stat st;
+        ASSERT(fstat(fd, &st) == 0, "Failed to stat scene file `%s`.\n", path);
+
+        char magic[5] = { 0 };
+        ASSERT(pread(fd, magic, sizeof(magic), 0) == sizeof(magic), "Failed to read scene header.\n");
+        ASSERT(!strncmp(magic, "OSCE", 4), "Failed to verify scene header magic.\n");
+        printf("Loading scene `%s`.\n", path);
+        if (magic[4] == '\0') { // version 1
+            FILE *f = fdopen(fd, "r");
+            ASSERT(f != NULL, "Failed to open scene file `%s` for loading.\n", path);
+            this->loadlegacy(f);
+            fclose(f);
+            return;
+        }
+
+        ASSERT((size_t)st.st_size >= sizeof(struct fileheader), "Scene file `%s` is too small to be a scene.\n", path);
+        const uint8_t *file = (const uint8_t *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        ASSERT(file != MAP_FAILED, "Failed to map scene file `%s`.\n", path);
+        madvise((void *)file, st.st_size, MADV_WILLNEED);
+
+        const struct fileheader *header = (const struct fileheader *)file;
+        ASSERT(header->version == SCENE_FORMATVERSION, "Unsupported scene version %u (expected %u).\n", header->version, SCENE_FORMATVERSION);
+        printf("Number of terrains: %lu\n", header->numterrain);
+        printf("Number of objects: %lu\n", header->numobjects);
+
+        const size_t numobjects = header->numobjects;
+        // Every object takes at least a uint64_t (its ID), so anything claiming more than that is corrupt. Checked first so none of the section sizes below can overflow.
+        ASSERT(numobjects <= (size_t)st.st_size / sizeof(uint64_t), "Scene file `%s` claims more objects (%lu) than it can hold.\n", path, numobjects);
+        static const size_t strides[SECTION_COUNT] = { // per object size of each section (0 for those that aren't one per object)
+            sizeof(uint64_t), sizeof(uint32_t), sizeof(uint32_t), sizeof(glm::vec3), sizeof(glm::quat), sizeof(glm::vec3), sizeof(glm::vec3), sizeof(glm::vec3), sizeof(uint64_t), 0, 0, 0, 0
+        };
+        for (size_t i = 0; i < SECTION_COUNT; i++) {
+            const struct sectionentry *section = &header->sections[i];
+            ASSERT(section->offset <= (uint64_t)st.st_size && section->size <= (uint64_t)st.st_size - section->offset, "Scene section %lu lies outside of the file.\n", i);
+            ASSERT((section->offset & (SCENE_SECTIONALIGN - 1)) == 0, "Scene section %lu is misaligned.\n", i);
+            ASSERT(strides[i] == 0 || section->size == strides[i] * numobjects, "Scene section %lu is the wrong size.\n", i);
+        }
+        ASSERT(header->sections[SECTION_CHILDSTART].size == (numobjects + 1) * sizeof(uint64_t), "Scene child ranges are the wrong size.\n");
+        ASSERT(header->sections[SECTION_DATASTART].size == (numobjects + 1) * sizeof(uint64_t), "Scene data ranges are the wrong size.\n");
+
+        if (numobjects > 0) {
+            GameObject **objects = (GameObject **)malloc(sizeof(GameObject *) * numobjects);
+            ASSERT(objects != NULL, "Failed to allocate memory for scene objects.\n");
+            size_t base = this->objects.size();
+            this->objects.resize(base + numobjects);
+
+            size_t numjobs = (numobjects + SCENE_OBJECTSPERLOADCHUNK - 1) / SCENE_OBJECTSPERLOADCHUNK;
+            struct loadwork *work = (struct loadwork *)malloc(sizeof(struct loadwork) * numjobs);
+            ASSERT(work != NULL, "Failed to allocate memory for scene loading work.\n");
+            for (size_t i = 0; i < numjobs; i++) {
+                work[i] = (struct loadwork) {
+                    .scene = this, .header = header, .file = file, .objects = objects, .base = base,
+                    .start = i * SCENE_OBJECTSPERLOADCHUNK, .end = MIN((i + 1) * SCENE_OBJECTSPERLOADCHUNK, numobjects)
+                };
+            }
+
+            this->runload(Scene::instantiateworker, work, numjobs);
+            this->runload(Scene::linkworker, work, numjobs);
+            this->runload(Scene::partitionworker, work, numjobs);
+
+            free(work);
+            free(objects);
+        }
+        munmap((void *)file, st.st_size);
+    }
+
     Scene::Scene(const char *path) {
         this->load(path);
     }
 
-    static void saveobj(FILE *f, OUtils::Handle<GameObject> obj) {
-        struct Scene::gameobjecthdr gobj = { };
-        gobj.position = obj->position;
-        gobj.orientation = obj->orientation;
-        gobj.scale = obj->scale;
-        gobj.flags = obj->flags;
-        gobj.type = obj->type;
-        gobj.id = obj->id;
-        gobj.min = obj->bounds.min;
-        gobj.max = obj->bounds.max;
-        gobj.parent = obj->parent.isvalid() ? obj->parent->id : 0;
-        gobj.numchildren = obj->children.size();
-
-        OResource::Serialiser serialiser = OResource::Serialiser();
-        obj->serialise(&serialiser);
-        gobj.datasize = serialiser.writeoffset;
-        ASSERT(fwrite(&gobj, sizeof(struct Scene::gameobjecthdr), 1, f), "Failed to write game object header.\n");
-        for (auto it = obj->children.begin(); it != obj->children.end(); it++) {
-            ASSERT(fwrite(&(*it)->id, sizeof(size_t), 1, f), "Failed to write game object children.\n");
+    // Write a section at the next aligned offset.
+    static void writesection(FILE *f, struct Scene::fileheader *header, enum Scene::section section, const void *data, size_t size) {
+        static const uint8_t padding[SCENE_SECTIONALIGN] = { 0 };
+        long offset = ftell(f);
+        size_t pad = (SCENE_SECTIONALIGN - offset % SCENE_SECTIONALIGN) % SCENE_SECTIONALIGN;
+        if (pad > 0) {
+            ASSERT(fwrite(padding, pad, 1, f), "Failed to pad scene section.\n");
         }
-        if (gobj.datasize) {
-            ASSERT(fwrite(serialiser.data, serialiser.writeoffset, 1, f), "Failed to write serialised game object data.\n");
+        header->sections[section] = (struct Scene::sectionentry) { .offset = (uint64_t)offset + pad, .size = size };
+        if (size > 0) {
+            ASSERT(fwrite(data, size, 1, f), "Failed to write scene section %u.\n", section);
         }
     }
 
     void Scene::save(const char *path) {
+        ZoneScoped;
         ASSERT(path != NULL, "NULL path.\n");
         FILE *f = fopen(path, "w");
         ASSERT(f != NULL, "Failed to open scene file `%s` for scene serialisation.\n", path);
 
-        struct scenehdr header = { };
-        strcpy(header.magic, "OSCE");
-        header.numterrain = 0; // XXX: TODO
-        header.numobjects = this->objects.size();
+        const size_t numobjects = this->objects.size();
+        std::unordered_map<size_t, uint64_t> idindex; // object ID -> index in the file
+        idindex.reserve(numobjects);
+        for (size_t i = 0; i < numobjects; i++) {
+            idindex[this->objects[i]->id] = i;
+        }
 
-        ASSERT(fwrite(&header, sizeof(struct scenehdr), 1, f), "Failed to write scene header.\n");
+        std::vector<uint64_t> ids(numobjects);
+        std::vector<uint32_t> types(numobjects);
+        std::vector<uint32_t> flags(numobjects);
+        std::vector<glm::vec3> positions(numobjects);
+        std::vector<glm::quat> orientations(numobjects);
+        std::vector<glm::vec3> scales(numobjects);
+        std::vector<glm::vec3> mins(numobjects);
+        std::vector<glm::vec3> maxs(numobjects);
+        std::vector<uint64_t> parents(numobjects);
+        std::vector<uint64_t> childstart(numobjects + 1);
+        std::vector<uint64_t> children;
+        std::vector<uint64_t> datastart(numobjects + 1);
+        std::vector<uint8_t> data;
 
-        for (auto it = this->objects.begin(); it != this->objects.end(); it++) {
-            saveobj(f, *it);
+        for (size_t i = 0; i < numobjects; i++) {
+            OUtils::Handle<GameObject> obj = this->objects[i];
+            ids[i] = obj->id;
+            types[i] = obj->type;
+            flags[i] = obj->flags;
+            positions[i] = obj->position;
+            orientations[i] = obj->orientation;
+            scales[i] = obj->scale;
+            mins[i] = obj->bounds.min;
+            maxs[i] = obj->bounds.max;
+            if (obj->parent.isvalid()) {
+                ASSERT(idindex.find(obj->parent->id) != idindex.end(), "Object parent (%lu) is not part of the scene.\n", obj->parent->id);
+                parents[i] = idindex[obj->parent->id];
+            } else {
+                parents[i] = SCENE_NOPARENT;
+            }
+
+            childstart[i] = children.size();
+            for (auto it = obj->children.begin(); it != obj->children.end(); it++) {
+                ASSERT(idindex.find((*it)->id) != idindex.end(), "Object child (%lu) is not part of the scene.\n", (*it)->id);
+                children.push_back(idindex[(*it)->id]);
+            }
+
+            datastart[i] = data.size();
+            OResource::Serialiser serialiser = OResource::Serialiser();
+            obj->serialise(&serialiser);
+            data.insert(data.end(), serialiser.data, serialiser.data + serialiser.writeoffset);
         }
+        childstart[numobjects] = children.size();
+        datastart[numobjects] = data.size();
+
+        struct fileheader header = { };
+        memcpy(header.magic, "OSCE", sizeof(header.magic));
+        header.version = SCENE_FORMATVERSION;
+        header.numterrain = 0; // XXX: TODO
+        header.numobjects = numobjects;
+        ASSERT(fwrite(&header, sizeof(struct fileheader), 1, f), "Failed to write scene header.\n"); // placeholder, rewritten once the sections are known
+
+        writesection(f, &header, SECTION_ID, ids.data(), numobjects * sizeof(uint64_t));
+        writesection(f, &header, SECTION_TYPE, types.data(), numobjects * sizeof(uint32_t));
+        writesection(f, &header, SECTION_FLAGS, flags.data(), numobjects * sizeof(uint32_t));
+        writesection(f, &header, SECTION_POSITION, positions.data(), numobjects * sizeof(glm::vec3));
+        writesection(f, &header, SECTION_ORIENTATION, orientations.data(), numobjects * sizeof(glm::quat));
+        writesection(f, &header, SECTION_SCALE, scales.data(), numobjects * sizeof(glm::vec3));
+        writesection(f, &header, SECTION_MIN, mins.data(), numobjects * sizeof(glm::vec3));
+        writesection(f, &header, SECTION_MAX, maxs.data(), numobjects * sizeof(glm::vec3));
+        writesection(f, &header, SECTION_PARENT, parents.data(), numobjects * sizeof(uint64_t));
+        writesection(f, &header, SECTION_CHILDSTART, childstart.data(), (numobjects + 1) * sizeof(uint64_t));
+        writesection(f, &header, SECTION_CHILDREN, children.data(), children.size() * sizeof(uint64_t));
+        writesection(f, &header, SECTION_DATASTART, datastart.data(), (numobjects + 1) * sizeof(uint64_t));
+        writesection(f, &header, SECTION_DATA, data.data(), data.size());
 
+        ASSERT(fseek(f, 0, SEEK_SET) == 0, "Failed to rewind scene file.\n");
+        ASSERT(fwrite(&header, sizeof(struct fileheader), 1, f), "Failed to write scene header.\n");
         fclose(f);
     }
 }
@@ -0,0 +1,237 @@
+#include <engine/scene/transform.hpp>
+#include <sys/param.h>
+#include <tracy/Tracy.hpp>
+
+namespace OScene {
+
+    void TransformSystem::add(OUtils::Handle<GameObject> obj) {
+        if (obj->transformadded.exchange(true, std::memory_order_acq_rel)) {
+            return; // Already registered (or waiting to be).
+        }
+
+        OJob::ScopedSpinlock lock(&this->addlock);
+        this->added.push_back(obj);
+        this->restructure.store(true, std::memory_order_release);
+    }
+
+    void TransformSystem::rebuild(void) {
+        ZoneScoped;
+        // Everything we had (minus anything deleted since), plus everything added.
+        std::vector<OUtils::Handle<GameObject>> all;
+        std::vector<size_t> previous; // slot each object had before this rebuild (SIZE_MAX for new ones)
+        all.reserve(this->objects.size() + this->added.size());
+        previous.reserve(this->objects.size() + this->added.size());
+        for (size_t i = 0; i < this->objects.size(); i++) {
+            if (this->objects[i].isvalid()) {
+                all.push_back(this->objects[i]);
+                previous.push_back(i);
+            }
+        }
+        this->addlock.lock();
+        for (size_t i = 0; i < this->added.size(); i++) {
+            if (this->added[i].isvalid()) {
+                all.push_back(this->added[i]);
+                previous.push_back(SIZE_MAX);
+            }
+        }
+        this->added.clear();
+        this->addlock.unlock();
+
+        // Parents need slots too, whether anyone added them or not. transformidx temporarily indexes all[] from here.
+        for (size_t i = 0; i < all.size(); i++) {
+            all[i]->transformidx = i;
+            OUtils::Handle<GameObject> parent = all[i]->parent;
+            if (parent.isvalid() && !parent->transformadded.exchange(true, std::memory_order_acq_rel)) {
+                all.push_back(parent);
+                previous.push_back(SIZE_MAX);
+            }
+        }
+
+        // Depth of everything, walking up until we reach a root or something we already know the depth of.
+        std::vector<uint32_t> depth = std::vector<uint32_t>(all.size(), UINT32_MAX);
+        std::vector<size_t> chain;
+        uint32_t maxdepth = 0;
+        for (size_t i = 0; i < all.size(); i++) {
+            chain.clear();
+            size_t j = i;
+            uint32_t base = 0;
+            for (;;) {
+                if (depth[j] != UINT32_MAX) {
+                    base = depth[j] + 1;
+                    break;
+                }
+                chain.push_back(j);
+                ASSERT(chain.size() <= all.size(), "Transform hierarchy contains a cycle.\n");
+                OUtils::Handle<GameObject> parent = all[j]->parent;
+                if (!parent.isvalid()) {
+                    break;
+                }
+                j = parent->transformidx;
+            }
+            for (size_t k = chain.size(); k > 0; k--) {
+                depth[chain[k - 1]] = base++;
+            }
+            maxdepth = MAX(maxdepth, depth[i]);
+        }
+
+        // Counting sort by depth, so every level is contiguous and comes after its parents'.
+        this->levels.assign(all.size() ? maxdepth + 2 : 1, 0);
+        for (size_t i = 0; i < all.size(); i++) {
+            this->levels[depth[i] + 1]++;
+        }
+        for (size_t i = 1; i < this->levels.size(); i++) {
+            this->levels[i] += this->levels[i - 1];
+        }
+        std::vector<size_t> slots = std::vector<size_t>(all.size());
+        std::vector<size_t> cursor = std::vector<size_t>(this->levels.begin(), this->levels.end() - 1);
+        for (size_t i = 0; i < all.size(); i++) {
+            slots[i] = cursor[depth[i]]++;
+        }
+
+        // Everything that survived keeps its world transform and pending changes, so a rebuild only costs new (and reparented, those were marked dirty along with their subtrees) objects an update.
+        std::vector<OUtils::Handle<GameObject>> objects = std::vector<OUtils::Handle<GameObject>>(all.size());
+        std::vector<uint32_t> parents = std::vector<uint32_t>(all.size());
+        std::vector<glm::vec3> localpositions = std::vector<glm::vec3>(all.size());
+        std::vector<glm::quat> localorientations = std::vector<glm::quat>(all.size());
+        std::vector<glm::vec3> localscales = std::vector<glm::vec3>(all.size());
+        std::vector<struct world> worlds = std::vector<struct world>(all.size());
+        std::vector<uint8_t> flags = std::vector<uint8_t>(all.size());
+        for (size_t i = 0; i < all.size(); i++) {
+            const size_t slot = slots[i];
+            const size_t old = previous[i];
+            OUtils::Handle<GameObject> parent = all[i]->parent;
+            objects[slot] = all[i];
+            parents[slot] = parent.isvalid() ? slots[parent->transformidx] : TRANSFORM_NOPARENT;
+            if (old != SIZE_MAX) {
+                localpositions[slot] = this->localpositions[old];
+                localorientations[slot] = this->localorientations[old];
+                localscales[slot] = this->localscales[old];
+                worlds[slot] = this->worlds[old];
+                flags[slot] = this->dirty[old].load(std::memory_order_relaxed);
+            } else {
+                flags[slot] = TRANSFORM_NEW;
+            }
+        }
+        this->objects.swap(objects);
+        this->parents.swap(parents);
+        this->localpositions.swap(localpositions);
+        this->localorientations.swap(localorientations);
+        this->localscales.swap(localscales);
+        this->worlds.swap(worlds);
+        this->changed.assign(all.size(), 0);
+
+        if (all.size() > this->capacity) {
+            free(this->dirty);
+            this->capacity = MAX(all.size(), this->capacity * 2);
+            this->dirty = (std::atomic<uint8_t> *)malloc(this->capacity * sizeof(std::atomic<uint8_t>));
+            ASSERT(this->dirty != NULL, "Failed to allocate transform dirty flags.\n");
+        }
+        for (size_t i = 0; i < all.size(); i++) {
+            this->objects[i]->transformidx = i;
+            this->dirty[i].store(flags[i], std::memory_order_relaxed);
+        }
+    }
+
+    void TransformSystem::updaterange(size_t start, size_t end) {
+        for (size_t i = start; i < end; i++) {
+            const uint32_t parent = this->parents[i];
+            const uint8_t flags = this->dirty[i].load(std::memory_order_relaxed);
+            if (!flags && (parent == TRANSFORM_NOPARENT || !this->changed[parent])) {
+                this->changed[i] = 0;
+                continue;
+            }
+
+            if (!this->objects[i].isvalid()) { // Deleted, dropped on the next rebuild. Until then it's an identity transform, so its children carry on as roots (same as the getters treat them).
+                this->worlds[i] = (struct world) { .matrix = glm::mat4(1.0f), .staticmatrix = glm::mat4(1.0f), .position = glm::vec3(0.0f), .orientation = glm::quat(1.0f, 0.0f, 0.0f, 0.0f), .scale = glm::vec3(1.0f) };
+                this->changed[i] = 1;
+                this->dirty[i].store(0, std::memory_order_relaxed);
+                this->restructure.store(true, std::memory_order_release);
+                continue;
+            }
+
+            GameObject *obj = this->objects[i].resolve();
+            if (flags) {
+                this->localpositions[i] = obj->position;
+                this->localorientations[i] = obj->orientation;
+                this->localscales[i] = obj->scale;
+            }
+
+            const glm::vec3 &position = this->localpositions[i];
+            const glm::quat &orientation = this->localorientations[i];
+            const glm::vec3 &scale = this->localscales[i];
+            const glm::mat4 translation = glm::translate(position);
+            const glm::mat4 scaling = glm::scale(scale);
+            struct world world;
+            if (parent == TRANSFORM_NOPARENT) {
+                world.matrix = translation * glm::toMat4(orientation) * scaling;
+                world.staticmatrix = translation * scaling;
+                world.position = position;
+                world.orientation = orientation;
+                world.scale = scale;
+            } else {
+                const struct world *pworld = &this->worlds[parent];
+                world.matrix = pworld->matrix * translation * glm::toMat4(orientation) * scaling;
+                world.staticmatrix = pworld->staticmatrix * translation * scaling;
+                world.position = pworld->position + position;
+                world.orientation = glm::normalize(pworld->orientation * orientation);
+                world.scale = pworld->scale * scale;
+            }
+            this->dirty[i].store(0, std::memory_order_relaxed);
+
+            // Setting something to what it already was (or a change that cancels out further up) doesn't move anything.
+            const struct world *current = &this->worlds[i];
+            if (!(flags & TRANSFORM_NEW) && world.matrix == current->matrix && world.staticmatrix == current->staticmatrix &&
+                world.position == current->position && world.orientation == current->orientation && world.scale == current->scale) {
+                this->changed[i] = 0;
+                continue;
+            }
+            this->worlds[i] = world;
+            this->changed[i] = 1;
+
+            if (this->onmove != NULL) {
+                this->onmove(obj, this->moveparam);
+            }
+        }
+    }
+
+    void TransformSystem::updateworker(OJob::Job *job) {
+        ZoneScoped;
+        struct work *work = (struct work *)job->param;
+        work->system->updaterange(work->start, work->end);
+    }
+
+    void TransformSystem::update(void) {
+        ZoneScoped;
+        if (this->restructure.exchange(false, std::memory_order_acq_rel)) {
+            this->rebuild();
+        }
+
+        // Level by level, every parent is final before any of its children are looked at.
+        for (size_t level = 0; level + 1 < this->levels.size(); level++) {
+            const size_t start = this->levels[level];
+            const size_t end = this->levels[level + 1];
+            const size_t numjobs = (end - start + TRANSFORM_UPDATECHUNK - 1) / TRANSFORM_UPDATECHUNK;
+            if (numjobs <= 1) { // Not worth a job.
+                this->updaterange(start, end);
+                continue;
+            }
+
+            struct work *work = (struct work *)malloc(sizeof(struct work) * numjobs);
+            ASSERT(work != NULL, "Failed to allocate memory for transform update work.\n");
+            OJob::Job **jobs = (OJob::Job **)malloc(sizeof(OJob::Job *) * numjobs);
+            ASSERT(jobs != NULL, "Failed to allocate memory for job list.\n");
+            OJob::Counter counter;
+            for (size_t i = 0; i < numjobs; i++) {
+                work[i] = (struct work) { .system = this, .start = start + i * TRANSFORM_UPDATECHUNK, .end = MIN(start + (i + 1) * TRANSFORM_UPDATECHUNK, end) };
+                jobs[i] = new OJob::Job(TransformSystem::updateworker, (uintptr_t)&work[i]);
+                jobs[i]->stack = OJob::Job::STACK_SMALL;
+                jobs[i]->counter = &counter;
+            }
+            OJob::kickjobs(numjobs, jobs);
+            counter.wait();
+            free(jobs);
+            free(work);
+        }
+    }
+
+}
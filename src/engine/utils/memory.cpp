@@ -0,0 +1,5 @@
+#include <engine/utils/memory.hpp>
+
+namespace OUtils {
+    FrameAllocator frameallocator = FrameAllocator(MEMORY_FRAMESIZE, "Frame Allocator");
+}
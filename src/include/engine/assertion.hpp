@@ -2,6 +2,7 @@
 #define _ENGINE__ASSERTION_HPP
 
 #include <stdio.h>
+#include <stdlib.h>
 
 // XXX: TODO: Forcibly end a job on assertion failure.
 // XXX: Consider safely ending a task whenever an assertion fails rather than crashing the entire engine.
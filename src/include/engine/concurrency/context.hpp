@@ -0,0 +1,53 @@
+#ifndef _ENGINE__CONCURRENCY__CONTEXT_HPP
+#define _ENGINE__CONCURRENCY__CONTEXT_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Execution contexts for fibres.
+// swapcontext() saves and restores the signal mask on every switch (a syscall each time), which we never need as fibres never touch signal masks. So on platforms we know we switch only the callee-saved registers ourselves, anywhere else (or when built with OMICRON_UCONTEXTFIBRES) we fall back to ucontext.
+#if !defined(OMICRON_UCONTEXTFIBRES) && (defined(__x86_64__) || defined(__aarch64__))
+#define JOB_ASMCONTEXT
+#else
+#include <ucontext.h>
+#endif
+
+namespace OJob {
+
+    struct context {
+#ifdef JOB_ASMCONTEXT
+        void *sp = NULL; // stack pointer of a suspended context, everything else lives on its stack
+#else
+        ucontext_t uc = { };
+#endif
+    };
+
+    // Prepare a context that will call entry(param) on the given stack the first time it's switched to. entry must never return.
+    void initcontext(struct OJob::context *ctx, void *stack, size_t size, void (*entry)(void *param), void *param);
+
+#ifdef JOB_ASMCONTEXT
+    extern "C" void ojob_switchcontext(struct OJob::context *from, struct OJob::context *to);
+#endif
+
+    // Suspend the current context into `from` and resume `to`.
+    static inline void switchcontext(struct OJob::context *from, struct OJob::context *to) {
+#ifdef JOB_ASMCONTEXT
+        ojob_switchcontext(from, to);
+#else
+        swapcontext(&from->uc, &to->uc);
+#endif
+    }
+
+    // Sanity check that a context has been initialised (or suspended) and can be switched to.
+    static inline bool validcontext(struct OJob::context *ctx) {
+#ifdef JOB_ASMCONTEXT
+        return ctx->sp != NULL;
+#else
+        (void)ctx;
+        return true; // nothing portable to check in a ucontext
+#endif
+    }
+
+}
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef _ENGINE__CONCURRENCY__GRAPH_HPP
+#define _ENGINE__CONCURRENCY__GRAPH_HPP
+
+#include <atomic>
+#include <engine/concurrency/job.hpp>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace OJob {
+
+    // A dependency graph of tasks (a frame graph, etc.). Each node declares which nodes must finish before it, and is only kicked once all of them have, so nothing ever sits on a fibre waiting on a counter just to express an ordering.
+    // Build it once (addnode()/depend()) and submit() it as often as needed, resubmission doesn't allocate anything beyond the jobs themselves (which come from the job pool).
+    // Usage:
+    //   size_t a = graph.addnode("Animate", animate, 0);
+    //   size_t b = graph.addnode("Cull", cull, 0);
+    //   graph.depend(b, a); // cull after animate
+    //   graph.submit(); graph.wait();
+    class TaskGraph {
+        public:
+            struct node {
+                const char *name = NULL; // expected to stay valid for the lifetime of the graph (shows up in Tracy and traces)
+                void (*entry)(uintptr_t param) = NULL;
+                uintptr_t param = 0;
+                enum OJob::Job::priority priority = OJob::Job::PRIORITY_NORMAL;
+                enum OJob::Job::stack stack = OJob::Job::STACK_LARGE;
+                std::vector<size_t> successors; // nodes that depend on this one
+                size_t indegree = 0; // number of nodes this one depends on
+
+                // Per-submission state.
+                std::atomic<size_t> pending = 0; // predecessors yet to finish
+                std::atomic<size_t> releasedby = SIZE_MAX; // predecessor that finished last (and so kicked us), SIZE_MAX for roots
+                uint64_t start = 0; // nanoseconds since the graph was submitted
+                uint64_t end = 0;
+                int worker = -1; // worker that ran the node
+
+                node(void) { }
+                node(const node &other) { // std::vector needs to be able to copy these around while the graph is being built
+                    this->name = other.name;
+                    this->entry = other.entry;
+                    this->param = other.param;
+                    this->priority = other.priority;
+                    this->stack = other.stack;
+                    this->successors = other.successors;
+                    this->indegree = other.indegree;
+                }
+            };
+        private:
+            std::vector<struct node> nodes;
+            std::vector<size_t> roots; // nodes with no predecessors, rebuilt by validate()
+            bool dirty = true; // graph changed since it was last validated
+            std::atomic<bool> running = false;
+            OJob::Counter counter;
+            uint64_t epoch = 0; // time of the last submission
+
+            struct runner {
+                TaskGraph *graph;
+                size_t node;
+            };
+            std::vector<struct runner> runners; // job parameters, one per node (stable storage so we don't allocate per submission)
+
+            static void run(OJob::Job *job);
+            void validate(void);
+            void kick(size_t *ready, size_t count);
+        public:
+            // Add a node to the graph, returns its index for use with depend().
+            size_t addnode(const char *name, void (*entry)(uintptr_t param), uintptr_t param, enum OJob::Job::priority priority = OJob::Job::PRIORITY_NORMAL, enum OJob::Job::stack stack = OJob::Job::STACK_LARGE);
+            // Declare that `node` may only start once `on` has finished.
+            void depend(size_t node, size_t on);
+            // Remove every node.
+            void clear(void);
+
+            size_t size(void) {
+                return this->nodes.size();
+            }
+
+            struct node *getnode(size_t node) {
+                ASSERT(node < this->nodes.size(), "Invalid task graph node %lu.\n", node);
+                return &this->nodes[node];
+            }
+
+            // Kick every node with no predecessors, the rest follow as their dependencies finish. The graph may not be modified or resubmitted until wait() returns.
+            void submit(void);
+            // Wait for every node of the last submission to finish (from a job or from outside the job system).
+            void wait(void);
+
+            // Walk back from the last node to finish through whichever predecessor released each node, this is the chain that determined how long the last submission took. Returns the number of nodes written to `path` (last node first), at most `max`.
+            size_t criticalpath(size_t *path, size_t max);
+            // Send the last submission's critical path to Tracy.
+            void tracecriticalpath(void);
+            // Write the last submission as a Chrome trace (chrome://tracing, Perfetto), with nodes on the critical path marked. Returns false if the file couldn't be written.
+            bool writetrace(const char *path);
+    };
+
+}
+
+#endif
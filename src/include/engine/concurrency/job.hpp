@@ -4,17 +4,22 @@
 #include <atomic>
 #include <stddef.h>
 #include <stdint.h>
+#include <engine/concurrency/context.hpp>
 #include <engine/utils.hpp>
 #include <engine/utils/queue.hpp>
 #include <tracy/Tracy.hpp>
-#ifdef __linux__
-#include <ucontext.h>
-#endif
 #include <vector>
 
 namespace OJob {
 
 #define COMPILER_BARRIER() asm volatile("" ::: "memory")
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX() asm volatile("pause" ::: "memory")
+#elif defined(__aarch64__)
+#define CPU_RELAX() asm volatile("yield" ::: "memory")
+#else
+#define CPU_RELAX() COMPILER_BARRIER()
+#endif
 
 #define JOB_MAXWORKERS 512 // probably unlikely a CPU will ever need 512 cores to run this engine, but this is of course a wild number that has no logical sense in being needed
 
@@ -81,11 +86,17 @@ namespace OJob {
                 PRIORITY_HIGH, // we need this done now! (this job will be placed into a priority queue and executed as soon as a spot is available)
                 PRIORITY_COUNT
             };
+            enum stack {
+                STACK_SMALL, // shallow leaf work (culling, parallel for chunks, etc.), lets us keep thousands of these around cheaply
+                STACK_LARGE, // anything that may recurse deeply or call into third party code (model loading, etc.)
+                STACK_COUNT
+            };
 
             std::atomic<bool> allgood = false;
 
             OJob::Fibre *fibre = NULL;
             enum priority priority = PRIORITY_NORMAL;
+            enum stack stack = STACK_LARGE; // class of fibre stack this job runs on, only opt into small stacks if you know how deep the job goes
             std::atomic<bool> running = false;
             OJob::Counter *counter = NULL;
             size_t id = 0;
@@ -109,7 +120,28 @@ namespace OJob {
     };
 
 #define FIBRE_NAMELEN 64
-#define FIBRE_COUNT 128 // total fibres
+
+// Fibre stacks are reserved up front but only committed as they're touched, with a guard page underneath to catch overflows.
+#ifndef FIBRE_SMALLSTACK
+#define FIBRE_SMALLSTACK (256 * 1024) // 256KB
+#endif
+#ifndef FIBRE_LARGESTACK
+#define FIBRE_LARGESTACK (8 * 1024 * 1024) // 8MB (same as the default thread stack)
+#endif
+
+// Fibre pool bounds per stack class, the pool grows on demand up to the maximum and hands surplus stacks back to the OS when idle. Maximums must be a power of 2.
+#ifndef FIBRE_SMALLMIN
+#define FIBRE_SMALLMIN 64
+#endif
+#ifndef FIBRE_SMALLMAX
+#define FIBRE_SMALLMAX 4096
+#endif
+#ifndef FIBRE_LARGEMIN
+#define FIBRE_LARGEMIN 16
+#endif
+#ifndef FIBRE_LARGEMAX
+#define FIBRE_LARGEMAX 512
+#endif
 
     class Mutex;
 
@@ -124,11 +156,10 @@ namespace OJob {
             std::atomic<OJob::Counter *> tounref = NULL;
             OJob::Job *job = NULL;
 
-            void *stack = NULL;
-#ifdef __linux__
-            static constexpr ucontext_t INVALIDFIBRE = { };
-            ucontext_t ctx = INVALIDFIBRE;
-#endif
+            enum OJob::Job::stack stackclass = OJob::Job::STACK_LARGE;
+            void *stack = NULL; // base of the mapping (guard page included)
+            size_t stacksize = 0; // size of the mapping (guard page included)
+            struct OJob::context ctx;
 
     };
 
@@ -147,7 +178,7 @@ namespace OJob {
             void join(void) { // Ask that all jobs connected to this fence be completed, while also letting them continue.
                 Counter *counter = NULL;
                 if (this->counter.waitlist.size() > 0) {
-                    counter = this->counter.waitlist[0]->job->counter; // Get a reference to the counter of the first job waiting on the fence. XXX: This means that we can't wait properly if the jobs have any different counters.
+                    counter = this->counter.waitlist[0]->job->counter; // Get a reference to the counter of the first job waiting on the fence. XXX: This means that we can't wait properly if the jobs have any different counters. Prefer an OJob::TaskGraph for ordering work between jobs.
                 }
                 this->counter.unreference(); // Unreference the counter.
                 if (counter != NULL) {
@@ -162,25 +193,120 @@ namespace OJob {
 
     extern thread_local OJob::Fibre *currentfibre;
 
+#define JOB_DEQUESIZE 4096 // per-worker local job deque size (per priority), anything kicked past this overflows to the global queues
+
+#define JOB_SPINCOUNT 256 // number of times an idle worker polls for work before parking itself
+
+    // Lets threads sleep until "something changed" without a mutex, waking only one sleeper per notify (no thundering herd).
+    // Usage: key = prepare(); recheck condition; if satisfied cancel(), otherwise wait(key).
+    class EventCount {
+        private:
+            std::atomic<uint32_t> epoch; // futex word, bumped on every notify that has someone to wake
+            std::atomic<uint32_t> waiters; // threads between prepare() and the end of wait()/cancel()
+        public:
+            std::atomic<size_t> unparks; // number of sleeping threads actually woken
+
+            EventCount(void) {
+                this->epoch.store(0);
+                this->waiters.store(0);
+                this->unparks.store(0);
+            }
+
+            // Announce intent to sleep, the returned key must be passed to wait().
+            uint32_t prepare(void) {
+                this->waiters.fetch_add(1, std::memory_order_seq_cst);
+                return this->epoch.load(std::memory_order_seq_cst);
+            }
+
+            // Condition was satisfied after prepare(), don't sleep after all.
+            void cancel(void) {
+                this->waiters.fetch_sub(1, std::memory_order_relaxed);
+            }
+
+            // Sleep until notified (returns immediately if a notify happened since prepare()).
+            void wait(uint32_t key);
+            // Wake at most `count` waiters, cheap when nobody is waiting.
+            void notify(size_t count = 1);
+            // Wake every waiter.
+            void notifyall(void);
+
+            uint32_t getwaiters(void) {
+                return this->waiters.load(std::memory_order_relaxed);
+            }
+    };
+
     struct worker {
         int id = 0;
         std::atomic<int> state; // current worker state
         OJob::Fibre *current = NULL; // current fibre
         OJob::Fibre *prev = NULL;
         pthread_t thread; // thread running the worker
-        ucontext_t ctx;
+        struct OJob::context ctx; // scheduler context, fibres switch back to this when they yield
+        OUtils::WorkStealingDeque deques[Job::PRIORITY_COUNT]; // jobs kicked from this worker, other workers steal from here when they run dry
+        std::atomic<size_t> parks = 0; // number of times this worker went to sleep waiting for work
+        std::atomic<size_t> spurious = 0; // number of times this worker woke up only to find nothing to do
+    };
+
+    // Job system counters, for profiling scheduler overhead.
+    struct stats {
+        size_t parks; // workers going to sleep for lack of work
+        size_t unparks; // sleeping workers woken for new work
+        size_t spurious; // wakeups that found no work waiting
+        size_t fibreparks; // waits for a free fibre
+        size_t fibres[Job::STACK_COUNT]; // fibres (with a stack) currently allocated per stack class
+        size_t queuedepth[Job::PRIORITY_COUNT]; // jobs waiting to run (global queues and worker deques)
+        size_t idle; // workers currently asleep
     };
 
     extern thread_local OJob::worker *currentworker;
 
-    extern OUtils::MPMCQueue freefibres;
+    extern OUtils::MPMCQueue freefibres[Job::STACK_COUNT];
 
     extern struct OJob::worker workers[JOB_MAXWORKERS];
     extern size_t numworkers;
 
-    // Jobs are ordered by a queue of priorities
+    // One zero initialised T per worker, created the first time any worker asks for theirs (workers only exist after OJob::init(), so we know how many there are by then).
+    // T has to be fine starting out as zeroed memory, as it's never constructed or destructed.
+    template <typename T>
+    class PerWorker {
+        private:
+            std::atomic<T *> items = NULL;
+        public:
+            ~PerWorker(void) {
+                free(this->items.load());
+            }
+
+            // The calling worker's T, NULL from outside the job system.
+            T *get(void) {
+                if (OJob::currentworker == NULL) {
+                    return NULL;
+                }
+
+                T *items = this->items.load(std::memory_order_acquire);
+                if (items == NULL) {
+                    T *fresh = (T *)calloc(OJob::numworkers, sizeof(T));
+                    ASSERT(fresh != NULL, "Failed to allocate per worker state.\n");
+                    if (this->items.compare_exchange_strong(items, fresh, std::memory_order_acq_rel)) {
+                        items = fresh;
+                    } else {
+                        free(fresh); // Another worker beat us to it.
+                    }
+                }
+                return &items[OJob::currentworker->id];
+            }
+
+            // Every worker's T (numworkers of them), NULL if no worker has asked for theirs yet.
+            T *all(void) {
+                return this->items.load(std::memory_order_acquire);
+            }
+    };
+
+    // Jobs are ordered by a queue of priorities (global injection queues for jobs kicked from outside of the worker threads)
     extern OUtils::MPMCQueue queues[Job::PRIORITY_COUNT];
 
+    // Place a job onto a run queue (local deque of the current worker if there is one) and wake a worker to pick it up. Does not touch the job's counter.
+    void schedule(OJob::Job *job);
+
     // Concurrency synchronisation for when we expect to only wait for small amounts of time with heavy competition.
     class Spinlock {
         private:
@@ -233,7 +359,7 @@ namespace OJob {
 
 
                         ASSERT(fibre != NULL, "Invalid fibre on waitlist.\n");
-                        ASSERT(fibre->id < FIBRE_COUNT, "Invalid fibre ID %lu. Must be corrupt!.\n", fibre->id);
+                        ASSERT(fibre->stack != NULL, "Fibre %lu has no stack. Must be corrupt!.\n", fibre->id);
                         OJob::Job *job = fibre->job;
                         ASSERT(job != NULL, "Invalid job from waitlist for fibre %lu.\n", fibre->id); // A job this fibre encapsulated exited before a waiting fibre was released.
                         ASSERT(job->id < id.load(), "Invalid job ID %lu. Must be corrupt!.\n", fibre->id);
@@ -247,7 +373,7 @@ namespace OJob {
                         // printf("[%ld] rescheduling a job %lu.\n", utils_getcounter(), job->id);
 
                         COMPILER_BARRIER(); // Keep flow coherent.
-                        queues[job->priority].push(job); // Essentially act like a single file line, leading jobs back into the queue one at a time to prevent wasting time rescheduling everything only for one to actually do anything with that opportunity
+                        OJob::schedule(job); // Essentially act like a single file line, leading jobs back into the queue one at a time to prevent wasting time rescheduling everything only for one to actually do anything with that opportunity
                     } else {
                         this->heldby = NULL;
                         this->ref.store(false);
@@ -319,7 +445,7 @@ namespace OJob {
         return TEMP; \
 
     void kickjob(OJob::Job *job);
-    // queue a batch of jobs
+    // queue a batch of jobs (one counter reference per run of jobs sharing a counter, one queue reservation per priority and at most one wakeup per job)
     void kickjobs(int count, OJob::Job *jobs[]);
     // call job_kickjob and wait for completion using job_waitcounter
     void kickjobwait(OJob::Job *job);
@@ -327,7 +453,16 @@ namespace OJob {
     void kickjobswait(int count, OJob::Job *jobs[]);
     void yield(OJob::Fibre *fibre, enum OJob::Job::status status);
 
-    void init(void);
+    // Split [start, end) into chunks of `grain` and run `fn` over each chunk as a batch of jobs, returning once all chunks are done.
+    void parallelfor(size_t start, size_t end, size_t grain, void (*fn)(size_t start, size_t end, uintptr_t param), uintptr_t param, enum OJob::Job::priority priority = OJob::Job::PRIORITY_NORMAL);
+
+    // Snapshot the job system counters.
+    void getstats(struct stats *stats);
+    // Send the job system counters to Tracy (call once per frame).
+    void plotstats(void);
+
+    // Start the job system with `workers` worker threads, one per core if 0.
+    void init(size_t workers = 0);
     void destroy(void);
 
 }
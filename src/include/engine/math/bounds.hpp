@@ -1,6 +1,7 @@
 #ifndef _ENGINE__BOUNDS_HPP
 #define _ENGINE__BOUNDS_HPP
 
+#include <engine/math/cull.hpp>
 #include <engine/math/math.hpp>
 #include <engine/matrix.hpp>
 #include <tracy/Tracy.hpp>
@@ -104,7 +105,7 @@ namespace OMath {
                 const glm::vec4 zb = mtx[2] * this->max.z;
 
                 // Transform min and max
-                return AABB(glm::min(xa, xb) + glm::min(ya, yb) + glm::min(za, zb) + mtx[3], max = glm::max(xa, xb) + glm::max(ya, yb) + glm::max(za, zb) + mtx[3]);
+                return AABB(glm::min(xa, xb) + glm::min(ya, yb) + glm::min(za, zb) + mtx[3], glm::max(xa, xb) + glm::max(ya, yb) + glm::max(za, zb) + mtx[3]);
             }
 
             constexpr bool operator ==(AABB &rhs) {
@@ -239,6 +240,16 @@ namespace OMath {
                 this->update(mtx);
             }
 
+            // Transpose our planes for the batch culling kernels.
+            void getcullplanes(struct cullplanes *out) {
+                for (size_t i = 0; i < planes::COUNT; i++) {
+                    out->x[i] = this->planes[i].normal.x;
+                    out->y[i] = this->planes[i].normal.y;
+                    out->z[i] = this->planes[i].normal.z;
+                    out->d[i] = this->planes[i].distance;
+                }
+            }
+
             bool intersectnearplane(Sphere sphere) {
                 const Plane plane = this->planes[planes::NEAR];
                 const float distance = glm::dot(plane.normal, sphere.pos) + plane.distance;
@@ -295,8 +306,15 @@ namespace OMath {
             }
 
             size_t testaabb(AABB aabb) {
+                uint8_t plane = 0;
+                return this->testaabb(aabb, &plane);
+            }
+
+            // Plane coherent test: start with the plane that rejected this box last time (*lastplane), and remember whichever rejects it this time. Something outside one frame is usually outside the next frame for the same reason, so a rejection mostly takes one plane instead of up to six.
+            size_t testaabb(AABB aabb, uint8_t *lastplane) {
                 size_t result = intersection::INSIDE;
-                for (size_t i = 0; i < planes::COUNT; i++) {
+                size_t i = *lastplane;
+                for (size_t n = 0; n < planes::COUNT; n++, i = i + 1 == planes::COUNT ? 0 : i + 1) {
                     Plane plane = this->planes[i];
 
                     AABB representation = aabb;
@@ -314,6 +332,7 @@ namespace OMath {
                         representation.max.z = aabb.min.z;
                     }
                     if ((glm::dot(plane.normal, representation.min) + plane.distance) < 0) {
+                        *lastplane = i;
                         return intersection::OUTSIDE;
                     }
                     if ((glm::dot(plane.normal, representation.max) + plane.distance) < 0) {
@@ -0,0 +1,134 @@
+#ifndef _ENGINE__MATH__CULL_HPP
+#define _ENGINE__MATH__CULL_HPP
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__AVX__) || defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace OMath {
+
+    // Batch bounding sphere culling over SoA data. No glm in here, the kernels only ever see flat float arrays.
+    // The widest kernel is picked at compile time: AVX (8 lanes, build with AVX2=1), SSE2 (4 lanes, always there on x86-64), NEON (4 lanes, always there on aarch64), otherwise plain scalar code.
+
+#if defined(__AVX__)
+#define CULL_LANES 8
+#elif defined(__SSE2__) || defined(_M_X64) || defined(__ARM_NEON)
+#define CULL_LANES 4
+#else
+#define CULL_LANES 1
+#endif
+#define CULL_PADDING 8 // sphere arrays are sized to a multiple of this (and 32 byte aligned), so no kernel needs a tail loop
+#define CULL_INVALIDRADIUS (-INFINITY) // radius of an empty slot (fails every plane)
+#define CULL_ALWAYSRADIUS (INFINITY) // radius of something that should never be culled (passes every plane)
+
+    // The six frustum planes transposed (normal x, y, z and distance of each plane) so a plane's coefficients can be broadcast straight into a register.
+    struct cullplanes {
+        float x[6];
+        float y[6];
+        float z[6];
+        float d[6];
+    };
+
+    // Test `count` spheres (x, y, z, r) against all six planes. The index of every sphere at least partly inside is written to `visible` (in order), returning how many were.
+    // count must be a multiple of CULL_PADDING and the arrays aligned to 32 bytes. A sphere is outside if it is entirely behind any plane (dot(n, p) + d < -r), same as Frustum::testsphere().
+    // Spheres are tested CULL_PADDING at a time, a block stops as soon as none of it is left inside. lastplane holds one plane per block: the one that rejected the whole block last time, which is tried first and updated whenever a block is rejected.
+    static inline size_t cullspheres(const struct cullplanes *planes, const float *x, const float *y, const float *z, const float *r, size_t count, uint8_t *lastplane, uint16_t *visible) {
+        size_t num = 0;
+        for (size_t i = 0; i < count; i += CULL_PADDING) {
+            uint8_t *last = &lastplane[i / CULL_PADDING];
+            size_t p = *last;
+            uint32_t mask;
+#if CULL_LANES == 8
+            const __m256 px = _mm256_load_ps(x + i);
+            const __m256 py = _mm256_load_ps(y + i);
+            const __m256 pz = _mm256_load_ps(z + i);
+            const __m256 pr = _mm256_load_ps(r + i);
+            __m256 in = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+            for (size_t n = 0; n < 6; n++, p = p + 1 == 6 ? 0 : p + 1) {
+                __m256 dist = _mm256_add_ps(_mm256_mul_ps(px, _mm256_set1_ps(planes->x[p])), _mm256_set1_ps(planes->d[p]));
+                dist = _mm256_add_ps(_mm256_mul_ps(py, _mm256_set1_ps(planes->y[p])), dist);
+                dist = _mm256_add_ps(_mm256_mul_ps(pz, _mm256_set1_ps(planes->z[p])), dist);
+                in = _mm256_and_ps(in, _mm256_cmp_ps(_mm256_add_ps(dist, pr), _mm256_setzero_ps(), _CMP_GE_OQ)); // dist >= -r
+                if (_mm256_testz_ps(in, in)) { // nothing left inside
+                    *last = p;
+                    break;
+                }
+            }
+            mask = _mm256_movemask_ps(in);
+#elif CULL_LANES == 4 && !defined(__ARM_NEON)
+            const __m128 px0 = _mm_load_ps(x + i), px1 = _mm_load_ps(x + i + 4);
+            const __m128 py0 = _mm_load_ps(y + i), py1 = _mm_load_ps(y + i + 4);
+            const __m128 pz0 = _mm_load_ps(z + i), pz1 = _mm_load_ps(z + i + 4);
+            const __m128 pr0 = _mm_load_ps(r + i), pr1 = _mm_load_ps(r + i + 4);
+            __m128 in0 = _mm_castsi128_ps(_mm_set1_epi32(-1));
+            __m128 in1 = in0;
+            for (size_t n = 0; n < 6; n++, p = p + 1 == 6 ? 0 : p + 1) {
+                const __m128 nx = _mm_set1_ps(planes->x[p]), ny = _mm_set1_ps(planes->y[p]), nz = _mm_set1_ps(planes->z[p]), d = _mm_set1_ps(planes->d[p]);
+                __m128 dist0 = _mm_add_ps(_mm_mul_ps(px0, nx), d);
+                __m128 dist1 = _mm_add_ps(_mm_mul_ps(px1, nx), d);
+                dist0 = _mm_add_ps(_mm_mul_ps(py0, ny), dist0);
+                dist1 = _mm_add_ps(_mm_mul_ps(py1, ny), dist1);
+                dist0 = _mm_add_ps(_mm_mul_ps(pz0, nz), dist0);
+                dist1 = _mm_add_ps(_mm_mul_ps(pz1, nz), dist1);
+                in0 = _mm_and_ps(in0, _mm_cmpge_ps(_mm_add_ps(dist0, pr0), _mm_setzero_ps())); // dist >= -r
+                in1 = _mm_and_ps(in1, _mm_cmpge_ps(_mm_add_ps(dist1, pr1), _mm_setzero_ps()));
+                if (!_mm_movemask_ps(_mm_or_ps(in0, in1))) {
+                    *last = p;
+                    break;
+                }
+            }
+            mask = _mm_movemask_ps(in0) | (_mm_movemask_ps(in1) << 4);
+#elif CULL_LANES == 4
+            const float32x4_t px0 = vld1q_f32(x + i), px1 = vld1q_f32(x + i + 4);
+            const float32x4_t py0 = vld1q_f32(y + i), py1 = vld1q_f32(y + i + 4);
+            const float32x4_t pz0 = vld1q_f32(z + i), pz1 = vld1q_f32(z + i + 4);
+            const float32x4_t pr0 = vld1q_f32(r + i), pr1 = vld1q_f32(r + i + 4);
+            uint32x4_t in0 = vdupq_n_u32(UINT32_MAX);
+            uint32x4_t in1 = in0;
+            for (size_t n = 0; n < 6; n++, p = p + 1 == 6 ? 0 : p + 1) {
+                float32x4_t dist0 = vmlaq_n_f32(vdupq_n_f32(planes->d[p]), px0, planes->x[p]);
+                float32x4_t dist1 = vmlaq_n_f32(vdupq_n_f32(planes->d[p]), px1, planes->x[p]);
+                dist0 = vmlaq_n_f32(dist0, py0, planes->y[p]);
+                dist1 = vmlaq_n_f32(dist1, py1, planes->y[p]);
+                dist0 = vmlaq_n_f32(dist0, pz0, planes->z[p]);
+                dist1 = vmlaq_n_f32(dist1, pz1, planes->z[p]);
+                in0 = vandq_u32(in0, vcgeq_f32(vaddq_f32(dist0, pr0), vdupq_n_f32(0.0f))); // dist >= -r
+                in1 = vandq_u32(in1, vcgeq_f32(vaddq_f32(dist1, pr1), vdupq_n_f32(0.0f)));
+                if (!vmaxvq_u32(vorrq_u32(in0, in1))) {
+                    *last = p;
+                    break;
+                }
+            }
+            // No movemask on NEON, narrow each lane down to one bit ourselves.
+            static const uint32_t bits0[4] = { 1, 2, 4, 8 };
+            static const uint32_t bits1[4] = { 16, 32, 64, 128 };
+            mask = vaddvq_u32(vandq_u32(in0, vld1q_u32(bits0))) | vaddvq_u32(vandq_u32(in1, vld1q_u32(bits1)));
+#else
+            mask = (1 << CULL_PADDING) - 1;
+            for (size_t n = 0; n < 6; n++, p = p + 1 == 6 ? 0 : p + 1) {
+                for (size_t j = 0; j < CULL_PADDING; j++) {
+                    const float dist = x[i + j] * planes->x[p] + y[i + j] * planes->y[p] + z[i + j] * planes->z[p] + planes->d[p];
+                    mask &= ~((uint32_t)(dist + r[i + j] < 0.0f) << j);
+                }
+                if (!mask) {
+                    *last = p;
+                    break;
+                }
+            }
+#endif
+            while (mask) { // compact the lanes that survived into the index list
+                visible[num++] = i + __builtin_ctz(mask);
+                mask &= mask - 1;
+            }
+        }
+        return num;
+    }
+}
+
+#endif
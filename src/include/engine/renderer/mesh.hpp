@@ -4,6 +4,7 @@
 #include <assimp/scene.h>
 #include <engine/renderer/material.hpp>
 #include <engine/renderer/renderer.hpp>
+#include <engine/resources/assetcache.hpp>
 #include <engine/resources/model.hpp>
 
 namespace ORenderer {
@@ -25,10 +26,14 @@ namespace ORenderer {
             struct buffer indexbuffer;
 
             Material material;
+            OUtils::Handle<OResource::Resource> textures[3]; // shared material textures (base, normal, metallic roughness) we hold references on
 
             Mesh(void) { };
             Mesh(OResource::Model::mesh *mesh, OResource::Model::material *material);
 
+            // Free the mesh's buffers and let go of its textures. Meshes are copied around by value, so this is never done implicitly.
+            void destroy(void);
+
             // Generate a vertex layout descriptor for the specified binding following the attributes of the mesh class' vertex structure.
             static struct ORenderer::vertexlayout getlayout(size_t binding) {
                 struct ORenderer::vertexlayout layout = { };
@@ -60,7 +65,19 @@ namespace ORenderer {
 
             Model(void) { };
             Model(const char *path);
+
+            // Free everything the model holds on the GPU. Nothing in flight may still be drawing it.
+            void destroy(void);
+            // Memory held on either side (textures are not counted on the GPU side yet, we don't know their sizes once uploaded).
+            size_t cpusize(void);
+            size_t gpusize(void);
+
+            // Residency callbacks for the model cache, the param is the source resource.
+            static void *residentload(const char *path, uintptr_t param, size_t *cpusize, size_t *gpusize);
+            static void residentunload(void *ptr, uintptr_t param);
     };
+
+    extern OResource::AssetCache models; // content addressed, models with identical files are shared whatever their paths
 }
 
 #endif
@@ -102,7 +102,7 @@ namespace ORenderer {
                     struct OResource::RPak::tableentry entry = res->rpakentry;
                     void *code = malloc(entry.uncompressedsize);
                     ASSERT(code != NULL, "Failed to allocate memory for shader.\n");
-                    ASSERT(res->rpak->read(path, code, entry.uncompressedsize, 0) > 0, "Failed to load shader '%s'.\n", path);
+                    ASSERT(res->rpak->read(&res->rpakentry, code, entry.uncompressedsize, 0) > 0, "Failed to load shader '%s'.\n", path);
                     this->size = entry.uncompressedsize;
                     this->type = type;
                     this->code = code;
@@ -0,0 +1,80 @@
+#ifndef _ENGINE__RESOURCES__ASSETCACHE_HPP
+#define _ENGINE__RESOURCES__ASSETCACHE_HPP
+
+#include <engine/concurrency/job.hpp>
+#include <engine/resources/resource.hpp>
+#include <unordered_map>
+#include <vector>
+
+namespace OResource {
+
+#define ASSETCACHE_KEYLEN 64 // longest content key ("kind:hash*")
+
+    // Loaded assets keyed by what's in the file rather than where it is: each source path is hashed once (ResourceManager::contenthash()) and the payload is registered under its contents ("model:<hash>*"), so the same file reached through any number of paths is only ever loaded once.
+    // Payloads live with the resource manager's residency system (reference counted, evicted when over budget and unreferenced, reloaded on demand), the cache just decides what they're called and makes sure a path is only loaded by one job at a time.
+    // Usage:
+    //   AssetCache models = AssetCache("model", ResourceManager::CATEGORY_MODEL, loadmodel, unloadmodel);
+    //   OUtils::Handle<Resource> model = models.get("misc/test.omod"); // blocks, referenced
+    //   models.request("misc/test.omod", ready, (uintptr_t)instance); // never blocks, ready() is handed a referenced payload once it's loaded
+    // The loader is given the source Resource * as its param.
+    class AssetCache {
+        public:
+            // Called with the cache locked (so keep it short and don't call back into the cache), from whichever thread finished the load or straight from request() if the payload was already resident. The reference on the payload is the callee's.
+            typedef void (*readyfunc)(OUtils::Handle<Resource> asset, uintptr_t param);
+
+            struct stats {
+                size_t requests; // get() and request() calls
+                size_t hits; // payload already resident
+                size_t joined; // requests that joined a load already in flight for the same path
+                size_t loads; // loads started
+                size_t shared; // loads that found their contents already loaded through another path
+                size_t inflight; // loads in flight right now
+            };
+        private:
+            struct waiter {
+                readyfunc ready;
+                uintptr_t param;
+            };
+
+            // One per source path.
+            struct entry {
+                AssetCache *cache;
+                Resource *source;
+                OUtils::Handle<Resource> asset = RESOURCE_INVALIDHANDLE; // content addressed payload, valid once loaded (may since have been evicted)
+                bool loading = false;
+                bool first = false; // the load in flight is the path's first
+                std::vector<struct waiter> waiters;
+            };
+
+            const char *kind;
+            enum ResourceManager::category category;
+            ResourceManager::loadfunc load;
+            ResourceManager::unloadfunc unload;
+
+            OJob::Mutex mutex;
+            std::unordered_map<Resource *, struct entry *> entries;
+            struct stats counters = { };
+
+            struct entry *getentry(Resource *source);
+            OUtils::Handle<Resource> resolve(Resource *source, bool first);
+            static void loadworker(OJob::Job *job);
+        public:
+            AssetCache(const char *kind, enum ResourceManager::category category, ResourceManager::loadfunc load, ResourceManager::unloadfunc unload);
+            ~AssetCache(void);
+
+            // Resolve a path to its source resource, registering it as a filesystem file if no RPak has it. The path on the result stays valid for good (interned).
+            OUtils::Handle<Resource> source(const char *path);
+
+            // Get a referenced payload, loading it on the calling thread if need be.
+            OUtils::Handle<Resource> get(const char *path);
+            // Get a referenced payload without ever blocking on its loading: ready() is called right away if it's resident, otherwise once a job has loaded it. Any number of requests for the same path share the one load.
+            void request(const char *path, readyfunc ready, uintptr_t param);
+            // Forget a request that hasn't been answered yet. Returns false if ready() has already been called for it (it won't be after this returns either way).
+            bool cancel(const char *path, uintptr_t param);
+
+            void getstats(struct stats *stats);
+    };
+
+}
+
+#endif
@@ -7,12 +7,47 @@
 #include <stdio.h>
 
 namespace OResource {
+
+#define ASYNCIO_QUEUEDEPTH 256 // io_uring submission queue entries
+#define ASYNCIO_INFLIGHT 32 // reads handed to the kernel (or the reader threads) at once, everything else waits with the scheduler where it can still be reordered or cancelled
+#define ASYNCIO_READERS 4 // threads servicing reads when io_uring isn't available
+#define ASYNCIO_BATCHSTACK 16 // batches up to this size keep their requests on the stack
+#define ASYNCIO_COALESCE 16 // most requests merged into a single read
+#define ASYNCIO_COALESCESIZE (1024 * 1024) // largest merged read
+#define ASYNCIO_LATENCYSAMPLES 1024 // completed reads kept for latency percentiles
+
+    // Disk reads are handed off to an I/O service so that no worker ever blocks on the disk: the calling job sleeps on a counter until the service has finished its reads, and its worker moves on to other jobs in the meantime.
+    // On Linux the service is an io_uring (a single thread reaping completions, submission happens straight from the caller), anywhere it can't be set up (old kernels, seccomp, OMICRON_NOIOURING builds) a small pool of pread() threads takes its place.
+    // Files stay open across requests, RPak reads go through the archive's descriptor and filesystem resources keep theirs on the resource.
+    // Only ASYNCIO_INFLIGHT reads are outstanding at a time, the rest are held by the scheduler and dispatched by priority, then deadline (anything past its deadline jumps to critical), then age. Requests dispatched together that are adjacent in the same file (neighbouring files in an RPak, successive mip levels) are merged into one read.
+    // A per-frame bandwidth budget (setbudget()/frame()) holds back everything but critical and overdue reads once it's been spent.
     class AsyncIO {
         public:
             enum error {
                 SUCCESS,
                 SUSPENDED,
-                FAILED
+                FAILED,
+                CANCELLED // cancelled before it was ever read
+            };
+
+            enum priority {
+                PRIORITY_CRITICAL, // something is waiting on this right now (ignores the bandwidth budget)
+                PRIORITY_HIGH, // visible (mips on screen, nearby objects)
+                PRIORITY_NORMAL,
+                PRIORITY_BACKGROUND, // prefetch, nobody minds if it's late
+                PRIORITY_COUNT
+            };
+
+            // I/O scheduler counters.
+            struct stats {
+                size_t pending; // waiting on the scheduler
+                size_t inflight; // reads (after merging) handed to the kernel or reader threads
+                size_t completed;
+                size_t cancelled;
+                size_t coalesced; // requests merged into another's read
+                size_t bytes; // read this frame
+                size_t budget; // per-frame budget (0 is unlimited)
+                uint64_t latency[3]; // p50, p95 and p99 of submission to completion over the last ASYNCIO_LATENCYSAMPLES reads (nanoseconds)
             };
 
             class Promise {
@@ -28,57 +63,79 @@ namespace OResource {
             struct work {
                 OUtils::Handle<Resource> resource;
                 void *buffer = NULL;
+                bool mapped = false; // buffer points into a mapped RPak rather than being ours to free (only ever for callback loads)
                 bool hascallback;
                 size_t offset;
                 size_t size;
                 uint8_t *error;
                 void (*callback)(struct work *work);
+                void **out = NULL; // where load() hands the buffer back
+                enum priority priority = PRIORITY_NORMAL;
+                uint64_t deadline = 0;
             };
 
-            static void loadwrapper(OJob::Job *job) {
-                ZoneScopedN("AsyncIO File Load");
-                struct work *work = (struct work *)job->param;
-
-                RESOURCE_GUARANTEE(work->resource, // Guarantee exclusive access to this resource.
+            // A single read as seen by the I/O service.
+            struct request {
+                int fd;
+                size_t offset; // absolute offset in the file
+                size_t size;
+                uint8_t *buffer;
+                size_t done; // bytes read so far (reads may come back short and get resubmitted for the rest)
+                int error; // errno of a failed read, 0 on success
+                OJob::Counter *counter; // unreferenced once the read has finished (successfully or not)
+                enum priority priority;
+                uint64_t deadline; // CLOCK_MONOTONIC nanoseconds (see now()), 0 for none
+                size_t tag; // what cancel() matches on (the resource ID for reads from readbatch())
+                uint64_t submitted; // filled in by submit()
+                uint64_t sequence; // submission order, breaks ties
+            };
 
-                    if (work->size != SIZE_MAX) {
-                        work->buffer = malloc(work->size);
-                        ASSERT(work->buffer != NULL, "Failed to allocate buffer memory for async file load of %s.\n", work->resource->path);
-                    }
-                    if (work->resource->type == Resource::SOURCE_OSFS) {
-                        FILE *f = fopen(work->resource->path, "r");
-                        ASSERT(f != NULL, "Failed to load file %s.\n", work->resource->path);
-                        ASSERT(!fseek(f, 0, SEEK_END), "Failed to seek end of file to figure out its size of %s.\n", work->resource->path);
-                        size_t size = ftell(f);
-                        if (work->size != SIZE_MAX) {
-                            ASSERT(size - work->offset != 0, "Specified offset is at the end of the file for %s.\n", work->resource->path);
-                        }
-                        ASSERT(!fseek(f, work->offset, SEEK_SET), "Failed to seek to specified offset for %s.\n", work->resource->path);
-                        if (work->size != SIZE_MAX) {
-                            ASSERT(fread(work->buffer, work->size, 1, f), "Failed to read data from file %s.\n", work->resource->path);
-                        } else {
-                            work->buffer = malloc(size - work->offset);
-                            ASSERT(work->buffer != NULL, "Failed to allocate buffer memory for async file load of %s.\n", work->resource->path);
-                            work->size = size - work->offset; // update the size to now include the actual buffer size
-                            ASSERT(fread(work->buffer, size - work->offset, 1, f), "Failed to read data from file %s.\n", work->resource->path);
-                        }
-                        fclose(f);
-                        if (work->error != NULL) {
-                            *work->error = SUCCESS;
-                        }
-                    }
-                    if (work->hascallback) {
-                        ASSERT(work->callback != NULL, "Callback async file load for %s was requested but no callback provided!\n", work->resource->path);
-                        work->callback(work); // Run callback
-                        free(work->buffer);
-                        free(work);
-                    }
+            // One read of a batch.
+            struct batchread {
+                OUtils::Handle<Resource> resource;
+                size_t offset;
+                size_t size; // SIZE_MAX reads to the end of the file (updated to the size actually read)
+                void *buffer; // NULL has one allocated (for the caller to free)
+                uint8_t error; // SUCCESS, FAILED or CANCELLED
+                enum priority priority = PRIORITY_NORMAL;
+                uint64_t deadline = 0; // CLOCK_MONOTONIC nanoseconds (see now()), 0 for none
+            };
 
-                ); // RESOURCE_GUARANTEE
+            // Start the I/O service. Reads issued before this (or after destroy()) are done in place by the caller.
+            static void init(void);
+            // Stop the I/O service, every read must have completed by now.
+            static void destroy(void);
+            // Is the service backed by io_uring (rather than reader threads)?
+            static bool uring(void);
+
+            // Queue reads with the service. Each request's counter must already have been referenced for it.
+            static void submit(struct request **requests, size_t count);
+            // Read every entry of a batch and sleep the calling job until they're all done. All of them are queued at once.
+            static void readbatch(struct batchread *reads, size_t count);
+            // Cancel every read of a resource that hasn't been dispatched yet (reads already in flight finish as normal). Returns the number of reads cancelled.
+            static size_t cancel(OUtils::Handle<Resource> resource);
+            static size_t cancel(size_t tag);
+
+            // Bytes the scheduler may dispatch per frame, 0 for no limit.
+            static void setbudget(size_t bytes);
+            // Start a new frame's budget (call once per frame).
+            static void frame(void);
+            // Current time on the clock deadlines are measured against.
+            static uint64_t now(void);
+
+            // Snapshot the scheduler counters.
+            static void getstats(struct stats *stats);
+            // Send the scheduler counters to Tracy (call once per frame).
+            static void plotstats(void);
+
+            // Carry out a load request (from its job, or directly for loadwait()).
+            static void loadwork(struct work *work);
+            static void loadwrapper(OJob::Job *job) {
+                loadwork((struct work *)job->param);
             }
 
             // Request a file to be loaded and sleep the calling job until the file has been loaded (Blocking, but will wake the caller when done).
-            static void loadwait(OUtils::Handle<Resource> resource, void **buffer, size_t offset, size_t size, uint8_t *error = NULL) {
+            static void loadwait(OUtils::Handle<Resource> resource, void **buffer, size_t offset, size_t size, uint8_t *error = NULL, enum priority priority = PRIORITY_CRITICAL, uint64_t deadline = 0) {
                 ZoneScopedN("AsyncIO File Load Wait");
                 ASSERT(buffer != NULL, "No buffer for output data provided.\n");
                 ASSERT(size > 0, "Buffer cannot have the size 0.\n");
@@ -89,40 +146,42 @@ namespace OResource {
                 work.hascallback = false;
                 work.offset = offset;
                 work.error = error;
+                work.priority = priority;
+                work.deadline = deadline;
 
-                OJob::Job *job = new OJob::Job(loadwrapper, (uintptr_t)&work);
-                OJob::Counter counter = OJob::Counter(); // We can keep this in stack memory because the memory here isn't invalidated until the function returns.
-                job->counter = &counter;
-                OJob::kickjobwait(job);
+                loadwork(&work); // No need for a job of our own, the read itself is what we sleep on.
                 *buffer = work.buffer;
             }
 
-            static Promise load(OUtils::Handle<Resource> resource, void **buffer, size_t offset, size_t size, uint8_t *error = NULL) {
+            // Request a file to be loaded in the background, resolve() the promise before touching the buffer. A cancelled load leaves the buffer NULL.
+            static Promise load(OUtils::Handle<Resource> resource, void **buffer, size_t offset, size_t size, uint8_t *error = NULL, enum priority priority = PRIORITY_NORMAL, uint64_t deadline = 0) {
                 ASSERT(buffer != NULL, "No buffer for output data provided.\n");
                 ASSERT(size > 0, "Buffer cannot have the size 0.\n");
 
-                struct work *work = (struct work *)malloc(sizeof(struct work));
-                ASSERT(work != NULL, "Failed to allocate work object for async file load.\n");
+                struct work *work = new struct work;
                 work->resource = resource;
                 work->size = size;
                 work->hascallback = false;
                 work->offset = offset;
                 work->error = error;
+                work->out = buffer;
+                work->priority = priority;
+                work->deadline = deadline;
 
                 Promise promise = Promise();
                 promise.counter = new OJob::Counter();
 
                 OJob::Job *job = new OJob::Job(loadwrapper, (uintptr_t)work);
                 job->counter = promise.counter;
+                job->priority = priority <= PRIORITY_HIGH ? OJob::Job::PRIORITY_HIGH : OJob::Job::PRIORITY_NORMAL;
                 OJob::kickjob(job);
 
                 return promise;
             }
 
-            // Request a file to be loaded and calls a callback when done, buffer for data is allocated automatically for the callback (Non-blocking).
-            static void loadcall(OUtils::Handle<Resource> resource, size_t offset, size_t size, void (*callback)(struct work *)) {
-                struct work *work = (struct work *)malloc(sizeof(struct work)); // We have to allocate a pointer for our work here as it would otherwise result in nothing being done.
-                ASSERT(work != NULL, "Failed to allocate work object for async file load.\n");
+            // Request a file to be loaded and calls a callback when done, buffer for data is allocated automatically for the callback (Non-blocking). For uncompressed files in a mapped RPak the buffer is the mapped file data itself (read-only, only valid for the duration of the callback). A load that gets cancelled never calls back.
+            static void loadcall(OUtils::Handle<Resource> resource, size_t offset, size_t size, void (*callback)(struct work *), enum priority priority = PRIORITY_NORMAL, uint64_t deadline = 0) {
+                struct work *work = new struct work; // We have to allocate a pointer for our work here as it would otherwise result in nothing being done.
                 work->resource = resource;
                 work->buffer = NULL;
                 work->hascallback = true;
@@ -130,8 +189,11 @@ namespace OResource {
                 work->size = size;
                 work->error = NULL;
                 work->offset = offset;
+                work->priority = priority;
+                work->deadline = deadline;
 
                 OJob::Job *job = new OJob::Job(loadwrapper, (uintptr_t)work);
+                job->priority = priority <= PRIORITY_HIGH ? OJob::Job::PRIORITY_HIGH : OJob::Job::PRIORITY_NORMAL;
                 OJob::kickjob(job);
             }
 
@@ -12,22 +12,110 @@ namespace OResource {
     class Resource;
 
 #define RESOURCE_INVALIDHANDLE OUtils::Handle<OResource::Resource>(NULL, SIZE_MAX, SIZE_MAX)
+#define RESOURCE_MINCAPACITY 1024 // initial path index buckets (power of 2)
+#define RESOURCE_EVICTFRAMES 4 // frames an unreferenced payload must sit unused before it may be evicted (at least the frames the GPU can have in flight)
 
+    // Resources by path. Lookups never take a lock: the index is an open addressed (linear probing) table of resource pointers keyed on the 64-bit FNV-1a hash of the path, and a hit is only a hit once the path itself matches, so colliding paths simply live side by side.
+    // Registration is serialised on the manager's mutex. Growing the index publishes a new table and keeps the old one around (until the manager goes away) for any reader still probing it. Resources are never removed, registering a path again replaces what it resolved to.
     class ResourceManager {
+        private:
+            struct index {
+                size_t capacity; // power of 2, kept at least twice the number of resources
+                std::atomic<Resource *> *slots;
+                struct index *retired; // previous (smaller) index
+            };
+
+            std::atomic<struct index *> paths = NULL;
+            size_t count = 0; // resources in the index (only touched under the mutex)
+
+            static struct index *createindex(size_t capacity);
+            void reserve(size_t count);
+            void insert(Resource *resource);
         public:
-            OJob::Mutex mutex; // We expect little contention but long waits on resources.
+            // Residency categories, each with its own budgets.
+            enum category {
+                CATEGORY_MODEL,
+                CATEGORY_TEXTURE,
+                CATEGORY_OTHER,
+                CATEGORY_COUNT
+            };
+
+            struct stats {
+                size_t resident[CATEGORY_COUNT]; // loaded payloads
+                size_t unreferenced[CATEGORY_COUNT]; // of which nobody holds a reference (eviction candidates)
+                size_t cpu[CATEGORY_COUNT]; // bytes
+                size_t gpu[CATEGORY_COUNT];
+                size_t cpubudget[CATEGORY_COUNT]; // 0 is unlimited
+                size_t gpubudget[CATEGORY_COUNT];
+                size_t evictions[CATEGORY_COUNT]; // since startup
+                size_t reloads[CATEGORY_COUNT]; // evicted payloads loaded again
+            };
+        private:
+            // Residency (loaded payloads). Everything here is only touched under the residency lock.
+            struct residency {
+                Resource *head = NULL; // unreferenced resident resources, least recently released first
+                Resource *tail = NULL;
+                size_t resident = 0;
+                size_t unreferenced = 0;
+                size_t cpu = 0;
+                size_t gpu = 0;
+                size_t cpubudget = 0;
+                size_t gpubudget = 0;
+                size_t evictions = 0;
+                size_t reloads = 0;
+            };
+
+            pthread_spinlock_t residencylock;
+            struct residency categories[CATEGORY_COUNT];
+            uint64_t frame = 0;
+
+            void lruremove(Resource *resource);
+            void lrupush(Resource *resource);
+        public:
+            OJob::Mutex mutex; // writers only
 
-            // map hash of path to resources
-            std::unordered_map<uint32_t, Resource *> resources;
             OUtils::ResolutionTable table = OUtils::ResolutionTable(8192);
             std::atomic<size_t> idcounter = 1;
 
-            // load from RPak
+            ResourceManager(void);
+            ~ResourceManager(void);
+
+            // Register every file of an RPak in one pass (one allocation and one trip through the mutex for the lot).
             void loadrpak(RPak *rpak);
             OUtils::Handle<Resource> create(const char *path);
             OUtils::Handle<Resource> create(const char *path, void *src);
 
+            // Safe from any thread at any time, including while other threads are registering resources.
             OUtils::Handle<Resource> get(const char *path);
+            // Hash of a file's contents (seeded with its size), read in full the first time it's asked for and remembered after. Never 0.
+            uint64_t contenthash(OUtils::Handle<Resource> resource);
+
+            // Loaded payloads are reference counted and may be evicted once nothing references them. Usage:
+            //   OUtils::Handle<Resource> model = manager.acquire("misc/test.omod*", ResourceManager::CATEGORY_MODEL, loadmodel, unloadmodel, 0);
+            //   ... model->as<ORenderer::Model>() ...
+            //   manager.unreference(model);
+            // load() builds the payload for a path (also called again if it was evicted) and reports its size, unload() frees a payload once it has been evicted. Both may be called from any thread.
+            typedef void *(*loadfunc)(const char *path, uintptr_t param, size_t *cpusize, size_t *gpusize);
+            typedef void (*unloadfunc)(void *ptr, uintptr_t param);
+
+            // Get (loading or reloading it if need be) and reference a payload. The path is copied if the resource has to be created.
+            OUtils::Handle<Resource> acquire(const char *path, enum category category, loadfunc load, unloadfunc unload, uintptr_t param);
+            // Reference a resident payload, returns false (and takes no reference) if it isn't resident (never loaded or evicted).
+            bool reference(OUtils::Handle<Resource> resource);
+            // Drop a reference, the payload becomes an eviction candidate once the last one is gone.
+            void unreference(OUtils::Handle<Resource> resource);
+            // Track a payload that was loaded some other way, unreferenced to begin with.
+            void makeresident(OUtils::Handle<Resource> resource, enum category category, size_t cpusize, size_t gpusize, unloadfunc unload, uintptr_t param);
+            // A resident payload changed size (streamed in more of itself, etc.).
+            void resize(OUtils::Handle<Resource> resource, size_t cpusize, size_t gpusize);
+
+            // Budgets (bytes) for a category, 0 is unlimited. Going over a budget is never an error, it just makes tick() evict harder.
+            void setbudget(enum category category, size_t cpu, size_t gpu);
+            // Once a frame: evict unreferenced payloads (least recently used first) from every category that is over budget. Payloads released within the last RESOURCE_EVICTFRAMES frames are left alone as the GPU may still be using them.
+            void tick(void);
+
+            void getstats(struct stats *stats);
+            void plotstats(void);
     };
 
     extern ResourceManager manager;
@@ -51,7 +139,24 @@ namespace OResource {
             struct RPak::tableentry rpakentry; // RPak entry header
             void *ptr = NULL; // virtual is a pointer to whatever source
             const char *path = NULL; // path to file (either os filesystem or RPak)
+            uint64_t hash = 0; // fnv1a64 of the path
+            int fd = -1; // operating system's filesystem files are kept open once AsyncIO has read from them
             size_t id = SIZE_MAX; // unique resource ID.
+            std::atomic<uint64_t> content = 0; // contents hash, 0 until ResourceManager::contenthash() has worked it out
+
+            // Residency, only used by payloads the manager tracks (see ResourceManager::acquire()).
+            std::atomic<size_t> refs = 0;
+            std::atomic<bool> resident = false; // read without the residency lock by anyone checking whether a payload is there yet
+            bool tracked = false; // managed by the residency system at all
+            bool inlru = false;
+            uint8_t category = ResourceManager::CATEGORY_OTHER;
+            size_t cpusize = 0;
+            size_t gpusize = 0;
+            uint64_t lastused = 0; // frame the last reference went away
+            ResourceManager::unloadfunc unload = NULL;
+            uintptr_t unloadparam = 0;
+            Resource *lruprev = NULL;
+            Resource *lrunext = NULL;
 
             Resource() {
                 this->handle = manager.table.bind(this);
@@ -60,18 +165,31 @@ namespace OResource {
             Resource(RPak *rpak, const char *path) {
                 this->rpak = rpak;
                 this->path = path;
+                this->hash = OUtils::fnv1a64(path, strlen(path));
                 this->type = SOURCE_RPAK;
                 this->handle = manager.table.bind(this);
                 this->id = manager.idcounter.fetch_add(1);
             }
+            // Bulk registration, handle and id have already been reserved for us.
+            Resource(RPak *rpak, const struct RPak::tableentry *entry, size_t handle, size_t id) {
+                this->rpak = rpak;
+                this->rpakentry = *entry;
+                this->path = entry->path;
+                this->hash = entry->hash;
+                this->type = SOURCE_RPAK;
+                this->handle = handle;
+                this->id = id;
+            }
             Resource(const char *path) {
                 this->path = path;
+                this->hash = OUtils::fnv1a64(path, strlen(path));
                 this->type = SOURCE_OSFS;
                 this->handle = manager.table.bind(this);
                 this->id = manager.idcounter.fetch_add(1);
             }
             Resource(const char *path, void *src) {
                 this->path = path;
+                this->hash = OUtils::fnv1a64(path, strlen(path));
                 this->ptr = src;
                 this->type = SOURCE_VIRTUAL;
                 this->handle = manager.table.bind(this);
@@ -8,20 +8,42 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <string.h>
 #include <unistd.h>
 
 namespace OResource {
 
-#define RPAK_FORMATVERSION 1
-#define RPAK_COMPRESSBIAS (16 * 1024 * 1024) // above 16MB we compress the file
+#define RPAK_FORMATVERSION 3
+#define RPAK_COMPRESSBIAS (64 * 1024) // files at least this big are considered for compression
 #define RPAK_COMPRESSIONFAULTTOLERANCE (32) // fault tolerance for compression buffers
+#define RPAK_COMPRESSIONLEVEL 6 // zlib level, only affects packaging time (inflate speed is about the same at any level)
+#define RPAK_COMPRESSMINSAVING 8 // percent, files that compress worse than this are stored as is (keeps them mappable)
+#define RPAK_BLOCKSIZE (64 * 1024) // uncompressed size of each independently compressed block
+#define RPAK_DATAALIGN 8 // version 3+ file data starts on this boundary (so block tables can be used in place)
+#define RPAK_ALIGNDATA(x) (((x) + RPAK_DATAALIGN - 1) & ~(size_t)(RPAK_DATAALIGN - 1))
+#define RPAK_PARALLELBLOCKS 8 // reads spanning at least this many blocks decompress across the job system (also the blocks per job)
+#define RPAK_INDEXEMPTY 0 // empty hash index bucket (buckets otherwise hold entry index + 1)
 
+    // Layout (version 2):
+    // header | tocheader | diskentry[num] | uint32_t index[buckets] | path strings | file data
+    // The index is an open addressed (linear probing) hash table over the 64-bit FNV-1a hash of each path, so lookups never have to compare more than a handful of entries.
+    // Version 1 archives (512 byte inline paths, no index) are still mounted, we just build the index ourselves.
+    // Version 3+ compressed files are split into RPAK_BLOCKSIZE blocks, each its own zlib stream, so any range of a file can be read by inflating only the blocks it touches:
+    // uint64_t blockoffsets[blocks + 1] | block data
+    // Offsets are relative to the end of the table, a block whose compressed size equals its uncompressed size is stored as is.
+    // The whole archive is mapped read-only at mount (when the platform lets us), so uncompressed files can be handed out as spans straight into the page cache with no intermediate copy. Compressed files, or archives that failed to map, go through read() as before.
     class RPak {
         private:
-            OJob::Mutex lock;
             int fd;
+            uint8_t *mapping = NULL; // read-only mapping of the whole archive (NULL if it couldn't be mapped)
+            size_t mappingsize = 0;
+            uint8_t *strings = NULL; // path string table
+            uint32_t *index = NULL; // hash index
+            uint32_t buckets = 0; // size of the hash index (power of 2)
+
+            void buildindex(void);
         public:
             struct header {
                 char magic[5]; // RPAK\0
@@ -31,7 +53,26 @@ namespace OResource {
                 uint32_t num; // number of package entries
             } __attribute__((packed));
 
-            struct tableentry {
+            // Version 2+, directly follows the header.
+            struct tocheader {
+                uint32_t buckets; // number of hash index buckets (power of 2)
+                uint64_t stringsize; // size of the path string table
+            } __attribute__((packed));
+
+            // Version 2+ on-disk table entry.
+            struct diskentry {
+                uint64_t hash; // fnv1a64 of the path
+                uint32_t pathoffset; // offset of the (NUL terminated) path in the string table
+                uint16_t pathlen; // length of the path (excluding NUL)
+                uint8_t compressed; // is this file compressed?
+                uint8_t reserved;
+                uint64_t uncompressedsize; // original file size
+                uint64_t compressedsize; // file size when compressed
+                uint64_t offset; // offset of file data in the archive
+            } __attribute__((packed));
+
+            // Version 1 on-disk table entry.
+            struct diskentryv1 {
                 char path[512]; // full pathname for the file in RPak
                 bool compressed; // is this file compressed?
                 size_t uncompressedsize; // original file size
@@ -39,31 +80,79 @@ namespace OResource {
                 size_t offset; // offset of file data in blob
             } __attribute__((packed));
 
+            // Blocks making up a compressed file.
+            static size_t blockcount(size_t size) {
+                return (size + RPAK_BLOCKSIZE - 1) / RPAK_BLOCKSIZE;
+            }
+
+            // In-memory table entry, pointers to these are stable for the lifetime of the RPak so they can be resolved once (with find()) and used for every read after.
+            struct tableentry {
+                const char *path; // full pathname for the file in RPak
+                uint64_t hash; // fnv1a64 of the path
+                bool compressed; // is this file compressed?
+                size_t uncompressedsize; // original file size
+                size_t compressedsize; // file size when compressed
+                size_t offset; // offset of file data in the archive
+            };
+
+        private:
+            void readblocks(const struct tableentry *entry, uint8_t *buf, size_t size, size_t off);
+            static void inflateblocks(size_t start, size_t end, uintptr_t param);
+        public:
             struct stat {
                 size_t realsize; // size in the RPAK file
                 size_t decompressedsize; // size counting for decompression
                 bool compressed;
             };
 
-            struct data {
-                uint8_t *data;
+            // A view into the mapped archive, valid for as long as the RPak is mounted. data is NULL if the file can't be viewed directly (compressed, or the archive isn't mapped).
+            struct span {
+                const uint8_t *data;
                 size_t size;
             };
 
+            // Access pattern hints for a file's pages, passed on to madvise().
+            enum advice {
+                ADVICE_NORMAL,
+                ADVICE_SEQUENTIAL, // about to be read front to back once (whole file loads)
+                ADVICE_WILLNEED, // start reading it in now, we'll want it soon (streaming requests)
+                ADVICE_DONTNEED // done with it for now, let the kernel drop our pages
+            };
+
             struct header header;
             struct tableentry *entries;
 
             RPak(const char *path);
             ~RPak(void) {
-                this->lock.lock();
+                if (this->mapping != NULL) {
+                    munmap(this->mapping, this->mappingsize);
+                }
                 close(this->fd);
-                free(entries);
-                this->lock.unlock();
+                free(this->entries);
+                free(this->strings);
+                free(this->index);
+            }
+
+            // Descriptor of the archive itself, for reading uncompressed files without going through us (AsyncIO).
+            int descriptor(void) {
+                return this->fd;
             }
 
+            // Resolve a path to its table entry (NULL if it isn't in this RPak). Keep hold of the result rather than looking the path up on every read.
+            const struct tableentry *find(const char *path);
+
+            struct stat stat(const struct tableentry *entry);
             struct stat stat(const char *path);
+            size_t read(const struct tableentry *entry, void *buf, const size_t size, const size_t off);
             size_t read(const char *path, void *buf, const size_t size, const size_t off);
 
+            // View (part of) a file in place, size SIZE_MAX views everything from off to the end of the file. Check data for NULL and fall back to read() if it is.
+            struct span map(const struct tableentry *entry, size_t off = 0, size_t size = SIZE_MAX);
+            // Hint how (part of) a file is about to be used, off and size are in the uncompressed file (the same as read()), compressed files hint the blocks covering that range. Only meaningful for mapped archives, otherwise a no-op.
+            void advise(const struct tableentry *entry, enum advice advice, size_t off = 0, size_t size = SIZE_MAX);
+
+            // Block compress a file's data in the version 3 layout. Returns NULL (and leaves the file to be stored as is) if it doesn't save at least RPAK_COMPRESSMINSAVING percent.
+            static uint8_t *compress(const uint8_t *data, size_t size, size_t *outsize);
             static void create(const char *path, const char *output);
     };
 }
@@ -52,6 +52,8 @@ namespace OResource {
             static struct loaded loadheaders(OUtils::Handle<OResource::Resource> resource);
             // Load individual mip level into a buffer (XXX: level here represents the index inside the texture file, which is (0 - mip) + levelcount where mip is the typical GPU representation, this is because level headers are stored in reverse order in OTexture files (basically to enable incremental reads for streaming)).
             static void loadlevel(struct loaded &loaded, uint32_t level, OUtils::Handle<Resource> resource, void *data, size_t size, size_t offset = 0);
+            // Hint that a level is about to be loaded so the read can start ahead of loadlevel() (no-op for anything but mapped RPaks).
+            static void prefetchlevel(struct loaded &loaded, uint32_t level);
             static struct loaded loadheaders(const char *path) {
                 return loadheaders(manager.get(path));
             }
@@ -221,7 +223,21 @@ namespace OResource {
                 }
             }
 
-            static struct ORenderer::texture loadfromdata(struct ORenderer::texturedesc *desc, uint8_t *data, size_t size) {
+            static void copyfill(void *dst, size_t size, uintptr_t param) {
+                memcpy(dst, (const void *)param, size);
+            }
+
+            static void ktxfill(void *dst, size_t size, uintptr_t param) {
+                KTX_error_code res = ktxTexture_LoadImageData((ktxTexture *)param, (ktx_uint8_t *)dst, size);
+                ASSERT(res == KTX_SUCCESS, "Failed to load KTX image data into staging buffer %u.\n", res);
+            }
+
+            static struct ORenderer::texture loadfromdata(struct ORenderer::texturedesc *desc, const uint8_t *data, size_t size) {
+                return loadfromdata(desc, size, copyfill, (uintptr_t)data);
+            }
+
+            // Upload a texture, letting fill() write its data directly into the mapped staging buffer (so a source that's already in memory, like a mapped RPak, only ever gets copied the once).
+            static struct ORenderer::texture loadfromdata(struct ORenderer::texturedesc *desc, size_t size, void (*fill)(void *dst, size_t size, uintptr_t param), uintptr_t param) {
                 struct ORenderer::buffer staging = { };
                 ASSERT(ORenderer::context->createbuffer(
                     &staging, size, ORenderer::BUFFER_TRANSFERSRC,
@@ -231,7 +247,7 @@ namespace OResource {
 
                 struct ORenderer::buffermap stagingmap = { };
                 ASSERT(ORenderer::context->mapbuffer(&stagingmap, staging, 0, size) == ORenderer::RESULT_SUCCESS, "Failed to map staging buffer.\n");
-                memcpy(stagingmap.mapped[0], data, size);
+                fill(stagingmap.mapped[0], size, param);
                 ORenderer::context->unmapbuffer(stagingmap);
 
                 ORenderer::Stream *stream = ORenderer::context->requeststream(ORenderer::STREAM_IMMEDIATE);
@@ -305,15 +321,21 @@ namespace OResource {
                 switch (resource->type) {
                     case Resource::SOURCE_RPAK: {
                         struct RPak::tableentry entry = resource->rpakentry;
-                        uint8_t *buffer = (uint8_t *)malloc(entry.uncompressedsize);
-                        ASSERT(buffer != NULL, "Failed to allocate buffer for RPak texture data read.\n");
-                        ASSERT(resource->rpak->read(resource->path, buffer, entry.uncompressedsize, 0) > 0, "Failed to read RPak file.\n");
+                        // Parse the KTX container in place if we can, image data is then only loaded once we have somewhere to put it (the staging buffer).
+                        resource->rpak->advise(&resource->rpakentry, RPak::ADVICE_SEQUENTIAL);
+                        struct RPak::span span = resource->rpak->map(&resource->rpakentry);
+                        uint8_t *buffer = NULL;
+                        if (span.data == NULL) {
+                            buffer = (uint8_t *)malloc(entry.uncompressedsize);
+                            ASSERT(buffer != NULL, "Failed to allocate buffer for RPak texture data read.\n");
+                            ASSERT(resource->rpak->read(&resource->rpakentry, buffer, entry.uncompressedsize, 0) > 0, "Failed to read RPak file.\n");
+                            span = (struct RPak::span) { .data = buffer, .size = entry.uncompressedsize };
+                        }
                         ktxTexture *ktxtexture;
-                        KTX_error_code res = ktxTexture_CreateFromMemory(buffer, entry.uncompressedsize, KTX_TEXTURE_CREATE_LOAD_IMAGE_DATA_BIT, &ktxtexture);
+                        KTX_error_code res = ktxTexture_CreateFromMemory(span.data, span.size, KTX_TEXTURE_CREATE_NO_FLAGS, &ktxtexture);
                         ASSERT(res == KTX_SUCCESS, "Failed to create KTX texture from RPak file %u.\n", res);
                         ASSERT(ktxtexture->classId == ktxTexture2_c, "KTX file must be KTX2.\n");
 
-                        ktx_uint8_t *data = ktxTexture_GetData(ktxtexture);
                         struct ORenderer::texturedesc desc = { };
                         ASSERT(ktxtexture->numDimensions == 3 ? ktxtexture->isArray == false : true, "3D image cannot be an array.\n");
                         desc.type = ktxtexture->isCubemap ? ktxtexture->isArray ? ORenderer::IMAGETYPE_CUBEARRAY : ORenderer::IMAGETYPE_CUBE :
@@ -334,13 +356,13 @@ namespace OResource {
                         ASSERT(desc.format != ORenderer::FORMAT_COUNT, "Could not infer ktx2 image format from provided Vulkan format %d.\n", ((ktxTexture2 *)ktxtexture)->vkFormat);
                         desc.memlayout = ORenderer::MEMLAYOUT_OPTIMAL;
                         desc.usage = ORenderer::USAGE_SAMPLED | ORenderer::USAGE_DST;
-                        texture = loadfromdata(&desc, data, ktxtexture->dataSize);
+                        texture = loadfromdata(&desc, ktxtexture->dataSize, ktxfill, (uintptr_t)ktxtexture);
 
                         char text[256];
                         sprintf(text, "RPak KTX2 Texture %s", basename(resource->path));
                         ORenderer::context->setdebugname(texture, text);
                         ktxTexture_Destroy(ktxtexture);
-                        free(buffer);
+                        free(buffer); // NULL when the texture was parsed in place
 
                         break;
                     }
@@ -393,13 +415,20 @@ namespace OResource {
                 switch (resource->type) {
                     case Resource::SOURCE_RPAK: {
                         struct RPak::tableentry entry = resource->rpakentry;
-                        uint8_t *buffer = (uint8_t *)malloc(entry.uncompressedsize);
-                        ASSERT(buffer != NULL, "Failed to allocate buffer for RPak texture data read.\n");
-                        ASSERT(resource->rpak->read(resource->path, buffer, entry.uncompressedsize, 0) > 0, "Failed to read RPak file.\n");
+                        // Decode straight out of the mapped archive where possible.
+                        resource->rpak->advise(&resource->rpakentry, RPak::ADVICE_SEQUENTIAL);
+                        struct RPak::span span = resource->rpak->map(&resource->rpakentry);
+                        uint8_t *buffer = NULL;
+                        if (span.data == NULL) {
+                            buffer = (uint8_t *)malloc(entry.uncompressedsize);
+                            ASSERT(buffer != NULL, "Failed to allocate buffer for RPak texture data read.\n");
+                            ASSERT(resource->rpak->read(&resource->rpakentry, buffer, entry.uncompressedsize, 0) > 0, "Failed to read RPak file.\n");
+                            span = (struct RPak::span) { .data = buffer, .size = entry.uncompressedsize };
+                        }
 
                         int width, height, bpp = 0;
-                        stbi_info_from_memory(buffer, entry.uncompressedsize, &width, &height, &bpp);
-                        uint8_t *data = stbi_load_from_memory(buffer, entry.uncompressedsize, &width, &height, &bpp, bpp == 3 ? STBI_rgb_alpha : 0); // Force RGB to be RGBA
+                        stbi_info_from_memory(span.data, span.size, &width, &height, &bpp);
+                        uint8_t *data = stbi_load_from_memory(span.data, span.size, &width, &height, &bpp, bpp == 3 ? STBI_rgb_alpha : 0); // Force RGB to be RGBA
                         printf("image %s of %dx%dx%d.\n", resource->path, width, height, bpp);
                         ASSERT(data != NULL, "STBI failed to load texture data from RPak.\n");
                         struct ORenderer::texturedesc desc = { };
@@ -421,7 +450,7 @@ namespace OResource {
                         sprintf(text, "RPak STBI Texture %s", basename(resource->path));
                         ORenderer::context->setdebugname(texture, text);
                         stbi_image_free(data);
-                        free(buffer);
+                        free(buffer); // NULL when decoded in place
                         // exit(1);
 
                         break;
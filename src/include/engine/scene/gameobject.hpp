@@ -15,59 +15,21 @@ namespace OScene {
 
     class GameObjectAllocator {
         public:
-            OUtils::SlabAllocator::Slab slabs[8];
-
-            GameObjectAllocator(const char *name = NULL) {
-                // This all consumes a lot of memory, so we'll need to restrict this a lot, and this only needs to be for dynamic objects (static objects can be allocated separately)
-                // XXX: Figure out static distinction
-                this->slabs[0].init(128, 16384);
-                this->slabs[1].init(256, 16384);
-                this->slabs[2].init(512, 16384);
-                this->slabs[3].init(1024, 16384);
-                this->slabs[4].init(2048, 16384);
-                this->slabs[5].init(4096, 8096);
-                this->slabs[6].init(8096, 4096);
-                this->slabs[7].init(16384, 4096);
-            }
+            OUtils::SlabAllocator allocator;
 
-            OUtils::SlabAllocator::Slab *optimalslab(size_t size) {
-                for (size_t i = 0; i < sizeof(this->slabs) / sizeof(this->slabs[0]); i++) {
-                    OUtils::SlabAllocator::Slab *slab = &this->slabs[i];
-                    // Slab allocator
-                    if (slab->entsize >= size && slab->allocator.allocblock != NULL) {
-                        return slab;
-                    }
-                }
-                return NULL;
-            }
+            // This all consumes a lot of memory, so we'll need to restrict this a lot, and this only needs to be for dynamic objects (static objects can be allocated separately)
+            // XXX: Figure out static distinction
+            static constexpr size_t sizes[] = { 128, 256, 512, 1024, 2048, 4096, 8096, 16384 };
+            static constexpr size_t blocks[] = { 16384, 16384, 16384, 16384, 16384, 8096, 4096, 4096 };
 
-            void *alloc(size_t size) {
-                OUtils::SlabAllocator::Slab *slab = this->optimalslab(size);
-                if (slab != NULL) {
-                    void *allocation = slab->alloc(size);
-                    TracySecureAllocN(allocation, sizeof(struct OUtils::SlabAllocator::metadata) + size, "GameObjects and Components");
-                    return allocation;
-                }
+            GameObjectAllocator(const char *name = NULL) : allocator(sizeof(sizes) / sizeof(sizes[0]), sizes, blocks, name) { }
 
-                // Fallback to host memory allocator (yikers!)
-                struct OUtils::SlabAllocator::metadata *allocation = (struct OUtils::SlabAllocator::metadata *)malloc(size + sizeof(struct OUtils::SlabAllocator::metadata));
-                ASSERT(allocation != NULL, "Failed to allocate memory from fallback host memory allocator.\n");
-                allocation->size = size;
-                TracySecureAllocN(allocation, sizeof(struct OUtils::SlabAllocator::metadata) + size, "GameObjects and Components Host Fallback");
-                TracySecureAllocN(allocation, sizeof(struct OUtils::SlabAllocator::metadata) + size, "GameObjects and Components");
-                return allocation + 1;
+            void *alloc(size_t size) {
+                return this->allocator.alloc(size);
             }
 
-            virtual void free(void *ptr) {
-                struct OUtils::SlabAllocator::metadata *allocation = (struct OUtils::SlabAllocator::metadata *)((uint8_t *)ptr - sizeof(struct OUtils::SlabAllocator::metadata));
-                OUtils::SlabAllocator::Slab *slab = this->optimalslab(allocation->size);
-                if (slab != NULL) {
-                    TracySecureFreeN(allocation, "GameObjects and Components");
-                    slab->free(allocation);
-                } else {
-                    TracySecureFreeN(allocation, "GameObjects and Components Host Fallback");
-                    std::free(allocation);
-                }
+            void free(void *ptr) {
+                this->allocator.free(ptr);
             }
 
     };
@@ -78,6 +40,7 @@ namespace OScene {
 
     extern OUtils::ResolutionTable table;
 #define SCENE_INVALIDHANDLE OUtils::Handle<OScene::GameObject>(NULL, SIZE_MAX, SIZE_MAX)
+#define MODELINSTANCE_MAXPATH 512 // longest model path a serialised model instance may carry
 
     // Early exit on invalid objects/components
 #define SCENE_INVALIDATION() \
@@ -148,6 +111,8 @@ namespace OScene {
             uint32_t type = OUtils::fnv1a("GameObject");
 
             OUtils::Handle<GameObject> parent; // This is guaranteed to have been updated before this current object to solve the object dependency problem.
+            size_t transformidx = SIZE_MAX; // slot in the scene's TransformSystem (SIZE_MAX until it has one)
+            std::atomic<bool> transformadded = false; // registered with the scene's TransformSystem
             std::vector<OUtils::Handle<GameObject>> children;
             // Temporary values, aids scene loading
             size_t sparent; // serialised parent
@@ -161,6 +126,7 @@ namespace OScene {
                 void *pageref = NULL; // Pointer reference to the current cell page (Used to index directly into linked list of cells)
                 size_t pageid; // Backup ID to prevent stale references to old cells (cells are pool allocated, although this shouldn't be much of a problem as we memset new allocations anyway)
             } culldata;
+            std::atomic<bool> cullqueued = false; // waiting for the partition's next sync()
             OMath::AABB bounds;
 
             virtual void construct(void) { }
@@ -190,15 +156,15 @@ namespace OScene {
             }
 
             static void destroy(OUtils::Handle<GameObject> obj) {
+                obj->releasetransform();
                 obj->deconstruct();
                 size_t handle = obj->handle;
-                if (obj->poolallocated) {
-                    objallocator.free(obj.resolve());
-                    table.release(obj->handle);
-                    return;
+                GameObject *ptr = obj.resolve();
+                table.release(handle); // before the memory goes, so nothing can resolve the handle to freed memory
+                if (ptr->poolallocated) {
+                    objallocator.free(ptr);
                 } else {
-                    free(obj.resolve());
-                    table.release(obj->handle);
+                    free(ptr);
                 }
             }
 
@@ -241,6 +207,10 @@ namespace OScene {
             void orientate(glm::quat q);
             void lookat(glm::vec4 target);
             void scaleby(glm::vec3 s);
+            // Move under another object (or to the root with an invalid handle), keeping our local transform.
+            void setparent(OUtils::Handle<GameObject> parent);
+            // Let the scene's TransformSystem know our slot is about to go (called by destroy()).
+            void releasetransform(void);
     };
 
     class Component {
@@ -282,13 +252,12 @@ namespace OScene {
             static void destroy(OUtils::Handle<Component> component) {
                 component->deconstruct();
                 size_t handle = component->handle;
-                if (component->poolallocated) {
-                    objallocator.free(component.resolve());
-                    table.release(handle);
-                    return;
+                Component *ptr = component.resolve();
+                table.release(handle); // before the memory goes, so nothing can resolve the handle to freed memory
+                if (ptr->poolallocated) {
+                    objallocator.free(ptr);
                 } else {
-                    free(component.resolve());
-                    table.release(handle);
+                    free(ptr);
                 }
             }
 
@@ -356,21 +325,55 @@ namespace OScene {
     // Game object tied to one or more meshes
     class ModelInstance : public Component {
         public:
-            OUtils::Handle<OResource::Resource> model;
-            char *modelpath;
+            OUtils::Handle<OResource::Resource> model; // referenced for as long as we point at it, only valid once modelready is set
+            std::atomic<bool> modelready = false; // model has been loaded and set (requested models arrive some time after deserialisation)
+            const char *modelpath = NULL; // interned by the model cache, shared by every instance of the same model
 
             ModelInstance(void) {
                 // flags |= GameObject::IS_MODEL;
                 // this->type = OUtils::fnv1a("ModelInstance");
             }
 
+            // Point the instance at a model, loading it on this thread if nothing has yet. Instances of the same model (or of identical model files) share the one loaded copy, which stays resident while any of them reference it.
+            void setmodel(const char *path) {
+                this->deconstruct();
+                this->modelpath = ORenderer::models.source(path)->path;
+                this->model = ORenderer::models.get(path);
+                this->modelready.store(true, std::memory_order_release);
+            }
+
+            // Same as setmodel() but never blocks on loading, the instance simply isn't drawn until its model arrives.
+            void requestmodel(const char *path) {
+                this->deconstruct();
+                this->modelpath = ORenderer::models.source(path)->path;
+                ORenderer::models.request(this->modelpath, ModelInstance::modelloaded, (uintptr_t)this);
+            }
+
+            static void modelloaded(OUtils::Handle<OResource::Resource> model, uintptr_t param) {
+                ModelInstance *instance = (ModelInstance *)param;
+                instance->model = model;
+                instance->modelready.store(true, std::memory_order_release);
+            }
+
+            void deconstruct(void) {
+                if (this->modelpath != NULL && !this->modelready.load(std::memory_order_acquire) && ORenderer::models.cancel(this->modelpath, (uintptr_t)this)) {
+                    return; // never arrived, nothing to let go of
+                }
+                if (this->modelready.load(std::memory_order_acquire)) {
+                    OResource::manager.unreference(this->model);
+                    this->model = RESOURCE_INVALIDHANDLE;
+                    this->modelready.store(false, std::memory_order_relaxed);
+                }
+            }
+
             void serialise(OResource::Serialiser *serialiser) {
                 uint32_t len = 0;
                 if (this->modelpath != NULL) {
                     len = strlen(this->modelpath);
                     serialiser->write<uint32_t>(&len);
                     for (size_t i = 0; i < len; i++) {
-                        serialiser->write<char>(&this->modelpath[i]);
+                        char c = this->modelpath[i]; // write() takes a non-const pointer
+                        serialiser->write<char>(&c);
                     }
                 } else {
                     serialiser->write<uint32_t>(&len);
@@ -380,25 +383,14 @@ namespace OScene {
             void deserialise(OResource::Serialiser *serialiser) {
                 uint32_t len = 0;
                 serialiser->read<uint32_t>(&len);
-                if (len > 0) { // XXX: TODO: Resolve resource.
-                    this->modelpath = (char *)malloc(len + 1);
-                    ASSERT(this->modelpath, "Failed to allocate memory for deserialising the model path.\n");
+                if (len > 0) {
+                    char path[MODELINSTANCE_MAXPATH];
+                    ASSERT(len < MODELINSTANCE_MAXPATH, "Serialised model path is too long (%u bytes).\n", len);
                     for (size_t i = 0; i < len; i++) {
-                        serialiser->read<char>(&this->modelpath[i]); // Read in the model path from the serialiser incrementally.
-                    }
-                    this->modelpath[len] = '\0';
-                    char *loaded = (char *)malloc(len + 2);
-                    ASSERT(loaded != NULL, "Failed to allocate memory for marking a loader version of the model path.\n");
-                    snprintf(loaded, len + 2, "%s*", this->modelpath); // Represent the virtual resource as the same path but with an asterisk to mark it "loaded". If the model path remains the same for multiple objects, we'll end up just grabbing one that's already been loaded instead of loading it again and consuming more memory.
-                    loaded[len + 1] = '\0';
-
-                    // Formatted like this so we'll end up setting the model either way if it *does* exist without having to do it twice
-                    // This code here will basically let us load an already loaded copy of the model whenever we need it to be loaded.
-                    if ((this->model = OResource::manager.get(loaded)) == RESOURCE_INVALIDHANDLE) {
-                        this->model = OResource::manager.create(loaded, new ORenderer::Model(this->modelpath));
-                    } else {
-                        free(loaded); // Not needed to be persistent for the resource manager, free it.
+                        serialiser->read<char>(&path[i]); // Read in the model path from the serialiser incrementally.
                     }
+                    path[len] = '\0';
+                    this->requestmodel(path); // loads in the background, deserialisation never waits on model I/O
                 }
             }
     };
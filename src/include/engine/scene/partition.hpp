@@ -1,6 +1,7 @@
 #ifndef _ENGINE__SCENE__PARTITION_HPP
 #define _ENGINE__SCENE__PARTITION_HPP
 
+#include <engine/math/cull.hpp>
 #include <engine/math/math.hpp>
 #include <engine/renderer/camera.hpp>
 #include <engine/scene/gameobject.hpp>
@@ -34,6 +35,8 @@ namespace OScene {
             }
     };
 
+    class Cluster;
+
     // 4096 byte aligned cells (so they may fit into a page allocator)
     // NOTE: Multiple of these can be assigned to a single cell position (hence the prev and next members) so that we can exceed the arbitary limit imposed by 4096 byte alignment
     class Cell {
@@ -44,18 +47,43 @@ namespace OScene {
                 Cell *prev = NULL;
                 glm::vec3 origin; // cell position in the world (for making world-local translations for objects)
                 glm::ivec3 cellpos; // cell position in grid (for searching)
-                uint32_t count; // number of objects in this cell
+                uint32_t count; // number of objects in this cell (always packed into the first count slots)
                 size_t id; // unique ID given on cell creation
-                size_t idx; // index in cell list
+                size_t idx; // index in the cluster's cell list (head of a cell list only)
+                Cluster *cluster; // cluster the cell list belongs to (head of a cell list only)
+                Cell *freelist; // first page of the list with room for another object (head of a cell list only)
+                // Doubly linked to the other pages with room
+                Cell *nextfree;
+                Cell *prevfree;
                 bool big; // Contains an object whose bounds exceeds the cell
+                uint8_t lastplane; // frustum plane that last rejected the whole cell list (head of a cell list only)
             };
 
             struct header header;
 
-            static const uint32_t COUNT = (4096 - sizeof(header)) / sizeof(OUtils::Handle<GameObject>);
+            // Room for the object handles plus their bounding spheres, rounded down so the culling kernels never need a tail.
+            static const uint32_t COUNT = ((4096 - sizeof(header) - 32) / (sizeof(OUtils::Handle<GameObject>) + 4 * sizeof(float))) & ~(CULL_PADDING - 1);
 
+            // World space bounding sphere of each slot in SoA form (so culling can test a whole register's worth of objects at once), kept up to date by the partition manager. Empty slots have a radius of CULL_INVALIDRADIUS.
+            float spherex[COUNT] __attribute__((aligned(32)));
+            float spherey[COUNT] __attribute__((aligned(32)));
+            float spherez[COUNT] __attribute__((aligned(32)));
+            float spherer[COUNT] __attribute__((aligned(32)));
             OUtils::Handle<GameObject> objects[COUNT];
+            uint8_t lastplane[COUNT / CULL_PADDING]; // frustum plane that last rejected each block of CULL_PADDING slots
     } __attribute__((aligned(4096)));
+    static_assert(sizeof(Cell) == 4096, "Cell does not fit in a page.");
+
+#define PARTITION_CLUSTERCELLS 8 // cells along each side of a cluster
+
+    // A cube of PARTITION_CLUSTERCELLS^3 cell positions, culling tests these first so whole regions are accepted or rejected without looking at any of their cells.
+    class Cluster {
+        public:
+            glm::ivec3 pos; // cluster position in the cluster grid
+            std::vector<Cell *> cells; // heads of the cell lists in this cluster
+            size_t idx; // index in the cluster list
+            uint8_t lastplane = 0; // frustum plane that last rejected the cluster (tested first next time, cameras rarely move far between frames)
+    };
 
     class CullResult {
         public:
@@ -71,28 +99,19 @@ namespace OScene {
             OUtils::Handle<GameObject> objects[COUNT];
     } __attribute__((aligned(4096)));
 
+    // Result pages come out of the per-frame arena, so they're only valid until the end of the frame they were culled in and are never freed individually.
     class CullResultList {
         public:
-            OUtils::PoolAllocator *allocator = NULL;
+            OUtils::FrameAllocator *allocator = NULL;
             CullResult *begin = NULL;
             CullResult *end = NULL;
             // OJob::Mutex mutex;
             OJob::Spinlock spin;
 
-            CullResultList(OUtils::PoolAllocator *allocator) {
+            CullResultList(OUtils::FrameAllocator *allocator) {
                 this->allocator = allocator;
             }
 
-            ~CullResultList(void) {
-                ASSERT(this->allocator != NULL, "Invalid allocator, cannot free.\n");
-                CullResult *i = this->begin;
-                while (i != NULL) {
-                    CullResult *tmp = i;
-                    i = i->header.next;
-                    this->allocator->free(tmp);
-                }
-            }
-
             // Detach results list from this handler.
             CullResult *detach(void) {
                 CullResult *tmp = this->begin;
@@ -103,12 +122,17 @@ namespace OScene {
 
             // Merge another results list into result list.
             void merge(CullResult *res) {
+                if (res == NULL) {
+                    return;
+                }
                 if (this->begin == NULL) {
                     this->begin = res;
-                    this->end = res;
                 } else {
                     this->end->header.next = res;
-                    this->end = res;
+                }
+                this->end = res;
+                while (this->end->header.next != NULL) { // the merged list can be more than one page long, the next merge has to go after all of it
+                    this->end = this->end->header.next;
                 }
             }
 
@@ -117,7 +141,7 @@ namespace OScene {
                 // this->mutex.lock();
                 OJob::ScopedSpinlock spin(&this->spin);
 
-                CullResult *res = (CullResult *)this->allocator->alloc();
+                CullResult *res = (CullResult *)this->allocator->alloc(sizeof(CullResult), alignof(CullResult));
                 memset(res, 0, sizeof(CullResult));
                 if (this->begin == NULL) { // List is empty, initialise it.
                     this->begin = res;
@@ -135,57 +159,90 @@ namespace OScene {
     // Cells are created as needed rather than on level load or anything like that.
     // Cells are not 2D, they are 3D (allowing for better culling density)
 
-    // The cell position hash function in CellDescHasher will represent the start the head of the doubly linked cell list, when attempting to place an object in a cell one must loop over all the "same-cells" to find a free slot
-    // Problematic: That's an O(N) time complexity function. Potential solutions could include moving the referenced head to the next free slot. However, this does mean objects moved out of a cell will leave free slots in cells no longer referenced.
+    // The cell position hash function in CellDescHasher will represent the start the head of the doubly linked cell list.
+    // Pages with room are additionally linked into a free list rooted in the head, and objects are kept packed at the front of each page (removal moves the last object into the hole), so placing or removing an object is O(1) and culling only ever looks at occupied slots.
 
-    // Keep a list of the next free cells? (Linked, so simple enough) would solve the speed issue of O(N) time complexity for search as we always have O(1) search time for a slot with free cells.
+#define PARTITION_LOCKSTRIPES 64 // cell list locks (power of 2), cell positions share them by hash
+#define PARTITION_SYNCBATCH 256 // queued objects per sync() job
 
+    // add() and remove() (and so updatepos()) may be called from any number of jobs at once, culling may not run alongside them.
+    // Moving objects don't touch the cells at all. Transform setters only mark the scene's TransformSystem dirty, TransformSystem::update() queue()s everything whose world transform changed (through Scene::transformmoved, lock free, one queue per worker) and sync() applies every queued move at once across the job system, cull() does this first thing.
+    // So the scene's transforms have to be updated before cull() for a move to show up in it. Nothing may be queued while a sync() is running.
     class ParitionManager {
         public:
+            struct movequeue {
+                OUtils::Handle<GameObject> *objects;
+                size_t count;
+                size_t capacity;
+            };
+
+            struct syncwork {
+                ParitionManager *manager;
+                OUtils::Handle<GameObject> *objects;
+                size_t count;
+            };
+
             struct work {
                 std::atomic<size_t> *idx; // Reference to the index atomic.
                 OMath::Frustum *frustum; // Reference to the camera frustum.
+                OMath::cullplanes planes; // The frustum's planes in the layout the culling kernel wants.
                 ParitionManager *manager; // Reference to the partition manager this work is for.
-                size_t cellsperjob; // Number of cells to do per culling worker job.
+                size_t clustersperjob; // Number of clusters to do per culling worker job.
             };
 
             std::unordered_map<glm::ivec3, Cell *, CellDescHasher> map;
-            std::vector<Cell *> cells;
-            OUtils::PoolAllocator allocator = OUtils::PoolAllocator(4096, 4096, 256, "Dynamic World Partition Culling"); // Generic page allocator (16MB)
+            std::unordered_map<glm::ivec3, Cluster *, CellDescHasher> clustermap;
+            std::vector<Cluster *> clusters;
+            OUtils::PoolAllocator allocator = OUtils::PoolAllocator(4096, 4096, 256, "Dynamic World Partition Culling"); // Cell page allocator (16MB)
             CellDescHasher hasher;
             std::atomic<size_t> idcounter = 1; // Start at one so a zeroed out cell can never be valid
+            OJob::Spinlock maplock; // map, clustermap and clusters
+            OJob::Spinlock celllocks[PARTITION_LOCKSTRIPES]; // everything in a cell list (held across the map lock, never the other way around)
+            OJob::PerWorker<struct movequeue> queues; // one per worker, created on first use from a worker
+            struct movequeue sharedqueue = { }; // for anything queued from outside the job system
+            OJob::Spinlock sharedlock;
+            std::vector<OUtils::Handle<GameObject>> pending; // every queue gathered up by sync()
+
+            ~ParitionManager(void) {
+                struct movequeue *queues = this->queues.all();
+                for (size_t i = 0; queues != NULL && i < OJob::numworkers; i++) {
+                    free(queues[i].objects);
+                }
+                free(this->sharedqueue.objects);
+            }
 
-            // Create this only once as a constant so we can have fast runtime comparisons
-            const OUtils::Handle<GameObject> INVALIDHANDLE = OUtils::Handle<GameObject>(NULL, SIZE_MAX, SIZE_MAX);
+            OJob::Spinlock *celllock(const glm::ivec3 &cellpos) {
+                return &this->celllocks[this->hasher(cellpos) & (PARTITION_LOCKSTRIPES - 1)];
+            }
 
-            size_t getfreespot(Cell *cell) {
-                // O(N) time complexity, unfortunate but there is no immediate solution I can think of to produce the same result. (Perhaps do what we do for the old resolution table and hash the game object to get a potential spot quicker?)
-                for (size_t i = 0; i < cell->COUNT; i++) {
-                    if (cell->objects[i] == INVALIDHANDLE) { // We don't use isvalid() here because it's actually faster to do a comparison when we know that this slot will be invalidated automatically when a game object is deleted (and thus, isvalid() would only really waste extra cycles on checking the handle)
-                        return i; // Free slot here
-                    }
-                }
-                return SIZE_MAX; // Failed to find a free cell
+            // Cluster a cell position falls in (rounding towards negative infinity, so clusters never straddle the origin).
+            static glm::ivec3 clusterpos(const glm::ivec3 &cellpos) {
+                return glm::ivec3(glm::floor(glm::vec3(cellpos) * (1.0f / PARTITION_CLUSTERCELLS)));
             }
 
-            // Add an object to a specific cell.
-            void addtocell(Cell *cell, OUtils::Handle<GameObject> obj);
+            // Add a new cell list head to its cluster, creating the cluster if needed (with the map lock held).
+            void addtocluster(Cell *cell);
+            // Take a cell list head out of its cluster, replacing it with another head or dropping it altogether if replacement is NULL (with the map lock held).
+            void removefromcluster(Cell *cell, Cell *replacement);
+            // Add an object to a cell list (with its cell lock held).
+            void addtocell(Cell *head, OUtils::Handle<GameObject> obj);
             // Add an object to the partition manager system.
             void add(OUtils::Handle<GameObject> obj);
             // Remove an object from the cell it is registered in.
             void remove(OUtils::Handle<GameObject> obj);
             // Update the position of an object in the partition manager system (will also add the object if it's not already there).
             void updatepos(OUtils::Handle<GameObject> obj);
-
-            void freeresults(CullResult *results) {
-                while (results != NULL) {
-                    CullResult *tmp = results; // Save this temporarily because after the page is freed we cannot guarantee it'll not be overwritten.
-                    results = results->header.next;
-                    this->allocator.free(tmp);
-                }
-            }
-
-            void docull(Cell *cell, OMath::Frustum *frustum, CullResult **ret, CullResultList *list);
+            // Recalculate the bounding sphere culling uses for an object (call after changing its bounds or scale). Moving an object's parent doesn't do this for it.
+            void refresh(OUtils::Handle<GameObject> obj);
+            // Have the next sync() bring an object's cell and bounding sphere up to date (adding it if it isn't in the system yet). Cheap and safe from any job, an object is only ever queued once per sync.
+            void queue(OUtils::Handle<GameObject> obj);
+            // Apply every queued move, spread over the job system when there are enough of them.
+            void sync(void);
+
+            // Append the visible objects of a cell list to the results, everything in it if planes is NULL (the cell is known to be entirely inside).
+            void docull(Cell *cell, OMath::cullplanes *planes, CullResult **ret, CullResultList *list);
+            // Cull a cluster's cells, everything in it if planes is NULL.
+            void cullcluster(Cluster *cluster, OMath::Frustum *frustum, OMath::cullplanes *planes, CullResult **ret, CullResultList *list);
             CullResult *cull(ORenderer::PerspectiveCamera &camera);
     };
 }
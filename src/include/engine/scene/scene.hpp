@@ -3,12 +3,52 @@
 
 #include <engine/scene/gameobject.hpp>
 #include <engine/scene/partition.hpp>
+#include <engine/scene/transform.hpp>
 #include <vector>
 
 namespace OScene {
 
+#define SCENE_FORMATVERSION 2
+#define SCENE_SECTIONALIGN 64 // sections start on this boundary, so they can be used straight out of the mapping
+#define SCENE_NOPARENT UINT64_MAX
+#define SCENE_OBJECTSPERLOADCHUNK 256 // objects handled by each scene loading job
+
     class Scene {
         public:
+            // Version 2+ layout:
+            // fileheader | sections (each SCENE_SECTIONALIGN aligned)
+            // Every per-object section is a flat array indexed by object (structure of arrays), objects refer to each other by index rather than by ID so nothing needs resolving on load. The whole file is mapped and read in place, objects are instantiated SCENE_OBJECTSPERLOADCHUNK at a time across the job system.
+            enum section {
+                SECTION_ID, // uint64_t, object ID
+                SECTION_TYPE, // uint32_t, object type FNV1a hash (for RTTI)
+                SECTION_FLAGS, // uint32_t, object flags
+                SECTION_POSITION, // glm::vec3
+                SECTION_ORIENTATION, // glm::quat
+                SECTION_SCALE, // glm::vec3
+                SECTION_MIN, // glm::vec3, bounds
+                SECTION_MAX, // glm::vec3
+                SECTION_PARENT, // uint64_t, parent object index (SCENE_NOPARENT for none)
+                SECTION_CHILDSTART, // uint64_t[numobjects + 1], each object's range of SECTION_CHILDREN
+                SECTION_CHILDREN, // uint64_t, child object indices
+                SECTION_DATASTART, // uint64_t[numobjects + 1], each object's range of SECTION_DATA
+                SECTION_DATA, // serialised object data
+                SECTION_COUNT
+            };
+
+            struct sectionentry {
+                uint64_t offset; // from the start of the file
+                uint64_t size;
+            } __attribute__((packed));
+
+            struct fileheader {
+                char magic[4]; // OSCE
+                uint32_t version; // SCENE_FORMATVERSION (where version 1 has the NUL ending its magic, so the two can't be confused)
+                uint64_t numterrain;
+                uint64_t numobjects;
+                struct sectionentry sections[SECTION_COUNT];
+            } __attribute__((packed));
+
+            // Version 1 object record.
             struct gameobjecthdr {
                 size_t id; // object ID
                 uint32_t type; // object type FNV1a hash (for RTTI)
@@ -31,6 +71,7 @@ namespace OScene {
 
             } __attribute__((packed));
 
+            // Version 1 header.
             struct scenehdr {
                 char magic[5]; // OSCE
                 size_t numterrain; // terrains are described before objects
@@ -38,15 +79,36 @@ namespace OScene {
             } __attribute__((packed));
 
             Scene(const char *path);
+            // Load a scene (either version) on top of whatever is already here.
             void load(const char *path);
+            // Save in the current version.
             void save(const char *path);
 
+            // Version 1:
             // Header
             // Terrains...
             // Objects...
             //      Header
             //      Children
             //      Data
+        private:
+            struct loadwork {
+                Scene *scene;
+                const struct fileheader *header;
+                const uint8_t *file;
+                GameObject **objects; // instantiated objects, by index
+                size_t base; // index of the first loaded object in the scene's object list
+                size_t start;
+                size_t end;
+            };
+
+            void loadlegacy(FILE *f);
+            void runload(void (*worker)(OJob::Job *job), struct loadwork *work, size_t numjobs);
+            static void instantiateworker(OJob::Job *job);
+            static void linkworker(OJob::Job *job);
+            static void partitionworker(OJob::Job *job);
+            static void transformmoved(GameObject *obj, uintptr_t param);
+        public:
 
 
 
@@ -58,6 +120,7 @@ namespace OScene {
             // should static objects be handled outside the culling system? this is inadvisable as it doesn't allow us to frustum cull.
             // how should the scene tree be worked out?
             ParitionManager partitionmanager; // Handles the partitions used for culling and other world-space operations that would benefit from optimising the number of objects worked on
+            TransformSystem transforms = TransformSystem(Scene::transformmoved, (uintptr_t)this); // World transforms of every object, call update() once a frame before culling
 
             Scene(void) {
 
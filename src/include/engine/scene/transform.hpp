@@ -0,0 +1,111 @@
+#ifndef _ENGINE__SCENE__TRANSFORM_HPP
+#define _ENGINE__SCENE__TRANSFORM_HPP
+
+#include <atomic>
+#include <engine/concurrency/job.hpp>
+#include <engine/math/math.hpp>
+#include <engine/scene/gameobject.hpp>
+#include <vector>
+
+namespace OScene {
+
+#define TRANSFORM_NOPARENT UINT32_MAX
+#define TRANSFORM_UPDATECHUNK 1024 // transforms per update job (within a depth level)
+#define TRANSFORM_DIRTY (1 << 0) // local transform (or an ancestor's) changed since the last update
+#define TRANSFORM_NEW (1 << 1) // slot was added by the last rebuild, always reported as moved
+
+    // Flattened transform hierarchy of a scene. Every registered object has a slot in a set of parallel arrays, sorted by depth in the hierarchy (roots first), holding its local transform and its world transform as of the last update().
+    // update() walks the levels in order, each level split across the job system, and only recomputes dirty slots. Only objects whose world transform actually came out different are reported to onmove. The GameObject global getters are then plain array reads.
+    // Objects are registered with add() (transform setters do this themselves) and only take up their slot on the next update(), until then (and while they or an ancestor have changes pending) the getters work it out the old way, walking up the parents.
+    // Nothing may touch object transforms while update() runs.
+    class TransformSystem {
+        public:
+            // World space values, composed the same way the GameObject getters always have (positions and scales are accumulated down the hierarchy, orientations multiplied).
+            struct world {
+                glm::mat4 matrix;
+                glm::mat4 staticmatrix; // not orientated
+                glm::vec3 position;
+                glm::quat orientation;
+                glm::vec3 scale;
+            };
+
+        private:
+            struct work {
+                TransformSystem *system;
+                size_t start;
+                size_t end;
+            };
+
+            // Slot data, all indexed the same way.
+            std::vector<OUtils::Handle<GameObject>> objects;
+            std::vector<uint32_t> parents; // slot of the parent (always at a lower depth), TRANSFORM_NOPARENT for roots
+            std::vector<glm::vec3> localpositions;
+            std::vector<glm::quat> localorientations;
+            std::vector<glm::vec3> localscales;
+            std::vector<struct world> worlds;
+            std::vector<uint8_t> changed; // world transform was recomputed this update (so the children have to be too)
+            std::atomic<uint8_t> *dirty = NULL; // TRANSFORM_DIRTY/TRANSFORM_NEW, set from any job. A dirty slot always has a dirty subtree, so a clean slot's world is exact
+            size_t capacity = 0;
+            std::vector<size_t> levels; // first slot of each depth level, plus one past the end
+
+            std::vector<OUtils::Handle<GameObject>> added; // waiting for the next rebuild
+            OJob::Spinlock addlock;
+            std::atomic<bool> restructure = false; // hierarchy changed, rebuild before updating
+
+            void (*onmove)(GameObject *obj, uintptr_t param) = NULL; // told about every object whose world transform changed (from the update jobs)
+            uintptr_t moveparam = 0;
+
+            void rebuild(void);
+            static void updateworker(OJob::Job *job);
+            void updaterange(size_t start, size_t end);
+        public:
+            TransformSystem(void (*onmove)(GameObject *obj, uintptr_t param) = NULL, uintptr_t param = 0) {
+                this->onmove = onmove;
+                this->moveparam = param;
+            }
+
+            ~TransformSystem(void) {
+                free(this->dirty);
+            }
+
+            // Register an object (once, repeat calls are ignored). It gets its slot on the next update(), existing slots keep their world transforms across the rebuild.
+            void add(OUtils::Handle<GameObject> obj);
+            // An object's local transform changed. Its whole subtree is marked too, so nothing below it hands out a stale world transform before the next update().
+            void markdirty(GameObject *obj) {
+                if (obj->transformidx == SIZE_MAX) {
+                    this->add(obj->gethandle());
+                } else if (this->dirty[obj->transformidx].fetch_or(TRANSFORM_DIRTY, std::memory_order_relaxed) & TRANSFORM_DIRTY) {
+                    return; // already dirty, and so is everything below it
+                }
+                for (size_t i = 0; i < obj->children.size(); i++) {
+                    if (obj->children[i].isvalid()) {
+                        this->markdirty(obj->children[i].resolve());
+                    }
+                }
+            }
+            // An object's parent changed, everything gets re-sorted on the next update().
+            void reparent(GameObject *obj) {
+                this->restructure.store(true, std::memory_order_release);
+                this->markdirty(obj);
+            }
+
+            // World transform of an object, NULL if it doesn't have an up to date one yet (not registered, not updated since, or it or an ancestor changed since).
+            const struct world *get(const GameObject *obj) {
+                const size_t idx = obj->transformidx;
+                if (idx == SIZE_MAX || this->dirty[idx].load(std::memory_order_relaxed)) {
+                    return NULL;
+                }
+                return &this->worlds[idx];
+            }
+
+            // Bring every world transform up to date, once per frame before anything that reads them (partition sync, culling, rendering).
+            void update(void);
+
+            size_t size(void) {
+                return this->objects.size();
+            }
+    };
+
+}
+
+#endif
@@ -59,6 +59,71 @@ namespace OUtils {
         return fnv1a(str, strlen(str), hash);
     }
 
+#define FNV1A64_PRIME 0x00000100000001B3
+#define FNV1A64_SEED 0xCBF29CE484222325
+
+    // 64-bit variant, for when a table is large enough that 32-bit collisions become a real concern. There's deliberately no string overload, fnv1a64(str, len) would silently pick it up with the length as the seed.
+    static inline uint64_t fnv1a64(const void *data, size_t len, uint64_t hash = FNV1A64_SEED) {
+        ASSERT(data != NULL, "Data is NULL.\n");
+        const uint8_t *ptr = (uint8_t *)data;
+        while (len--) {
+            hash = (*ptr++ ^ hash) * FNV1A64_PRIME;
+        }
+        return hash;
+    }
+
+#define HASH64_PRIME1 0x9E3779B185EBCA87
+#define HASH64_PRIME2 0xC2B2AE3D27D4EB4F
+#define HASH64_PRIME3 0x165667B19E3779F9
+#define HASH64_PRIME4 0x85EBCA77C2B2AE63
+
+    static inline uint64_t hash64round(uint64_t acc, uint64_t word) {
+        acc += word * HASH64_PRIME2;
+        acc = (acc << 31) | (acc >> 33);
+        return acc * HASH64_PRIME1;
+    }
+
+    // Bulk data hash (file contents, etc.), xxHash64 style rounds over four independent lanes so it runs at several bytes per cycle rather than FNV's one. Not the same values as xxHash64, don't compare against it.
+    static inline uint64_t hash64(const void *data, size_t len, uint64_t seed = 0) {
+        ASSERT(data != NULL || len == 0, "Data is NULL.\n");
+        const uint8_t *ptr = (const uint8_t *)data;
+        const uint8_t *end = ptr + len;
+        uint64_t hash;
+        uint64_t word;
+        if (len >= 32) {
+            uint64_t lanes[4] = { seed + HASH64_PRIME1 + HASH64_PRIME2, seed + HASH64_PRIME2, seed, seed - HASH64_PRIME1 };
+            for (; ptr + 32 <= end; ptr += 32) {
+                for (size_t i = 0; i < 4; i++) {
+                    memcpy(&word, ptr + i * 8, sizeof(uint64_t));
+                    lanes[i] = hash64round(lanes[i], word);
+                }
+            }
+            hash = ((lanes[0] << 1) | (lanes[0] >> 63)) + ((lanes[1] << 7) | (lanes[1] >> 57)) + ((lanes[2] << 12) | (lanes[2] >> 52)) + ((lanes[3] << 18) | (lanes[3] >> 46));
+            for (size_t i = 0; i < 4; i++) {
+                hash = (hash ^ hash64round(0, lanes[i])) * HASH64_PRIME1 + HASH64_PRIME4;
+            }
+        } else {
+            hash = seed + HASH64_PRIME3;
+        }
+        hash += len;
+        for (; ptr + 8 <= end; ptr += 8) {
+            memcpy(&word, ptr, sizeof(uint64_t));
+            hash ^= hash64round(0, word);
+            hash = ((hash << 27) | (hash >> 37)) * HASH64_PRIME1 + HASH64_PRIME4;
+        }
+        for (; ptr < end; ptr++) {
+            hash ^= *ptr * HASH64_PRIME3;
+            hash = ((hash << 11) | (hash >> 53)) * HASH64_PRIME1;
+        }
+        // Avalanche.
+        hash ^= hash >> 33;
+        hash *= HASH64_PRIME2;
+        hash ^= hash >> 29;
+        hash *= HASH64_PRIME3;
+        hash ^= hash >> 32;
+        return hash;
+    }
+
     constexpr uint32_t STRINGID(const char *str, uint32_t hash = FNV1A_SEED) {
         return *str != '\0' ? STRINGID(str + 1, (*str ^ hash) * FNV1A_PRIME) : hash;
     }
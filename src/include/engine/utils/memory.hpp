@@ -2,6 +2,7 @@
 #define _ENGINE__UTILS__MEMORY_HPP
 
 #include <engine/concurrency/job.hpp>
+#include <sys/mman.h>
 #include <tracy/Tracy.hpp>
 
 namespace OUtils {
@@ -53,23 +54,76 @@ namespace OUtils {
     };
 
 #define MEMORY_POOLALLOCEXPAND 16
+#define MEMORY_POOLMAGAZINE 64 // blocks a worker can keep to itself before handing half of them back to the shared pool (and half of which it takes when it runs dry)
 
+// Per-call pool allocator messages are handy for chasing lock problems but swamp Tracy under any real load, build with OMICRON_NOPOOLMESSAGES to drop them.
+#ifdef OMICRON_NOPOOLMESSAGES
+#define MEMORY_POOLMESSAGE(MSG)
+#else
+#define MEMORY_POOLMESSAGE(MSG) TracyMessageL(MSG)
+#endif
+
+    // Fixed size block allocator.
+    // Worker threads allocate from and free to their own magazine (a small thread-local free list) without any locking, the shared free list (behind a spinlock) is only touched to refill or drain a magazine in batches. Anything outside of the job system uses the shared free list directly.
     class PoolAllocator {
+        public:
+            struct block {
+                struct block *next;
+            };
         private:
+            struct magazine {
+                struct block *head;
+                size_t count;
+                uint8_t pad[64 - sizeof(struct block *) - sizeof(size_t)]; // only ever touched by its own worker, keep it off everyone else's cache lines
+            };
+
             size_t blocksize = 0;
             size_t size = 0;
-            size_t allocated = 0;
+            size_t allocated = 0; // blocks out of the shared free list (including those sitting in magazines)
             size_t expandsize = 0;
             uint8_t *blocks = NULL;
             uint64_t previous = 0;
             OJob::Spinlock spin;
             std::vector<void *> additionalmem; // additional memory allocations (upon expansion)
+            OJob::PerWorker<struct magazine> magazines; // one per worker, created on first use from a worker
 
-        public:
-            struct block {
-                struct block *next;
-            };
+            // Move half a magazine's worth of blocks from the shared free list into a magazine.
+            void refill(struct magazine *magazine) {
+                this->spin.lock();
+                MEMORY_POOLMESSAGE("lock acquired");
+                for (size_t i = 0; i < MEMORY_POOLMAGAZINE / 2; i++) {
+                    if (this->allocblock == NULL) {
+                        this->expand();
+                    }
+                    struct block *block = this->allocblock;
+                    this->allocblock = block->next;
+                    block->next = magazine->head;
+                    magazine->head = block;
+                }
+                this->allocated += MEMORY_POOLMAGAZINE / 2;
+                this->spin.unlock();
+                MEMORY_POOLMESSAGE("lock released");
+                magazine->count += MEMORY_POOLMAGAZINE / 2;
+            }
 
+            // Hand half of a full magazine back to the shared free list in one go.
+            void drain(struct magazine *magazine) {
+                struct block *first = magazine->head;
+                struct block *last = first;
+                for (size_t i = 1; i < MEMORY_POOLMAGAZINE / 2; i++) {
+                    last = last->next;
+                }
+                magazine->head = last->next;
+                magazine->count -= MEMORY_POOLMAGAZINE / 2;
+
+                this->spin.lock();
+                last->next = this->allocblock;
+                this->allocblock = first;
+                this->allocated -= MEMORY_POOLMAGAZINE / 2;
+                this->spin.unlock();
+            }
+
+        public:
             struct block *allocblock = NULL;
             const char *name = NULL;
 
@@ -110,8 +164,16 @@ namespace OUtils {
                 }
             }
 
+            // Number of blocks to grow by once the pool runs dry.
+            void setexpand(size_t expand) {
+                this->expandsize = expand;
+            }
+
             void expand(void) {
                 // we implictly assume this is already locked as it's only ever called inside a mutex locked call
+                if (this->expandsize == 0) {
+                    this->expandsize = MEMORY_POOLALLOCEXPAND; // default constructed pools never had their expansion size set
+                }
                 size_t increment = expandsize;
                 void *memory = malloc(increment * this->blocksize);
                 ASSERT(memory != NULL, "Failed to allocate memory for pool expansion.\n");
@@ -130,69 +192,88 @@ namespace OUtils {
             }
 
             void *alloc(void) {
-                // this->mutex.lock();
-                this->spin.lock();
-                if (OJob::currentfibre != NULL) {
-                    TracyMessageL("lock acquired");
-                    // printf("lock acquired on fibre %lu\n", OJob::currentfibre->id);
-                }
-                // ASSERT(this->allocblock != NULL, "Allocation exceeds available blocks.\n");
+                struct magazine *magazine = this->magazines.get();
+                struct block *freeblock = NULL;
+                if (magazine != NULL) { // Fast path, no locking.
+                    if (magazine->head == NULL) {
+                        this->refill(magazine);
+                    }
+                    freeblock = magazine->head;
+                    magazine->head = freeblock->next;
+                    magazine->count--;
+                } else {
+                    this->spin.lock();
+                    MEMORY_POOLMESSAGE("lock acquired");
 
-                if (this->allocblock == NULL) {
-                    this->expand();
-                    // this->mutex.unlock();
-                    this->spin.unlock();
-                    if (OJob::currentfibre != NULL) {
-                        TracyMessageL("lock released following expansion");
-                        // printf("lock released on fibre before expansion %lu\n", OJob::currentfibre->id);
+                    if (this->allocblock == NULL) {
+                        this->expand();
+                        MEMORY_POOLMESSAGE("pool expanded");
                     }
-                    return this->alloc();
+
+                    freeblock = this->allocblock;
+                    this->allocblock = this->allocblock->next;
+                    this->allocated++;
+                    ASSERT(previous != (uint64_t)freeblock, "Current allocation matches previous %lx == %lx.\n", previous, (uint64_t)previous);
+                    this->previous = 0;
+                    this->spin.unlock();
+                    MEMORY_POOLMESSAGE("lock released");
                 }
 
-                struct block *freeblock = this->allocblock;
                 if (this->name != NULL) {
                     TracySecureAllocN(freeblock, this->blocksize, this->name);
                 }
-                this->allocblock = this->allocblock->next;
-                this->allocated++;
-                ASSERT(previous != (uint64_t)freeblock, "Current allocation matches previous %lx == %lx.\n", previous, (uint64_t)previous);
-                this->previous = 0;
-                // this->mutex.unlock();
-                this->spin.unlock();
-                if (OJob::currentfibre != NULL) {
-                    TracyMessageL("lock released");
-                    // printf("lock released on fibre %lu\n", OJob::currentfibre->id);
-                }
-
                 return (void *)freeblock;
             }
 
             void free(void *ptr) {
-                // this->mutex.lock();
-                this->spin.lock();
                 ASSERT(ptr != NULL, "Expected allocation, not NULL.\n");
 
-                TracyMessageL("Freeing!");
+                MEMORY_POOLMESSAGE("Freeing!");
                 if (this->name != NULL) {
                     TracySecureFreeN(ptr, this->name);
                 }
 
+                struct magazine *magazine = this->magazines.get();
+                if (magazine != NULL) { // Fast path, no locking.
+                    ((struct block *)ptr)->next = magazine->head;
+                    magazine->head = (struct block *)ptr;
+                    if (++magazine->count >= MEMORY_POOLMAGAZINE) {
+                        this->drain(magazine);
+                    }
+                    return;
+                }
+
+                this->spin.lock();
                 ((struct block *)ptr)->next = this->allocblock;
                 this->allocblock = ((struct block *)ptr);
                 this->allocated--;
                 this->spin.unlock();
-                // this->mutex.unlock();
             }
 
+            // Approximate number of free blocks (magazines are read without synchronisation).
             size_t getfree(void) {
-                return this->size - this->allocated;
+                size_t free = this->size - this->allocated;
+                struct magazine *magazines = this->magazines.all();
+                if (magazines != NULL) {
+                    for (size_t i = 0; i < OJob::numworkers; i++) {
+                        free += magazines[i].count;
+                    }
+                }
+                return free;
             }
     };
 
+#define MEMORY_SLABMAXCLASSES 16 // most size classes a slab allocator can have
+#define MEMORY_SLABGRANULARITY 8 // resolution of the size class lookup table
+#define MEMORY_SLABHOST UINT32_MAX // owner of allocations too large for any slab (served by malloc)
+
+    // Size class allocator over a set of pool allocators (one per class).
+    // Every allocation records which slab it came from so it always goes back to the right one, and classes are looked up through a table indexed by size rather than by searching. Slabs grow when exhausted, only allocations larger than the largest class go to malloc.
     class SlabAllocator {
         public:
             struct metadata {
-                size_t size;
+                uint32_t slab; // owning slab index (MEMORY_SLABHOST for the malloc fallback)
+                uint32_t size; // requested size
             };
             const char *name = NULL;
             class Slab {
@@ -202,12 +283,14 @@ namespace OUtils {
                     Slab(void) { }
                     void init(size_t entsize, size_t blocks) {
                         this->entsize = entsize;
-                        // Ideally we wouldn't expand the pool allocators
-                        allocator.init(entsize + sizeof(struct metadata), blocks);
+                        // Grow by an eighth of the initial size at a time once exhausted.
+                        this->allocator.setexpand(blocks / 8 > MEMORY_POOLALLOCEXPAND ? blocks / 8 : MEMORY_POOLALLOCEXPAND);
+                        this->allocator.init(entsize + sizeof(struct metadata), blocks);
                     }
 
-                    void *alloc(size_t size) {
+                    void *alloc(size_t size, uint32_t index) {
                         struct metadata *allocation = (struct metadata *)this->allocator.alloc();
+                        allocation->slab = index;
                         allocation->size = size;
                         return allocation + 1;
                     }
@@ -217,46 +300,71 @@ namespace OUtils {
                     }
             };
 
-            // 7MB~ of preallocated slab memory
-            Slab slabs[10];
+            Slab slabs[MEMORY_SLABMAXCLASSES];
+            size_t numslabs = 0;
+            uint8_t *lut = NULL; // size (in MEMORY_SLABGRANULARITY steps, rounded up) -> smallest slab that fits
+            size_t maxsize = 0; // largest size served by a slab
 
+            // 7MB~ of preallocated slab memory
             SlabAllocator(const char *name = NULL) {
+                static const size_t sizes[] = { 8, 16, 24, 32, 48, 64, 128, 256, 512, 1024 };
+                static const size_t blocks[] = {
+                    16384, 16384, 16384, 16384, 16384, 16384, // 3MB
+                    8096, // 1MB
+                    4096, // 1MB
+                    2048, // 1MB
+                    1024 // 1MB
+                };
+                this->init(sizeof(sizes) / sizeof(sizes[0]), sizes, blocks, name);
+            }
+
+            // Size classes must be given in ascending order.
+            SlabAllocator(size_t count, const size_t *sizes, const size_t *blocks, const char *name = NULL) {
+                this->init(count, sizes, blocks, name);
+            }
+
+            ~SlabAllocator(void) {
+                std::free(this->lut);
+            }
+
+            void init(size_t count, const size_t *sizes, const size_t *blocks, const char *name = NULL) {
+                ASSERT(count > 0 && count <= MEMORY_SLABMAXCLASSES, "Invalid number of slab size classes %lu.\n", count);
                 this->name = name;
-                // 3MB
-                this->slabs[0].init(8, 16384);
-                this->slabs[1].init(16, 16384);
-                this->slabs[2].init(24, 16384);
-                this->slabs[3].init(32, 16384);
-                this->slabs[4].init(48, 16384);
-                this->slabs[5].init(64, 16384);
-
-                // 1MB
-                this->slabs[6].init(128, 8096);
-                // 1MB
-                this->slabs[7].init(256, 4096);
-                // 1MB
-                this->slabs[8].init(512, 2048);
-                // 1MB
-                this->slabs[9].init(1024, 1024);
+                this->numslabs = count;
+                for (size_t i = 0; i < count; i++) {
+                    ASSERT(i == 0 || sizes[i] > sizes[i - 1], "Slab size classes must be in ascending order.\n");
+                    ASSERT((sizes[i] & (MEMORY_SLABGRANULARITY - 1)) == 0, "Slab size class %lu is not a multiple of %u.\n", sizes[i], MEMORY_SLABGRANULARITY);
+                    this->slabs[i].init(sizes[i], blocks[i]);
+                }
+
+                this->maxsize = sizes[count - 1];
+                size_t entries = (this->maxsize + MEMORY_SLABGRANULARITY - 1) / MEMORY_SLABGRANULARITY + 1;
+                this->lut = (uint8_t *)malloc(entries);
+                ASSERT(this->lut != NULL, "Failed to allocate slab size class lookup table.\n");
+                size_t slab = 0;
+                for (size_t i = 0; i < entries; i++) {
+                    while (sizes[slab] < i * MEMORY_SLABGRANULARITY) { // smallest class that holds anything up to this entry's size
+                        slab++;
+                    }
+                    this->lut[i] = slab;
+                }
             }
 
+            // Smallest slab that fits `size`, NULL if it's too large for any of them.
             Slab *optimalslab(size_t size) {
-                for (size_t i = 0; i < sizeof(this->slabs) / sizeof(this->slabs[0]); i++) {
-                    Slab *slab = &this->slabs[i];
-                    // Slab allocator
-                    if (slab->entsize >= size && slab->allocator.allocblock != NULL) {
-                        return slab;
-                    }
+                if (size > this->maxsize) {
+                    return NULL;
                 }
-                return NULL;
+                return &this->slabs[this->lut[(size + MEMORY_SLABGRANULARITY - 1) / MEMORY_SLABGRANULARITY]];
             }
 
             void *alloc(size_t size) {
+                ASSERT(size <= UINT32_MAX, "Allocation of %lu bytes is too large for a slab allocator.\n", size);
                 Slab *slab = this->optimalslab(size);
                 if (slab != NULL) {
-                    void *allocation = slab->alloc(size);
+                    void *allocation = slab->alloc(size, slab - this->slabs);
                     if (this->name != NULL) {
-                        TracySecureAllocN(allocation, sizeof(struct metadata) + size, this->name);
+                        TracySecureAllocN((uint8_t *)allocation - sizeof(struct metadata), sizeof(struct metadata) + size, this->name);
                     }
                     return allocation;
                 }
@@ -264,6 +372,7 @@ namespace OUtils {
                 // Fallback to host memory allocator (yikers!)
                 struct metadata *allocation = (struct metadata *)malloc(size + sizeof(struct metadata));
                 ASSERT(allocation != NULL, "Failed to allocate memory from fallback host memory allocator.\n");
+                allocation->slab = MEMORY_SLABHOST;
                 allocation->size = size;
                 TracySecureAllocN(allocation, sizeof(struct metadata) + size, "SlabAllocator Host Fallback");
                 if (this->name != NULL) {
@@ -274,12 +383,12 @@ namespace OUtils {
 
             virtual void free(void *ptr) {
                 struct metadata *allocation = (struct metadata *)((uint8_t *)ptr - sizeof(struct metadata));
-                Slab *slab = this->optimalslab(allocation->size);
-                if (slab != NULL) {
-                    if (this->name != NULL) {
-                        TracySecureFreeN(allocation, this->name);
-                    }
-                    slab->free(allocation);
+                if (this->name != NULL) {
+                    TracySecureFreeN(allocation, this->name);
+                }
+                if (allocation->slab != MEMORY_SLABHOST) {
+                    ASSERT(allocation->slab < this->numslabs, "Invalid slab %u for allocation %p, must be corrupt!\n", allocation->slab, ptr);
+                    this->slabs[allocation->slab].free(allocation);
                 } else {
                     TracySecureFreeN(allocation, "SlabAllocator Host Fallback");
                     std::free(allocation);
@@ -380,6 +489,106 @@ namespace OUtils {
             }
     };
 
+#define MEMORY_FRAMECHUNK (64 * 1024) // size of the chunks workers carve their frame allocations out of
+#define MEMORY_FRAMESIZE (256 * 1024 * 1024) // reserved (not committed) size of the engine's frame allocator
+
+    // Per-frame arena for transient data (culling results, command recording scratch, upload staging descriptors, etc.), everything allocated from it is released at once by reset().
+    // Each worker bump-allocates out of its own chunk without any locking, fresh chunks come from a shared cursor with a single atomic add. Threads outside of the job system allocate straight from the shared cursor.
+    // The whole capacity is reserved up front but only committed as it's used. Allocations must not outlive the frame, keep two of these around and alternate if data needs to survive until the GPU is done with it.
+    class FrameAllocator {
+        private:
+            struct local {
+                uint8_t *ptr; // next free byte in this worker's chunk
+                uint8_t *end;
+                size_t epoch; // frame the chunk belongs to, a chunk from an older frame is treated as empty
+                uint8_t pad[64 - sizeof(uint8_t *) * 2 - sizeof(size_t)];
+            };
+
+            uint8_t *mem = NULL;
+            size_t size = 0;
+            std::atomic<size_t> cursor = 0; // shared bump offset
+            std::atomic<size_t> epoch = 1;
+            OJob::PerWorker<struct local> locals; // one per worker, created on first use from a worker
+            size_t highwater = 0;
+            const char *name = NULL;
+
+            // Take `size` bytes from the shared cursor.
+            uint8_t *claim(size_t size, size_t align) {
+                size_t offset = this->cursor.fetch_add(size + align - 1, std::memory_order_relaxed);
+                ASSERT(offset + size + align - 1 <= this->size, "Frame allocator %s exhausted (%lu bytes), consider increasing its size.\n", this->name != NULL ? this->name : "", this->size);
+                return (uint8_t *)(((uintptr_t)this->mem + offset + align - 1) & ~(uintptr_t)(align - 1));
+            }
+
+        public:
+            FrameAllocator(void) { }
+            FrameAllocator(size_t size, const char *name = NULL) {
+                this->init(size, name);
+            }
+
+            void init(size_t size, const char *name = NULL) {
+                ASSERT(size >= MEMORY_FRAMECHUNK, "Cannot initialise frame allocator with memory size of %lu\n", size);
+
+                this->name = name;
+                this->size = size;
+                this->mem = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+                ASSERT(this->mem != MAP_FAILED, "Failed to reserve memory for frame allocator.\n");
+                TracySecureAllocN(this->mem, this->size, "FrameAllocator");
+            }
+
+            ~FrameAllocator(void) {
+                if (this->mem != NULL) {
+                    TracySecureFreeN(this->mem, "FrameAllocator");
+                    munmap(this->mem, this->size);
+                }
+            }
+
+            // Allocate `size` bytes aligned to `align` (a power of 2) that stay valid until the next reset().
+            void *alloc(size_t size, size_t align = 16) {
+                ASSERT(align > 0 && (align & (align - 1)) == 0, "Invalid frame allocation alignment %lu.\n", align);
+
+                struct local *local = this->locals.get();
+                if (local == NULL || size > MEMORY_FRAMECHUNK / 4) { // Big allocations would waste most of a chunk, take them straight from the shared cursor.
+                    return this->claim(size, align);
+                }
+
+                size_t epoch = this->epoch.load(std::memory_order_relaxed);
+                uint8_t *ptr = (uint8_t *)(((uintptr_t)local->ptr + align - 1) & ~(uintptr_t)(align - 1));
+                if (local->epoch != epoch || local->ptr == NULL || ptr + size > local->end) {
+                    local->ptr = this->claim(MEMORY_FRAMECHUNK, 64);
+                    local->end = local->ptr + MEMORY_FRAMECHUNK;
+                    local->epoch = epoch;
+                    ptr = (uint8_t *)(((uintptr_t)local->ptr + align - 1) & ~(uintptr_t)(align - 1));
+                }
+                local->ptr = ptr + size;
+                return ptr;
+            }
+
+            // Release everything allocated this frame. Nothing may be allocating from the arena while this happens (call it at the end of the frame once all frame work has finished).
+            void reset(void) {
+                size_t used = this->cursor.exchange(0, std::memory_order_relaxed);
+                this->epoch.fetch_add(1, std::memory_order_relaxed); // Invalidates every worker's chunk without having to touch them.
+                if (used > this->highwater) {
+                    this->highwater = used;
+                }
+                if (this->name != NULL) {
+                    TracyPlot(this->name, (int64_t)used);
+                }
+            }
+
+            // Bytes handed out (in whole chunks for workers) since the last reset.
+            size_t getused(void) {
+                return this->cursor.load(std::memory_order_relaxed);
+            }
+
+            // Most bytes used by any single frame so far.
+            size_t gethighwater(void) {
+                return this->highwater;
+            }
+    };
+
+    // The engine's per-frame arena (culling results and anything else that only lives for a frame), reset at the end of every frame by the main loop.
+    extern FrameAllocator frameallocator;
+
 }
 
 #endif
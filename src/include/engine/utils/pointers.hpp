@@ -8,98 +8,144 @@
 #include <engine/concurrency/job.hpp>
 #include <engine/utils.hpp>
 #include <engine/utils/hash.hpp>
-#include <unordered_map>
-
-#define OMICRON_RESOLUTIONTABLEMAP
+#include <pthread.h>
 
 namespace OUtils {
 
-#ifndef OMICRON_RESOLUTIONTABLEMAP // if we aren't using C++ stl maps for our table
-    class ResolutionTable {
-        public:
-            size_t size = 0;
-            void **table = NULL;
-
-            ResolutionTable(size_t size) {
-                table = (void **)malloc(sizeof(void *) * size);
-                ASSERT(table != NULL, "Failed to allocate memory for handle resolution table.\n");
-                this->size = size;
-            }
-
-            ~ResolutionTable(void) {
-                free(table);
-            }
-
-            size_t bind(void *ptr) {
-                ASSERT(ptr != NULL, "Pointer is NULL.\n");
-                uint32_t off = OUtils::fnv1a(ptr); // we use a hash here to try and reduce the amount of time we'll spend searching for a free spot
-                for (size_t i = 0; i < this->size; i++) {
-                    size_t idx = (off + i) % this->size;
+#define RESOLUTIONTABLE_CHUNKSHIFT 12
+#define RESOLUTIONTABLE_CHUNKSIZE (1 << RESOLUTIONTABLE_CHUNKSHIFT) // slots per chunk
+#define RESOLUTIONTABLE_MAXCHUNKS 4096 // 16M slots
+#define RESOLUTIONTABLE_NOFREE UINT32_MAX
 
-                    if (this->table[idx] != NULL) {
-                        continue;
+    // Generational slot map from handles to pointers. A handle packs the slot index (low 32 bits) with the generation of the slot at the time it was bound (high 32 bits), releasing a slot bumps its generation so every handle still pointing at it stops resolving, and the slot goes on a free list for reuse.
+    // Slots live in fixed size chunks that never move once allocated, so get() is a couple of loads with no lock at all. bind() and release() serialise on a spinlock.
+    class ResolutionTable {
+        private:
+            struct slot {
+                std::atomic<void *> ptr;
+                std::atomic<uint32_t> generation;
+                uint32_t nextfree;
+            };
+
+            std::atomic<struct slot *> chunks[RESOLUTIONTABLE_MAXCHUNKS];
+            size_t numslots = 0; // high water mark
+            uint32_t freelist = RESOLUTIONTABLE_NOFREE;
+            pthread_spinlock_t lock;
+
+            static size_t pack(size_t index, uint32_t generation) {
+                return ((size_t)generation << 32) | index;
+            }
+
+            struct slot *getslot(size_t index) {
+                struct slot *chunk = this->chunks[index >> RESOLUTIONTABLE_CHUNKSHIFT].load(std::memory_order_acquire);
+                return chunk != NULL ? &chunk[index & (RESOLUTIONTABLE_CHUNKSIZE - 1)] : NULL;
+            }
+
+            // Fresh slot off the end of the table, called with the lock held.
+            size_t grow(void) {
+                size_t index = this->numslots++;
+                ASSERT((index >> RESOLUTIONTABLE_CHUNKSHIFT) < RESOLUTIONTABLE_MAXCHUNKS, "Handle resolution table is full.\n");
+                if ((index & (RESOLUTIONTABLE_CHUNKSIZE - 1)) == 0 && this->chunks[index >> RESOLUTIONTABLE_CHUNKSHIFT].load(std::memory_order_relaxed) == NULL) {
+                    struct slot *chunk = (struct slot *)calloc(RESOLUTIONTABLE_CHUNKSIZE, sizeof(struct slot));
+                    ASSERT(chunk != NULL, "Failed to allocate memory for handle resolution table.\n");
+                    for (size_t i = 0; i < RESOLUTIONTABLE_CHUNKSIZE; i++) {
+                        chunk[i].generation.store(1, std::memory_order_relaxed); // generation 0 never resolves, so a zeroed handle is never valid
                     }
-
-                    this->table[idx] = ptr;
-                    return idx;
+                    this->chunks[index >> RESOLUTIONTABLE_CHUNKSHIFT].store(chunk, std::memory_order_release);
                 }
-                return SIZE_MAX;
-            }
-
-            void release(size_t handle) {
-                this->table[handle] = NULL;
-            }
-
-            void *get(size_t handle) {
-                return this->table[handle];
+                return index;
             }
-    };
-#else
-    class ResolutionTable {
         public:
-            OJob::Mutex mutex;
-            size_t size = 0;
-
-            std::unordered_map<size_t, void *> table;
-            size_t handle;
-
             ResolutionTable(size_t size) {
-                this->size = size;
-                this->table.reserve(size); // initialise (these will be the fastest handles)
+                pthread_spin_init(&this->lock, PTHREAD_PROCESS_PRIVATE);
+                for (size_t i = 0; i < RESOLUTIONTABLE_MAXCHUNKS; i++) {
+                    this->chunks[i].store(NULL, std::memory_order_relaxed);
+                }
+                // Allocate enough chunks up front for `size` handles.
+                for (size_t i = 0; i < (size + RESOLUTIONTABLE_CHUNKSIZE - 1) / RESOLUTIONTABLE_CHUNKSIZE && i < RESOLUTIONTABLE_MAXCHUNKS; i++) {
+                    struct slot *chunk = (struct slot *)calloc(RESOLUTIONTABLE_CHUNKSIZE, sizeof(struct slot));
+                    ASSERT(chunk != NULL, "Failed to allocate memory for handle resolution table.\n");
+                    for (size_t j = 0; j < RESOLUTIONTABLE_CHUNKSIZE; j++) {
+                        chunk[j].generation.store(1, std::memory_order_relaxed);
+                    }
+                    this->chunks[i].store(chunk, std::memory_order_relaxed);
+                }
             }
 
             ~ResolutionTable(void) {
-                this->table.clear();
+                for (size_t i = 0; i < RESOLUTIONTABLE_MAXCHUNKS; i++) {
+                    free(this->chunks[i].load(std::memory_order_relaxed));
+                }
+                pthread_spin_destroy(&this->lock);
             }
 
             size_t bind(void *ptr) {
                 ASSERT(ptr != NULL, "Pointer is NULL.\n");
-                this->mutex.lock();
-                size_t index = this->handle++;
-                this->table[index] = ptr;
-                this->mutex.unlock();
-                return index;
+                pthread_spin_lock(&this->lock);
+                size_t index;
+                if (this->freelist != RESOLUTIONTABLE_NOFREE) {
+                    index = this->freelist;
+                    this->freelist = this->getslot(index)->nextfree;
+                } else {
+                    index = this->grow();
+                }
+                struct slot *slot = this->getslot(index);
+                slot->ptr.store(ptr, std::memory_order_release);
+                size_t handle = ResolutionTable::pack(index, slot->generation.load(std::memory_order_relaxed));
+                pthread_spin_unlock(&this->lock);
+                return handle;
+            }
+
+            // Bind `count` objects laid out `stride` bytes apart from `base`, their handles are consecutive from the one returned.
+            size_t bindrange(void *base, size_t stride, size_t count) {
+                ASSERT(base != NULL, "Pointer is NULL.\n");
+                ASSERT(count > 0, "Binding an empty range.\n");
+                pthread_spin_lock(&this->lock);
+                size_t first = SIZE_MAX;
+                for (size_t i = 0; i < count; i++) { // always fresh slots, they all share the initial generation so the handles follow on from each other
+                    size_t index = this->grow();
+                    struct slot *slot = this->getslot(index);
+                    slot->ptr.store((uint8_t *)base + (i * stride), std::memory_order_release);
+                    if (first == SIZE_MAX) {
+                        first = ResolutionTable::pack(index, slot->generation.load(std::memory_order_relaxed));
+                    }
+                }
+                pthread_spin_unlock(&this->lock);
+                return first;
             }
 
             void release(size_t handle) {
-                this->mutex.lock();
-                this->table.erase(handle);
-                this->mutex.unlock();
-            }
-
+                size_t index = handle & UINT32_MAX;
+                pthread_spin_lock(&this->lock);
+                struct slot *slot = this->getslot(index);
+                ASSERT(slot != NULL && slot->generation.load(std::memory_order_relaxed) == (uint32_t)(handle >> 32), "Releasing stale handle %lu.\n", handle);
+                slot->ptr.store(NULL, std::memory_order_relaxed);
+                uint32_t generation = slot->generation.load(std::memory_order_relaxed) + 1;
+                slot->generation.store(generation != 0 ? generation : 1, std::memory_order_release); // skip 0 on wraparound
+                slot->nextfree = this->freelist;
+                this->freelist = index;
+                pthread_spin_unlock(&this->lock);
+            }
+
+            // NULL if the handle is stale (or was never valid).
             void *get(size_t handle) {
-                const auto res = this->table.find(handle);
-                if (res != this->table.end()) {
-                    return res->second;
-                } else {
-                    ASSERT(false, "Invalid handle %lu requested of resolution table, something is seriously wrong.\n", handle);
-                    // TODO: Consider how to act when a handle is invalidated. Typically we'd be okay as returning a result would leave us with nothing of value, marking the pointer as invalid.
-                    // But what if later on we're trying to do work with an object? what do we do then now that the object is invalid?
-                    return NULL; // XXX: Can you even return from this in confidence? We'd assume when resolving a pointer we'd check its validity first, but I guess not.
+                size_t index = handle & UINT32_MAX;
+                if ((index >> RESOLUTIONTABLE_CHUNKSHIFT) >= RESOLUTIONTABLE_MAXCHUNKS) {
+                    return NULL;
+                }
+                struct slot *slot = this->getslot(index);
+                if (slot == NULL) {
+                    return NULL;
                 }
+                uint32_t generation = (uint32_t)(handle >> 32);
+                if (slot->generation.load(std::memory_order_acquire) != generation) {
+                    return NULL;
+                }
+                void *ptr = slot->ptr.load(std::memory_order_acquire);
+                // Released (and possibly rebound) between our loads, the pointer we got may not be ours.
+                return slot->generation.load(std::memory_order_acquire) == generation ? ptr : NULL;
             }
     };
-#endif
 
 #define HANDLE_TEMPLATEINVALID OUtils::Handle<T>(NULL, SIZE_MAX, SIZE_MAX)
 
@@ -8,6 +8,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/types.h>
 
 namespace OUtils {
 
@@ -78,13 +79,53 @@ namespace OUtils {
             }
 
             void push(void *data) {
-                struct work get = this->work(&this->enqueuepos, 0);
-
-                ASSERT(get.cell != NULL, "No space available in queue for element.\n");
+                struct work get;
+                while ((get = this->work(&this->enqueuepos, 0)).cell == NULL) {
+                    // A slot can look occupied while a consumer that has already claimed it is still reading it out (common when the queue holds exactly as many elements as it has slots, like the fibre pool), so only treat it as an error when the queue really is full.
+                    intptr_t enqueue = this->enqueuepos.load(std::memory_order_relaxed);
+                    intptr_t dequeue = this->dequeuepos.load(std::memory_order_relaxed);
+                    ASSERT(enqueue - dequeue <= (intptr_t)this->mask, "No space available in queue for element.\n");
+                }
                 get.cell->data = data;
                 get.cell->seq.store(get.pos + 1, std::memory_order_release);
             }
 
+            // Push `count` elements in one go, reserving all their slots with a single CAS. Returns false (having pushed nothing) if there isn't room for all of them.
+            bool pushbatch(void **data, size_t count) {
+                ASSERT(count <= this->mask + 1, "Batch of %lu elements exceeds queue capacity.\n", count);
+                if (count == 0) {
+                    return true;
+                }
+
+                size_t pos = this->enqueuepos.load(std::memory_order_relaxed);
+                for (;;) {
+                    // Dequeues claim slots in order, so if the first and last slots of our range are free then everything in between has at least been claimed by a consumer.
+                    size_t first = this->buf[pos & this->mask].seq.load(std::memory_order_acquire);
+                    size_t last = this->buf[(pos + count - 1) & this->mask].seq.load(std::memory_order_acquire);
+                    intptr_t diff = (intptr_t)first - (intptr_t)pos;
+
+                    if (!diff && last == pos + count - 1) {
+                        if (this->enqueuepos.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed, std::memory_order_relaxed)) {
+                            break;
+                        }
+                    } else if (diff < 0 || (intptr_t)last - (intptr_t)(pos + count - 1) < 0) {
+                        return false; // not enough room
+                    } else {
+                        pos = this->enqueuepos.load(std::memory_order_relaxed);
+                    }
+                }
+
+                for (size_t i = 0; i < count; i++) {
+                    struct cell *cell = &this->buf[(pos + i) & this->mask];
+                    while (cell->seq.load(std::memory_order_acquire) != pos + i) {
+                        // A consumer has claimed this slot but hasn't finished reading it yet.
+                    }
+                    cell->data = data[i];
+                    cell->seq.store(pos + i + 1, std::memory_order_release);
+                }
+                return true;
+            }
+
             void *pop(void) {
                 struct work get = this->work(&this->dequeuepos, 1);
 
@@ -96,6 +137,126 @@ namespace OUtils {
 
                 return NULL; // queue is empty
             }
+
+            // Approximate number of elements in the queue (racy by nature, only useful for statistics).
+            size_t size(void) {
+                size_t enqueue = this->enqueuepos.load(std::memory_order_relaxed);
+                size_t dequeue = this->dequeuepos.load(std::memory_order_relaxed);
+                return enqueue > dequeue ? enqueue - dequeue : 0;
+            }
+    };
+
+    // Chase-Lev work-stealing deque (using the weak memory model formulation from Le et al. 2013).
+    // Only the owning thread may push() and pop() (LIFO from the bottom), any other thread may steal() (FIFO from the top).
+    class WorkStealingDeque {
+        private:
+            uint8_t pad0[64];
+            std::atomic<void *> *buf = NULL;
+            ssize_t mask = 0;
+            uint8_t pad1[64];
+            std::atomic<ssize_t> top;
+            uint8_t pad2[64];
+            std::atomic<ssize_t> bottom;
+            uint8_t pad3[64];
+        public:
+            WorkStealingDeque(void) {
+                this->top.store(0, std::memory_order_relaxed);
+                this->bottom.store(0, std::memory_order_relaxed);
+            }
+            WorkStealingDeque(size_t size) {
+                this->init(size);
+            }
+
+            void init(size_t size) {
+                ASSERT((size >= 2) && ((size & (size - 1)) == 0), "Invalid deque size %lu, must be a power of 2.\n", size);
+
+                this->buf = (std::atomic<void *> *)malloc(size * sizeof(std::atomic<void *>));
+                ASSERT(this->buf != NULL, "Failed to allocate cells for work-stealing deque.\n");
+                memset((void *)this->buf, 0, size * sizeof(std::atomic<void *>));
+
+                this->mask = size - 1;
+                this->top.store(0, std::memory_order_relaxed);
+                this->bottom.store(0, std::memory_order_relaxed);
+            }
+
+            ~WorkStealingDeque(void) {
+                free(this->buf);
+            }
+
+            // Push onto the bottom of the deque (owner only). Returns false if the deque is full so the caller may overflow elsewhere.
+            bool push(void *data) {
+                ssize_t b = this->bottom.load(std::memory_order_relaxed);
+                ssize_t t = this->top.load(std::memory_order_acquire);
+                if (b - t > this->mask) {
+                    return false; // full
+                }
+
+                this->buf[b & this->mask].store(data, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_release);
+                this->bottom.store(b + 1, std::memory_order_relaxed);
+                return true;
+            }
+
+            // Push as many of `count` elements as will fit onto the bottom of the deque, publishing them all at once (owner only). Returns the number pushed.
+            size_t pushbatch(void **data, size_t count) {
+                ssize_t b = this->bottom.load(std::memory_order_relaxed);
+                ssize_t t = this->top.load(std::memory_order_acquire);
+                ssize_t space = (this->mask + 1) - (b - t);
+                size_t n = space > 0 ? ((size_t)space < count ? (size_t)space : count) : 0;
+
+                for (size_t i = 0; i < n; i++) {
+                    this->buf[(b + i) & this->mask].store(data[i], std::memory_order_relaxed);
+                }
+                std::atomic_thread_fence(std::memory_order_release);
+                this->bottom.store(b + n, std::memory_order_relaxed);
+                return n;
+            }
+
+            // Pop from the bottom of the deque (owner only).
+            void *pop(void) {
+                ssize_t b = this->bottom.load(std::memory_order_relaxed) - 1;
+                this->bottom.store(b, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                ssize_t t = this->top.load(std::memory_order_relaxed);
+
+                if (t > b) { // empty, restore bottom
+                    this->bottom.store(b + 1, std::memory_order_relaxed);
+                    return NULL;
+                }
+
+                void *data = this->buf[b & this->mask].load(std::memory_order_relaxed);
+                if (t == b) { // last element, race any thieves for it
+                    if (!this->top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                        data = NULL; // lost to a thief
+                    }
+                    this->bottom.store(b + 1, std::memory_order_relaxed);
+                }
+                return data;
+            }
+
+            // Steal from the top of the deque (any thread). May spuriously return NULL when racing another thief.
+            void *steal(void) {
+                ssize_t t = this->top.load(std::memory_order_acquire);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                ssize_t b = this->bottom.load(std::memory_order_acquire);
+
+                if (t >= b) {
+                    return NULL; // empty
+                }
+
+                void *data = this->buf[t & this->mask].load(std::memory_order_relaxed);
+                if (!this->top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                    return NULL; // lost the race
+                }
+                return data;
+            }
+
+            // Approximate number of elements (only exact when called by the owner with no concurrent thieves).
+            size_t size(void) {
+                ssize_t b = this->bottom.load(std::memory_order_relaxed);
+                ssize_t t = this->top.load(std::memory_order_relaxed);
+                return b > t ? b - t : 0;
+            }
     };
 
     // struct mpmc_queue {
@@ -55,6 +55,7 @@ int main(int argc, const char **argv) {
     glfwSetKeyCallback(window, keycallback);
 
     OJob::init();
+    OResource::AsyncIO::init();
 
     struct ORenderer::init init = { 0 };
     init.platform.ndt = glfwGetX11Display();
@@ -66,6 +67,7 @@ int main(int argc, const char **argv) {
     OResource::manager.loadrpak(&rpak);
     OResource::RPak shaders = OResource::RPak("shaders.rpak");
     OResource::manager.loadrpak(&shaders);
+    OResource::manager.setbudget(OResource::ResourceManager::CATEGORY_MODEL, 256 * 1024 * 1024, 512 * 1024 * 1024);
 
     PBRPipeline pipeline = PBRPipeline();
     pipeline.init();
@@ -88,9 +90,7 @@ int main(int argc, const char **argv) {
     OScene::Test *m = OScene::GameObject::create<OScene::Test>();
     m->scene = &scene2;
     // test->flags |= OScene::GameObject::IS_INVISIBLE;
-    OResource::manager.create("misc/test2.omod*", new ORenderer::Model("misc/test2.omod"));
-    m->model->model = OResource::manager.get("misc/test2.omod*");
-    m->model->modelpath = "misc/test2.omod";
+    m->model->setmodel("misc/test2.omod");
     printf("bounds.\n");
     m->bounds = OMath::AABB(m->model->model->as<ORenderer::Model>()->bounds.min, m->model->model->as<ORenderer::Model>()->bounds.max);
     printf("done.\n");
@@ -107,8 +107,7 @@ int main(int argc, const char **argv) {
             OScene::Test *e = OScene::GameObject::create<OScene::Test>();
             e->scene = &scene2;
             // e->flags |= OScene::GameObject::IS_INVISIBLE;
-            e->model->model = m->model->model;
-            e->model->modelpath = "misc/test2.omod";
+            e->model->setmodel("misc/test2.omod"); // already resident, just another reference
             e->bounds = m->bounds;
             e->translate(glm::vec3(rand() % 40000, rand() % 5, rand() % 40000));
             e->setrotation(glm::vec3(glm::radians((float)(rand() % 40)), 0.0f, glm::radians((float)(rand() % 40))));
@@ -182,9 +181,17 @@ int main(int argc, const char **argv) {
         }
 
         ((OVulkan::VulkanContext *)ORenderer::context)->execute(&pipeline, &camera);
+        OUtils::frameallocator.reset(); // nothing from this frame is used past here
+        TracyPlot("Frame Allocator High Water (MB)", OUtils::frameallocator.gethighwater() / (1024.0 * 1024.0));
+        OJob::plotstats();
+        OResource::manager.tick();
+        OResource::manager.plotstats();
+        OResource::AsyncIO::plotstats();
+        OResource::AsyncIO::frame();
         FrameMark; // Tracy frame mark.
     }
 
+    OResource::AsyncIO::destroy();
     OJob::destroy();
     delete ORenderer::context;
 
@@ -0,0 +1,75 @@
+// Fibre context switch rate: ping-pongs between the calling thread and a fibre BENCH_SWITCHES times through OJob::switchcontext() and, for comparison, straight through ucontext's swapcontext().
+// OJob::switchcontext() is only the register switch when the engine is built without UCONTEXT_FIBRES, `make clean bench UCONTEXT_FIBRES=1` gets you the job system on ucontext instead.
+//
+// Usage: bin/bench/context
+
+#include <engine/concurrency/context.hpp>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <ucontext.h>
+
+#define BENCH_SWITCHES (16 * 1024 * 1024) // round trips, so twice as many switches
+#define BENCH_STACKSIZE (64 * 1024)
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static struct OJob::context caller, fibre;
+static ucontext_t calleruc, fibreuc;
+
+static void fibreentry(void *) {
+    for (;;) { // never returns, we just stop switching back to it
+        OJob::switchcontext(&fibre, &caller);
+    }
+}
+
+static void fibreentryuc(void) {
+    for (;;) {
+        swapcontext(&fibreuc, &calleruc);
+    }
+}
+
+int main(void) {
+    void *stack = malloc(BENCH_STACKSIZE);
+    void *stackuc = malloc(BENCH_STACKSIZE);
+
+#ifdef JOB_ASMCONTEXT
+    const char *backend = "register switch";
+#else
+    const char *backend = "ucontext";
+#endif
+
+    OJob::initcontext(&fibre, stack, BENCH_STACKSIZE, fibreentry, NULL);
+    double start = now();
+    for (size_t i = 0; i < BENCH_SWITCHES; i++) {
+        OJob::switchcontext(&caller, &fibre);
+    }
+    double ojob = now() - start;
+
+    getcontext(&fibreuc);
+    fibreuc.uc_stack.ss_sp = stackuc;
+    fibreuc.uc_stack.ss_size = BENCH_STACKSIZE;
+    fibreuc.uc_link = NULL;
+    makecontext(&fibreuc, fibreentryuc, 0);
+    start = now();
+    for (size_t i = 0; i < BENCH_SWITCHES; i++) {
+        swapcontext(&calleruc, &fibreuc);
+    }
+    double uc = now() - start;
+
+    char label[64];
+    snprintf(label, sizeof(label), "OJob::switchcontext (%s)", backend);
+    printf("%d round trips\n", BENCH_SWITCHES);
+    printf("%-40s %12s %10s\n", "", "Mswitches/s", "ns/switch");
+    printf("%-40s %12.2f %10.2f\n", label, BENCH_SWITCHES * 2 / ojob / 1e6, ojob * 1e9 / (BENCH_SWITCHES * 2));
+    printf("%-40s %12.2f %10.2f\n", "swapcontext", BENCH_SWITCHES * 2 / uc / 1e6, uc * 1e9 / (BENCH_SWITCHES * 2));
+
+    free(stack);
+    free(stackuc);
+    return 0;
+}
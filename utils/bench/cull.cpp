@@ -0,0 +1,99 @@
+// Frustum culling: culls BENCH_OBJECTS objects (spread through a BENCH_EXTENT box around the camera) through ParitionManager::cull(), and through a copy of the per-object test it replaced.
+// The old path dereferenced each object's handle, transformed its bounds by getglobalstaticmatrix() and tested the resulting sphere against the frustum one object at a time, spread across the job system in chunks here as it was in cells there.
+//
+// Usage: bin/bench/cull [workers]
+// Build with `make bench DEBUG=0`, add AVX2=1 for the 8 wide kernel.
+
+#include <engine/concurrency/job.hpp>
+#include <engine/renderer/camera.hpp>
+#include <engine/scene/scene.hpp>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_OBJECTS (1024 * 1024)
+#define BENCH_EXTENT glm::vec3(4096.0f, 256.0f, 4096.0f)
+#define BENCH_FRAMES 8
+#define BENCH_GRAIN 4096 // objects per job for the old path
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct legacywork {
+    OScene::Scene *scene;
+    OMath::Frustum *frustum;
+    std::atomic<size_t> visible;
+};
+
+static void legacycull(size_t start, size_t end, uintptr_t param) {
+    struct legacywork *work = (struct legacywork *)param;
+    size_t visible = 0;
+    for (size_t i = start; i < end; i++) {
+        OUtils::Handle<OScene::GameObject> obj = work->scene->objects[i];
+        if (!(obj->flags & OScene::GameObject::IS_CULLABLE)) {
+            continue;
+        }
+
+        OMath::AABB bounds = obj->bounds;
+        bounds = bounds.transformed(obj->getglobalstaticmatrix());
+        OMath::Sphere sphere = OMath::Sphere(bounds.centre, bounds.radius());
+        if (work->frustum->testsphere(sphere) == OMath::Frustum::OUTSIDE) {
+            continue;
+        }
+        visible++;
+    }
+    work->visible.fetch_add(visible);
+}
+
+int main(int argc, char **argv) {
+    OJob::init(argc > 1 ? strtoul(argv[1], NULL, 10) : 0);
+    ORenderer::context = new ORenderer::RendererContext(NULL); // the base context, the camera only wants its (no-op) projection adjustment
+
+    srand(1);
+    OScene::Scene *scene = new OScene::Scene();
+    for (size_t i = 0; i < BENCH_OBJECTS; i++) {
+        OScene::GameObject *obj = OScene::GameObject::create<OScene::GameObject>();
+        obj->scene = scene;
+        obj->flags = OScene::GameObject::IS_CULLABLE;
+        obj->bounds = OMath::AABB(glm::vec3(-1.0f), glm::vec3(1.0f));
+        obj->position = (glm::vec3(rand(), rand(), rand()) / (float)RAND_MAX - 0.5f) * BENCH_EXTENT;
+        scene->objects.push_back(obj->gethandle());
+        scene->partitionmanager.add(obj->gethandle());
+        scene->transforms.add(obj->gethandle());
+    }
+    scene->transforms.update();
+
+    ORenderer::PerspectiveCamera camera = ORenderer::PerspectiveCamera(glm::vec3(0.0f), glm::quat(1.0f, 0.0f, 0.0f, 0.0f), 70.0f, 16.0f / 9.0f, 0.1f, 1000.0f);
+    OMath::Frustum frustum = camera.getfrustum();
+
+    size_t visible = 0;
+    double start = now();
+    for (size_t frame = 0; frame < BENCH_FRAMES; frame++) {
+        visible = 0;
+        for (OScene::CullResult *res = scene->partitionmanager.cull(camera); res != NULL; res = res->header.next) {
+            visible += res->header.count;
+        }
+        OUtils::frameallocator.reset();
+    }
+    double partition = (now() - start) / BENCH_FRAMES;
+
+    struct legacywork work = { .scene = scene, .frustum = &frustum, .visible = 0 };
+    start = now();
+    for (size_t frame = 0; frame < BENCH_FRAMES; frame++) {
+        work.visible.store(0);
+        OJob::parallelfor(0, BENCH_OBJECTS, BENCH_GRAIN, legacycull, (uintptr_t)&work);
+    }
+    double legacy = (now() - start) / BENCH_FRAMES;
+    ASSERT(visible == work.visible.load(), "Partition found %lu visible objects, the per-object test %lu.\n", visible, work.visible.load());
+
+    printf("%d objects, %lu visible, %lu workers, %d wide kernel\n", BENCH_OBJECTS, visible, OJob::numworkers, CULL_LANES);
+    printf("%-24s %10s %14s\n", "", "ms/frame", "Mobjects/s");
+    printf("%-24s %10.2f %14.2f\n", "partition cull()", partition * 1e3, BENCH_OBJECTS / partition / 1e6);
+    printf("%-24s %10.2f %14.2f\n", "per-object test", legacy * 1e3, BENCH_OBJECTS / legacy / 1e6);
+    fflush(stdout);
+    _exit(0); // skip tearing the job system down under running workers, the process going away takes them with it
+}
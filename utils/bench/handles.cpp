@@ -0,0 +1,129 @@
+// Handle resolution rate: binds a set of objects and dereferences their handles in bind order and shuffled, through the slot map ResolutionTable and through a copy of the std::unordered_map table it replaced.
+// Both sides do the same stale check on the object id that Handle<T>::operator->() does. Small sets stay in cache and show the cost of the lookup itself, large ones are bound by memory either way.
+//
+// Usage: bin/bench/handles
+
+#include <engine/utils/pointers.hpp>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unordered_map>
+
+#define BENCH_DEREFS (16 * 1024 * 1024) // per measurement, whatever the number of objects
+
+static const size_t objectcounts[] = { 4 * 1024, 64 * 1024, 1024 * 1024 };
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct object {
+    size_t id;
+    float value;
+    uint8_t pad[52]; // roughly a cache line per object, like the things we hand out handles to
+};
+
+// The old table, minus its mutex (we only ever bind from one thread here).
+class MapTable {
+    public:
+        std::unordered_map<size_t, void *> table;
+        size_t handle = 0;
+
+        MapTable(size_t size) {
+            this->table.reserve(size);
+        }
+
+        size_t bind(void *ptr) {
+            size_t index = this->handle++;
+            this->table[index] = ptr;
+            return index;
+        }
+
+        void *get(size_t handle) {
+            const auto res = this->table.find(handle);
+            return res != this->table.end() ? res->second : NULL;
+        }
+};
+
+static float sum = 0.0f; // printed so the loops can't be thrown away
+
+static double derefslotmap(OUtils::Handle<struct object> *handles, size_t *order, size_t count) {
+    float total = 0.0f;
+    double start = now();
+    for (size_t pass = 0; pass < BENCH_DEREFS / count; pass++) {
+        for (size_t i = 0; i < count; i++) {
+            total += handles[order[i]]->value;
+        }
+    }
+    sum += total;
+    return BENCH_DEREFS / (now() - start) / 1e6;
+}
+
+static double derefmap(MapTable *table, size_t *handles, struct object *objects, size_t *order, size_t count) {
+    float total = 0.0f;
+    double start = now();
+    for (size_t pass = 0; pass < BENCH_DEREFS / count; pass++) {
+        for (size_t i = 0; i < count; i++) {
+            const size_t idx = order[i];
+            struct object *ptr = (struct object *)table->get(handles[idx]);
+            ASSERT(ptr != NULL && ptr->id == objects[idx].id, "Attempted to dereference stale pointer.\n");
+            total += ptr->value;
+        }
+    }
+    sum += total;
+    return BENCH_DEREFS / (now() - start) / 1e6;
+}
+
+static void run(size_t count) {
+    struct object *objects = (struct object *)calloc(count, sizeof(struct object));
+    size_t *order = (size_t *)malloc(sizeof(size_t) * count); // object indices to dereference in
+    OUtils::Handle<struct object> *handles = new OUtils::Handle<struct object>[count];
+    size_t *maphandles = (size_t *)malloc(sizeof(size_t) * count);
+    ASSERT(objects != NULL && order != NULL && maphandles != NULL, "Failed to allocate memory for benchmark.\n");
+
+    OUtils::ResolutionTable *slotmap = new OUtils::ResolutionTable(count);
+    MapTable *map = new MapTable(count);
+    for (size_t i = 0; i < count; i++) {
+        objects[i].id = i + 1;
+        objects[i].value = i & 0xFF;
+        handles[i] = OUtils::Handle<struct object>(slotmap, slotmap->bind(&objects[i]), objects[i].id);
+        maphandles[i] = map->bind(&objects[i]);
+        order[i] = i;
+    }
+
+    double slotmapseq = derefslotmap(handles, order, count);
+    double mapseq = derefmap(map, maphandles, objects, order, count);
+
+    srand(1);
+    for (size_t i = count - 1; i > 0; i--) { // Fisher-Yates
+        size_t j = ((size_t)rand() * RAND_MAX + rand()) % (i + 1);
+        size_t tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+    double slotmaprand = derefslotmap(handles, order, count);
+    double maprand = derefmap(map, maphandles, objects, order, count);
+
+    printf("%8lu %14.2f %14.2f %14.2f %14.2f\n", count, slotmapseq, mapseq, slotmaprand, maprand);
+
+    delete slotmap;
+    delete map;
+    delete[] handles;
+    free(maphandles);
+    free(order);
+    free(objects);
+}
+
+int main(void) {
+    printf("%d derefs per measurement, Mderefs/s\n", BENCH_DEREFS);
+    printf("%8s %14s %14s %14s %14s\n", "", "in order", "", "shuffled", "");
+    printf("%8s %14s %14s %14s %14s\n", "objects", "slot map", "unordered_map", "slot map", "unordered_map");
+    for (size_t i = 0; i < sizeof(objectcounts) / sizeof(objectcounts[0]); i++) {
+        run(objectcounts[i]);
+    }
+    printf("(checksum %.0f)\n", sum);
+    return 0;
+}
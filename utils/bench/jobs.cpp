@@ -0,0 +1,79 @@
+// Job system throughput: kicks BENCH_JOBS empty jobs and reports how many complete per second for each worker count.
+// Jobs are kicked both from outside the job system (the global queue) and from inside a job (the worker's own deque, everyone else has to steal).
+//
+// Usage: bin/bench/jobs [max workers], runs 1, 2, 4, ... workers up to the maximum (default: one per core), each in its own process.
+// Build with `make bench DEBUG=0`, Tracy instrumentation is otherwise part of what gets measured.
+
+#include <engine/concurrency/job.hpp>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_JOBS (1024 * 1024)
+#define BENCH_BATCH 4096 // jobs in flight at once, keeps us inside the job pool
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void empty(OJob::Job *job) { }
+
+static void kickall(void) {
+    static OJob::Job *jobs[BENCH_BATCH];
+    for (size_t done = 0; done < BENCH_JOBS; done += BENCH_BATCH) {
+        OJob::Counter counter;
+        for (size_t i = 0; i < BENCH_BATCH; i++) {
+            jobs[i] = new OJob::Job(empty, 0);
+            jobs[i]->stack = OJob::Job::STACK_SMALL;
+            jobs[i]->counter = &counter;
+        }
+        OJob::kickjobs(BENCH_BATCH, jobs);
+        counter.wait();
+    }
+}
+
+static void kicker(OJob::Job *job) {
+    kickall();
+}
+
+static void run(size_t workers) {
+    OJob::init(workers);
+
+    kickall(); // warm up pools and fibres
+
+    double start = now();
+    kickall();
+    double external = now() - start;
+
+    start = now();
+    OJob::Counter counter;
+    OJob::Job *job = new OJob::Job(kicker, 0);
+    job->counter = &counter;
+    OJob::kickjobwait(job);
+    double internal = now() - start;
+
+    printf("%7lu %21.2f %21.2f\n", workers, BENCH_JOBS / external / 1e6, BENCH_JOBS / internal / 1e6);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+    size_t max = argc > 1 ? strtoul(argv[1], NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+
+    printf("%lu empty jobs, %d in flight\n", (size_t)BENCH_JOBS, BENCH_BATCH);
+    printf("%7s %21s %21s\n", "workers", "external (Mjobs/s)", "from a job (Mjobs/s)");
+    for (size_t workers = 1; workers <= max; workers = workers * 2 > max && workers != max ? max : workers * 2) {
+        fflush(stdout);
+        pid_t pid = fork(); // the job system is only meant to be brought up once per process
+        if (pid == 0) {
+            run(workers);
+            _exit(0); // skip tearing the job system down under running workers, the process going away takes them with it
+        }
+        waitpid(pid, NULL, 0);
+    }
+    return 0;
+}
@@ -0,0 +1,87 @@
+// Pool allocator contention: BENCH_THREADS threads each churn BENCH_PAIRS alloc/free pairs (in bursts of BENCH_BURST) on one pool.
+// Plain threads aren't workers, so they all go through the shared locked free list. Job workers get a magazine each and only touch the shared list to refill or drain in batches.
+//
+// Usage: bin/bench/pool, each thread count runs in its own process.
+// Build with `make bench DEBUG=0 POOL_MESSAGES=0` for the numbers the engine actually sees.
+
+#include <engine/concurrency/job.hpp>
+#include <engine/utils/memory.hpp>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_PAIRS (1024 * 1024) // per thread
+#define BENCH_BURST 16 // blocks held at once by each thread
+#define BENCH_BLOCKSIZE 64
+
+static const size_t threadcounts[] = { 1, 4, 16, 64 };
+
+static OUtils::PoolAllocator pool = OUtils::PoolAllocator(BENCH_BLOCKSIZE, 16384, 256, "Bench Pool");
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void churn(void) {
+    void *held[BENCH_BURST];
+    for (size_t i = 0; i < BENCH_PAIRS / BENCH_BURST; i++) {
+        for (size_t j = 0; j < BENCH_BURST; j++) {
+            held[j] = pool.alloc();
+        }
+        for (size_t j = 0; j < BENCH_BURST; j++) {
+            pool.free(held[j]);
+        }
+    }
+}
+
+static void *churnthread(void *) {
+    churn();
+    return NULL;
+}
+
+static void churnjob(size_t start, size_t end, uintptr_t) {
+    for (size_t i = start; i < end; i++) {
+        churn();
+    }
+}
+
+static void run(size_t threads) {
+    pthread_t ids[threads];
+    double start = now();
+    for (size_t i = 0; i < threads; i++) {
+        pthread_create(&ids[i], NULL, churnthread, NULL);
+    }
+    for (size_t i = 0; i < threads; i++) {
+        pthread_join(ids[i], NULL);
+    }
+    double shared = now() - start;
+
+    OJob::init(threads);
+    start = now();
+    OJob::parallelfor(0, threads, 1, churnjob, 0);
+    double magazines = now() - start;
+
+    printf("%7lu %24.2f %24.2f\n", threads, threads * BENCH_PAIRS / shared / 1e6, threads * BENCH_PAIRS / magazines / 1e6);
+    fflush(stdout);
+}
+
+int main(void) {
+    printf("%d alloc/free pairs per thread, %d held at once\n", BENCH_PAIRS, BENCH_BURST);
+    printf("%7s %24s %24s\n", "threads", "shared lock (Mpairs/s)", "magazines (Mpairs/s)");
+    for (size_t i = 0; i < sizeof(threadcounts) / sizeof(threadcounts[0]); i++) {
+        fflush(stdout);
+        pid_t pid = fork(); // the job system is only meant to be brought up once per process
+        if (pid == 0) {
+            run(threadcounts[i]);
+            _exit(0); // skip tearing the job system down under running workers, the process going away takes them with it
+        }
+        waitpid(pid, NULL, 0);
+    }
+    return 0;
+}
@@ -0,0 +1,178 @@
+// RPak load time against disk footprint: packs a generated set of texture-like (compressible) and noise (incompressible, stored as is) files, then times reading them back.
+// Whole file reads are timed from the calling thread (inflating serially) and from a job (inflating across every worker), against reading the loose files. Sub-range reads pull BENCH_RANGESIZE bytes from random offsets in compressed files, which only inflates the blocks they touch.
+// Everything is in the page cache by the time we read, so this measures decompression rather than the disk, a cold disk read favours the smaller archive.
+//
+// Usage: bin/bench/rpak [workers], packs into (and cleans up) a temporary directory.
+
+#include <engine/concurrency/job.hpp>
+#include <engine/resources/rpak.hpp>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_COMPRESSIBLE 16 // files of each kind
+#define BENCH_INCOMPRESSIBLE 4
+#define BENCH_FILESIZE (4 * 1024 * 1024)
+#define BENCH_PASSES 4 // whole file reads of every file
+#define BENCH_RANGES 4096 // sub-range reads
+#define BENCH_RANGESIZE (4 * 1024)
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t seed = 0x9E3779B97F4A7C15;
+static uint32_t random32(void) { // xorshift, we only need it to be deterministic
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed >> 32;
+}
+
+static void generate(const char *path, bool compressible) {
+    uint8_t *data = (uint8_t *)malloc(BENCH_FILESIZE);
+    ASSERT(data != NULL, "Failed to allocate memory for generated file.\n");
+    for (size_t i = 0; i < BENCH_FILESIZE; i++) {
+        const size_t x = i % 1024;
+        const size_t y = i / 1024;
+        data[i] = compressible ? ((x + y) / 8) + (random32() & 7) : random32(); // smooth gradient with some noise, like an uncompressed texture
+    }
+    FILE *f = fopen(path, "w");
+    ASSERT(f != NULL, "Failed to create `%s`.\n", path);
+    ASSERT(fwrite(data, BENCH_FILESIZE, 1, f), "Failed to write `%s`.\n", path);
+    fclose(f);
+    free(data);
+}
+
+static size_t filesize(const char *path) {
+    struct stat st;
+    ASSERT(!stat(path, &st), "Failed to stat `%s`.\n", path);
+    return st.st_size;
+}
+
+static OResource::RPak *rpak = NULL;
+static uint8_t *buf = NULL;
+
+// Read every file (of one kind) in full, returns MB/s of file data.
+static double readall(bool compressed) {
+    size_t total = 0;
+    double start = now();
+    for (size_t pass = 0; pass < BENCH_PASSES; pass++) {
+        for (size_t i = 0; i < rpak->header.num; i++) {
+            const struct OResource::RPak::tableentry *entry = &rpak->entries[i];
+            if (entry->compressed == compressed) {
+                total += rpak->read(entry, buf, entry->uncompressedsize, 0);
+            }
+        }
+    }
+    return total / (now() - start) / 1e6;
+}
+
+// Same again for the loose files we packed.
+static double readloose(bool compressible) {
+    size_t total = 0;
+    double start = now();
+    for (size_t pass = 0; pass < BENCH_PASSES; pass++) {
+        for (size_t i = 0; i < (compressible ? BENCH_COMPRESSIBLE : BENCH_INCOMPRESSIBLE); i++) {
+            char path[64];
+            snprintf(path, sizeof(path), "data/%s%lu.bin", compressible ? "texture" : "noise", i);
+            int fd = open(path, O_RDONLY);
+            ASSERT(fd != -1, "Failed to open `%s`.\n", path);
+            total += pread(fd, buf, BENCH_FILESIZE, 0);
+            close(fd);
+        }
+    }
+    return total / (now() - start) / 1e6;
+}
+
+// Random BENCH_RANGESIZE reads out of compressed files, returns microseconds per read.
+static double readranges(void) {
+    const struct OResource::RPak::tableentry *compressed[BENCH_COMPRESSIBLE];
+    size_t count = 0;
+    for (size_t i = 0; i < rpak->header.num && count < BENCH_COMPRESSIBLE; i++) {
+        if (rpak->entries[i].compressed) {
+            compressed[count++] = &rpak->entries[i];
+        }
+    }
+    ASSERT(count > 0, "Nothing in the archive was compressed.\n");
+
+    double start = now();
+    for (size_t i = 0; i < BENCH_RANGES; i++) {
+        const struct OResource::RPak::tableentry *entry = compressed[random32() % count];
+        rpak->read(entry, buf, BENCH_RANGESIZE, random32() % (entry->uncompressedsize - BENCH_RANGESIZE));
+    }
+    return (now() - start) * 1e6 / BENCH_RANGES;
+}
+
+static double jobresult = 0.0;
+
+static void readalljob(OJob::Job *) {
+    jobresult = readall(true);
+}
+
+int main(int argc, char **argv) {
+    char dir[] = "/tmp/omicron-rpak-XXXXXX";
+    ASSERT(mkdtemp(dir) != NULL, "Failed to create temporary directory.\n");
+    ASSERT(!chdir(dir), "Failed to enter temporary directory.\n");
+    ASSERT(!mkdir("data", 0755), "Failed to create data directory.\n");
+
+    size_t raw = 0;
+    for (size_t i = 0; i < BENCH_COMPRESSIBLE + BENCH_INCOMPRESSIBLE; i++) {
+        char path[64];
+        snprintf(path, sizeof(path), "data/%s%lu.bin", i < BENCH_COMPRESSIBLE ? "texture" : "noise", i < BENCH_COMPRESSIBLE ? i : i - BENCH_COMPRESSIBLE);
+        generate(path, i < BENCH_COMPRESSIBLE);
+        raw += BENCH_FILESIZE;
+    }
+
+    double start = now();
+    OResource::RPak::create("data", "bench.rpak");
+    double packtime = now() - start;
+
+    OJob::init(argc > 1 ? strtoul(argv[1], NULL, 10) : 0);
+    rpak = new OResource::RPak("bench.rpak");
+    buf = (uint8_t *)malloc(BENCH_FILESIZE);
+    ASSERT(buf != NULL, "Failed to allocate read buffer.\n");
+
+    const size_t archive = filesize("bench.rpak");
+    printf("%d texture-like + %d noise files of %d MB, block size %d KB\n", BENCH_COMPRESSIBLE, BENCH_INCOMPRESSIBLE, BENCH_FILESIZE / (1024 * 1024), RPAK_BLOCKSIZE / 1024);
+    printf("footprint: %.1f MB raw, %.1f MB packed (%.1f%%), packed in %.2fs\n", raw / 1e6, archive / 1e6, archive * 100.0 / raw, packtime);
+
+    readall(true); // warm up
+    double serial = readall(true);
+    OJob::Counter counter;
+    OJob::Job *job = new OJob::Job(readalljob, 0);
+    job->counter = &counter;
+    OJob::kickjobwait(job);
+    double parallel = jobresult;
+
+    printf("%-44s %10s\n", "whole file reads", "MB/s");
+    printf("%-44s %10.1f\n", "loose texture files", readloose(true));
+    printf("%-44s %10.1f\n", "compressed, inflated on the calling thread", serial);
+    char label[64];
+    snprintf(label, sizeof(label), "compressed, inflated across %lu workers", OJob::numworkers);
+    printf("%-44s %10.1f\n", label, parallel);
+    printf("%-44s %10.1f\n", "loose noise files", readloose(false));
+    printf("%-44s %10.1f\n", "stored (incompressible)", readall(false));
+    printf("%d byte reads at random offsets in compressed files: %.2f us each\n", BENCH_RANGESIZE, readranges());
+
+    delete rpak;
+    free(buf);
+    for (size_t i = 0; i < BENCH_COMPRESSIBLE + BENCH_INCOMPRESSIBLE; i++) {
+        char path[64];
+        snprintf(path, sizeof(path), "data/%s%lu.bin", i < BENCH_COMPRESSIBLE ? "texture" : "noise", i < BENCH_COMPRESSIBLE ? i : i - BENCH_COMPRESSIBLE);
+        unlink(path);
+    }
+    rmdir("data");
+    unlink("bench.rpak");
+    ASSERT(!chdir("/"), "Failed to leave temporary directory.\n");
+    rmdir(dir);
+    fflush(stdout);
+    _exit(0); // skip tearing the job system down under running workers, the process going away takes them with it
+}
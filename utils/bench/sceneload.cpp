@@ -0,0 +1,122 @@
+// Scene load time: builds a BENCH_OBJECTS object scene (groups of a root with BENCH_CHILDREN children, spread through a BENCH_EXTENT cube), saves it in the current format and in the version 1 layout, then times Scene::load() on each.
+// Version 1 goes through the legacy loader (one record at a time on the calling thread), the current version is mapped and instantiated across the job system. Each load runs in its own process so neither inherits the other's objects.
+//
+// Usage: bin/bench/sceneload [workers], writes its scene files to /tmp and removes them after.
+// Build with `make bench DEBUG=0`.
+
+#include <engine/concurrency/job.hpp>
+#include <engine/scene/scene.hpp>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_OBJECTS (1024 * 1024)
+#define BENCH_CHILDREN 3 // per root object
+#define BENCH_EXTENT 4096.0f
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static float randomfloat(void) {
+    return (rand() / (float)RAND_MAX) * BENCH_EXTENT - (BENCH_EXTENT / 2.0f);
+}
+
+// Same records the engine wrote before the current format.
+static void savelegacy(OScene::Scene *scene, const char *path) {
+    FILE *f = fopen(path, "w");
+    ASSERT(f != NULL, "Failed to open `%s` for writing.\n", path);
+    struct OScene::Scene::scenehdr header = { };
+    memcpy(header.magic, "OSCE", 5);
+    header.numobjects = scene->objects.size();
+    ASSERT(fwrite(&header, sizeof(header), 1, f), "Failed to write scene header.\n");
+
+    for (size_t i = 0; i < scene->objects.size(); i++) {
+        OUtils::Handle<OScene::GameObject> obj = scene->objects[i];
+        OResource::Serialiser serialiser = OResource::Serialiser();
+        obj->serialise(&serialiser);
+
+        struct OScene::Scene::gameobjecthdr gobj = { };
+        gobj.id = obj->id;
+        gobj.type = obj->type;
+        gobj.flags = obj->flags;
+        gobj.position = obj->position;
+        gobj.orientation = obj->orientation;
+        gobj.scale = obj->scale;
+        gobj.min = obj->bounds.min;
+        gobj.max = obj->bounds.max;
+        gobj.parent = obj->parent.isvalid() ? obj->parent->id : 0;
+        gobj.numchildren = obj->children.size();
+        gobj.datasize = serialiser.writeoffset;
+        ASSERT(fwrite(&gobj, sizeof(gobj), 1, f), "Failed to write game object header.\n");
+        for (auto it = obj->children.begin(); it != obj->children.end(); it++) {
+            size_t id = (*it)->id;
+            ASSERT(fwrite(&id, sizeof(size_t), 1, f), "Failed to write game object children.\n");
+        }
+        if (gobj.datasize) {
+            ASSERT(fwrite(serialiser.data, gobj.datasize, 1, f), "Failed to write game object data.\n");
+        }
+    }
+    fclose(f);
+}
+
+static size_t filesize(const char *path) {
+    struct stat st;
+    ASSERT(!stat(path, &st), "Failed to stat `%s`.\n", path);
+    return st.st_size;
+}
+
+static void timeload(const char *label, const char *path, size_t workers) {
+    fflush(stdout);
+    pid_t pid = fork(); // the job system is only meant to be brought up once per process
+    if (pid == 0) {
+        OJob::init(workers);
+        OScene::Scene *scene = new OScene::Scene();
+        double start = now();
+        scene->load(path);
+        double elapsed = now() - start;
+        ASSERT(scene->objects.size() == BENCH_OBJECTS, "Loaded %lu objects, expected %d.\n", scene->objects.size(), BENCH_OBJECTS);
+        printf("%-12s %8.1f MB %10.0f ms %10.2f Mobjects/s\n", label, filesize(path) / 1e6, elapsed * 1e3, BENCH_OBJECTS / elapsed / 1e6);
+        fflush(stdout);
+        _exit(0); // skip tearing the job system down under running workers, the process going away takes them with it
+    }
+    waitpid(pid, NULL, 0);
+}
+
+int main(int argc, char **argv) {
+    size_t workers = argc > 1 ? strtoul(argv[1], NULL, 10) : 0;
+    OScene::setupreflection();
+
+    srand(1);
+    OScene::Scene *scene = new OScene::Scene(); // only for saving, objects are never added to its transforms or partition
+    OScene::GameObject *root = NULL;
+    for (size_t i = 0; i < BENCH_OBJECTS; i++) {
+        OScene::GameObject *obj = OScene::GameObject::create<OScene::GameObject>();
+        obj->flags = OScene::GameObject::IS_CULLABLE;
+        obj->bounds = OMath::AABB(glm::vec3(-1.0f), glm::vec3(1.0f));
+        if (i % (BENCH_CHILDREN + 1) == 0) {
+            obj->position = glm::vec3(randomfloat(), randomfloat(), randomfloat());
+            root = obj;
+        } else {
+            obj->position = glm::vec3(i % (BENCH_CHILDREN + 1), 0.0f, 0.0f);
+            obj->setparent(root->gethandle());
+        }
+        scene->objects.push_back(obj->gethandle());
+    }
+    scene->save("/tmp/omicron-bench.osce");
+    savelegacy(scene, "/tmp/omicron-bench-v1.osce");
+
+    printf("%d objects (%d children per root)\n", BENCH_OBJECTS, BENCH_CHILDREN);
+    timeload("version 1", "/tmp/omicron-bench-v1.osce", workers);
+    timeload("version 2", "/tmp/omicron-bench.osce", workers);
+
+    unlink("/tmp/omicron-bench.osce");
+    unlink("/tmp/omicron-bench-v1.osce");
+    return 0;
+}
@@ -1,9 +1,14 @@
 #include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 #include <zlib.h>
 
 #define ASSERT(cond, ...) ({ \
@@ -14,9 +19,27 @@
     } \
 })
 
-#define RPAK_FORMATVERSION 1
-#define RPAK_COMPRESSBIAS (16 * 1024 * 1024) // above 16MB we compress the file
+#define RPAK_FORMATVERSION 3
+#define RPAK_COMPRESSBIAS (64 * 1024) // files at least this big are considered for compression
 #define RPAK_COMPRESSIONFAULTTOLERANCE (32) // fault tolerance for compression buffers
+#define RPAK_COMPRESSIONLEVEL 6 // zlib level
+#define RPAK_COMPRESSMINSAVING 8 // percent, files that compress worse than this are stored as is
+#define RPAK_BLOCKSIZE (64 * 1024) // uncompressed size of each independently compressed block
+#define RPAK_DATAALIGN 8 // file data starts on this boundary
+#define RPAK_ALIGNDATA(x) (((x) + RPAK_DATAALIGN - 1) & ~(size_t)(RPAK_DATAALIGN - 1))
+#define RPAK_INDEXEMPTY 0 // empty hash index bucket (buckets otherwise hold entry index + 1)
+#define RPAK_MANIFESTVERSION 1
+#define RPAK_WINDOW 4 // files each worker may have packed ahead of the writer (bounds memory use to roughly threads * window * file size)
+#define RPAK_COPYCHUNK (1024 * 1024) // chunk size for copying reused data over from the previous pack
+
+// Must match OUtils::fnv1a64() in the engine, the index is built against it.
+static uint64_t fnv1a64(const void *data, size_t len, uint64_t hash = 0xCBF29CE484222325) {
+    const uint8_t *ptr = (const uint8_t *)data;
+    while (len--) {
+        hash = (*ptr++ ^ hash) * 0x00000100000001B3;
+    }
+    return hash;
+}
 
 struct header {
     char magic[5]; // RPAK\0
@@ -26,157 +49,497 @@ struct header {
     uint32_t num; // number of package entries
 } __attribute__((packed));
 
-struct tableentry {
-    char path[512]; // full pathname for the file in RPak
-    bool compressed; // is this file compressed?
-    size_t uncompressedsize; // original file size
-    size_t compressedsize; // file size when compressed
-    size_t offset; // offset of file data in blob
+// Layout (version 3): header | tocheader | diskentry[num] | uint32_t index[buckets] | path strings | file data
+// Compressed files: uint64_t blockoffsets[blocks + 1] | block data (each block its own zlib stream, stored as is if it doesn't shrink)
+// Must match OResource::RPak, see src/include/engine/resources/rpak.hpp.
+struct tocheader {
+    uint32_t buckets; // number of hash index buckets (power of 2)
+    uint64_t stringsize; // size of the path string table
 } __attribute__((packed));
 
-struct data {
-    uint8_t *data;
+struct diskentry {
+    uint64_t hash; // fnv1a64 of the path
+    uint32_t pathoffset; // offset of the (NUL terminated) path in the string table
+    uint16_t pathlen; // length of the path (excluding NUL)
+    uint8_t compressed; // is this file compressed?
+    uint8_t reserved;
+    uint64_t uncompressedsize; // original file size
+    uint64_t compressedsize; // file size when compressed
+    uint64_t offset; // offset of file data in the archive
+} __attribute__((packed));
+
+// Build-time information kept alongside the pack (<output>.manifest) so the next build knows what it can reuse. One line per entry, in entry order.
+struct manifestentry {
+    int64_t mtime; // nanoseconds
+    uint64_t size;
+    uint64_t contenthash; // fnv1a64 of the uncompressed contents
+};
+
+struct file {
+    char *path; // full pathname for the file in RPak
+    char *fpath; // path on disk
     size_t size;
+    int64_t mtime;
+
+    // Filled in by whichever worker packs the file.
+    bool ready;
+    bool reused; // copy the data over from the previous pack rather than writing data
+    bool compressed;
+    uint64_t contenthash;
+    uint8_t *data;
+    size_t outsize; // size of the data in the archive
+    size_t prevoffset; // offset of the data in the previous pack when reused
+};
+
+struct filelist {
+    struct file *files;
+    size_t count;
+    size_t capacity;
 };
 
-static size_t listdir(int counter, char *path, char *gdpath, struct tableentry **tables, size_t *tableidx, struct data **data, size_t *dataidx, size_t *datasize) {
+struct previous {
+    int fd;
+    struct header header;
+    struct tocheader toc;
+    struct diskentry *entries;
+    uint32_t *index;
+    char *strings;
+    struct manifestentry *manifest;
+};
+
+struct builder {
+    struct filelist *list;
+    struct previous *previous; // NULL for a full build
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t next; // next file for a worker to pick up
+    size_t written; // files written out so far
+    size_t window; // how far ahead of the writer the workers may get
+};
+
+static int64_t filemtime(const struct stat *st) {
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+static void listdir(char *path, char *gdpath, struct filelist *list) {
     struct dirent *dir;
     DIR *d = opendir(path);
     if (d == NULL) {
-        return 0;
+        return;
     }
-    size_t count = 0;
     while ((dir = readdir(d)) != NULL) {
         if (dir->d_type == DT_REG) {
-            count++;
             char dpath[512];
             char fpath[512];
-            // if (counter == 1) {
-                // snprintf(dpath, 512, "%s", dir->d_name);
-            // } else {
-                snprintf(dpath, 512, "%s/%s", gdpath, dir->d_name);
-            // }
+            snprintf(dpath, 512, "%s/%s", gdpath, dir->d_name);
             snprintf(fpath, 512, "%s/%s", path, dir->d_name);
 
-            struct tableentry entry = { 0 };
-            FILE *f = fopen(fpath, "r");
-            ASSERT(f, "Failed to open file for RPAK compression.\n");
-            fseek(f, 0, SEEK_END);
-            entry.uncompressedsize = ftell(f);
-            fseek(f, 0, SEEK_SET);
-            entry.offset = 0;
-            strncpy(entry.path, dpath, 512);
-            // XXX: Too expensive
-            // entry.compressed = (entry.uncompressedsize > RPAK_COMPRESSBIAS);
-
-            uint8_t *fdata = (uint8_t *)malloc(entry.uncompressedsize);
-            ASSERT(fread(fdata, entry.uncompressedsize, 1, f), "Failed to read file for RPAK compression.\n");
-            fclose(f);
-
-            uint8_t *compressed = NULL;
-
-            if (entry.compressed) {
-                compressed = (uint8_t *)malloc(entry.uncompressedsize + RPAK_COMPRESSIONFAULTTOLERANCE); // more space for the compression (annoying if it gets too big)
-                size_t compressedsize = entry.uncompressedsize + RPAK_COMPRESSIONFAULTTOLERANCE;
-                int res = compress(compressed, &compressedsize, fdata, entry.uncompressedsize);
-                ASSERT(res == Z_OK, "Compression failed.\n");
-                entry.compressedsize = compressedsize;
-                free(fdata);
-            } else {
-                entry.compressedsize = entry.uncompressedsize;
-            }
+            struct stat st;
+            ASSERT(!stat(fpath, &st), "Failed to stat file `%s` for RPAK packaging.\n", fpath);
+            ASSERT(st.st_size > 0, "Failed to determine file size for RPAK packaging.\n");
 
-            size_t outsize = entry.compressed ? entry.compressedsize : entry.uncompressedsize;
-            (*tables)[*tableidx] = entry;
-            (*tableidx)++;
-            *tables = (struct tableentry *)realloc(*tables, sizeof(struct tableentry) * ((*tableidx) + 1));
-            entry.offset = outsize;
-            struct data *d = *data;
-            d[*dataidx] = (struct data) { .data = (uint8_t *)malloc(outsize), .size = outsize };
-            memcpy(d[*dataidx].data, entry.compressed ? compressed : fdata, outsize);
-            (*dataidx)++;
-            *datasize += outsize;
-            *data = (struct data *)realloc(*data, sizeof(struct data) * ((*dataidx) + 1));
-
-            if (entry.compressed) {
-                free(compressed);
-            } else {
-                free(fdata);
+            if (list->count == list->capacity) { // grow geometrically rather than per entry
+                list->capacity = list->capacity ? list->capacity * 2 : 64;
+                list->files = (struct file *)realloc(list->files, sizeof(struct file) * list->capacity);
+                ASSERT(list->files != NULL, "Failed to allocate memory for RPAK file list.\n");
             }
-
+            struct file *file = &list->files[list->count++];
+            memset(file, 0, sizeof(struct file));
+            file->path = strdup(dpath);
+            file->fpath = strdup(fpath);
+            ASSERT(file->path != NULL && file->fpath != NULL, "Failed to allocate memory for RPAK file paths.\n");
+            file->size = st.st_size;
+            file->mtime = filemtime(&st);
         } else if (dir->d_type == DT_DIR && strcmp(dir->d_name, ".") && strcmp(dir->d_name, "..")) {
             char dpath[512];
-            // if (counter == 1) {
-                // snprintf(dpath, 256, "%s", dir->d_name);
-            // } else {
-                snprintf(dpath, 256, "%s/%s", gdpath, dir->d_name);
-            // }
+            snprintf(dpath, 256, "%s/%s", gdpath, dir->d_name);
             char fpath[512];
             snprintf(fpath, 256, "%s/%s", path, dir->d_name);
-            count += listdir(counter - 1, fpath, dpath, tables, tableidx, data, dataidx, datasize);
+            listdir(fpath, dpath, list);
         }
     }
     closedir(d);
+}
+
+static uint8_t *compressblocks(const uint8_t *data, size_t size, size_t *outsize) {
+    if (size < RPAK_COMPRESSBIAS) {
+        return NULL;
+    }
+
+    size_t blocks = (size + RPAK_BLOCKSIZE - 1) / RPAK_BLOCKSIZE;
+    size_t tablesize = sizeof(uint64_t) * (blocks + 1);
+    uint8_t *out = (uint8_t *)malloc(tablesize + compressBound(size) + (blocks * RPAK_COMPRESSIONFAULTTOLERANCE));
+    ASSERT(out != NULL, "Failed to allocate memory for RPAK compression.\n");
+
+    uint64_t *offsets = (uint64_t *)out;
+    uint64_t coff = 0;
+    for (size_t i = 0; i < blocks; i++) {
+        size_t rawsize = size - (i * RPAK_BLOCKSIZE) < RPAK_BLOCKSIZE ? size - (i * RPAK_BLOCKSIZE) : RPAK_BLOCKSIZE;
+        uLongf csize = compressBound(rawsize);
+        offsets[i] = coff;
+        int res = compress2(out + tablesize + coff, &csize, data + (i * RPAK_BLOCKSIZE), rawsize, RPAK_COMPRESSIONLEVEL);
+        ASSERT(res == Z_OK, "Compression failed.\n");
+        if (csize >= rawsize) {
+            memcpy(out + tablesize + coff, data + (i * RPAK_BLOCKSIZE), rawsize);
+            csize = rawsize;
+        }
+        coff += csize;
+    }
+    offsets[blocks] = coff;
+
+    if ((tablesize + coff) * 100 > size * (100 - RPAK_COMPRESSMINSAVING)) {
+        free(out);
+        return NULL;
+    }
+    *outsize = tablesize + coff;
+    return out;
+}
+
+// Load the previous build of this pack and its manifest, NULL if there isn't a usable one (in which case everything gets packed from scratch).
+static struct previous *loadprevious(const char *output) {
+    char mpath[512];
+    snprintf(mpath, sizeof(mpath), "%s.manifest", output);
+    FILE *mf = fopen(mpath, "r");
+    if (mf == NULL) {
+        return NULL;
+    }
+    int fd = open(output, O_RDONLY);
+    if (fd == -1) {
+        fclose(mf);
+        return NULL;
+    }
+
+    struct previous *prev = (struct previous *)calloc(1, sizeof(struct previous));
+    ASSERT(prev != NULL, "Failed to allocate memory for previous RPAK.\n");
+    prev->fd = fd;
+
+    unsigned int mversion = 0;
+    size_t mcount = 0;
+    if (
+        pread(fd, &prev->header, sizeof(struct header), 0) != sizeof(struct header) || strncmp(prev->header.magic, "RPAK", sizeof(prev->header.magic)) ||
+        prev->header.version != RPAK_FORMATVERSION || // different layout or compression, nothing is safe to reuse
+        pread(fd, &prev->toc, sizeof(struct tocheader), sizeof(struct header)) != sizeof(struct tocheader) ||
+        fscanf(mf, "RPAKMANIFEST %u %zu\n", &mversion, &mcount) != 2 || mversion != RPAK_MANIFESTVERSION || mcount != prev->header.num
+    ) {
+        fclose(mf);
+        close(fd);
+        free(prev);
+        return NULL;
+    }
+
+    size_t entriessize = sizeof(struct diskentry) * prev->header.num;
+    size_t indexsize = sizeof(uint32_t) * prev->toc.buckets;
+    prev->entries = (struct diskentry *)malloc(entriessize);
+    prev->index = (uint32_t *)malloc(indexsize);
+    prev->strings = (char *)malloc(prev->toc.stringsize);
+    prev->manifest = (struct manifestentry *)malloc(sizeof(struct manifestentry) * (prev->header.num + 1));
+    ASSERT(prev->entries != NULL && prev->index != NULL && prev->strings != NULL && prev->manifest != NULL, "Failed to allocate memory for previous RPAK table of contents.\n");
+    size_t off = sizeof(struct header) + sizeof(struct tocheader);
+    ASSERT(pread(fd, prev->entries, entriessize, off) == (ssize_t)entriessize, "Failed to read previous RPAK entries.\n");
+    ASSERT(pread(fd, prev->index, indexsize, off + entriessize) == (ssize_t)indexsize, "Failed to read previous RPAK index.\n");
+    ASSERT(pread(fd, prev->strings, prev->toc.stringsize, off + entriessize + indexsize) == (ssize_t)prev->toc.stringsize, "Failed to read previous RPAK strings.\n");
+    for (size_t i = 0; i < prev->header.num; i++) {
+        struct manifestentry *m = &prev->manifest[i];
+        int read = fscanf(mf, "%ld %lu %lx\n", &m->mtime, &m->size, &m->contenthash);
+        ASSERT(read == 3, "Corrupt RPAK manifest `%s`.\n", mpath);
+    }
+    fclose(mf);
+    return prev;
+}
+
+static ssize_t findprevious(struct previous *prev, const char *path) {
+    uint64_t hash = fnv1a64(path, strlen(path));
+    for (uint32_t bucket = hash & (prev->toc.buckets - 1); prev->index[bucket] != RPAK_INDEXEMPTY; bucket = (bucket + 1) & (prev->toc.buckets - 1)) {
+        struct diskentry *entry = &prev->entries[prev->index[bucket] - 1];
+        if (entry->hash == hash && !strcmp(prev->strings + entry->pathoffset, path)) {
+            return prev->index[bucket] - 1;
+        }
+    }
+    return -1;
+}
+
+static void packfile(struct builder *builder, struct file *file) {
+    struct previous *prev = builder->previous;
+    ssize_t pidx = prev != NULL ? findprevious(prev, file->path) : -1;
 
-    return count;
+    // Untouched since the last build, don't even read it.
+    if (pidx != -1 && prev->manifest[pidx].mtime == file->mtime && prev->manifest[pidx].size == file->size) {
+        file->reused = true;
+        file->contenthash = prev->manifest[pidx].contenthash;
+        file->compressed = prev->entries[pidx].compressed;
+        file->outsize = prev->entries[pidx].compressedsize;
+        file->prevoffset = prev->entries[pidx].offset;
+        return;
+    }
+
+    FILE *f = fopen(file->fpath, "r");
+    ASSERT(f, "Failed to open file for RPAK packaging.\n");
+    uint8_t *fdata = (uint8_t *)malloc(file->size);
+    ASSERT(fdata != NULL, "Failed to allocate memory for file data for RPAK packaging.\n");
+    ASSERT(fread(fdata, file->size, 1, f), "Failed to read file for RPAK compression.\n");
+    fclose(f);
+    file->contenthash = fnv1a64(fdata, file->size);
+
+    // Touched but the same contents (a fresh checkout, etc.), skip compressing it again.
+    if (pidx != -1 && prev->manifest[pidx].contenthash == file->contenthash && prev->manifest[pidx].size == file->size) {
+        free(fdata);
+        file->reused = true;
+        file->compressed = prev->entries[pidx].compressed;
+        file->outsize = prev->entries[pidx].compressedsize;
+        file->prevoffset = prev->entries[pidx].offset;
+        return;
+    }
+
+    size_t outsize = file->size;
+    uint8_t *compressed = compressblocks(fdata, file->size, &outsize);
+    file->compressed = compressed != NULL;
+    if (file->compressed) {
+        free(fdata);
+        fdata = compressed;
+    }
+    file->data = fdata;
+    file->outsize = outsize;
 }
 
-void create(const char *path, const char *output) {
+static void *worker(void *param) {
+    struct builder *builder = (struct builder *)param;
+    for (;;) {
+        pthread_mutex_lock(&builder->lock);
+        while (builder->next < builder->list->count && builder->next - builder->written >= builder->window) {
+            pthread_cond_wait(&builder->cond, &builder->lock);
+        }
+        if (builder->next >= builder->list->count) {
+            pthread_mutex_unlock(&builder->lock);
+            return NULL;
+        }
+        struct file *file = &builder->list->files[builder->next++];
+        pthread_mutex_unlock(&builder->lock);
+
+        packfile(builder, file);
+
+        pthread_mutex_lock(&builder->lock);
+        file->ready = true;
+        pthread_cond_broadcast(&builder->cond);
+        pthread_mutex_unlock(&builder->lock);
+    }
+}
+
+static void writeall(int fd, const void *data, size_t size) {
+    const uint8_t *ptr = (const uint8_t *)data;
+    while (size > 0) {
+        ssize_t res = write(fd, ptr, size);
+        ASSERT(res > 0, "Failed to write RPAK.\n");
+        ptr += res;
+        size -= res;
+    }
+}
+
+static void copyprevious(int fd, struct previous *prev, size_t offset, size_t size, uint8_t *buf) {
+    while (size > 0) {
+        size_t chunk = size < RPAK_COPYCHUNK ? size : RPAK_COPYCHUNK;
+        ASSERT(pread(prev->fd, buf, chunk, offset) == (ssize_t)chunk, "Failed to read reused data from previous RPAK.\n");
+        writeall(fd, buf, chunk);
+        offset += chunk;
+        size -= chunk;
+    }
+}
+
+// Pack a directory into an RPak.
+// Files are packed (read, hashed, compressed) by `threads` workers while this thread streams them out in order, so output is deterministic and only a few files are ever held in memory at once.
+// If a previous build of the pack and its manifest are around (and `incremental` is set), files whose mtime and size are unchanged are copied straight over without being read, and files whose contents hash the same skip compression.
+void create(const char *path, const char *output, size_t threads, bool incremental) {
     ASSERT(strlen(path) < 512, "Path too long.\n");
     ASSERT(strlen(output) < 64, "Output path too long.\n");
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
     struct header header = { 0 };
     strcpy(header.magic, "RPAK");
     header.version = RPAK_FORMATVERSION;
     header.contentversion = 1;
-    strncpy(header.name, output, 64);
+    snprintf(header.name, sizeof(header.name), "%s", output); // always terminated, long names are cut short
+
+    struct filelist list = { 0 };
+    listdir((char *)path, (char *)path, &list);
+    header.num = list.count;
+
+    // Everything ahead of the file data is known up front, so data can be streamed straight to its final place and the table of contents filled in last.
+    struct tocheader toc = { 0 };
+    toc.buckets = 2;
+    while (toc.buckets < list.count * 2) {
+        toc.buckets <<= 1;
+    }
+    for (size_t i = 0; i < list.count; i++) {
+        toc.stringsize += strlen(list.files[i].path) + 1;
+    }
+    size_t tocsize = sizeof(struct tocheader) + (sizeof(struct diskentry) * list.count) + (sizeof(uint32_t) * toc.buckets) + toc.stringsize;
+    size_t dataoff = RPAK_ALIGNDATA(sizeof(struct header) + tocsize);
 
-    size_t tableidx = 0;
-    size_t dataidx = 0;
-    size_t datasize = 0;
-    struct tableentry *tables = (struct tableentry *)malloc(sizeof(struct tableentry));
-    struct data *data = (struct data *)malloc(sizeof(struct data));
-    size_t count = listdir(1, (char *)path, (char *)path, &tables, &tableidx, &data, &dataidx, &datasize);
+    char tmppath[512];
+    snprintf(tmppath, sizeof(tmppath), "%s.tmp", output);
+    int fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ASSERT(fd != -1, "Failed to open output RPAK.\n");
+    ASSERT(lseek(fd, dataoff, SEEK_SET) == (off_t)dataoff, "Failed to seek to RPAK data.\n");
 
-    header.num = count;
+    struct builder builder = { };
+    builder.list = &list;
+    builder.previous = incremental ? loadprevious(output) : NULL;
+    pthread_mutex_init(&builder.lock, NULL);
+    pthread_cond_init(&builder.cond, NULL);
+    builder.window = threads * RPAK_WINDOW;
 
-    size_t outputsize = sizeof(struct header) + (sizeof(struct tableentry) * count) + (datasize);
-    uint8_t *rpakdata = (uint8_t *)malloc(outputsize);
-    memcpy(rpakdata, &header, sizeof(struct header));
+    pthread_t *workers = (pthread_t *)malloc(sizeof(pthread_t) * threads);
+    ASSERT(workers != NULL, "Failed to allocate memory for RPAK packaging workers.\n");
+    for (size_t i = 0; i < threads; i++) {
+        ASSERT(!pthread_create(&workers[i], NULL, worker, &builder), "Failed to create RPAK packaging worker.\n");
+    }
+
+    struct diskentry *entries = (struct diskentry *)calloc(list.count, sizeof(struct diskentry));
+    struct manifestentry *manifest = (struct manifestentry *)calloc(list.count + 1, sizeof(struct manifestentry));
+    uint8_t *copybuf = (uint8_t *)malloc(RPAK_COPYCHUNK);
+    ASSERT(entries != NULL && manifest != NULL && copybuf != NULL, "Failed to allocate memory for RPAK table of contents.\n");
+    const uint8_t padding[RPAK_DATAALIGN] = { 0 };
+    size_t reused = 0;
+    size_t compressed = 0;
+    size_t insize = 0;
+    for (size_t i = 0; i < list.count; i++) {
+        struct file *file = &list.files[i];
+        pthread_mutex_lock(&builder.lock);
+        while (!file->ready) {
+            pthread_cond_wait(&builder.cond, &builder.lock);
+        }
+        pthread_mutex_unlock(&builder.lock);
+
+        if (file->reused) {
+            copyprevious(fd, builder.previous, file->prevoffset, file->outsize, copybuf);
+            reused++;
+        } else {
+            writeall(fd, file->data, file->outsize);
+            free(file->data);
+            file->data = NULL;
+        }
+        writeall(fd, padding, RPAK_ALIGNDATA(file->outsize) - file->outsize);
+        compressed += file->compressed;
+        insize += file->size;
+
+        entries[i].hash = fnv1a64(file->path, strlen(file->path));
+        entries[i].compressed = file->compressed;
+        entries[i].uncompressedsize = file->size;
+        entries[i].compressedsize = file->outsize;
+        entries[i].offset = dataoff;
+        dataoff += RPAK_ALIGNDATA(file->outsize);
+        manifest[i] = (struct manifestentry) { .mtime = file->mtime, .size = file->size, .contenthash = file->contenthash };
+
+        pthread_mutex_lock(&builder.lock);
+        builder.written++;
+        pthread_cond_broadcast(&builder.cond);
+        pthread_mutex_unlock(&builder.lock);
+    }
+    for (size_t i = 0; i < threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    free(copybuf);
+
+    // Now the table of contents.
+    uint8_t *tocdata = (uint8_t *)calloc(1, sizeof(struct header) + tocsize);
+    uint32_t *index = (uint32_t *)calloc(toc.buckets, sizeof(uint32_t));
+    ASSERT(tocdata != NULL && index != NULL, "Failed to allocate memory for RPAK table of contents.\n");
+    memcpy(tocdata, &header, sizeof(struct header));
     size_t off = sizeof(struct header);
-    size_t dataoff = sizeof(struct header);
-    for (size_t i = 0; i < tableidx; i++) {
-        struct tableentry entry = tables[i];
-        entry.offset += dataoff + (sizeof(struct tableentry) * (tableidx)); // update offset
-        dataoff += data[i].size;
-        memcpy(rpakdata + off, &entry, sizeof(struct tableentry));
-        off += (sizeof(struct tableentry));
-    }
-    free(tables);
-
-    for (size_t i = 0; i < dataidx; i++) {
-        struct data rdata = data[i];
-        memcpy(rpakdata + off, data[i].data, data[i].size);
-        off += data[i].size;
-        free(data[i].data);
-    }
-    free(data);
-
-    FILE *out = fopen(output, "w");
-    ASSERT(out, "Failed to open output RPAK.\n");
-    ASSERT(fwrite(rpakdata, outputsize, 1, out), "Failed to write RPAK.\n");
-    free(rpakdata);
-    fclose(out);
+    memcpy(tocdata + off, &toc, sizeof(struct tocheader));
+    off += sizeof(struct tocheader);
+    uint8_t *strings = tocdata + off + (sizeof(struct diskentry) * list.count) + (sizeof(uint32_t) * toc.buckets);
+    size_t stroff = 0;
+    for (size_t i = 0; i < list.count; i++) {
+        size_t len = strlen(list.files[i].path);
+        entries[i].pathoffset = stroff;
+        entries[i].pathlen = len;
+        memcpy(tocdata + off, &entries[i], sizeof(struct diskentry));
+        off += sizeof(struct diskentry);
+        memcpy(strings + stroff, list.files[i].path, len + 1);
+        stroff += len + 1;
+
+        uint32_t bucket = entries[i].hash & (toc.buckets - 1);
+        while (index[bucket] != RPAK_INDEXEMPTY) {
+            bucket = (bucket + 1) & (toc.buckets - 1);
+        }
+        index[bucket] = i + 1;
+    }
+    memcpy(tocdata + off, index, sizeof(uint32_t) * toc.buckets);
+    ASSERT(pwrite(fd, tocdata, sizeof(struct header) + tocsize, 0) == (ssize_t)(sizeof(struct header) + tocsize), "Failed to write RPAK table of contents.\n");
+    free(index);
+    free(tocdata);
+    free(entries);
+    ASSERT(!close(fd), "Failed to write RPAK.\n");
+
+    char mpath[512];
+    char mtmppath[512];
+    snprintf(mpath, sizeof(mpath), "%s.manifest", output);
+    snprintf(mtmppath, sizeof(mtmppath), "%s.manifest.tmp", output);
+    FILE *mf = fopen(mtmppath, "w");
+    ASSERT(mf != NULL, "Failed to open RPAK manifest for writing.\n");
+    fprintf(mf, "RPAKMANIFEST %u %zu\n", RPAK_MANIFESTVERSION, list.count);
+    for (size_t i = 0; i < list.count; i++) {
+        fprintf(mf, "%ld %lu %lx\n", manifest[i].mtime, manifest[i].size, manifest[i].contenthash);
+    }
+    ASSERT(!fclose(mf), "Failed to write RPAK manifest.\n");
+    free(manifest);
+
+    // Only replace the old pack once the new one is complete (the old one may have been what we were copying from).
+    ASSERT(!rename(tmppath, output), "Failed to move RPAK into place.\n");
+    ASSERT(!rename(mtmppath, mpath), "Failed to move RPAK manifest into place.\n");
+
+    if (builder.previous != NULL) {
+        close(builder.previous->fd);
+        free(builder.previous->entries);
+        free(builder.previous->index);
+        free(builder.previous->strings);
+        free(builder.previous->manifest);
+        free(builder.previous);
+    }
+    pthread_mutex_destroy(&builder.lock);
+    pthread_cond_destroy(&builder.cond);
+    for (size_t i = 0; i < list.count; i++) {
+        free(list.files[i].path);
+        free(list.files[i].fpath);
+    }
+    free(list.files);
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf(
+        "Packed %zu files (%zu reused, %zu compressed), %zu -> %zu bytes in %.3fs with %zu thread(s).\n",
+        (size_t)header.num, reused, compressed, insize, dataoff,
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1000000000.0, threads
+    );
 }
 
 
-int main(int argc, const char **argv) {
-    if (argc < 3) {
-        fprintf(stderr, "Usage: %s input output\n", argv[0]);
+int main(int argc, char **argv) {
+    size_t threads = sysconf(_SC_NPROCESSORS_ONLN);
+    bool incremental = true;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:f")) != -1) {
+        switch (opt) {
+            case 'j':
+                threads = strtoul(optarg, NULL, 10);
+                break;
+            case 'f':
+                incremental = false;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-j threads] [-f] input output\n\t-j: number of packaging threads (defaults to one per CPU)\n\t-f: full rebuild, ignore any previous build of the output\n", argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind < 2) {
+        fprintf(stderr, "Usage: %s [-j threads] [-f] input output\n", argv[0]);
         return 1;
     }
 
-    create(argv[1], argv[2]);
+    create(argv[optind], argv[optind + 1], threads > 0 ? threads : 1, incremental);
 
     return 0;
 }